@@ -1,6 +1,10 @@
 #include "Buffer.h"
 #include "FileBuffer.h"
 #include "InMemoryBuffer.h"
+#include "BufferPolicy.h"
+#include "BufferArena.h"
+#include "BufferCompression.h"
+#include "BufferStatistics.h"
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
@@ -11,63 +15,930 @@
 #include <errno.h>
 #include <string.h>
 
+// waits on spin locks taken by the buffer manager are counted in statistics
+#define BUFFER_SPIN_LOCK(LOCK, SOURCESTATISTICS)\
+	if(bool __scope_variable_flag__=true)\
+		for(BufferLockScope scope(LOCK, statistics.Obj(), SOURCESTATISTICS);__scope_variable_flag__;__scope_variable_flag__=false)
+
+#define PREFETCH_BATCH_SIZE 64
+#define CLEAN_BATCH_SIZE 32
+
 namespace vl
 {
 	namespace database
 	{
 		using namespace collections;
+		using namespace buffer_internal;
+
+/***********************************************************************
+BufferPageDesc
+***********************************************************************/
+
+		void BufferPageDesc::Release(BufferPageDesc* pageDesc)
+		{
+			if (pageDesc->arena)
+			{
+				pageDesc->arena->ReleasePageDesc(pageDesc);
+			}
+			else
+			{
+				delete pageDesc;
+			}
+		}
+
+		bool BufferPageDesc::IsLocked()
+		{
+			vint state = lockState;
+			return state > 0 || state == ExclusivelyLocked;
+		}
+
+		bool BufferPageDesc::IsExclusivelyLocked()
+		{
+			return lockState == ExclusivelyLocked;
+		}
+
+		vint BufferPageDesc::GetPinCount()
+		{
+			vint state = lockState;
+			return state > 0 ? state : state == ExclusivelyLocked ? 1 : 0;
+		}
+
+		bool BufferPageDesc::TryLock(PageLockAccess access)
+		{
+			if (access == PageLockAccess::Exclusive)
+			{
+				if (!__sync_bool_compare_and_swap(&lockState, 0, ExclusivelyLocked)) return false;
+				INCRC(&exclusiveLockCount);
+				return true;
+			}
+
+			while (true)
+			{
+				vint state = lockState;
+				if (state < 0) return false;
+				if (__sync_bool_compare_and_swap(&lockState, state, state + 1)) return true;
+			}
+		}
+
+		vuint64_t BufferPageDesc::GetDirtyClock()
+		{
+			timespec time;
+			clock_gettime(CLOCK_MONOTONIC, &time);
+			return (vuint64_t)time.tv_sec * 1000 + time.tv_nsec / 1000000;
+		}
+
+		void BufferPageDesc::MarkDirty()
+		{
+			// a page that is already dirty keeps the time of its first change
+			if (!dirty)
+			{
+				firstDirtyTime = GetDirtyClock();
+				dirty = true;
+			}
+		}
+
+		bool BufferPageDesc::TryUpgrade()
+		{
+			if (!__sync_bool_compare_and_swap(&lockState, 1, ExclusivelyLocked)) return false;
+			INCRC(&exclusiveLockCount);
+			return true;
+		}
+
+		bool BufferPageDesc::Unlock()
+		{
+			while (true)
+			{
+				vint state = lockState;
+				if (state == ExclusivelyLocked)
+				{
+					return __sync_bool_compare_and_swap(&lockState, ExclusivelyLocked, 0);
+				}
+				if (state <= 0) return false;
+				if (__sync_bool_compare_and_swap(&lockState, state, state - 1)) return true;
+			}
+		}
+
+		bool BufferPageDesc::TryBeginUnmap()
+		{
+			if (!__sync_bool_compare_and_swap(&lockState, 0, Unmapping))
+			{
+				return false;
+			}
+			if (writeBackCount > 0)
+			{
+				CancelUnmap();
+				return false;
+			}
+			return true;
+		}
+
+		bool BufferPageDesc::CancelUnmap()
+		{
+			return __sync_bool_compare_and_swap(&lockState, Unmapping, 0);
+		}
+
+		bool BufferPageDesc::TryBeginWriteBack()
+		{
+			INCRC(&writeBackCount);
+			if (lockState == Unmapping)
+			{
+				DECRC(&writeBackCount);
+				return false;
+			}
+			return true;
+		}
+
+		void BufferPageDesc::EndWriteBack()
+		{
+			DECRC(&writeBackCount);
+		}
+
+		bool BufferPageDesc::TrySnapshot(void* buffer, vuint64_t size)
+		{
+			// the owner changes the page only after the lock count is increased, so an unchanged count means a consistent copy
+			vint lockCount = exclusiveLockCount;
+			__sync_synchronize();
+			if (lockState == ExclusivelyLocked && !persisting) return false;
+			memcpy(buffer, address, size);
+			__sync_synchronize();
+			return (lockState != ExclusivelyLocked || persisting) && exclusiveLockCount == lockCount;
+		}
+
+/***********************************************************************
+BufferPageGuard
+***********************************************************************/
+
+		BufferPageGuard::BufferPageGuard()
+		{
+		}
+
+		BufferPageGuard::BufferPageGuard(Ptr<IBufferSource> _source, Ptr<BufferPageDesc> _pageDesc)
+			:source(_source)
+			,pageDesc(_pageDesc)
+		{
+		}
+
+		BufferPageGuard::BufferPageGuard(BufferPageGuard&& guard)
+			:source(guard.source)
+			,pageDesc(guard.pageDesc)
+			,persistanceType(guard.persistanceType)
+		{
+			guard.source = nullptr;
+			guard.pageDesc = nullptr;
+			guard.persistanceType = PersistanceType::NoChanging;
+		}
+
+		BufferPageGuard::~BufferPageGuard()
+		{
+			Release();
+		}
+
+		BufferPageGuard& BufferPageGuard::operator=(BufferPageGuard&& guard)
+		{
+			if (this != &guard)
+			{
+				Release();
+				source = guard.source;
+				pageDesc = guard.pageDesc;
+				persistanceType = guard.persistanceType;
+				guard.source = nullptr;
+				guard.pageDesc = nullptr;
+				guard.persistanceType = PersistanceType::NoChanging;
+			}
+			return *this;
+		}
+
+		bool BufferPageGuard::IsValid()
+		{
+			return pageDesc;
+		}
+
+		BufferPage BufferPageGuard::GetPage()
+		{
+			return pageDesc ? pageDesc->page : BufferPage::Invalid();
+		}
+
+		void* BufferPageGuard::GetAddress()
+		{
+			return pageDesc ? pageDesc->address : nullptr;
+		}
+
+		bool BufferPageGuard::IsExclusive()
+		{
+			return pageDesc && pageDesc->IsExclusivelyLocked();
+		}
+
+		bool BufferPageGuard::Upgrade()
+		{
+			if (!pageDesc) return false;
+			return pageDesc->IsExclusivelyLocked() || pageDesc->TryUpgrade();
+		}
+
+		bool BufferPageGuard::MarkChanged(bool persist)
+		{
+			if (!IsExclusive()) return false;
+			if (persist)
+			{
+				persistanceType = PersistanceType::ChangedAndPersist;
+			}
+			else if (persistanceType == PersistanceType::NoChanging)
+			{
+				persistanceType = PersistanceType::Changed;
+			}
+			return true;
+		}
+
+		bool BufferPageGuard::Release()
+		{
+			if (!pageDesc) return false;
+			bool successful = source->UnlockPageDesc(pageDesc.Obj(), persistanceType);
+			source = nullptr;
+			pageDesc = nullptr;
+			persistanceType = PersistanceType::NoChanging;
+			return successful;
+		}
+
+		namespace buffer_internal
+		{
+
+/***********************************************************************
+BufferPageTable
+***********************************************************************/
+
+			BufferPageTable::Shard& BufferPageTable::GetShard(BufferPage page)
+			{
+				vuint64_t hash = page.index * 0x9E3779B97F4A7C15ULL;
+				return shards[(hash >> 32) % ShardCount];
+			}
+
+			BufferPageTable::BufferPageTable(BufferSource _source, volatile vuint64_t* _totalUsedPages, IBufferPageObserver* _observer)
+				:source(_source)
+				,totalUsedPages(_totalUsedPages)
+				,observer(_observer)
+			{
+			}
+
+			vint BufferPageTable::Count()
+			{
+				return pageCount;
+			}
+
+			Ptr<BufferPageDesc> BufferPageTable::Get(BufferPage page)
+			{
+				auto& shard = GetShard(page);
+				SPIN_LOCK(shard.lock)
+				{
+					vint index = shard.pages.Keys().IndexOf(page.index);
+					if (index != -1)
+					{
+						return shard.pages.Values()[index];
+					}
+				}
+				return nullptr;
+			}
+
+			bool BufferPageTable::Add(Ptr<BufferPageDesc> pageDesc)
+			{
+				pageDesc->source = source;
+				auto& shard = GetShard(pageDesc->page);
+				SPIN_LOCK(shard.lock)
+				{
+					if (shard.pages.Keys().Contains(pageDesc->page.index))
+					{
+						return false;
+					}
+					shard.pages.Add(pageDesc->page.index, pageDesc);
+				}
+				INCRC(&pageCount);
+				INCRC(totalUsedPages);
+				if (observer)
+				{
+					observer->OnPageMapped(pageDesc);
+				}
+				return true;
+			}
+
+			void BufferPageTable::Touch(BufferPageDesc* pageDesc)
+			{
+				INCRC(&pageDesc->accessCount);
+				if (observer)
+				{
+					observer->OnPageAccessed(pageDesc);
+				}
+			}
+
+			bool BufferPageTable::Remove(BufferPage page)
+			{
+				Ptr<BufferPageDesc> pageDesc;
+				auto& shard = GetShard(page);
+				SPIN_LOCK(shard.lock)
+				{
+					vint index = shard.pages.Keys().IndexOf(page.index);
+					if (index == -1)
+					{
+						return false;
+					}
+					pageDesc = shard.pages.Values()[index];
+					shard.pages.Remove(page.index);
+				}
+				DECRC(&pageCount);
+				DECRC(totalUsedPages);
+				if (observer)
+				{
+					observer->OnPageUnmapped(pageDesc);
+				}
+				return true;
+			}
+
+			void BufferPageTable::FillPages(PageDescList& pageDescs)
+			{
+				for (vint i = 0; i < ShardCount; i++)
+				{
+					auto& shard = shards[i];
+					SPIN_LOCK(shard.lock)
+					{
+						FOREACH(Ptr<BufferPageDesc>, pageDesc, shard.pages.Values())
+						{
+							pageDescs.Add(pageDesc);
+						}
+					}
+				}
+			}
+
+			void BufferPageTable::FillDirtyPages(PageDescList& pageDescs)
+			{
+				for (vint i = 0; i < ShardCount; i++)
+				{
+					auto& shard = shards[i];
+					SPIN_LOCK(shard.lock)
+					{
+						FOREACH(Ptr<BufferPageDesc>, pageDesc, shard.pages.Values())
+						{
+							if (pageDesc->dirty)
+							{
+								pageDescs.Add(pageDesc);
+							}
+						}
+					}
+				}
+
+				if (pageDescs.Count() > 0)
+				{
+					SortLambda(&pageDescs[0], pageDescs.Count(), [](const Ptr<BufferPageDesc>& a, const Ptr<BufferPageDesc>& b)
+					{
+						return a->offset < b->offset ? -1 : a->offset > b->offset ? 1 : 0;
+					});
+				}
+			}
+		}
+
+/***********************************************************************
+BufferAccessStrategy
+***********************************************************************/
+
+		BufferAccessStrategy::BufferAccessStrategy(vint ringSize)
+		{
+			CHECK_ERROR(ringSize > 0, L"vl::database::BufferAccessStrategy::BufferAccessStrategy(vint)#Internal error: A ring should contain at least one frame.");
+			ring.Resize(ringSize);
+		}
+
+		vint BufferAccessStrategy::GetRingSize()
+		{
+			return ring.Count();
+		}
+
+		vuint64_t BufferAccessStrategy::GetRecycledPageCount()
+		{
+			return recycledPageCount;
+		}
+
+/***********************************************************************
+BufferManager
+***********************************************************************/
+
+		Ptr<IBufferSource> BufferManager::GetSource(BufferSource source)
+		{
+			READER_LOCK(sourcesLock)
+			{
+				vint index = sources.Keys().IndexOf(source);
+				if (index != -1)
+				{
+					return sources.Values()[index];
+				}
+			}
+			return nullptr;
+		}
+
+		Ptr<IBufferSource> BufferManager::GetSource(BufferSource source, StatisticsPtr& bsStatistics)
+		{
+			READER_LOCK(sourcesLock)
+			{
+				vint index = sources.Keys().IndexOf(source);
+				if (index != -1)
+				{
+					bsStatistics = sourceStatistics[source];
+					return sources.Values()[index];
+				}
+			}
+			return nullptr;
+		}
+
+		BufferManager::StatisticsPtr BufferManager::GetSourceStatistics(BufferSource source)
+		{
+			READER_LOCK(sourcesLock)
+			{
+				vint index = sourceStatistics.Keys().IndexOf(source);
+				if (index != -1)
+				{
+					return sourceStatistics.Values()[index];
+				}
+			}
+			return nullptr;
+		}
+
+		void BufferManager::Count(BufferStatisticsCollector* bsStatistics, BufferCounter counter, vuint64_t value)
+		{
+			statistics->Increase(counter, value);
+			if (bsStatistics)
+			{
+				bsStatistics->Increase(counter, value);
+			}
+		}
+
+		void BufferManager::RecordLatency(BufferStatisticsCollector* bsStatistics, BufferLatency latency, vuint64_t start)
+		{
+			vuint64_t nanoseconds = BufferStatisticsCollector::GetClock() - start;
+			statistics->Record(latency, nanoseconds);
+			if (bsStatistics)
+			{
+				bsStatistics->Record(latency, nanoseconds);
+			}
+		}
+
+		Ptr<BufferPageDesc> BufferManager::LockSourcePage(BufferSource source, BufferPage page, PageLockAccess access, BufferAccessStrategy* strategy, Ptr<IBufferSource>& bs)
+		{
+			vuint64_t start = BufferStatisticsCollector::GetClock();
+			StatisticsPtr bsStatistics;
+			bs = GetSource(source, bsStatistics);
+			if (!bs) return nullptr;
+
+			bool missed = false;
+			auto pageDesc = bs->LockPageDesc(page, access, missed);
+			if (pageDesc)
+			{
+				Count(bsStatistics.Obj(), BufferCounter::Locks);
+				// pages prefetched or read ahead are hits, they are read before the lock
+				Count(bsStatistics.Obj(), missed ? BufferCounter::Misses : BufferCounter::Hits);
+				if (strategy)
+				{
+					RecyclePage(pageDesc, strategy);
+				}
+			}
+			else
+			{
+				Count(bsStatistics.Obj(), BufferCounter::FailedLocks);
+			}
+
+			// pages read ahead by the source are read by the cleaner, so that this thread does not wait for them
+			List<BufferPage> readaheadPages;
+			bs->FillReadaheadPages(readaheadPages);
+			if (readaheadPages.Count() > 0)
+			{
+				Prefetch(source, readaheadPages);
+			}
+			TrimSource(bs);
+			SwapCacheIfNecessary();
+			RecordLatency(bsStatistics.Obj(), BufferLatency::LockPage, start);
+			return pageDesc;
+		}
+
+		bool BufferManager::WriteBackVictim(Ptr<IBufferSource> bs, BufferPageDesc* pageDesc)
+		{
+			if (!pageDesc->dirty) return true;
+
+			vuint64_t start = BufferStatisticsCollector::GetClock();
+			if (!bs->WriteBackPage(pageDesc->page)) return false;
+			auto bsStatistics = GetSourceStatistics(pageDesc->source);
+			Count(bsStatistics.Obj(), BufferCounter::WriteBacks);
+			RecordLatency(bsStatistics.Obj(), BufferLatency::WriteBack, start);
+			return true;
+		}
+
+		void BufferManager::WriteBackVictims(Ptr<IBufferSource> bs, List<Ptr<BufferPageDesc>>& pageDescs)
+		{
+			if (pageDescs.Count() == 0) return;
+
+			vuint64_t start = BufferStatisticsCollector::GetClock();
+			bs->WriteBackPages(pageDescs);
+			// every page is charged its share of the batch
+			vuint64_t nanoseconds = (BufferStatisticsCollector::GetClock() - start) / pageDescs.Count();
+			auto bsStatistics = GetSourceStatistics(pageDescs[0]->source);
+			FOREACH(Ptr<BufferPageDesc>, pageDesc, pageDescs)
+			{
+				if (pageDesc->dirty) continue;
+				Count(bsStatistics.Obj(), BufferCounter::WriteBacks);
+				statistics->Record(BufferLatency::WriteBack, nanoseconds);
+				if (bsStatistics)
+				{
+					bsStatistics->Record(BufferLatency::WriteBack, nanoseconds);
+				}
+				UnmapVictim(bs, pageDesc.Obj());
+			}
+			pageDescs.Clear();
+		}
+
+		bool BufferManager::UnmapVictim(Ptr<IBufferSource> bs, BufferPageDesc* pageDesc)
+		{
+			auto bsStatistics = GetSourceStatistics(pageDesc->source);
+			bool unmapped = false;
+			BUFFER_SPIN_LOCK(bs->GetLock(), bsStatistics.Obj())
+			{
+				// an unmapped descriptor stays in the Unmapping state, so a page mapped again by others is not touched
+				unmapped = pageDesc->lockState != BufferPageDesc::Unmapping && bs->UnmapPage(pageDesc->page);
+			}
+			if (unmapped)
+			{
+				Count(bsStatistics.Obj(), BufferCounter::Evictions);
+			}
+			return unmapped;
+		}
+
+		bool BufferManager::RecordHotPages(Ptr<IBufferSource> bs)
+		{
+			List<Ptr<BufferPageDesc>> pageDescs;
+			BUFFER_SPIN_LOCK(bs->GetLock(), nullptr)
+			{
+				bs->FillCachedPages(pageDescs);
+			}
+
+			List<BufferPage> pages;
+			FOREACH(Ptr<BufferPageDesc>, pageDesc, pageDescs)
+			{
+				pages.Add(pageDesc->page);
+			}
+			return SaveHotPages(bs->GetFileName(), pages);
+		}
+
+		void BufferManager::RecordAllHotPages()
+		{
+			List<Ptr<IBufferSource>> recordingSources;
+			READER_LOCK(sourcesLock)
+			{
+				FOREACH(BufferSource, source, hotPageSources)
+				{
+					recordingSources.Add(sources[source]);
+				}
+			}
+
+			FOREACH(Ptr<IBufferSource>, bs, recordingSources)
+			{
+				RecordHotPages(bs);
+			}
+		}
+
+		vuint64_t BufferManager::GetFreePageCount()
+		{
+			vuint64_t cachedPages = totalCachedPages;
+			return cachedPages < cachePageCount ? cachePageCount - cachedPages : 0;
+		}
+
+		void BufferManager::WakeCleaner()
+		{
+			if (cleanerRequested) return;
+			CS_LOCK(cleanerLock)
+			{
+				cleanerRequested = true;
+				cleanerCondition.WakeAllPendings();
+			}
+		}
+
+		void BufferManager::StopCleaner()
+		{
+			CS_LOCK(cleanerLock)
+			{
+				cleanerStopping = true;
+				cleanerCondition.WakeAllPendings();
+				while (cleanerRunning)
+				{
+					cleanerCondition.SleepWith(cleanerLock);
+				}
+			}
+		}
+
+		void BufferManager::CleanerProc()
+		{
+			cleanerLock.Enter();
+			while (!cleanerStopping)
+			{
+				vuint64_t now = BufferPageDesc::GetDirtyClock();
+				if (hotPageInterval > 0 && now - lastHotPageTime >= hotPageInterval)
+				{
+					lastHotPageTime = now;
+					cleanerLock.Leave();
+					RecordAllHotPages();
+					cleanerLock.Enter();
+				}
+				else if (cleanerRequested || prefetchQueue.Count() > 0)
+				{
+					cleanerRequested = false;
+					PrefetchList prefetchPages;
+					CopyFrom(prefetchPages, prefetchQueue);
+					prefetchQueue.Clear();
+					cleanerLock.Leave();
+					CleanPages();
+					PrefetchQueuedPages(prefetchPages);
+					cleanerLock.Enter();
+				}
+				else
+				{
+					cleanerCondition.SleepWith(cleanerLock);
+				}
+			}
+			cleanerRunning = false;
+			cleanerCondition.WakeAllPendings();
+			cleanerLock.Leave();
+		}
+
+		BufferSource BufferManager::AddSource(Ptr<IBufferSource> bs, const BufferSourceQuota& quota)
+		{
+			auto source = bs->GetBufferSource();
+			WRITER_LOCK(sourcesLock)
+			{
+				sources.Add(source, bs);
+				sourceQuotas.Add(source, quota);
+				sourceStatistics.Add(source, new BufferStatisticsCollector);
+				UpdateSourcePriorities();
+			}
+			TrimSource(bs);
+			SwapCacheIfNecessary();
+			return source;
+		}
+
+		void BufferManager::UpdateSourcePriorities()
+		{
+			sourcePriorities.Clear();
+			vint capped = 0;
+			FOREACH(BufferSourceQuota, quota, sourceQuotas.Values())
+			{
+				if (!sourcePriorities.Contains(quota.priority))
+				{
+					sourcePriorities.Add(quota.priority);
+				}
+				if (quota.maxPages > 0)
+				{
+					capped++;
+				}
+			}
+			cappedSourceCount = capped;
+		}
 
-/***********************************************************************
-BufferManager
-***********************************************************************/
+		void BufferManager::GetSourcePriorities(PriorityList& priorities)
+		{
+			READER_LOCK(sourcesLock)
+			{
+				CopyFrom(priorities, sourcePriorities);
+			}
+			if (priorities.Count() == 0)
+			{
+				priorities.Add(0);
+			}
+		}
 
-		void BufferManager::SwapCacheIfNecessary()
+		Ptr<IBufferSource> BufferManager::GetEvictableSource(BufferPageDesc* victim, vint priority)
 		{
-			if (totalCachedPages > cachePageCount)
+			READER_LOCK(sourcesLock)
+			{
+				vint index = sources.Keys().IndexOf(victim->source);
+				if (index == -1) return nullptr;
+
+				auto bs = sources.Values()[index];
+				const auto& quota = sourceQuotas[victim->source];
+				if (quota.priority > priority) return nullptr;
+				if ((vuint64_t)bs->GetCachedPageCount() <= quota.reservedPages) return nullptr;
+				return bs;
+			}
+			return nullptr;
+		}
+
+		void BufferManager::TrimSource(Ptr<IBufferSource> bs)
+		{
+			if (cappedSourceCount == 0) return;
+
+			BufferSourceQuota quota;
+			if (!GetSourceQuota(bs->GetBufferSource(), quota)) return;
+			if (quota.maxPages == 0 || (vuint64_t)bs->GetCachedPageCount() <= quota.maxPages) return;
+
+			// a capped source is trimmed by its own least recently used pages, so pages of other sources keep their places in the policy
+			List<Ptr<BufferPageDesc>> pageDescs;
+			BUFFER_SPIN_LOCK(bs->GetLock(), nullptr)
+			{
+				bs->FillCachedPages(pageDescs);
+			}
+			if (pageDescs.Count() == 0) return;
+			SortLambda(&pageDescs[0], pageDescs.Count(), [](const Ptr<BufferPageDesc>& a, const Ptr<BufferPageDesc>& b)
+			{
+				return a->lastAccessTime < b->lastAccessTime ? -1 : a->lastAccessTime > b->lastAccessTime ? 1 : 0;
+			});
+
+			// trimming goes below the cap by one eighth, so that it does not happen on every new page
+			vuint64_t targetPages = quota.maxPages - quota.maxPages / 8;
+			for (vint i = 0; i < pageDescs.Count() && (vuint64_t)bs->GetCachedPageCount() > targetPages; i++)
+			{
+				auto pageDesc = pageDescs[i];
+				if (pageDesc->IsLocked()) continue;
+				if (!WriteBackVictim(bs, pageDesc.Obj())) continue;
+				UnmapVictim(bs, pageDesc.Obj());
+			}
+		}
+
+		void BufferManager::CleanPages()
+		{
+			// dirty victims are written back here, so that foreground threads only need to unmap clean pages
+			// victims of sources with lower priorities are taken first, and sources are not evicted below their reservations
+			PriorityList priorities;
+			GetSourcePriorities(priorities);
+			for (vint i = 0; i < priorities.Count(); i++)
 			{
-				SPIN_LOCK(lock)
+				// dirty victims of the same source are written back together, so that they share checksum writes and synchronizations
+				Ptr<IBufferSource> batchSource;
+				List<Ptr<BufferPageDesc>> batch;
+
+				// skipped victims keep losing their reference bits, two sweeps reach every page of a lower priority
+				vint remainAttempts = policy->GetFrameCount() * 2;
+				while (remainAttempts-- > 0)
 				{
-					vuint64_t remainPage = cachePageCount / 4 * 3;
-					vuint64_t expectPage = totalCachedPages - remainPage;
-					List<IBufferSource::BufferPageTimeTuple> pages;
-					FOREACH(Ptr<IBufferSource>, source, sources.Values())
+					// pages in the batch are counted as free, and the batch is flushed before checking again
+					if (GetFreePageCount() + batch.Count() >= highWatermark)
+					{
+						if (batch.Count() == 0) break;
+						WriteBackVictims(batchSource, batch);
+						continue;
+					}
+
+					Ptr<BufferPageDesc> pageDesc;
+					BUFFER_SPIN_LOCK(lock, nullptr)
 					{
-						source->FillUnmapPageCandidates(pages, expectPage);
+						pageDesc = policy->NextVictim();
 					}
+					if (!pageDesc) break;
 
-					if (pages.Count() > 0)
+					auto source = GetEvictableSource(pageDesc.Obj(), priorities[i]);
+					if (!source)
 					{
-						SortLambda(&pages[0], pages.Count(), [](const IBufferSource::BufferPageTimeTuple& t1, const IBufferSource::BufferPageTimeTuple& t2)
+						// policies other than CLOCK would return the same page again
+						policy->SkipVictim(pageDesc.Obj());
+					}
+					else
+					{
+						if (!pageDesc->dirty)
+						{
+							UnmapVictim(source, pageDesc.Obj());
+							continue;
+						}
+						if (batchSource != source || batch.Contains(pageDesc.Obj()))
 						{
-							if (t1.f2 < t2.f2) return -1;
-							else if (t1.f2 > t2.f2) return 1;
-							else return 0;
-						});
+							WriteBackVictims(batchSource, batch);
+							batchSource = source;
+						}
+						batch.Add(pageDesc);
+						if (batch.Count() >= CLEAN_BATCH_SIZE)
+						{
+							WriteBackVictims(batchSource, batch);
+						}
+					}
+				}
+				if (batchSource)
+				{
+					WriteBackVictims(batchSource, batch);
+				}
+			}
+		}
+
+		void BufferManager::PrefetchQueuedPages(PrefetchList& pages)
+		{
+			// pages of the same source are queued together, each run is prefetched in batches, so that the source is not locked for long
+			vint begin = 0;
+			while (begin < pages.Count())
+			{
+				auto source = pages[begin].key;
+				List<BufferPage> sourcePages;
+				vint end = begin;
+				while (end < pages.Count() && end - begin < PREFETCH_BATCH_SIZE && pages[end].key == source)
+				{
+					sourcePages.Add(pages[end++].value);
+				}
+				begin = end;
+
+				if (auto bs = GetSource(source))
+				{
+					bs->PrefetchPages(sourcePages);
+					TrimSource(bs);
+				}
+			}
+		}
+
+		void BufferManager::SwapCacheIfNecessary()
+		{
+			if (GetFreePageCount() < lowWatermark)
+			{
+				WakeCleaner();
+			}
+			else if (hotPageInterval > 0 && BufferPageDesc::GetDirtyClock() - lastHotPageTime >= hotPageInterval)
+			{
+				// the cleaner only records hot pages when it wakes up, and a busy buffer manager wakes it up regularly
+				WakeCleaner();
+			}
 
-						vint count = pages.Count() < expectPage ? pages.Count() : expectPage;
-						for (vint i = 0; i < count; i++)
+			if (totalCachedPages > cachePageCount)
+			{
+				// the cleaner falls behind, evict clean pages inline and leave dirty pages to the cleaner
+				PriorityList priorities;
+				GetSourcePriorities(priorities);
+				for (vint i = 0; i < priorities.Count(); i++)
+				{
+					BUFFER_SPIN_LOCK(lock, nullptr)
+					{
+						vint remainAttempts = policy->GetFrameCount();
+						while (totalCachedPages > cachePageCount && remainAttempts-- > 0)
 						{
-							auto tuple = pages[i];
-							auto source = sources[tuple.f0];
-							SPIN_LOCK(source->GetLock())
+							auto pageDesc = policy->NextVictim();
+							if (!pageDesc) return;
+							if (pageDesc->dirty)
+							{
+								// a dirty page at the eviction end would be returned again until the cleaner writes it back
+								policy->SkipVictim(pageDesc.Obj());
+								continue;
+							}
+							if (auto source = GetEvictableSource(pageDesc.Obj(), priorities[i]))
 							{
-								CHECK_ERROR(source->UnmapPage(tuple.f1), L"vl::database::BufferManager::SwapCacheIfNecessary()#Internal error: Failed to unmap page.");
+								UnmapVictim(source, pageDesc.Obj());
+							}
+							else
+							{
+								// policies other than CLOCK would return the same page again
+								policy->SkipVictim(pageDesc.Obj());
 							}
 						}
+					}
+				}
+			}
+		}
 
-						CHECK_ERROR(totalCachedPages <= cachePageCount, L"vl::database::BufferManager::SwapCacheIfNecessary()#Internal error: Failed to maintain totalCachedPages.");
+		void BufferManager::RecyclePage(Ptr<BufferPageDesc> pageDesc, BufferAccessStrategy* strategy)
+		{
+			Ptr<BufferPageDesc> victim;
+			vint victimAccessCount = 0;
+			SPIN_LOCK(strategy->lock)
+			{
+				for (vint i = 0; i < strategy->ring.Count(); i++)
+				{
+					auto& entry = strategy->ring[i];
+					if (entry.pageDesc == pageDesc)
+					{
+						// the scan locks one of its pages again
+						entry.accessCount = pageDesc->accessCount;
+						return;
 					}
 				}
+
+				// a page that was already cached belongs to the shared cache
+				if (pageDesc->accessCount != 0) return;
+
+				auto& entry = strategy->ring[strategy->next];
+				strategy->next = (strategy->next + 1) % strategy->ring.Count();
+				victim = entry.pageDesc;
+				victimAccessCount = entry.accessCount;
+				entry.pageDesc = pageDesc;
+				entry.accessCount = 0;
+			}
+
+			// the oldest page of the ring is unmapped unless other threads accessed it after the scan
+			if (!victim || victim->accessCount != victimAccessCount) return;
+			auto source = GetSource(victim->source);
+			if (!source) return;
+			if (!WriteBackVictim(source, victim.Obj())) return;
+			if (UnmapVictim(source, victim.Obj()))
+			{
+				INCRC(&strategy->recycledPageCount);
 			}
 		}
 
-		BufferManager::BufferManager(vuint64_t _pageSize, vuint64_t _cachePageCount)
+		BufferManager::BufferManager(vuint64_t _pageSize, vuint64_t _cachePageCount, Ptr<IBufferEvictionPolicy> _policy)
 			:pageSize(_pageSize)
 			,cachePageCount(_cachePageCount)
 			,pageSizeBits(0)
 			,totalCachedPages(0)
 			,usedSourceIndex(0)
+			,policy(_policy)
+			,lowWatermark(_cachePageCount / 8)
+			,highWatermark(_cachePageCount / 4)
 		{
+			if (!policy)
+			{
+				policy = CreateClockEvictionPolicy();
+			}
+			policy->SetCapacity(cachePageCount);
+
 			vuint64_t systemPageSize = sysconf(_SC_PAGE_SIZE);
 			pageSize = IntUpperBound(pageSize, systemPageSize);
 			if (pageSize > 0)
@@ -78,13 +949,36 @@ BufferManager
 					pageSizeBits--;
 				}
 			}
+
+			// memory pages are carved from chunks of at least one transparent hugepage
+			const vuint64_t hugePageSize = 2 * 1024 * 1024;
+			vint framesPerChunk = pageSize >= hugePageSize ? 1 : (vint)(hugePageSize / pageSize);
+			arena = new BufferFrameArena(pageSize, framesPerChunk, true, buffer_internal::GetNumaNodeCount());
+			compressedTier = new BufferCompressedTier(pageSize);
+			statistics = new BufferStatisticsCollector;
+
+			// the cleaner uses every member, so it starts after they are initialized
+			cleanerRunning = true;
+			Thread::CreateAndStart([this]()
+			{
+				CleanerProc();
+			}, true);
 		}
 
 		BufferManager::~BufferManager()
 		{
-			FOREACH(Ptr<IBufferSource>, source, sources.Values())
+			StopCleaner();
+			RecordAllHotPages();
+			WRITER_LOCK(sourcesLock)
 			{
-				source->Unload();
+				FOREACH(Ptr<IBufferSource>, source, sources.Values())
+				{
+					SPIN_LOCK(source->GetLock())
+					{
+						source->Unload();
+					}
+				}
+				sources.Clear();
 			}
 		}
 
@@ -108,62 +1002,172 @@ BufferManager
 			return totalCachedPages;
 		}
 
-		BufferSource BufferManager::LoadMemorySource()
+		vuint64_t BufferManager::GetLowWatermark()
 		{
-			BufferSource source{(BufferSource::IndexType)INCRC(&usedSourceIndex) - 1};
-			Ptr<IBufferSource> bs = CreateMemorySource(source, &totalCachedPages, pageSize);
-			if (!bs)
+			return lowWatermark;
+		}
+
+		vuint64_t BufferManager::GetHighWatermark()
+		{
+			return highWatermark;
+		}
+
+		bool BufferManager::SetWatermarks(vuint64_t lowFreePages, vuint64_t highFreePages)
+		{
+			if (lowFreePages > highFreePages) return false;
+			if (highFreePages > cachePageCount) return false;
+			lowWatermark = lowFreePages;
+			highWatermark = highFreePages;
+			return true;
+		}
+
+		vint BufferManager::GetNumaNodeCount()
+		{
+			return arena->GetNodeCount();
+		}
+
+		BufferNodeStatistics BufferManager::GetNumaNodeStatistics(vint node)
+		{
+			return arena->GetNodeStatistics(node);
+		}
+
+		vuint64_t BufferManager::GetCompressedCacheSize()
+		{
+			return compressedTier->GetCapacity();
+		}
+
+		void BufferManager::SetCompressedCacheSize(vuint64_t bytes)
+		{
+			compressedTier->SetCapacity(bytes);
+		}
+
+		BufferCompressedTierStatistics BufferManager::GetCompressedTierStatistics()
+		{
+			return compressedTier->GetStatistics();
+		}
+
+		BufferStatistics BufferManager::GetStatistics()
+		{
+			BufferStatistics result;
+			result.cachedPageCount = totalCachedPages;
+			statistics->Fill(result);
+			return result;
+		}
+
+		bool BufferManager::GetStatistics(BufferSource source, BufferStatistics& sourceStatistics)
+		{
+			StatisticsPtr bsStatistics;
+			auto bs = GetSource(source, bsStatistics);
+			if (!bs) return false;
+
+			sourceStatistics = BufferStatistics();
+			sourceStatistics.cachedPageCount = bs->GetCachedPageCount();
+			bsStatistics->Fill(sourceStatistics);
+			return true;
+		}
+
+		WString BufferManager::DumpStatistics()
+		{
+			List<BufferSource> dumpSources;
+			READER_LOCK(sourcesLock)
 			{
-				return BufferSource::Invalid();
+				CopyFrom(dumpSources, sources.Keys());
 			}
 
-			SPIN_LOCK(lock)
+			WString result = L"buffer manager:\n" + FormatBufferStatistics(GetStatistics(), L"    ");
+			FOREACH(BufferSource, source, dumpSources)
 			{
-				sources.Add(source, bs);
+				BufferStatistics sourceStatistics;
+				if (GetStatistics(source, sourceStatistics))
+				{
+					WString fileName = GetSourceFileName(source);
+					result += L"source " + u64tow(source.index) + (fileName == L"" ? L"" : L" (" + fileName + L")") + L":\n";
+					result += FormatBufferStatistics(sourceStatistics, L"    ");
+				}
 			}
-			SwapCacheIfNecessary();
-			return source;
+			return result;
+		}
+
+		BufferSource BufferManager::LoadMemorySource(const BufferSourceQuota& quota)
+		{
+			BufferSource source{(BufferSource::IndexType)INCRC(&usedSourceIndex) - 1};
+			Ptr<IBufferSource> bs = CreateMemorySource(source, &totalCachedPages, policy.Obj(), arena, compressedTier);
+			if (!bs)
+			{
+				return BufferSource::Invalid();
+			}
+			return AddSource(bs, quota);
 		}
 
-		BufferSource BufferManager::LoadFileSource(const WString& fileName, bool createNew)
+		BufferSource BufferManager::LoadFileSource(const WString& fileName, bool createNew, FileIoMode ioMode, const BufferSourceQuota& quota, bool checksums, bool hotPages)
 		{
 			BufferSource source{(BufferSource::IndexType)INCRC(&usedSourceIndex) - 1};
-			Ptr<IBufferSource> bs = CreateFileSource(source, &totalCachedPages, pageSize, fileName, createNew);
+			Ptr<IBufferSource> bs = CreateFileSource(source, &totalCachedPages, policy.Obj(), pageSize, fileName, createNew, ioMode, arena, checksums, compressedTier);
 			if (!bs)
 			{
 				return BufferSource::Invalid();
 			}
 
-			SPIN_LOCK(lock)
+			List<BufferPage> pages;
+			if (createNew)
 			{
-				sources.Add(source, bs);
+				// pages recorded for the previous content mean nothing to a new file
+				unlink(wtoa(GetHotPageFileName(fileName)).Buffer());
+			}
+			else if (hotPages)
+			{
+				LoadHotPages(fileName, pages);
+			}
+
+			AddSource(bs, quota);
+			if (hotPages)
+			{
+				WRITER_LOCK(sourcesLock)
+				{
+					hotPageSources.Add(source);
+				}
+				// recorded pages are sorted by their offsets in the file, they are read while the source serves other requests
+				Prefetch(source, pages);
 			}
-			SwapCacheIfNecessary();
 			return source;
 		}
 
 #define TRY_GET_BUFFER_SOURCE(BS, SOURCE, FAILVALUE)					\
-			Ptr<IBufferSource> BS;										\
-			SPIN_LOCK(lock)												\
-			{															\
-				vint index = sources.Keys().IndexOf(SOURCE);			\
-				if (index == -1) return FAILVALUE;						\
-				BS = sources.Values()[index];							\
-			}															\
+			Ptr<IBufferSource> BS = GetSource(SOURCE);					\
+			if (!BS) return FAILVALUE;									\
+
+#define TRY_GET_BUFFER_SOURCE_STATISTICS(BS, BSSTATISTICS, SOURCE, FAILVALUE)	\
+			StatisticsPtr BSSTATISTICS;									\
+			Ptr<IBufferSource> BS = GetSource(SOURCE, BSSTATISTICS);	\
+			if (!BS) return FAILVALUE;									\
 
 
 		bool BufferManager::UnloadSource(BufferSource source)
 		{
 			Ptr<IBufferSource> bs;
-			SPIN_LOCK(lock)
+			bool recordHotPages = false;
+			WRITER_LOCK(sourcesLock)
 			{
 				vint index = sources.Keys().IndexOf(source);
 				if (index == -1) return false;
 				bs = sources.Values()[index];
 				sources.Remove(source);
+				sourceQuotas.Remove(source);
+				sourceStatistics.Remove(source);
+				UpdateSourcePriorities();
+				if (hotPageSources.Contains(source))
+				{
+					hotPageSources.Remove(source);
+					recordHotPages = true;
+				}
+			}
+
+			if (recordHotPages)
+			{
+				RecordHotPages(bs);
 			}
 
-			SPIN_LOCK(bs->GetLock())
+			BUFFER_SPIN_LOCK(bs->GetLock(), nullptr)
 			{
 				bs->Unload();
 			}
@@ -176,38 +1180,79 @@ BufferManager
 			return bs->GetFileName();
 		}
 
-		void* BufferManager::LockPage(BufferSource source, BufferPage page)
+		bool BufferManager::GetSourceQuota(BufferSource source, BufferSourceQuota& quota)
 		{
-			TRY_GET_BUFFER_SOURCE(bs, source, nullptr);
+			READER_LOCK(sourcesLock)
+			{
+				vint index = sourceQuotas.Keys().IndexOf(source);
+				if (index == -1) return false;
+				quota = sourceQuotas.Values()[index];
+				return true;
+			}
+			return false;
+		}
 
-			void* address = nullptr;
-			SPIN_LOCK(bs->GetLock())
+		bool BufferManager::SetSourceQuota(BufferSource source, const BufferSourceQuota& quota)
+		{
+			TRY_GET_BUFFER_SOURCE(bs, source, false);
+			WRITER_LOCK(sourcesLock)
 			{
-				address = bs->LockPage(page);
+				if (!sourceQuotas.Keys().Contains(source)) return false;
+				sourceQuotas.Set(source, quota);
+				UpdateSourcePriorities();
 			}
-			SwapCacheIfNecessary();
-			return address;
+			TrimSource(bs);
+			return true;
 		}
 
-		bool BufferManager::UnlockPage(BufferSource source, BufferPage page, void* buffer, PersistanceType persistanceType)
+		vuint64_t BufferManager::GetCachedPageCount(BufferSource source)
+		{
+			TRY_GET_BUFFER_SOURCE(bs, source, 0);
+			return bs->GetCachedPageCount();
+		}
+
+		void* BufferManager::LockPage(BufferSource source, BufferPage page, PageLockAccess access, BufferAccessStrategy* strategy)
+		{
+			Ptr<IBufferSource> bs;
+			auto pageDesc = LockSourcePage(source, page, access, strategy, bs);
+			return pageDesc ? pageDesc->address : nullptr;
+		}
+
+		BufferPageGuard BufferManager::AcquirePage(BufferSource source, BufferPage page, PageLockAccess access, BufferAccessStrategy* strategy)
+		{
+			Ptr<IBufferSource> bs;
+			auto pageDesc = LockSourcePage(source, page, access, strategy, bs);
+			if (!pageDesc) return BufferPageGuard();
+			return BufferPageGuard(bs, pageDesc);
+		}
+
+		bool BufferManager::UpgradePage(BufferSource source, BufferPage page, void* buffer)
 		{
 			TRY_GET_BUFFER_SOURCE(bs, source, false);
+			return bs->UpgradePage(page, buffer);
+		}
 
-			bool successful = false;
-			SPIN_LOCK(bs->GetLock())
+		bool BufferManager::UnlockPage(BufferSource source, BufferPage page, void* buffer, PersistanceType persistanceType)
+		{
+			vuint64_t start = BufferStatisticsCollector::GetClock();
+			TRY_GET_BUFFER_SOURCE_STATISTICS(bs, bsStatistics, source, false);
+
+			bool successful = bs->UnlockPage(page, buffer, persistanceType);
+			if (successful)
 			{
-				successful = bs->UnlockPage(page, buffer, persistanceType);
+				Count(bsStatistics.Obj(), BufferCounter::Unlocks);
 			}
 			SwapCacheIfNecessary();
+			RecordLatency(bsStatistics.Obj(), BufferLatency::UnlockPage, start);
 			return successful;
 		}
 
 		BufferPage BufferManager::GetIndexPage(BufferSource source)
 		{
-			TRY_GET_BUFFER_SOURCE(bs, source, BufferPage::Invalid());
+			TRY_GET_BUFFER_SOURCE_STATISTICS(bs, bsStatistics, source, BufferPage::Invalid());
 
 			BufferPage page;
-			SPIN_LOCK(bs->GetLock())
+			BUFFER_SPIN_LOCK(bs->GetLock(), bsStatistics.Obj())
 			{
 				page = bs->GetIndexPage();
 			}
@@ -217,31 +1262,161 @@ BufferManager
 
 		BufferPage BufferManager::AllocatePage(BufferSource source)
 		{
-			TRY_GET_BUFFER_SOURCE(bs, source, BufferPage::Invalid());
+			TRY_GET_BUFFER_SOURCE_STATISTICS(bs, bsStatistics, source, BufferPage::Invalid());
 
 			BufferPage page;
-			SPIN_LOCK(bs->GetLock())
+			BUFFER_SPIN_LOCK(bs->GetLock(), bsStatistics.Obj())
 			{
 				page = bs->AllocatePage();
 			}
+			TrimSource(bs);
 			SwapCacheIfNecessary();
 			return page;
 		}
 
+		BufferPage BufferManager::AllocatePages(BufferSource source, vuint64_t count)
+		{
+			TRY_GET_BUFFER_SOURCE_STATISTICS(bs, bsStatistics, source, BufferPage::Invalid());
+
+			BufferPage page;
+			BUFFER_SPIN_LOCK(bs->GetLock(), bsStatistics.Obj())
+			{
+				page = bs->AllocatePages(count);
+			}
+			return page;
+		}
+
 		bool BufferManager::FreePage(BufferSource source, BufferPage page)
 		{
-			TRY_GET_BUFFER_SOURCE(bs, source, false);
+			TRY_GET_BUFFER_SOURCE_STATISTICS(bs, bsStatistics, source, false);
 			
 			bool successful = false;
-			SPIN_LOCK(bs->GetLock())
+			BUFFER_SPIN_LOCK(bs->GetLock(), bsStatistics.Obj())
 			{
 				successful = bs->FreePage(page);
 			}
 			SwapCacheIfNecessary();
 			return successful;
 		}
+
+		bool BufferManager::PersistPages(BufferSource source, const collections::List<BufferPage>& pages)
+		{
+			vuint64_t start = BufferStatisticsCollector::GetClock();
+			TRY_GET_BUFFER_SOURCE_STATISTICS(bs, bsStatistics, source, false);
+
+			bool successful = bs->PersistPages(pages);
+			Count(bsStatistics.Obj(), BufferCounter::Flushes);
+			RecordLatency(bsStatistics.Obj(), BufferLatency::Flush, start);
+			return successful;
+		}
+
+		vint BufferManager::Prefetch(BufferSource source, const collections::List<BufferPage>& pages)
+		{
+			TRY_GET_BUFFER_SOURCE(bs, source, 0);
+
+			vint queued = 0;
+			CS_LOCK(cleanerLock)
+			{
+				vuint64_t freePages = GetFreePageCount();
+				vuint64_t queuedPages = prefetchQueue.Count();
+				for (vint i = 0; i < pages.Count() && queuedPages < freePages; i++)
+				{
+					prefetchQueue.Add({source, pages[i]});
+					queuedPages++;
+					queued++;
+				}
+				if (queued > 0)
+				{
+					cleanerCondition.WakeAllPendings();
+				}
+			}
+			return queued;
+		}
+
+		vuint64_t BufferManager::GetHotPageInterval()
+		{
+			return hotPageInterval;
+		}
+
+		void BufferManager::SetHotPageInterval(vuint64_t milliseconds)
+		{
+			CS_LOCK(cleanerLock)
+			{
+				hotPageInterval = milliseconds;
+				lastHotPageTime = BufferPageDesc::GetDirtyClock();
+				cleanerCondition.WakeAllPendings();
+			}
+		}
+
+		bool BufferManager::RecordHotPages(BufferSource source)
+		{
+			TRY_GET_BUFFER_SOURCE(bs, source, false);
+			READER_LOCK(sourcesLock)
+			{
+				if (!hotPageSources.Contains(source)) return false;
+			}
+			return RecordHotPages(bs);
+		}
+
+		bool BufferManager::Checkpoint(BufferSource source)
+		{
+			vuint64_t start = BufferStatisticsCollector::GetClock();
+			TRY_GET_BUFFER_SOURCE_STATISTICS(bs, bsStatistics, source, false);
+
+			bool successful = bs->Checkpoint();
+			Count(bsStatistics.Obj(), BufferCounter::Flushes);
+			RecordLatency(bsStatistics.Obj(), BufferLatency::Flush, start);
+			return successful;
+		}
+
+		bool BufferManager::CheckpointAll()
+		{
+			List<BufferSource> checkpointSources;
+			READER_LOCK(sourcesLock)
+			{
+				CopyFrom(checkpointSources, sources.Keys());
+			}
+
+			bool successful = true;
+			FOREACH(BufferSource, source, checkpointSources)
+			{
+				if (!Checkpoint(source))
+				{
+					successful = false;
+				}
+			}
+			return successful;
+		}
+
+		vint BufferManager::GetDirtyPageCount(BufferSource source)
+		{
+			TRY_GET_BUFFER_SOURCE(bs, source, 0);
+			List<Ptr<BufferPageDesc>> pageDescs;
+			bs->FillDirtyPages(pageDescs);
+			return pageDescs.Count();
+		}
+
+		vuint64_t BufferManager::GetDirtyPageAge(BufferSource source)
+		{
+			TRY_GET_BUFFER_SOURCE(bs, source, 0);
+			List<Ptr<BufferPageDesc>> pageDescs;
+			bs->FillDirtyPages(pageDescs);
+
+			vuint64_t now = BufferPageDesc::GetDirtyClock();
+			vuint64_t age = 0;
+			FOREACH(Ptr<BufferPageDesc>, pageDesc, pageDescs)
+			{
+				vuint64_t time = pageDesc->firstDirtyTime;
+				if (time < now && now - time > age)
+				{
+					age = now - time;
+				}
+			}
+			return age;
+		}
 		
 #undef TRY_GET_BUFFER_SOURCE
+#undef TRY_GET_BUFFER_SOURCE_STATISTICS
 
 		bool BufferManager::EncodePointer(BufferPointer& pointer, BufferPage page, vuint64_t offset)
 		{
@@ -258,3 +1433,7 @@ BufferManager
 		}
 	}
 }
+
+#undef BUFFER_SPIN_LOCK
+#undef PREFETCH_BATCH_SIZE
+#undef CLEAN_BATCH_SIZE
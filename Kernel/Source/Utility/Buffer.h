@@ -21,11 +21,114 @@ namespace vl
 			ChangedAndPersist,
 		};
 
-		class IBufferSource : public virtual Interface
+		enum class FileIoMode
+		{
+			MemoryMapped,		// every page is mapped from the file by mmap
+			ReadWrite,			// pages are read into frames by pread and written back by pwrite
+			DirectReadWrite,	// ReadWrite with O_DIRECT, the buffer manager is the only cache
+			RegionMapped,		// the file is mapped in large regions once, a page address is computed from its index
+		};
+
+		enum class PageLockAccess
+		{
+			Shared,			// reading the page, many threads could share the page
+			Exclusive,		// writing the page
+		};
+
+		namespace buffer_internal
+		{
+			class BufferFrameArena;
+			class BufferCompressedTier;
+			class BufferStatisticsCollector;
+			enum class BufferCounter;
+			enum class BufferLatency;
+		}
+
+		class BufferPageDesc
 		{
 		public:
-			typedef Tuple<BufferSource, BufferPage, vuint64_t>		BufferPageTimeTuple;
+			static const vint		Unmapping = -1;
+			static const vint		ExclusivelyLocked = -2;
 
+			BufferSource			source;
+			BufferPage				page;
+			void*					address = nullptr;
+			vuint64_t				offset = 0;
+			volatile vint			lockState = 0;			// 0: unlocked, n > 0: pinned by n readers, ExclusivelyLocked, Unmapping
+			volatile vuint64_t		lastAccessTime = 0;		// logical time from the eviction policy
+			volatile vint			accessCount = 0;		// accesses after the page is mapped, 0 means only the thread mapping it has seen it
+			volatile bool			referenced = true;		// reference bit for the CLOCK policy
+			vint					frameIndex = -1;		// slot in the eviction policy
+			volatile vint			writeBackCount = 0;		// write backs in progress, the page cannot be unmapped
+			volatile bool			dirty = false;
+			volatile vint			exclusiveLockCount = 0;	// exclusive locks taken so far, a snapshot taken across a change sees it increased
+			volatile bool			persisting = false;		// the exclusive owner waits for the page to be durable and does not change it
+			volatile vuint64_t		firstDirtyTime = 0;		// milliseconds of the monotonic clock when the page became dirty
+			volatile vint			referenceCounter = 0;	// descriptors are reference counted by themselves, see ReferenceCounterOperator<BufferPageDesc>
+			buffer_internal::BufferFrameArena*	arena = nullptr;		// the frame and the descriptor belong to this arena
+			vint					arenaNode = 0;			// the partition of the arena that the frame belongs to
+			vint					arenaFrame = -1;
+
+			static void				Release(BufferPageDesc* pageDesc);
+			static vuint64_t		GetDirtyClock();
+
+			void					MarkDirty();
+
+			bool					IsLocked();
+			bool					IsExclusivelyLocked();
+			vint					GetPinCount();
+			bool					TryLock(PageLockAccess access);
+			bool					TryUpgrade();
+			bool					Unlock();
+			bool					TryBeginUnmap();
+			bool					CancelUnmap();
+			bool					TryBeginWriteBack();
+			void					EndWriteBack();
+			// copies the page unless it is changed by its exclusive owner during the copy
+			bool					TrySnapshot(void* buffer, vuint64_t size);
+		};
+	}
+
+	template<>
+	struct ReferenceCounterOperator<database::BufferPageDesc>
+	{
+		static __forceinline volatile vint* CreateCounter(database::BufferPageDesc* reference)
+		{
+			return &reference->referenceCounter;
+		}
+
+		static __forceinline void DeleteReference(volatile vint*, void* reference)
+		{
+			database::BufferPageDesc::Release((database::BufferPageDesc*)reference);
+		}
+	};
+
+	namespace database
+	{
+
+		class IBufferPageObserver : public virtual Interface
+		{
+		public:
+			virtual void			OnPageMapped(Ptr<BufferPageDesc> pageDesc) = 0;
+			virtual void			OnPageAccessed(BufferPageDesc* pageDesc) = 0;
+			virtual void			OnPageUnmapped(Ptr<BufferPageDesc> pageDesc) = 0;
+		};
+
+		class IBufferEvictionPolicy : public virtual IBufferPageObserver
+		{
+		public:
+			virtual void					SetCapacity(vuint64_t pageCount) = 0;
+			virtual vint					GetFrameCount() = 0;
+			virtual Ptr<BufferPageDesc>		NextVictim() = 0;
+			// moves a victim that the caller does not evict away from the eviction end, so that the next victim is another page
+			virtual void					SkipVictim(BufferPageDesc* pageDesc) = 0;
+		};
+
+		class IBufferSource : public virtual Interface
+		{
+		public:
+			// LockPage, UpgradePage, UnlockPage, LockPageDesc, UnlockPageDesc and WriteBackPage synchronize by themselves, other functions require GetLock()
+			// UnmapPage fails on dirty pages, they need to be written back first
 			virtual void			Unload() = 0;
 			virtual BufferSource	GetBufferSource() = 0;
 			virtual SpinLock&		GetLock() = 0;
@@ -33,25 +136,192 @@ namespace vl
 			virtual bool			UnmapPage(BufferPage page) = 0;
 			virtual BufferPage		GetIndexPage() = 0;
 			virtual BufferPage		AllocatePage() = 0;
+			// allocates a contiguous run of pages and returns the first one, pages are not mapped until they are locked
+			virtual BufferPage		AllocatePages(vuint64_t count) = 0;
 			virtual bool			FreePage(BufferPage page) = 0;
-			virtual void*			LockPage(BufferPage page) = 0;
+			virtual void*			LockPage(BufferPage page, PageLockAccess access) = 0;
+			virtual bool			UpgradePage(BufferPage page, void* address) = 0;
 			virtual bool			UnlockPage(BufferPage page, void* address, PersistanceType persistanceType) = 0;
-			virtual void			FillUnmapPageCandidates(collections::List<BufferPageTimeTuple>& pages, vint expectCount) = 0;
+			// missed is set when the page is read for this lock, pages mapped ahead of use are not missed
+			virtual Ptr<BufferPageDesc>	LockPageDesc(BufferPage page, PageLockAccess access, bool& missed) = 0;
+			virtual bool			UnlockPageDesc(BufferPageDesc* pageDesc, PersistanceType persistanceType) = 0;
+			virtual bool			WriteBackPage(BufferPage page) = 0;
+			// writes dirty pages of the batch back without synchronizing the file, pages that are not written are left dirty
+			virtual bool			WriteBackPages(collections::List<Ptr<BufferPageDesc>>& pageDescs) = 0;
+			// makes changes of the pages durable, concurrent callers share writes and file synchronization
+			virtual bool			PersistPages(const collections::List<BufferPage>& pages) = 0;
+			// fills mapped dirty pages sorted by offset
+			virtual void			FillDirtyPages(collections::List<Ptr<BufferPageDesc>>& pageDescs) = 0;
+			virtual void			FillCachedPages(collections::List<Ptr<BufferPageDesc>>& pageDescs) = 0;
+			// writes dirty pages in offset order without locking them and makes them durable, pages being changed are left dirty
+			virtual bool			Checkpoint() = 0;
+			// maps pages ahead of use without locking them, returns the number of pages that are newly mapped or being read by the kernel
+			virtual vint			PrefetchPages(const collections::List<BufferPage>& pages) = 0;
+			// takes pages that the source decides to read ahead but cannot read without blocking, it synchronizes by itself
+			virtual void			FillReadaheadPages(collections::List<BufferPage>& pages) = 0;
+			virtual vint			GetCachedPageCount() = 0;
 		};
 
-		class BufferPageDesc
+		class BufferPageGuard
+		{
+		private:
+			Ptr<IBufferSource>		source;
+			Ptr<BufferPageDesc>		pageDesc;
+			PersistanceType			persistanceType = PersistanceType::NoChanging;
+
+		public:
+			BufferPageGuard();
+			BufferPageGuard(Ptr<IBufferSource> _source, Ptr<BufferPageDesc> _pageDesc);
+			BufferPageGuard(BufferPageGuard&& guard);
+			BufferPageGuard(const BufferPageGuard&) = delete;
+			~BufferPageGuard();
+
+			BufferPageGuard&		operator=(BufferPageGuard&& guard);
+			BufferPageGuard&		operator=(const BufferPageGuard&) = delete;
+
+			bool					IsValid();
+			BufferPage				GetPage();
+			void*					GetAddress();
+			bool					IsExclusive();
+			bool					Upgrade();
+			// the page will be unlocked as Changed or ChangedAndPersist, only exclusive guards could be marked
+			bool					MarkChanged(bool persist = false);
+			bool					Release();
+		};
+
+		namespace buffer_internal
+		{
+			class BufferPageTable : public Object
+			{
+				typedef collections::Dictionary<vuint64_t, Ptr<BufferPageDesc>>	PageMap;
+				typedef collections::List<Ptr<BufferPageDesc>>					PageDescList;
+				static const vint			ShardCount = 64;
+
+				struct Shard
+				{
+					SpinLock				lock;
+					PageMap					pages;
+				};
+			private:
+				BufferSource				source;
+				volatile vuint64_t*			totalUsedPages;
+				IBufferPageObserver*		observer;
+				volatile vint				pageCount = 0;
+				Shard						shards[ShardCount];
+
+				Shard&						GetShard(BufferPage page);
+			public:
+				BufferPageTable(BufferSource _source, volatile vuint64_t* _totalUsedPages, IBufferPageObserver* _observer);
+
+				vint						Count();
+				Ptr<BufferPageDesc>			Get(BufferPage page);
+				bool						Add(Ptr<BufferPageDesc> pageDesc);
+				void						Touch(BufferPageDesc* pageDesc);
+				bool						Remove(BufferPage page);
+				void						FillPages(PageDescList& pageDescs);
+				void						FillDirtyPages(PageDescList& pageDescs);
+			};
+		}
+
+		struct BufferNodeStatistics
+		{
+			vint				frameCount = 0;
+			vint				usedFrameCount = 0;
+			vuint64_t			localAllocations = 0;	// frames given to threads running on this node
+			vuint64_t			remoteAllocations = 0;	// frames given to threads running on other nodes
+		};
+
+		struct BufferCompressedTierStatistics
 		{
+			vuint64_t			capacity = 0;			// bytes of compressed pages the tier keeps
+			vuint64_t			usedBytes = 0;
+			vuint64_t			pageCount = 0;
+			vuint64_t			lookups = 0;			// pages that are not in frames and are looked up in the tier
+			vuint64_t			hits = 0;
+			vuint64_t			storedPages = 0;
+			vuint64_t			rejectedPages = 0;		// evicted pages that do not compress well enough
+			vuint64_t			droppedPages = 0;		// compressed pages dropped to stay under the capacity
+			double				hitRatio = 0;			// hits / lookups
+		};
+
+		struct BufferLatencyHistogram
+		{
+			// nanoseconds below 4 have their own buckets, every power of two above is split into 4 buckets
+			static const vint	BucketCount = 160;
+
+			vuint64_t			buckets[BucketCount];
+			vuint64_t			count = 0;
+			vuint64_t			totalNanoseconds = 0;
+
+			BufferLatencyHistogram();
+
+			static vint			GetBucket(vuint64_t nanoseconds);
+			static vuint64_t	GetBucketUpperBound(vint bucket);
+			vuint64_t			GetMean()const;
+			// returns the upper bound of the bucket that contains the percentile, percentile is in [0, 1]
+			vuint64_t			GetPercentile(double percentile)const;
+		};
+
+		struct BufferStatistics
+		{
+			vuint64_t			cachedPageCount = 0;
+			vuint64_t			lockCount = 0;			// pages successfully locked by LockPage and AcquirePage
+			vuint64_t			hitCount = 0;			// locked pages that were already cached
+			vuint64_t			missCount = 0;			// locked pages that were read from the source
+			vuint64_t			failedLockCount = 0;
+			vuint64_t			unlockCount = 0;
+			vuint64_t			evictionCount = 0;
+			vuint64_t			writeBackCount = 0;		// dirty pages written back to be evicted
+			vuint64_t			flushCount = 0;			// calls to PersistPages and Checkpoint
+			vuint64_t			lockWaitCount = 0;		// spin locks taken by the buffer manager that were not free
+			vuint64_t			lockWaitNanoseconds = 0;
+			double				hitRatio = 0;			// hitCount / lockCount
+			BufferLatencyHistogram	lockPageLatency;
+			BufferLatencyHistogram	unlockPageLatency;
+			BufferLatencyHistogram	flushLatency;
+			BufferLatencyHistogram	writeBackLatency;		// including msync of mapped pages
+		};
+
+		struct BufferSourceQuota
+		{
+			vuint64_t			reservedPages = 0;		// pages of the source are not evicted for other sources when it caches fewer pages
+			vuint64_t			maxPages = 0;			// the source caches at most this many pages, 0 means no limit
+			vint				priority = 0;			// pages of sources with lower priority are evicted first
+		};
+
+		class BufferAccessStrategy : public Object
+		{
+			friend class BufferManager;
+
+			struct RingEntry
+			{
+				Ptr<BufferPageDesc>	pageDesc;
+				vint				accessCount = 0;
+			};
+			typedef collections::Array<RingEntry>										RingEntryList;
+		private:
+			SpinLock			lock;
+			RingEntryList		ring;
+			vint				next = 0;
+			volatile vuint64_t	recycledPageCount = 0;
+
 		public:
-			void*					address = nullptr;
-			vuint64_t				offset = 0;
-			bool					locked = false;
-			vuint64_t				lastAccessTime = 0;
-			bool					dirty = false;
+			// pages mapped by a scan are recycled in a ring of ringSize frames, pages that others also access are left to the eviction policy
+			BufferAccessStrategy(vint ringSize);
+
+			vint				GetRingSize();
+			vuint64_t			GetRecycledPageCount();
 		};
 
 		class BufferManager
 		{
 			typedef collections::Dictionary<BufferSource, Ptr<IBufferSource>>				SourceMap;
+			typedef collections::List<collections::Pair<BufferSource, BufferPage>>			PrefetchList;
+			typedef collections::Dictionary<BufferSource, BufferSourceQuota>				QuotaMap;
+			typedef collections::SortedList<vint>												PriorityList;
+			typedef collections::SortedList<BufferSource>										SourceList;
+			typedef Ptr<buffer_internal::BufferStatisticsCollector>								StatisticsPtr;
+			typedef collections::Dictionary<BufferSource, StatisticsPtr>						StatisticsMap;
 		private:
 			vuint64_t			pageSize;
 			vuint64_t			cachePageCount;
@@ -59,28 +329,105 @@ namespace vl
 			volatile vuint64_t	totalCachedPages;
 			SpinLock			lock;
 			volatile vint		usedSourceIndex;
+			ReaderWriterLock	sourcesLock;
 			SourceMap			sources;
+			QuotaMap			sourceQuotas;			// guarded by sourcesLock
+			PriorityList		sourcePriorities;		// distinct priorities of all sources, guarded by sourcesLock
+			volatile vint		cappedSourceCount = 0;	// sources with maxPages, guarded by sourcesLock
+			StatisticsMap		sourceStatistics;		// guarded by sourcesLock
+			StatisticsPtr		statistics;				// everything in sourceStatistics and waits on lock
+			SourceList			hotPageSources;			// sources that record their hot pages, guarded by sourcesLock
+			Ptr<IBufferEvictionPolicy>	policy;
 
+			CriticalSection		cleanerLock;
+			ConditionVariable	cleanerCondition;
+			vuint64_t			lowWatermark;			// the cleaner wakes up when fewer frames are free
+			vuint64_t			highWatermark;			// the cleaner sleeps again when this many frames are free
+			volatile bool		cleanerRequested = false;
+			bool				cleanerStopping = false;
+			bool				cleanerRunning = false;
+			PrefetchList		prefetchQueue;			// pages waiting for the cleaner to prefetch them
+			volatile vuint64_t	hotPageInterval = 0;	// milliseconds between two recordings of hot pages
+			volatile vuint64_t	lastHotPageTime = 0;
+
+			Ptr<IBufferSource>	GetSource(BufferSource source);
+			Ptr<IBufferSource>	GetSource(BufferSource source, StatisticsPtr& bsStatistics);
+			StatisticsPtr		GetSourceStatistics(BufferSource source);
+			void				Count(buffer_internal::BufferStatisticsCollector* bsStatistics, buffer_internal::BufferCounter counter, vuint64_t value = 1);
+			void				RecordLatency(buffer_internal::BufferStatisticsCollector* bsStatistics, buffer_internal::BufferLatency latency, vuint64_t start);
+			Ptr<BufferPageDesc>	LockSourcePage(BufferSource source, BufferPage page, PageLockAccess access, BufferAccessStrategy* strategy, Ptr<IBufferSource>& bs);
+			bool				WriteBackVictim(Ptr<IBufferSource> bs, BufferPageDesc* pageDesc);
+			void				WriteBackVictims(Ptr<IBufferSource> bs, collections::List<Ptr<BufferPageDesc>>& pageDescs);
+			bool				UnmapVictim(Ptr<IBufferSource> bs, BufferPageDesc* pageDesc);
+			bool				RecordHotPages(Ptr<IBufferSource> bs);
+			void				RecordAllHotPages();
+			BufferSource		AddSource(Ptr<IBufferSource> bs, const BufferSourceQuota& quota);
+			void				UpdateSourcePriorities();
+			void				GetSourcePriorities(PriorityList& priorities);
+			Ptr<IBufferSource>	GetEvictableSource(BufferPageDesc* victim, vint priority);
+			void				TrimSource(Ptr<IBufferSource> bs);
+			vuint64_t			GetFreePageCount();
+			void				WakeCleaner();
+			void				StopCleaner();
+			void				CleanerProc();
+			void				CleanPages();
+			void				PrefetchQueuedPages(PrefetchList& pages);
 			void				SwapCacheIfNecessary();
+			void				RecyclePage(Ptr<BufferPageDesc> pageDesc, BufferAccessStrategy* strategy);
+
+			Ptr<buffer_internal::BufferFrameArena>	arena;
+			Ptr<buffer_internal::BufferCompressedTier>	compressedTier;
 		public:
-			BufferManager(vuint64_t _pageSize, vuint64_t _cachePageCount);
+			BufferManager(vuint64_t _pageSize, vuint64_t _cachePageCount, Ptr<IBufferEvictionPolicy> _policy = nullptr);
 			~BufferManager();
 
 			vuint64_t			GetPageSize();
 			vuint64_t			GetCachePageCount();
 			vuint64_t			GetCacheSize();
 			vuint64_t			GetCurrentlyCachedPageCount();
+			vuint64_t			GetLowWatermark();
+			vuint64_t			GetHighWatermark();
+			bool				SetWatermarks(vuint64_t lowFreePages, vuint64_t highFreePages);
+			vint				GetNumaNodeCount();
+			BufferNodeStatistics	GetNumaNodeStatistics(vint node);
+			// clean pages evicted from frames are compressed into a tier of at most this many bytes, 0 disables it
+			vuint64_t			GetCompressedCacheSize();
+			void				SetCompressedCacheSize(vuint64_t bytes);
+			BufferCompressedTierStatistics	GetCompressedTierStatistics();
+			// counters are collected per processor and summed up here, hits and misses are only known for pages locked through the manager
+			BufferStatistics	GetStatistics();
+			bool				GetStatistics(BufferSource source, BufferStatistics& sourceStatistics);
+			WString				DumpStatistics();
 
-			BufferSource		LoadMemorySource();
-			BufferSource		LoadFileSource(const WString& fileName, bool createNew);
+			BufferSource		LoadMemorySource(const BufferSourceQuota& quota = BufferSourceQuota());
+			// checksums are verified when pages are read, they require ReadWrite or DirectReadWrite
+			// with hotPages, cached pages are recorded in a file next to the source, and recorded pages are prefetched in the background when it is loaded again
+			BufferSource		LoadFileSource(const WString& fileName, bool createNew, FileIoMode ioMode = FileIoMode::MemoryMapped, const BufferSourceQuota& quota = BufferSourceQuota(), bool checksums = false, bool hotPages = false);
 			bool				UnloadSource(BufferSource source);
 			WString				GetSourceFileName(BufferSource source);
+			bool				GetSourceQuota(BufferSource source, BufferSourceQuota& quota);
+			bool				SetSourceQuota(BufferSource source, const BufferSourceQuota& quota);
+			vuint64_t			GetCachedPageCount(BufferSource source);
 
-			void*				LockPage(BufferSource source, BufferPage page);
+			void*				LockPage(BufferSource source, BufferPage page, PageLockAccess access = PageLockAccess::Exclusive, BufferAccessStrategy* strategy = nullptr);
+			BufferPageGuard		AcquirePage(BufferSource source, BufferPage page, PageLockAccess access = PageLockAccess::Exclusive, BufferAccessStrategy* strategy = nullptr);
+			bool				UpgradePage(BufferSource source, BufferPage page, void* buffer);
 			bool				UnlockPage(BufferSource source, BufferPage page, void* buffer, PersistanceType persistanceType);
 			BufferPage			GetIndexPage(BufferSource source);
 			BufferPage			AllocatePage(BufferSource source);
+			BufferPage			AllocatePages(BufferSource source, vuint64_t count);
 			bool				FreePage(BufferSource source, BufferPage page);
+			bool				PersistPages(BufferSource source, const collections::List<BufferPage>& pages);
+			// pages are read by the cleaner thread, prefetching never evicts pages, returns the number of pages queued
+			vint				Prefetch(BufferSource source, const collections::List<BufferPage>& pages);
+			// hot pages are recorded when sources are unloaded, and by the cleaner at most every interval milliseconds while pages are accessed, 0 disables it
+			vuint64_t			GetHotPageInterval();
+			void				SetHotPageInterval(vuint64_t milliseconds);
+			bool				RecordHotPages(BufferSource source);
+			bool				Checkpoint(BufferSource source);
+			bool				CheckpointAll();
+			vint				GetDirtyPageCount(BufferSource source);
+			vuint64_t			GetDirtyPageAge(BufferSource source);
 			bool				EncodePointer(BufferPointer& pointer, BufferPage page, vuint64_t offset);
 			bool				DecodePointer(BufferPointer pointer, BufferPage& page, vuint64_t& offset);
 		};
@@ -0,0 +1,248 @@
+#include "BufferArena.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_mbind)
+#include <linux/mempolicy.h>
+#endif
+
+namespace vl
+{
+	namespace database
+	{
+		using namespace collections;
+
+		namespace buffer_internal
+		{
+
+/***********************************************************************
+BufferFrameArena
+***********************************************************************/
+
+			bool BufferFrameArena::AllocateChunk(vint node)
+			{
+				auto partition = partitions[node];
+				vuint64_t chunkSize = pageSize * framesPerChunk;
+				void* frames = mmap(nullptr, chunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (frames == MAP_FAILED)
+				{
+					return false;
+				}
+				if (useHugePages)
+				{
+					// only a hint, the kernel falls back to normal pages when transparent hugepages are not available
+					madvise(frames, chunkSize, MADV_HUGEPAGE);
+				}
+#if defined(__NR_mbind)
+				if (partitions.Count() > 1 && node < (vint)sizeof(unsigned long) * 8)
+				{
+					// frames are not touched yet, so the policy decides where they are placed, the kernel falls back to other nodes when it is full
+					unsigned long nodeMask = 1UL << node;
+					syscall(__NR_mbind, frames, chunkSize, MPOL_PREFERRED, &nodeMask, sizeof(nodeMask) * 8, 0);
+				}
+#endif
+
+				auto pageDescs = (BufferPageDesc*)malloc(sizeof(BufferPageDesc) * framesPerChunk);
+				if (!pageDescs)
+				{
+					munmap(frames, chunkSize);
+					return false;
+				}
+
+				Chunk chunk;
+				chunk.frames = (char*)frames;
+				chunk.pageDescs = pageDescs;
+				vint firstFrame = partition->chunks.Count() * framesPerChunk;
+				partition->chunks.Add(chunk);
+
+				for (vint i = framesPerChunk - 1; i >= 0; i--)
+				{
+					partition->freeFrames.Add(firstFrame + i);
+				}
+				return true;
+			}
+
+			Ptr<BufferPageDesc> BufferFrameArena::AllocateFrame(vint node)
+			{
+				auto partition = partitions[node];
+				BufferPageDesc* pageDesc = nullptr;
+				SPIN_LOCK(partition->lock)
+				{
+					if (partition->freeFrames.Count() == 0 && !AllocateChunk(node))
+					{
+						return nullptr;
+					}
+
+					vint frame = partition->freeFrames[partition->freeFrames.Count() - 1];
+					partition->freeFrames.RemoveAt(partition->freeFrames.Count() - 1);
+
+					auto& chunk = partition->chunks[frame / framesPerChunk];
+					vint index = frame % framesPerChunk;
+					pageDesc = new(&chunk.pageDescs[index]) BufferPageDesc;
+					pageDesc->address = chunk.frames + pageSize * index;
+					pageDesc->arena = this;
+					pageDesc->arenaNode = node;
+					pageDesc->arenaFrame = frame;
+				}
+				INCRC(&partition->usedFrameCount);
+				return pageDesc;
+			}
+
+			void BufferFrameArena::ReleasePageDesc(BufferPageDesc* pageDesc)
+			{
+				auto partition = partitions[pageDesc->arenaNode];
+				vint frame = pageDesc->arenaFrame;
+				pageDesc->~BufferPageDesc();
+				SPIN_LOCK(partition->lock)
+				{
+					partition->freeFrames.Add(frame);
+				}
+				DECRC(&partition->usedFrameCount);
+			}
+
+			BufferFrameArena::BufferFrameArena(vuint64_t _pageSize, vint _framesPerChunk, bool _useHugePages, vint _nodeCount)
+				:pageSize(_pageSize)
+				,framesPerChunk(_framesPerChunk)
+				,useHugePages(_useHugePages)
+			{
+				CHECK_ERROR(framesPerChunk > 0, L"vl::database::buffer_internal::BufferFrameArena::BufferFrameArena(vuint64_t, vint, bool, vint)#Internal error: A chunk should contain at least one frame.");
+				CHECK_ERROR(_nodeCount > 0, L"vl::database::buffer_internal::BufferFrameArena::BufferFrameArena(vuint64_t, vint, bool, vint)#Internal error: An arena should contain at least one partition.");
+				for (vint i = 0; i < _nodeCount; i++)
+				{
+					partitions.Add(new Partition);
+				}
+			}
+
+			BufferFrameArena::~BufferFrameArena()
+			{
+				FOREACH(Ptr<Partition>, partition, partitions)
+				{
+					FOREACH(Chunk, chunk, partition->chunks)
+					{
+						munmap(chunk.frames, pageSize * framesPerChunk);
+						free(chunk.pageDescs);
+					}
+				}
+			}
+
+			vuint64_t BufferFrameArena::GetPageSize()
+			{
+				return pageSize;
+			}
+
+			vint BufferFrameArena::GetNodeCount()
+			{
+				return partitions.Count();
+			}
+
+			vint BufferFrameArena::GetFrameCount()
+			{
+				vint frameCount = 0;
+				FOREACH(Ptr<Partition>, partition, partitions)
+				{
+					SPIN_LOCK(partition->lock)
+					{
+						frameCount += partition->chunks.Count() * framesPerChunk;
+					}
+				}
+				return frameCount;
+			}
+
+			vint BufferFrameArena::GetUsedFrameCount()
+			{
+				vint usedFrameCount = 0;
+				FOREACH(Ptr<Partition>, partition, partitions)
+				{
+					usedFrameCount += partition->usedFrameCount;
+				}
+				return usedFrameCount;
+			}
+
+			BufferNodeStatistics BufferFrameArena::GetNodeStatistics(vint node)
+			{
+				CHECK_ERROR(0 <= node && node < partitions.Count(), L"vl::database::buffer_internal::BufferFrameArena::GetNodeStatistics(vint)#Internal error: Node out of range.");
+				auto partition = partitions[node];
+				BufferNodeStatistics statistics;
+				SPIN_LOCK(partition->lock)
+				{
+					statistics.frameCount = partition->chunks.Count() * framesPerChunk;
+				}
+				statistics.usedFrameCount = partition->usedFrameCount;
+				statistics.localAllocations = partition->localAllocations;
+				statistics.remoteAllocations = partition->remoteAllocations;
+				return statistics;
+			}
+
+			Ptr<BufferPageDesc> BufferFrameArena::AllocatePageDesc()
+			{
+				return AllocatePageDesc(partitions.Count() > 1 ? GetCurrentNumaNode() % partitions.Count() : 0);
+			}
+
+			Ptr<BufferPageDesc> BufferFrameArena::AllocatePageDesc(vint node)
+			{
+				CHECK_ERROR(0 <= node && node < partitions.Count(), L"vl::database::buffer_internal::BufferFrameArena::AllocatePageDesc(vint)#Internal error: Node out of range.");
+				vint currentNode = partitions.Count() > 1 ? GetCurrentNumaNode() % partitions.Count() : 0;
+				for (vint i = 0; i < partitions.Count(); i++)
+				{
+					vint target = (node + i) % partitions.Count();
+					if (auto pageDesc = AllocateFrame(target))
+					{
+						auto partition = partitions[target];
+						INCRC(target == currentNode ? &partition->localAllocations : &partition->remoteAllocations);
+						return pageDesc;
+					}
+				}
+				return nullptr;
+			}
+
+/***********************************************************************
+NUMA
+***********************************************************************/
+
+			vint GetNumaNodeCount()
+			{
+				// the file contains ranges like 0-1,3, nodes are counted up to the largest one
+				FILE* file = fopen("/sys/devices/system/node/online", "r");
+				if (!file)
+				{
+					return 1;
+				}
+
+				vint nodeCount = 1;
+				vint number = -1;
+				int c = 0;
+				while ((c = fgetc(file)) != EOF)
+				{
+					if ('0' <= c && c <= '9')
+					{
+						number = (number == -1 ? 0 : number * 10) + (c - '0');
+					}
+					else
+					{
+						if (number + 1 > nodeCount) nodeCount = number + 1;
+						number = -1;
+					}
+				}
+				if (number + 1 > nodeCount) nodeCount = number + 1;
+				fclose(file);
+				return nodeCount;
+			}
+
+			vint GetCurrentNumaNode()
+			{
+#if defined(__NR_getcpu)
+				unsigned cpu = 0;
+				unsigned node = 0;
+				if (syscall(__NR_getcpu, &cpu, &node, nullptr) == 0)
+				{
+					return (vint)node;
+				}
+#endif
+				return 0;
+			}
+		}
+	}
+}
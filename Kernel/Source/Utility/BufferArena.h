@@ -0,0 +1,74 @@
+/***********************************************************************
+Vczh Library++ 3.0
+Developer: Zihan Chen(vczh)
+Database::Utility
+
+***********************************************************************/
+
+#ifndef VCZH_DATABASE_UTILITY_BUFFERARENA
+#define VCZH_DATABASE_UTILITY_BUFFERARENA
+
+#include "Buffer.h"
+
+namespace vl
+{
+	namespace database
+	{
+		namespace buffer_internal
+		{
+			class BufferFrameArena : public Object
+			{
+				friend class vl::database::BufferPageDesc;
+
+				struct Chunk
+				{
+					char*					frames = nullptr;
+					BufferPageDesc*			pageDescs = nullptr;
+				};
+				typedef collections::List<Chunk>								ChunkList;
+				typedef collections::List<vint>									FrameIndexList;
+
+				class Partition : public Object
+				{
+				public:
+					SpinLock				lock;
+					ChunkList				chunks;
+					FrameIndexList			freeFrames;
+					volatile vint			usedFrameCount = 0;
+					volatile vuint64_t		localAllocations = 0;
+					volatile vuint64_t		remoteAllocations = 0;
+				};
+				typedef collections::List<Ptr<Partition>>						PartitionList;
+			private:
+				vuint64_t					pageSize;
+				vint						framesPerChunk;
+				bool						useHugePages;
+				PartitionList				partitions;
+
+				bool						AllocateChunk(vint node);
+				Ptr<BufferPageDesc>			AllocateFrame(vint node);
+				void						ReleasePageDesc(BufferPageDesc* pageDesc);
+			public:
+				// every chunk is a page aligned region of framesPerChunk frames, descriptors are stored in an array per chunk
+				// there is one partition per NUMA node, chunks of a partition prefer the memory of its node
+				BufferFrameArena(vuint64_t _pageSize, vint _framesPerChunk, bool _useHugePages, vint _nodeCount = 1);
+				~BufferFrameArena();
+
+				vuint64_t					GetPageSize();
+				vint						GetNodeCount();
+				vint						GetFrameCount();
+				vint						GetUsedFrameCount();
+				BufferNodeStatistics		GetNodeStatistics(vint node);
+				// the frame returns to the arena when the last reference to the descriptor is released
+				// frames come from the partition of the calling thread, other partitions are used when it cannot grow
+				Ptr<BufferPageDesc>			AllocatePageDesc();
+				Ptr<BufferPageDesc>			AllocatePageDesc(vint node);
+			};
+
+			extern vint						GetNumaNodeCount();
+			extern vint						GetCurrentNumaNode();
+		}
+	}
+}
+
+#endif
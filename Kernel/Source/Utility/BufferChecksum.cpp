@@ -0,0 +1,168 @@
+#include "BufferChecksum.h"
+#include <string.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BUFFER_CRC32C_SSE42
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define BUFFER_CRC32C_ARMV8
+#endif
+
+#define CRC32C_POLYNOMIAL 0x82F63B78U
+
+namespace vl
+{
+	namespace database
+	{
+		namespace buffer_internal
+		{
+
+/***********************************************************************
+CRC32C
+***********************************************************************/
+
+			namespace
+			{
+				struct Crc32cTables
+				{
+					vuint32_t				entries[8][256];
+
+					Crc32cTables()
+					{
+						for (vuint32_t i = 0; i < 256; i++)
+						{
+							vuint32_t crc = i;
+							for (vint j = 0; j < 8; j++)
+							{
+								crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+							}
+							entries[0][i] = crc;
+						}
+						for (vuint32_t i = 0; i < 256; i++)
+						{
+							for (vint j = 1; j < 8; j++)
+							{
+								entries[j][i] = (entries[j - 1][i] >> 8) ^ entries[0][entries[j - 1][i] & 0xFF];
+							}
+						}
+					}
+				};
+
+				vuint32_t ComputeCrc32cScalar(vuint32_t crc, const vuint8_t* bytes, vuint64_t length)
+				{
+					// slicing by 8 consumes a word per step with eight table lookups
+					static const Crc32cTables tables;
+					auto& t = tables.entries;
+					while (length >= 8)
+					{
+						vuint64_t word;
+						memcpy(&word, bytes, 8);
+						word ^= crc;
+						crc =
+							t[7][word & 0xFF] ^
+							t[6][(word >> 8) & 0xFF] ^
+							t[5][(word >> 16) & 0xFF] ^
+							t[4][(word >> 24) & 0xFF] ^
+							t[3][(word >> 32) & 0xFF] ^
+							t[2][(word >> 40) & 0xFF] ^
+							t[1][(word >> 48) & 0xFF] ^
+							t[0][word >> 56];
+						bytes += 8;
+						length -= 8;
+					}
+					while (length > 0)
+					{
+						crc = (crc >> 8) ^ t[0][(crc ^ *bytes) & 0xFF];
+						bytes++;
+						length--;
+					}
+					return crc;
+				}
+
+#if defined(BUFFER_CRC32C_SSE42)
+				__attribute__((target("sse4.2")))
+				vuint32_t ComputeCrc32cSse42(vuint32_t crc, const vuint8_t* bytes, vuint64_t length)
+				{
+#if defined(__x86_64__)
+					vuint64_t crc64 = crc;
+					while (length >= 8)
+					{
+						vuint64_t word;
+						memcpy(&word, bytes, 8);
+						crc64 = _mm_crc32_u64(crc64, word);
+						bytes += 8;
+						length -= 8;
+					}
+					crc = (vuint32_t)crc64;
+#endif
+					while (length >= 4)
+					{
+						vuint32_t word;
+						memcpy(&word, bytes, 4);
+						crc = _mm_crc32_u32(crc, word);
+						bytes += 4;
+						length -= 4;
+					}
+					while (length > 0)
+					{
+						crc = _mm_crc32_u8(crc, *bytes);
+						bytes++;
+						length--;
+					}
+					return crc;
+				}
+#elif defined(BUFFER_CRC32C_ARMV8)
+				vuint32_t ComputeCrc32cArmv8(vuint32_t crc, const vuint8_t* bytes, vuint64_t length)
+				{
+					while (length >= 8)
+					{
+						vuint64_t word;
+						memcpy(&word, bytes, 8);
+						crc = __crc32cd(crc, word);
+						bytes += 8;
+						length -= 8;
+					}
+					while (length > 0)
+					{
+						crc = __crc32cb(crc, *bytes);
+						bytes++;
+						length--;
+					}
+					return crc;
+				}
+#endif
+			}
+
+			vuint32_t ComputeCrc32c(const void* buffer, vuint64_t length)
+			{
+				auto bytes = (const vuint8_t*)buffer;
+#if defined(BUFFER_CRC32C_SSE42)
+				static const bool useSse42 = __builtin_cpu_supports("sse4.2");
+				return ~(useSse42
+					? ComputeCrc32cSse42(~0U, bytes, length)
+					: ComputeCrc32cScalar(~0U, bytes, length)
+					);
+#elif defined(BUFFER_CRC32C_ARMV8)
+				return ~ComputeCrc32cArmv8(~0U, bytes, length);
+#else
+				return ~ComputeCrc32cScalar(~0U, bytes, length);
+#endif
+			}
+
+			bool IsCrc32cAccelerated()
+			{
+#if defined(BUFFER_CRC32C_SSE42)
+				return __builtin_cpu_supports("sse4.2");
+#elif defined(BUFFER_CRC32C_ARMV8)
+				return true;
+#else
+				return false;
+#endif
+			}
+		}
+	}
+}
+
+#undef CRC32C_POLYNOMIAL
+#undef BUFFER_CRC32C_SSE42
+#undef BUFFER_CRC32C_ARMV8
@@ -0,0 +1,26 @@
+/***********************************************************************
+Vczh Library++ 3.0
+Developer: Zihan Chen(vczh)
+Database::Utility
+
+***********************************************************************/
+
+#ifndef VCZH_DATABASE_UTILITY_BUFFERCHECKSUM
+#define VCZH_DATABASE_UTILITY_BUFFERCHECKSUM
+
+#include "Buffer.h"
+
+namespace vl
+{
+	namespace database
+	{
+		namespace buffer_internal
+		{
+			// CRC32C (Castagnoli), computed by the crc32 instructions of SSE4.2 or ARMv8 when the processor has them
+			extern vuint32_t				ComputeCrc32c(const void* buffer, vuint64_t length);
+			extern bool						IsCrc32cAccelerated();
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,391 @@
+#include "BufferCompression.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define COMPRESSION_HASH_BITS 12
+#define COMPRESSION_MIN_MATCH 4
+#define COMPRESSION_MAX_OFFSET 65535
+
+namespace vl
+{
+	namespace database
+	{
+		using namespace collections;
+
+		namespace buffer_internal
+		{
+
+/***********************************************************************
+Compression
+***********************************************************************/
+
+			namespace
+			{
+				vuint32_t ReadWord(const vuint8_t* bytes)
+				{
+					vuint32_t word;
+					memcpy(&word, bytes, sizeof(word));
+					return word;
+				}
+
+				vuint32_t HashWord(vuint32_t word)
+				{
+					return (word * 2654435761U) >> (32 - COMPRESSION_HASH_BITS);
+				}
+
+				bool WriteLength(vuint8_t*& op, vuint8_t* end, vuint64_t length)
+				{
+					// a nibble of 15 is followed by bytes of 255 and a byte of the rest
+					while (length >= 255)
+					{
+						if (op >= end) return false;
+						*op++ = 255;
+						length -= 255;
+					}
+					if (op >= end) return false;
+					*op++ = (vuint8_t)length;
+					return true;
+				}
+
+				bool ReadLength(const vuint8_t*& ip, const vuint8_t* end, vuint64_t& length)
+				{
+					while (true)
+					{
+						if (ip >= end) return false;
+						vuint8_t byte = *ip++;
+						length += byte;
+						if (byte != 255) return true;
+					}
+				}
+
+				bool WriteSequence(vuint8_t*& op, vuint8_t* end, const vuint8_t* literals, vuint64_t literalLength, vuint64_t offset, vuint64_t matchLength)
+				{
+					if (op >= end) return false;
+					vuint8_t* token = op++;
+					vuint64_t matchNibble = matchLength == 0 ? 0 : matchLength - COMPRESSION_MIN_MATCH;
+					*token = (vuint8_t)((literalLength >= 15 ? 15 : literalLength) << 4 | (matchNibble >= 15 ? 15 : matchNibble));
+
+					if (literalLength >= 15 && !WriteLength(op, end, literalLength - 15)) return false;
+					if ((vuint64_t)(end - op) < literalLength) return false;
+					memcpy(op, literals, literalLength);
+					op += literalLength;
+
+					// the last sequence only has literals
+					if (matchLength == 0) return true;
+					if (end - op < 2) return false;
+					*op++ = (vuint8_t)(offset & 0xFF);
+					*op++ = (vuint8_t)(offset >> 8);
+					if (matchNibble >= 15 && !WriteLength(op, end, matchNibble - 15)) return false;
+					return true;
+				}
+			}
+
+			vuint64_t CompressPage(const void* input, vuint64_t length, void* output, vuint64_t capacity)
+			{
+				auto src = (const vuint8_t*)input;
+				auto op = (vuint8_t*)output;
+				auto end = op + capacity;
+
+				// positions are stored plus one, so that zero means an empty slot
+				vuint32_t table[1 << COMPRESSION_HASH_BITS];
+				memset(table, 0, sizeof(table));
+
+				vuint64_t anchor = 0;
+				vuint64_t ip = 0;
+				while (length >= COMPRESSION_MIN_MATCH && ip <= length - COMPRESSION_MIN_MATCH)
+				{
+					vuint32_t word = ReadWord(src + ip);
+					vuint32_t hash = HashWord(word);
+					vuint64_t candidate = table[hash];
+					table[hash] = (vuint32_t)(ip + 1);
+
+					if (candidate == 0 || ip - (candidate - 1) > COMPRESSION_MAX_OFFSET || ReadWord(src + candidate - 1) != word)
+					{
+						// incompressible data is skipped faster the longer no match is found
+						ip += 1 + ((ip - anchor) >> 6);
+						continue;
+					}
+
+					vuint64_t reference = candidate - 1;
+					vuint64_t matchLength = COMPRESSION_MIN_MATCH;
+					while (ip + matchLength < length && src[reference + matchLength] == src[ip + matchLength])
+					{
+						matchLength++;
+					}
+					if (!WriteSequence(op, end, src + anchor, ip - anchor, ip - reference, matchLength))
+					{
+						return 0;
+					}
+					ip += matchLength;
+					anchor = ip;
+				}
+
+				if (!WriteSequence(op, end, src + anchor, length - anchor, 0, 0))
+				{
+					return 0;
+				}
+				return op - (vuint8_t*)output;
+			}
+
+			bool DecompressPage(const void* input, vuint64_t compressedLength, void* output, vuint64_t length)
+			{
+				auto ip = (const vuint8_t*)input;
+				auto inputEnd = ip + compressedLength;
+				auto dst = (vuint8_t*)output;
+				vuint64_t op = 0;
+
+				while (true)
+				{
+					// the last sequence only has literals, so the input cannot end after a match
+					if (ip >= inputEnd) return false;
+					vuint8_t token = *ip++;
+					vuint64_t literalLength = token >> 4;
+					if (literalLength == 15 && !ReadLength(ip, inputEnd, literalLength)) return false;
+					if ((vuint64_t)(inputEnd - ip) < literalLength || length - op < literalLength) return false;
+					memcpy(dst + op, ip, literalLength);
+					ip += literalLength;
+					op += literalLength;
+
+					if (ip == inputEnd) break;
+					if (inputEnd - ip < 2) return false;
+					vuint64_t offset = (vuint64_t)ip[0] | ((vuint64_t)ip[1] << 8);
+					ip += 2;
+					vuint64_t matchLength = token & 15;
+					if (matchLength == 15 && !ReadLength(ip, inputEnd, matchLength)) return false;
+					matchLength += COMPRESSION_MIN_MATCH;
+					if (offset == 0 || offset > op || length - op < matchLength) return false;
+
+					// a match could overlap the bytes it produces, so it is copied byte by byte
+					for (vuint64_t i = 0; i < matchLength; i++)
+					{
+						dst[op + i] = dst[op - offset + i];
+					}
+					op += matchLength;
+				}
+				return op == length;
+			}
+
+/***********************************************************************
+BufferCompressedTier
+***********************************************************************/
+
+			BufferCompressedTier::EntryMap* BufferCompressedTier::GetShard(BufferSource source, BufferPage page, bool create)
+			{
+				vint index = sources.Keys().IndexOf(source);
+				if (index == -1)
+				{
+					if (!create) return nullptr;
+					sources.Add(source, new SourceEntries);
+					index = sources.Keys().IndexOf(source);
+				}
+				return &sources.Values()[index]->shards[page.index % ShardCount];
+			}
+
+			BufferCompressedTier::Entry* BufferCompressedTier::Detach(BufferSource source, BufferPage page)
+			{
+				auto shard = GetShard(source, page, false);
+				if (!shard) return nullptr;
+				vint index = shard->Keys().IndexOf(page.index);
+				if (index == -1) return nullptr;
+
+				auto entry = shard->Values()[index];
+				shard->Remove(page.index);
+				Unlink(entry);
+				return entry;
+			}
+
+			void BufferCompressedTier::Unlink(Entry* entry)
+			{
+				if (entry->previous) entry->previous->next = entry->next; else oldest = entry->next;
+				if (entry->next) entry->next->previous = entry->previous; else newest = entry->previous;
+				usedBytes -= entry->length;
+				pageCount--;
+			}
+
+			void BufferCompressedTier::DropOldest()
+			{
+				auto entry = oldest;
+				GetShard(entry->source, entry->page, false)->Remove(entry->page.index);
+				Unlink(entry);
+				free(entry->data);
+				delete entry;
+				INCRC(&droppedPages);
+			}
+
+			BufferCompressedTier::BufferCompressedTier(vuint64_t _pageSize, vuint64_t _capacity)
+				:pageSize(_pageSize)
+				,capacity(_capacity)
+			{
+			}
+
+			BufferCompressedTier::~BufferCompressedTier()
+			{
+				while (oldest)
+				{
+					DropOldest();
+				}
+			}
+
+			vuint64_t BufferCompressedTier::GetCapacity()
+			{
+				return capacity;
+			}
+
+			void BufferCompressedTier::SetCapacity(vuint64_t bytes)
+			{
+				SPIN_LOCK(lock)
+				{
+					capacity = bytes;
+					while (oldest && usedBytes > capacity)
+					{
+						DropOldest();
+					}
+				}
+			}
+
+			BufferCompressedTierStatistics BufferCompressedTier::GetStatistics()
+			{
+				BufferCompressedTierStatistics statistics;
+				SPIN_LOCK(lock)
+				{
+					statistics.capacity = capacity;
+					statistics.usedBytes = usedBytes;
+					statistics.pageCount = pageCount;
+				}
+				statistics.lookups = lookups;
+				statistics.hits = hits;
+				statistics.storedPages = storedPages;
+				statistics.rejectedPages = rejectedPages;
+				statistics.droppedPages = droppedPages;
+				statistics.hitRatio = statistics.lookups == 0 ? 0 : (double)statistics.hits / statistics.lookups;
+				return statistics;
+			}
+
+			bool BufferCompressedTier::Store(BufferSource source, BufferPage page, const void* address)
+			{
+				if (capacity == 0) return false;
+
+				vuint64_t maxLength = pageSize / 4 * 3;
+				auto data = (char*)malloc(maxLength);
+				if (!data) return false;
+				vuint64_t length = CompressPage(address, pageSize, data, maxLength);
+				if (length == 0)
+				{
+					free(data);
+					INCRC(&rejectedPages);
+					return false;
+				}
+				if (auto shrunk = (char*)realloc(data, length))
+				{
+					data = shrunk;
+				}
+
+				auto entry = new Entry;
+				entry->source = source;
+				entry->page = page;
+				entry->data = data;
+				entry->length = length;
+
+				Entry* replaced = nullptr;
+				SPIN_LOCK(lock)
+				{
+					if (length > capacity)
+					{
+						// the capacity is changed after the page is compressed
+						replaced = entry;
+					}
+					else
+					{
+						replaced = Detach(source, page);
+						while (oldest && usedBytes + length > capacity)
+						{
+							DropOldest();
+						}
+						GetShard(source, page, true)->Add(page.index, entry);
+						entry->previous = newest;
+						if (newest) newest->next = entry; else oldest = entry;
+						newest = entry;
+						usedBytes += length;
+						pageCount++;
+						entry = nullptr;
+					}
+				}
+
+				if (replaced)
+				{
+					free(replaced->data);
+					delete replaced;
+				}
+				if (entry) return false;
+				INCRC(&storedPages);
+				return true;
+			}
+
+			bool BufferCompressedTier::Load(BufferSource source, BufferPage page, void* address)
+			{
+				if (capacity == 0 && pageCount == 0) return false;
+
+				Entry* entry = nullptr;
+				SPIN_LOCK(lock)
+				{
+					entry = Detach(source, page);
+				}
+				INCRC(&lookups);
+				if (!entry) return false;
+
+				bool successful = DecompressPage(entry->data, entry->length, address, pageSize);
+				free(entry->data);
+				delete entry;
+				if (successful)
+				{
+					INCRC(&hits);
+				}
+				return successful;
+			}
+
+			void BufferCompressedTier::Remove(BufferSource source, BufferPage page)
+			{
+				Entry* entry = nullptr;
+				SPIN_LOCK(lock)
+				{
+					entry = Detach(source, page);
+				}
+				if (entry)
+				{
+					free(entry->data);
+					delete entry;
+				}
+			}
+
+			void BufferCompressedTier::RemoveSource(BufferSource source)
+			{
+				List<Entry*> entries;
+				SPIN_LOCK(lock)
+				{
+					vint index = sources.Keys().IndexOf(source);
+					if (index == -1) return;
+					auto sourceEntries = sources.Values()[index];
+					for (vint i = 0; i < ShardCount; i++)
+					{
+						FOREACH(Entry*, entry, sourceEntries->shards[i].Values())
+						{
+							Unlink(entry);
+							entries.Add(entry);
+						}
+					}
+					sources.Remove(source);
+				}
+
+				FOREACH(Entry*, entry, entries)
+				{
+					free(entry->data);
+					delete entry;
+				}
+			}
+		}
+	}
+}
+
+#undef COMPRESSION_HASH_BITS
+#undef COMPRESSION_MIN_MATCH
+#undef COMPRESSION_MAX_OFFSET
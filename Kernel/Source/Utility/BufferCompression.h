@@ -0,0 +1,85 @@
+/***********************************************************************
+Vczh Library++ 3.0
+Developer: Zihan Chen(vczh)
+Database::Utility
+
+***********************************************************************/
+
+#ifndef VCZH_DATABASE_UTILITY_BUFFERCOMPRESSION
+#define VCZH_DATABASE_UTILITY_BUFFERCOMPRESSION
+
+#include "Buffer.h"
+
+namespace vl
+{
+	namespace database
+	{
+		namespace buffer_internal
+		{
+			// a byte oriented LZ77 format in the style of LZ4, sequences of literals and matches with 16 bits offsets
+			// returns the compressed length, or 0 when the result does not fit in capacity
+			extern vuint64_t				CompressPage(const void* input, vuint64_t length, void* output, vuint64_t capacity);
+			// returns false unless the input decompresses to exactly length bytes
+			extern bool						DecompressPage(const void* input, vuint64_t compressedLength, void* output, vuint64_t length);
+
+			class BufferCompressedTier : public Object
+			{
+				struct Entry
+				{
+					BufferSource			source;
+					BufferPage				page;
+					char*					data = nullptr;
+					vuint64_t				length = 0;
+					Entry*					previous = nullptr;
+					Entry*					next = nullptr;
+				};
+				typedef collections::Dictionary<vuint64_t, Entry*>				EntryMap;
+				static const vint			ShardCount = 64;
+
+				struct SourceEntries
+				{
+					EntryMap				shards[ShardCount];
+				};
+				typedef collections::Dictionary<BufferSource, Ptr<SourceEntries>>	SourceMap;
+			private:
+				vuint64_t					pageSize;
+				SpinLock					lock;
+				SourceMap					sources;
+				Entry*						oldest = nullptr;
+				Entry*						newest = nullptr;
+				volatile vuint64_t			capacity;
+				vuint64_t					usedBytes = 0;
+				vuint64_t					pageCount = 0;
+				volatile vuint64_t			lookups = 0;
+				volatile vuint64_t			hits = 0;
+				volatile vuint64_t			storedPages = 0;
+				volatile vuint64_t			rejectedPages = 0;
+				volatile vuint64_t			droppedPages = 0;
+
+				EntryMap*					GetShard(BufferSource source, BufferPage page, bool create);
+				Entry*						Detach(BufferSource source, BufferPage page);
+				void						Unlink(Entry* entry);
+				void						DropOldest();
+
+			public:
+				// clean pages are compressed here when they are evicted from frames, and removed when they are mapped again
+				// entries are dropped from the oldest one to stay under capacity bytes, a capacity of 0 disables the tier
+				BufferCompressedTier(vuint64_t _pageSize, vuint64_t _capacity = 0);
+				~BufferCompressedTier();
+
+				vuint64_t					GetCapacity();
+				void						SetCapacity(vuint64_t bytes);
+				BufferCompressedTierStatistics	GetStatistics();
+
+				// pages that do not compress below three quarters of a page are not stored
+				bool						Store(BufferSource source, BufferPage page, const void* address);
+				// decompresses the page into address and removes it from the tier
+				bool						Load(BufferSource source, BufferPage page, void* address);
+				void						Remove(BufferSource source, BufferPage page);
+				void						RemoveSource(BufferSource source);
+			};
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,91 @@
+#include "BufferFlusher.h"
+
+namespace vl
+{
+	namespace database
+	{
+		using namespace collections;
+
+		namespace buffer_internal
+		{
+
+/***********************************************************************
+BufferGroupFlusher
+***********************************************************************/
+
+			BufferGroupFlusher::BufferGroupFlusher(const FlushProc& _flushProc)
+				:flushProc(_flushProc)
+			{
+			}
+
+			vuint64_t BufferGroupFlusher::Register(const PageDescList& pageDescs)
+			{
+				CS_LOCK(lock)
+				{
+					FOREACH(Ptr<BufferPageDesc>, pageDesc, pageDescs)
+					{
+						if (!pendingPageDescs.Contains(pageDesc.Obj()))
+						{
+							pendingPageDescs.Add(pageDesc);
+						}
+					}
+					return nextTicket;
+				}
+				return 0;
+			}
+
+			bool BufferGroupFlusher::Wait(vuint64_t ticket)
+			{
+				lock.Enter();
+				while (flushedTicket < ticket)
+				{
+					if (flushing)
+					{
+						condition.SleepWith(lock);
+						continue;
+					}
+
+					// no batch is being flushed, so the batch collecting pages is the one this thread is waiting for
+					flushing = true;
+					vuint64_t batchTicket = nextTicket++;
+					PageDescList batch;
+					CopyFrom(batch, pendingPageDescs);
+					pendingPageDescs.Clear();
+					lock.Leave();
+
+					if (batch.Count() > 0)
+					{
+						SortLambda(&batch[0], batch.Count(), [](const Ptr<BufferPageDesc>& a, const Ptr<BufferPageDesc>& b)
+						{
+							return a->offset < b->offset ? -1 : a->offset > b->offset ? 1 : 0;
+						});
+					}
+					bool successful = flushProc(batch);
+					INCRC(&batchCount);
+
+					lock.Enter();
+					if (!successful)
+					{
+						failedTickets.Add(batchTicket);
+					}
+					flushedTicket = batchTicket;
+					flushing = false;
+					condition.WakeAllPendings();
+				}
+				bool successful = !failedTickets.Contains(ticket);
+				lock.Leave();
+				return successful;
+			}
+
+			bool BufferGroupFlusher::Flush(const PageDescList& pageDescs)
+			{
+				return Wait(Register(pageDescs));
+			}
+
+			vuint64_t BufferGroupFlusher::GetBatchCount()
+			{
+				return batchCount;
+			}
+		}
+	}
+}
@@ -0,0 +1,51 @@
+/***********************************************************************
+Vczh Library++ 3.0
+Developer: Zihan Chen(vczh)
+Database::Utility
+
+***********************************************************************/
+
+#ifndef VCZH_DATABASE_UTILITY_BUFFERFLUSHER
+#define VCZH_DATABASE_UTILITY_BUFFERFLUSHER
+
+#include "Buffer.h"
+
+namespace vl
+{
+	namespace database
+	{
+		namespace buffer_internal
+		{
+			class BufferGroupFlusher : public Object
+			{
+			public:
+				typedef collections::List<Ptr<BufferPageDesc>>					PageDescList;
+				typedef Func<bool(PageDescList&)>								FlushProc;
+			private:
+				typedef collections::SortedList<vuint64_t>						TicketSet;
+
+				FlushProc					flushProc;
+				CriticalSection				lock;
+				ConditionVariable			condition;
+				PageDescList				pendingPageDescs;
+				TicketSet					failedTickets;
+				vuint64_t					nextTicket = 1;			// the batch collecting pages
+				vuint64_t					flushedTicket = 0;		// the last finished batch
+				bool						flushing = false;
+				volatile vuint64_t			batchCount = 0;
+
+			public:
+				// flushProc receives a batch sorted by offset, it writes all pages and returns after they are durable
+				BufferGroupFlusher(const FlushProc& _flushProc);
+
+				// a thread waiting for a batch that is not started flushes it, all pages registered so far join the batch
+				vuint64_t					Register(const PageDescList& pageDescs);
+				bool						Wait(vuint64_t ticket);
+				bool						Flush(const PageDescList& pageDescs);
+				vuint64_t					GetBatchCount();
+			};
+		}
+	}
+}
+
+#endif
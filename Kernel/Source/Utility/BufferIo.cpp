@@ -0,0 +1,305 @@
+#include "BufferIo.h"
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#include <linux/io_uring.h>
+#define BUFFER_IO_RING
+#endif
+
+#define USERDATA_SYNC (~(vuint64_t)0)
+
+namespace vl
+{
+	namespace database
+	{
+		using namespace collections;
+
+		namespace buffer_internal
+		{
+
+/***********************************************************************
+BufferIoEngine
+***********************************************************************/
+
+			bool BufferIoEngine::SetupRing(vint queueDepth)
+			{
+#ifdef BUFFER_IO_RING
+				io_uring_params params;
+				memset(&params, 0, sizeof(params));
+				int fd = (int)syscall(__NR_io_uring_setup, (unsigned)queueDepth, &params);
+				if (fd < 0)
+				{
+					return false;
+				}
+				ringDescriptor = fd;
+				sqEntries = params.sq_entries;
+
+				sqRingSize = params.sq_off.array + params.sq_entries * sizeof(vuint32_t);
+				cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+				bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+				if (singleMmap)
+				{
+					if (cqRingSize > sqRingSize) sqRingSize = cqRingSize;
+					cqRingSize = sqRingSize;
+				}
+
+				sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+				if (sqRing == MAP_FAILED)
+				{
+					sqRing = nullptr;
+					ReleaseRing();
+					return false;
+				}
+				if (singleMmap)
+				{
+					cqRing = sqRing;
+				}
+				else
+				{
+					cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+					if (cqRing == MAP_FAILED)
+					{
+						cqRing = nullptr;
+						ReleaseRing();
+						return false;
+					}
+				}
+				sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+				sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+				if (sqes == MAP_FAILED)
+				{
+					sqes = nullptr;
+					ReleaseRing();
+					return false;
+				}
+
+				sqTail = (vuint32_t*)((char*)sqRing + params.sq_off.tail);
+				sqMask = (vuint32_t*)((char*)sqRing + params.sq_off.ring_mask);
+				sqArray = (vuint32_t*)((char*)sqRing + params.sq_off.array);
+				cqHead = (vuint32_t*)((char*)cqRing + params.cq_off.head);
+				cqTail = (vuint32_t*)((char*)cqRing + params.cq_off.tail);
+				cqMask = (vuint32_t*)((char*)cqRing + params.cq_off.ring_mask);
+				cqes = (char*)cqRing + params.cq_off.cqes;
+				return true;
+#else
+				return false;
+#endif
+			}
+
+			void BufferIoEngine::ReleaseRing()
+			{
+				if (sqes)
+				{
+					munmap(sqes, sqesSize);
+					sqes = nullptr;
+				}
+				if (cqRing && cqRing != sqRing)
+				{
+					munmap(cqRing, cqRingSize);
+				}
+				cqRing = nullptr;
+				if (sqRing)
+				{
+					munmap(sqRing, sqRingSize);
+					sqRing = nullptr;
+				}
+				if (ringDescriptor != -1)
+				{
+					close(ringDescriptor);
+					ringDescriptor = -1;
+				}
+			}
+
+			bool BufferIoEngine::SubmitToRing(int fileDescriptor, RequestList& requests, vint begin, vint end, bool sync)
+			{
+#ifdef BUFFER_IO_RING
+				// one entry of every round is kept for the datasync
+				vint roundSize = sqEntries - 1;
+				bool synced = !sync;
+				vint current = begin;
+				do
+				{
+					vint roundEnd = end - current > roundSize ? current + roundSize : end;
+					bool roundSync = sync && roundEnd == end;
+
+					vuint32_t tail = *sqTail;
+					vuint32_t mask = *sqMask;
+					for (vint i = current; i <= roundEnd; i++)
+					{
+						if (i == roundEnd && !roundSync) break;
+
+						vuint32_t index = tail & mask;
+						auto sqe = (io_uring_sqe*)sqes + index;
+						memset(sqe, 0, sizeof(io_uring_sqe));
+						sqe->fd = fileDescriptor;
+						if (i == roundEnd)
+						{
+							// draining makes the datasync start after all writes in the ring are completed
+							sqe->opcode = IORING_OP_FSYNC;
+							sqe->flags = IOSQE_IO_DRAIN;
+							sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+							sqe->user_data = USERDATA_SYNC;
+						}
+						else
+						{
+							auto& request = requests[i];
+							request.successful = false;
+							sqe->opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+							sqe->addr = (vuint64_t)request.address;
+							sqe->len = (vuint32_t)request.length;
+							sqe->off = request.offset;
+							sqe->user_data = (vuint64_t)i;
+						}
+						sqArray[index] = index;
+						tail++;
+					}
+					__atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+					vint pending = roundEnd - current + (roundSync ? 1 : 0);
+					vint unsubmitted = pending;
+					bool roundSynced = false;
+					while (pending > 0)
+					{
+						int result = (int)syscall(__NR_io_uring_enter, ringDescriptor, (unsigned)unsubmitted, 1u, IORING_ENTER_GETEVENTS, nullptr, 0);
+						if (result == -1)
+						{
+							if (errno == EINTR) continue;
+							// the ring cannot be trusted anymore, remaining requests are served on the calling thread
+							ReleaseRing();
+							return SubmitSync(fileDescriptor, requests, current, end, sync);
+						}
+						unsubmitted -= result;
+						INCRC(&submitCount);
+
+						vuint32_t head = *cqHead;
+						vuint32_t completed = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+						while (head != completed)
+						{
+							auto cqe = (io_uring_cqe*)cqes + (head & *cqMask);
+							if (cqe->user_data == USERDATA_SYNC)
+							{
+								roundSynced = cqe->res == 0;
+							}
+							else
+							{
+								auto& request = requests[(vint)cqe->user_data];
+								request.successful = cqe->res >= 0 && (vuint64_t)cqe->res == request.length;
+							}
+							head++;
+							pending--;
+						}
+						__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+					}
+
+					// short transfers and operations the kernel does not support are finished on the calling thread
+					bool retried = false;
+					for (vint i = current; i < roundEnd; i++)
+					{
+						if (!requests[i].successful)
+						{
+							SubmitSync(fileDescriptor, requests, i, i + 1, false);
+							retried = true;
+						}
+					}
+					if (roundSync)
+					{
+						synced = roundSynced && !retried ? true : fdatasync(fileDescriptor) != -1;
+					}
+					current = roundEnd;
+				} while (current < end);
+
+				bool successful = synced;
+				for (vint i = begin; i < end; i++)
+				{
+					if (!requests[i].successful)
+					{
+						successful = false;
+					}
+				}
+				return successful;
+#else
+				return SubmitSync(fileDescriptor, requests, begin, end, sync);
+#endif
+			}
+
+			bool BufferIoEngine::SubmitSync(int fileDescriptor, RequestList& requests, vint begin, vint end, bool sync)
+			{
+				bool successful = true;
+				for (vint i = begin; i < end; i++)
+				{
+					auto& request = requests[i];
+					vuint64_t transferred = 0;
+					while (transferred < request.length)
+					{
+						auto address = (char*)request.address + transferred;
+						auto result = request.write
+							? pwrite(fileDescriptor, address, request.length - transferred, request.offset + transferred)
+							: pread(fileDescriptor, address, request.length - transferred, request.offset + transferred)
+							;
+						if (result == -1 && errno == EINTR) continue;
+						if (result <= 0) break;
+						transferred += result;
+					}
+					request.successful = transferred == request.length;
+					if (!request.successful)
+					{
+						successful = false;
+					}
+				}
+
+				if (sync && fdatasync(fileDescriptor) == -1)
+				{
+					successful = false;
+				}
+				return successful;
+			}
+
+			BufferIoEngine::BufferIoEngine(vint queueDepth, bool useRing)
+			{
+				CHECK_ERROR(queueDepth > 1, L"vl::database::buffer_internal::BufferIoEngine::BufferIoEngine(vint, bool)#Internal error: The queue should contain at least two requests.");
+				if (useRing)
+				{
+					SetupRing(queueDepth);
+				}
+			}
+
+			BufferIoEngine::~BufferIoEngine()
+			{
+				ReleaseRing();
+			}
+
+			bool BufferIoEngine::IsAsync()
+			{
+				return ringDescriptor != -1;
+			}
+
+			vuint64_t BufferIoEngine::GetSubmitCount()
+			{
+				return submitCount;
+			}
+
+			bool BufferIoEngine::Submit(int fileDescriptor, RequestList& requests, bool sync)
+			{
+				if (requests.Count() == 0 && !sync)
+				{
+					return true;
+				}
+
+				CS_LOCK(lock)
+				{
+					if (ringDescriptor != -1)
+					{
+						return SubmitToRing(fileDescriptor, requests, 0, requests.Count(), sync);
+					}
+				}
+				return SubmitSync(fileDescriptor, requests, 0, requests.Count(), sync);
+			}
+		}
+	}
+}
+
+#undef USERDATA_SYNC
+#undef BUFFER_IO_RING
@@ -0,0 +1,70 @@
+/***********************************************************************
+Vczh Library++ 3.0
+Developer: Zihan Chen(vczh)
+Database::Utility
+
+***********************************************************************/
+
+#ifndef VCZH_DATABASE_UTILITY_BUFFERIO
+#define VCZH_DATABASE_UTILITY_BUFFERIO
+
+#include "Buffer.h"
+
+namespace vl
+{
+	namespace database
+	{
+		namespace buffer_internal
+		{
+			struct BufferIoRequest
+			{
+				void*						address = nullptr;
+				vuint64_t					offset = 0;
+				vuint64_t					length = 0;
+				bool						write = false;
+				bool						successful = false;
+			};
+
+			class BufferIoEngine : public Object
+			{
+			public:
+				typedef collections::List<BufferIoRequest>						RequestList;
+			private:
+				CriticalSection				lock;
+				int							ringDescriptor = -1;
+				vuint32_t					sqEntries = 0;
+				void*						sqRing = nullptr;
+				vuint64_t					sqRingSize = 0;
+				void*						cqRing = nullptr;
+				vuint64_t					cqRingSize = 0;
+				void*						sqes = nullptr;
+				vuint64_t					sqesSize = 0;
+				vuint32_t*					sqTail = nullptr;
+				vuint32_t*					sqMask = nullptr;
+				vuint32_t*					sqArray = nullptr;
+				vuint32_t*					cqHead = nullptr;
+				vuint32_t*					cqTail = nullptr;
+				vuint32_t*					cqMask = nullptr;
+				void*						cqes = nullptr;
+				volatile vuint64_t			submitCount = 0;
+
+				bool						SetupRing(vint queueDepth);
+				void						ReleaseRing();
+				bool						SubmitToRing(int fileDescriptor, RequestList& requests, vint begin, vint end, bool sync);
+				bool						SubmitSync(int fileDescriptor, RequestList& requests, vint begin, vint end, bool sync);
+			public:
+				// the ring is created by io_uring_setup, when it is not available every request is served by pread and pwrite on the calling thread
+				BufferIoEngine(vint queueDepth, bool useRing = true);
+				~BufferIoEngine();
+
+				bool						IsAsync();
+				vuint64_t					GetSubmitCount();
+				// requests are submitted up to the queue depth at a time, it returns after all of them are completed
+				// when sync is true, a datasync is queued after the last request and waits for all writes before it
+				bool						Submit(int fileDescriptor, RequestList& requests, bool sync);
+			};
+		}
+	}
+}
+
+#endif
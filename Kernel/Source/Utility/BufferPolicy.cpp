@@ -0,0 +1,682 @@
+#include "BufferPolicy.h"
+
+namespace vl
+{
+	namespace database
+	{
+		using namespace collections;
+		using namespace buffer_internal;
+
+		namespace buffer_internal
+		{
+
+/***********************************************************************
+FrameQueue
+***********************************************************************/
+
+			FrameQueue::FrameQueue(FrameLinkList& _links, vint _id)
+				:links(_links)
+				,id(_id)
+			{
+			}
+
+			vint FrameQueue::Count()
+			{
+				return count;
+			}
+
+			vint FrameQueue::Tail()
+			{
+				return tail;
+			}
+
+			vint FrameQueue::Previous(vint frame)
+			{
+				return links[frame].previous;
+			}
+
+			bool FrameQueue::Contains(vint frame)
+			{
+				return frame < links.Count() && links[frame].queue == id;
+			}
+
+			void FrameQueue::PushHead(vint frame)
+			{
+				auto& link = links[frame];
+				CHECK_ERROR(link.queue == -1, L"vl::database::buffer_internal::FrameQueue::PushHead(vint)#Internal error: The frame is already in a queue.");
+				link.queue = id;
+				link.previous = -1;
+				link.next = head;
+				if (head != -1)
+				{
+					links[head].previous = frame;
+				}
+				head = frame;
+				if (tail == -1)
+				{
+					tail = frame;
+				}
+				count++;
+			}
+
+			void FrameQueue::Remove(vint frame)
+			{
+				auto& link = links[frame];
+				if (link.queue != id) return;
+
+				if (link.previous == -1)
+				{
+					head = link.next;
+				}
+				else
+				{
+					links[link.previous].next = link.next;
+				}
+				if (link.next == -1)
+				{
+					tail = link.previous;
+				}
+				else
+				{
+					links[link.next].previous = link.previous;
+				}
+				link = FrameLink();
+				count--;
+			}
+
+/***********************************************************************
+GhostQueue
+***********************************************************************/
+
+			vint GhostQueue::Count()
+			{
+				return entries.Count();
+			}
+
+			void GhostQueue::Push(BufferSource source, BufferPage page)
+			{
+				PageKey key(source, page.index);
+				entries.Set(key, firstSequence + queue.Count());
+				queue.Add(key);
+			}
+
+			bool GhostQueue::IsLive(vint position)
+			{
+				vint index = entries.Keys().IndexOf(queue[position]);
+				return index != -1 && entries.Values()[index] == firstSequence + position;
+			}
+
+			void GhostQueue::Compact()
+			{
+				PageList liveKeys;
+				for (vint i = queueHead; i < queue.Count(); i++)
+				{
+					if (IsLive(i))
+					{
+						liveKeys.Add(queue[i]);
+					}
+				}
+
+				firstSequence += queue.Count();
+				for (vint i = 0; i < liveKeys.Count(); i++)
+				{
+					entries.Set(liveKeys[i], firstSequence + i);
+				}
+				CopyFrom(queue, liveKeys);
+				queueHead = 0;
+			}
+
+			vint GhostQueue::GetQueuedCount()
+			{
+				return queue.Count() - queueHead;
+			}
+
+			bool GhostQueue::Remove(BufferSource source, BufferPage page)
+			{
+				return entries.Remove(PageKey(source, page.index));
+			}
+
+			void GhostQueue::Trim(vint maxCount)
+			{
+				while (entries.Count() > maxCount && queueHead < queue.Count())
+				{
+					if (IsLive(queueHead))
+					{
+						entries.Remove(queue[queueHead]);
+					}
+					queueHead++;
+				}
+
+				// keys removed by ghost hits are never trimmed, so the queue is rebuilt when most of it is stale
+				if (queue.Count() - queueHead > 2 * entries.Count())
+				{
+					Compact();
+				}
+				else if (queueHead > queue.Count() / 2)
+				{
+					queue.RemoveRange(0, queueHead);
+					firstSequence += queueHead;
+					queueHead = 0;
+				}
+			}
+
+/***********************************************************************
+EvictionPolicyBase
+***********************************************************************/
+
+			bool EvictionPolicyBase::IsEvictable(vint frame)
+			{
+				auto pageDesc = frames[frame].Obj();
+				return pageDesc && pageDesc->lockState == 0;
+			}
+
+			vint EvictionPolicyBase::FindEvictable(FrameQueue& queue)
+			{
+				vint frame = queue.Tail();
+				while (frame != -1 && !IsEvictable(frame))
+				{
+					frame = queue.Previous(frame);
+				}
+				return frame;
+			}
+
+			EvictionPolicyBase::EvictionPolicyBase()
+			{
+			}
+
+			void EvictionPolicyBase::SetCapacity(vuint64_t pageCount)
+			{
+				SPIN_LOCK(lock)
+				{
+					capacity = pageCount;
+				}
+			}
+
+			vint EvictionPolicyBase::GetFrameCount()
+			{
+				return frames.Count() - freeFrames.Count();
+			}
+
+			Ptr<BufferPageDesc> EvictionPolicyBase::NextVictim()
+			{
+				SPIN_LOCK(lock)
+				{
+					vint frame = PickVictimFrame();
+					if (frame != -1)
+					{
+						return frames[frame];
+					}
+				}
+				return nullptr;
+			}
+
+			void EvictionPolicyBase::SkipVictim(BufferPageDesc* pageDesc)
+			{
+				SPIN_LOCK(lock)
+				{
+					// the page could be unmapped and its frame reused after it was picked
+					vint frame = pageDesc->frameIndex;
+					if (frame != -1 && frames[frame].Obj() == pageDesc)
+					{
+						OnFrameSkipped(frame);
+					}
+				}
+			}
+
+			void EvictionPolicyBase::OnPageMapped(Ptr<BufferPageDesc> pageDesc)
+			{
+				pageDesc->lastAccessTime = INCRC(&accessClock);
+				SPIN_LOCK(lock)
+				{
+					if (freeFrames.Count() > 0)
+					{
+						pageDesc->frameIndex = freeFrames[freeFrames.Count() - 1];
+						freeFrames.RemoveAt(freeFrames.Count() - 1);
+						frames[pageDesc->frameIndex] = pageDesc;
+					}
+					else
+					{
+						pageDesc->frameIndex = frames.Add(pageDesc);
+					}
+					OnFrameMapped(pageDesc->frameIndex);
+				}
+			}
+
+			void EvictionPolicyBase::OnPageAccessed(BufferPageDesc* pageDesc)
+			{
+				pageDesc->lastAccessTime = INCRC(&accessClock);
+				SPIN_LOCK(lock)
+				{
+					if (pageDesc->frameIndex != -1)
+					{
+						OnFrameAccessed(pageDesc->frameIndex);
+					}
+				}
+			}
+
+			void EvictionPolicyBase::OnPageUnmapped(Ptr<BufferPageDesc> pageDesc)
+			{
+				SPIN_LOCK(lock)
+				{
+					if (pageDesc->frameIndex != -1)
+					{
+						OnFrameUnmapped(pageDesc->frameIndex);
+						frames[pageDesc->frameIndex] = nullptr;
+						freeFrames.Add(pageDesc->frameIndex);
+						pageDesc->frameIndex = -1;
+					}
+				}
+			}
+		}
+
+/***********************************************************************
+ClockEvictionPolicy
+***********************************************************************/
+
+		void ClockEvictionPolicy::OnFrameMapped(vint frame)
+		{
+			frames[frame]->referenced = true;
+		}
+
+		void ClockEvictionPolicy::OnFrameAccessed(vint frame)
+		{
+			frames[frame]->referenced = true;
+		}
+
+		void ClockEvictionPolicy::OnFrameUnmapped(vint)
+		{
+		}
+
+		void ClockEvictionPolicy::OnFrameSkipped(vint)
+		{
+			// the hand has already passed the skipped frame
+		}
+
+		vint ClockEvictionPolicy::PickVictimFrame()
+		{
+			vint frameCount = frames.Count();
+			for (vint i = 0; i < frameCount * 2; i++)
+			{
+				if (hand >= frameCount)
+				{
+					hand = 0;
+				}
+				vint frame = hand++;
+				if (!IsEvictable(frame))
+				{
+					continue;
+				}
+				if (frames[frame]->referenced)
+				{
+					frames[frame]->referenced = false;
+					continue;
+				}
+				return frame;
+			}
+			return -1;
+		}
+
+		ClockEvictionPolicy::ClockEvictionPolicy()
+		{
+		}
+
+		void ClockEvictionPolicy::OnPageAccessed(BufferPageDesc* pageDesc)
+		{
+			pageDesc->lastAccessTime = INCRC(&accessClock);
+			pageDesc->referenced = true;
+		}
+
+/***********************************************************************
+LruKEvictionPolicy
+***********************************************************************/
+
+		bool LruKEvictionPolicy::IsBefore(vint frameA, vint frameB)
+		{
+			vuint64_t kthA = histories[frameA * k + k - 1];
+			vuint64_t kthB = histories[frameB * k + k - 1];
+			if (kthA != kthB) return kthA < kthB;
+			return histories[frameA * k] < histories[frameB * k];
+		}
+
+		void LruKEvictionPolicy::SwapHeapItems(vint positionA, vint positionB)
+		{
+			vint frameA = heap[positionA];
+			vint frameB = heap[positionB];
+			heap[positionA] = frameB;
+			heap[positionB] = frameA;
+			heapPositions[frameA] = positionB;
+			heapPositions[frameB] = positionA;
+		}
+
+		void LruKEvictionPolicy::SiftUp(vint position)
+		{
+			while (position > 0)
+			{
+				vint parent = (position - 1) / 2;
+				if (!IsBefore(heap[position], heap[parent])) break;
+				SwapHeapItems(position, parent);
+				position = parent;
+			}
+		}
+
+		void LruKEvictionPolicy::SiftDown(vint position)
+		{
+			while (true)
+			{
+				vint smallest = position;
+				vint left = position * 2 + 1;
+				vint right = left + 1;
+				if (left < heap.Count() && IsBefore(heap[left], heap[smallest])) smallest = left;
+				if (right < heap.Count() && IsBefore(heap[right], heap[smallest])) smallest = right;
+				if (smallest == position) break;
+				SwapHeapItems(position, smallest);
+				position = smallest;
+			}
+		}
+
+		void LruKEvictionPolicy::Update(vint frame)
+		{
+			vint position = heapPositions[frame];
+			SiftUp(position);
+			SiftDown(heapPositions[frame]);
+		}
+
+		void LruKEvictionPolicy::OnFrameMapped(vint frame)
+		{
+			while (heapPositions.Count() <= frame)
+			{
+				heapPositions.Add(-1);
+				for (vint i = 0; i < k; i++)
+				{
+					histories.Add(0);
+				}
+			}
+
+			// a page with less than k accesses has an infinite backward k-distance, which is represented by 0
+			histories[frame * k] = frames[frame]->lastAccessTime;
+			for (vint i = 1; i < k; i++)
+			{
+				histories[frame * k + i] = 0;
+			}
+			heapPositions[frame] = heap.Add(frame);
+			SiftUp(heapPositions[frame]);
+		}
+
+		void LruKEvictionPolicy::OnFrameAccessed(vint frame)
+		{
+			for (vint i = k - 1; i > 0; i--)
+			{
+				histories[frame * k + i] = histories[frame * k + i - 1];
+			}
+			histories[frame * k] = frames[frame]->lastAccessTime;
+			Update(frame);
+		}
+
+		void LruKEvictionPolicy::OnFrameUnmapped(vint frame)
+		{
+			vint position = heapPositions[frame];
+			vint last = heap.Count() - 1;
+			if (position != last)
+			{
+				SwapHeapItems(position, last);
+			}
+			heap.RemoveAt(last);
+			heapPositions[frame] = -1;
+			if (position != last)
+			{
+				Update(heap[position]);
+			}
+		}
+
+		void LruKEvictionPolicy::OnFrameSkipped(vint frame)
+		{
+			// the skipped page looks accessed k times just now, which puts it behind every other page
+			vuint64_t now = INCRC(&accessClock);
+			for (vint i = 0; i < k; i++)
+			{
+				histories[frame * k + i] = now;
+			}
+			Update(frame);
+		}
+
+		vint LruKEvictionPolicy::PickVictimFrame()
+		{
+			// locked pages are taken out of the heap temporarily to reach the next candidate
+			List<vint> skipped;
+			vint victim = -1;
+			while (heap.Count() > 0)
+			{
+				vint frame = heap[0];
+				if (IsEvictable(frame))
+				{
+					victim = frame;
+					break;
+				}
+				OnFrameUnmapped(frame);
+				skipped.Add(frame);
+			}
+
+			FOREACH(vint, frame, skipped)
+			{
+				heapPositions[frame] = heap.Add(frame);
+				SiftUp(heapPositions[frame]);
+			}
+			return victim;
+		}
+
+		LruKEvictionPolicy::LruKEvictionPolicy(vint _k)
+			:k(_k < 1 ? 1 : _k)
+		{
+		}
+
+/***********************************************************************
+TwoQueueEvictionPolicy
+***********************************************************************/
+
+		void TwoQueueEvictionPolicy::OnFrameMapped(vint frame)
+		{
+			while (links.Count() <= frame)
+			{
+				links.Add(FrameLink());
+			}
+
+			auto pageDesc = frames[frame];
+			if (a1out.Remove(pageDesc->source, pageDesc->page))
+			{
+				am.PushHead(frame);
+			}
+			else
+			{
+				a1in.PushHead(frame);
+			}
+		}
+
+		void TwoQueueEvictionPolicy::OnFrameAccessed(vint frame)
+		{
+			// correlated references to a page in A1in do not promote it
+			if (am.Contains(frame))
+			{
+				am.Remove(frame);
+				am.PushHead(frame);
+			}
+		}
+
+		void TwoQueueEvictionPolicy::OnFrameUnmapped(vint frame)
+		{
+			if (a1in.Contains(frame))
+			{
+				auto pageDesc = frames[frame];
+				a1in.Remove(frame);
+				a1out.Push(pageDesc->source, pageDesc->page);
+				a1out.Trim((vint)(capacity / 2));
+			}
+			else
+			{
+				am.Remove(frame);
+			}
+		}
+
+		void TwoQueueEvictionPolicy::OnFrameSkipped(vint frame)
+		{
+			// the skipped page goes back to the head of its own queue without being promoted
+			auto& queue = a1in.Contains(frame) ? a1in : am;
+			queue.Remove(frame);
+			queue.PushHead(frame);
+		}
+
+		vint TwoQueueEvictionPolicy::PickVictimFrame()
+		{
+			vint frame = -1;
+			if (a1in.Count() > (vint)(capacity / 4) || am.Count() == 0)
+			{
+				frame = FindEvictable(a1in);
+				if (frame == -1) frame = FindEvictable(am);
+			}
+			else
+			{
+				frame = FindEvictable(am);
+				if (frame == -1) frame = FindEvictable(a1in);
+			}
+			return frame;
+		}
+
+		TwoQueueEvictionPolicy::TwoQueueEvictionPolicy()
+			:a1in(links, 0)
+			,am(links, 1)
+		{
+		}
+
+/***********************************************************************
+ArcEvictionPolicy
+***********************************************************************/
+
+		void ArcEvictionPolicy::TrimGhosts()
+		{
+			vint c = (vint)capacity;
+			if (t1.Count() + b1.Count() > c)
+			{
+				b1.Trim(c - t1.Count() > 0 ? c - t1.Count() : 0);
+			}
+			vint total = t1.Count() + t2.Count() + b1.Count() + b2.Count();
+			if (total > c * 2)
+			{
+				vint maxB2 = b2.Count() - (total - c * 2);
+				b2.Trim(maxB2 > 0 ? maxB2 : 0);
+			}
+		}
+
+		void ArcEvictionPolicy::OnFrameMapped(vint frame)
+		{
+			while (links.Count() <= frame)
+			{
+				links.Add(FrameLink());
+			}
+
+			auto pageDesc = frames[frame];
+			vint c = (vint)capacity;
+			if (b1.Remove(pageDesc->source, pageDesc->page))
+			{
+				vint delta = b1.Count() > 0 && b2.Count() > b1.Count() ? b2.Count() / b1.Count() : 1;
+				target = target + delta < c ? target + delta : c;
+				lastHitInB2 = false;
+				t2.PushHead(frame);
+			}
+			else if (b2.Remove(pageDesc->source, pageDesc->page))
+			{
+				vint delta = b2.Count() > 0 && b1.Count() > b2.Count() ? b1.Count() / b2.Count() : 1;
+				target = target - delta > 0 ? target - delta : 0;
+				lastHitInB2 = true;
+				t2.PushHead(frame);
+			}
+			else
+			{
+				lastHitInB2 = false;
+				t1.PushHead(frame);
+			}
+			TrimGhosts();
+		}
+
+		void ArcEvictionPolicy::OnFrameAccessed(vint frame)
+		{
+			if (t1.Contains(frame))
+			{
+				t1.Remove(frame);
+			}
+			else
+			{
+				t2.Remove(frame);
+			}
+			t2.PushHead(frame);
+		}
+
+		void ArcEvictionPolicy::OnFrameUnmapped(vint frame)
+		{
+			auto pageDesc = frames[frame];
+			if (t1.Contains(frame))
+			{
+				t1.Remove(frame);
+				b1.Push(pageDesc->source, pageDesc->page);
+			}
+			else
+			{
+				t2.Remove(frame);
+				b2.Push(pageDesc->source, pageDesc->page);
+			}
+			TrimGhosts();
+		}
+
+		void ArcEvictionPolicy::OnFrameSkipped(vint frame)
+		{
+			// the skipped page goes back to the head of its own queue without being promoted
+			auto& queue = t1.Contains(frame) ? t1 : t2;
+			queue.Remove(frame);
+			queue.PushHead(frame);
+		}
+
+		vint ArcEvictionPolicy::PickVictimFrame()
+		{
+			vint frame = -1;
+			if (t1.Count() > 0 && (t1.Count() > target || (lastHitInB2 && t1.Count() == target)))
+			{
+				frame = FindEvictable(t1);
+				if (frame == -1) frame = FindEvictable(t2);
+			}
+			else
+			{
+				frame = FindEvictable(t2);
+				if (frame == -1) frame = FindEvictable(t1);
+			}
+			return frame;
+		}
+
+		ArcEvictionPolicy::ArcEvictionPolicy()
+			:t1(links, 0)
+			,t2(links, 1)
+		{
+		}
+
+/***********************************************************************
+Factory
+***********************************************************************/
+
+		IBufferEvictionPolicy* CreateClockEvictionPolicy()
+		{
+			return new ClockEvictionPolicy;
+		}
+
+		IBufferEvictionPolicy* CreateLruKEvictionPolicy(vint k)
+		{
+			return new LruKEvictionPolicy(k);
+		}
+
+		IBufferEvictionPolicy* CreateTwoQueueEvictionPolicy()
+		{
+			return new TwoQueueEvictionPolicy;
+		}
+
+		IBufferEvictionPolicy* CreateArcEvictionPolicy()
+		{
+			return new ArcEvictionPolicy;
+		}
+	}
+}
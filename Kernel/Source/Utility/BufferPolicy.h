@@ -0,0 +1,208 @@
+/***********************************************************************
+Vczh Library++ 3.0
+Developer: Zihan Chen(vczh)
+Database::Utility
+
+***********************************************************************/
+
+#ifndef VCZH_DATABASE_UTILITY_BUFFERPOLICY
+#define VCZH_DATABASE_UTILITY_BUFFERPOLICY
+
+#include "Buffer.h"
+
+namespace vl
+{
+	namespace database
+	{
+		namespace buffer_internal
+		{
+			struct FrameLink
+			{
+				vint						previous = -1;
+				vint						next = -1;
+				vint						queue = -1;
+			};
+
+			typedef collections::List<FrameLink>								FrameLinkList;
+
+			class FrameQueue : public Object
+			{
+			private:
+				FrameLinkList&				links;
+				vint						id;
+				vint						head = -1;
+				vint						tail = -1;
+				vint						count = 0;
+
+			public:
+				FrameQueue(FrameLinkList& _links, vint _id);
+
+				vint						Count();
+				vint						Tail();
+				vint						Previous(vint frame);
+				bool						Contains(vint frame);
+				void						PushHead(vint frame);
+				void						Remove(vint frame);
+			};
+
+			class GhostQueue : public Object
+			{
+				typedef collections::Pair<BufferSource, vuint64_t>				PageKey;
+				typedef collections::Dictionary<PageKey, vuint64_t>				PageMap;
+				typedef collections::List<PageKey>								PageList;
+			private:
+				PageMap						entries;
+				PageList					queue;					// keys are stale when their sequence in entries changed or they are removed
+				vint						queueHead = 0;			// keys before it are trimmed
+				vuint64_t					firstSequence = 0;		// sequence of queue[0]
+
+				bool						IsLive(vint position);
+				void						Compact();
+			public:
+				vint						Count();
+				vint						GetQueuedCount();
+				void						Push(BufferSource source, BufferPage page);
+				bool						Remove(BufferSource source, BufferPage page);
+				void						Trim(vint maxCount);
+			};
+
+			class EvictionPolicyBase : public Object, public IBufferEvictionPolicy
+			{
+				typedef collections::List<Ptr<BufferPageDesc>>					FrameList;
+				typedef collections::List<vint>									FrameIndexList;
+			protected:
+				SpinLock					lock;
+				FrameList					frames;
+				FrameIndexList				freeFrames;
+				vuint64_t					capacity = 0;
+				volatile vuint64_t			accessClock = 0;
+
+				bool						IsEvictable(vint frame);
+				vint						FindEvictable(FrameQueue& queue);
+
+				virtual void				OnFrameMapped(vint frame) = 0;
+				virtual void				OnFrameAccessed(vint frame) = 0;
+				virtual void				OnFrameUnmapped(vint frame) = 0;
+				virtual void				OnFrameSkipped(vint frame) = 0;
+				virtual vint				PickVictimFrame() = 0;
+			public:
+				EvictionPolicyBase();
+
+				void						SetCapacity(vuint64_t pageCount)override;
+				vint						GetFrameCount()override;
+				Ptr<BufferPageDesc>			NextVictim()override;
+				void						SkipVictim(BufferPageDesc* pageDesc)override;
+				void						OnPageMapped(Ptr<BufferPageDesc> pageDesc)override;
+				void						OnPageAccessed(BufferPageDesc* pageDesc)override;
+				void						OnPageUnmapped(Ptr<BufferPageDesc> pageDesc)override;
+			};
+		}
+
+/***********************************************************************
+CLOCK: a reference bit per frame and a hand sweeping over all frames
+***********************************************************************/
+
+		class ClockEvictionPolicy : public buffer_internal::EvictionPolicyBase
+		{
+		private:
+			vint							hand = 0;
+
+		protected:
+			void							OnFrameMapped(vint frame)override;
+			void							OnFrameAccessed(vint frame)override;
+			void							OnFrameUnmapped(vint frame)override;
+			void							OnFrameSkipped(vint frame)override;
+			vint							PickVictimFrame()override;
+		public:
+			ClockEvictionPolicy();
+
+			void							OnPageAccessed(BufferPageDesc* pageDesc)override;
+		};
+
+/***********************************************************************
+LRU-K: evicts the page whose K-th most recent access is the oldest
+***********************************************************************/
+
+		class LruKEvictionPolicy : public buffer_internal::EvictionPolicyBase
+		{
+			typedef collections::List<vuint64_t>							TimeList;
+			typedef collections::List<vint>									IndexList;
+		private:
+			vint							k;
+			TimeList						histories;		// k access times per frame, most recent first
+			IndexList						heap;			// frames ordered by (k-th access, last access)
+			IndexList						heapPositions;
+
+			bool							IsBefore(vint frameA, vint frameB);
+			void							SwapHeapItems(vint positionA, vint positionB);
+			void							SiftUp(vint position);
+			void							SiftDown(vint position);
+			void							Update(vint frame);
+
+		protected:
+			void							OnFrameMapped(vint frame)override;
+			void							OnFrameAccessed(vint frame)override;
+			void							OnFrameUnmapped(vint frame)override;
+			void							OnFrameSkipped(vint frame)override;
+			vint							PickVictimFrame()override;
+		public:
+			LruKEvictionPolicy(vint _k);
+		};
+
+/***********************************************************************
+2Q: new pages stay in a FIFO queue, pages referenced again after leaving it are promoted to a LRU queue
+***********************************************************************/
+
+		class TwoQueueEvictionPolicy : public buffer_internal::EvictionPolicyBase
+		{
+		private:
+			buffer_internal::FrameLinkList	links;
+			buffer_internal::FrameQueue		a1in;
+			buffer_internal::FrameQueue		am;
+			buffer_internal::GhostQueue		a1out;
+
+		protected:
+			void							OnFrameMapped(vint frame)override;
+			void							OnFrameAccessed(vint frame)override;
+			void							OnFrameUnmapped(vint frame)override;
+			void							OnFrameSkipped(vint frame)override;
+			vint							PickVictimFrame()override;
+		public:
+			TwoQueueEvictionPolicy();
+		};
+
+/***********************************************************************
+ARC: balances a recency queue and a frequency queue using ghost entries of recently evicted pages
+***********************************************************************/
+
+		class ArcEvictionPolicy : public buffer_internal::EvictionPolicyBase
+		{
+		private:
+			buffer_internal::FrameLinkList	links;
+			buffer_internal::FrameQueue		t1;
+			buffer_internal::FrameQueue		t2;
+			buffer_internal::GhostQueue		b1;
+			buffer_internal::GhostQueue		b2;
+			vint							target = 0;
+			bool							lastHitInB2 = false;
+
+			void							TrimGhosts();
+
+		protected:
+			void							OnFrameMapped(vint frame)override;
+			void							OnFrameAccessed(vint frame)override;
+			void							OnFrameUnmapped(vint frame)override;
+			void							OnFrameSkipped(vint frame)override;
+			vint							PickVictimFrame()override;
+		public:
+			ArcEvictionPolicy();
+		};
+
+		extern IBufferEvictionPolicy*		CreateClockEvictionPolicy();
+		extern IBufferEvictionPolicy*		CreateLruKEvictionPolicy(vint k = 2);
+		extern IBufferEvictionPolicy*		CreateTwoQueueEvictionPolicy();
+		extern IBufferEvictionPolicy*		CreateArcEvictionPolicy();
+	}
+}
+
+#endif
@@ -0,0 +1,220 @@
+#include "BufferStatistics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+
+namespace vl
+{
+	namespace database
+	{
+
+/***********************************************************************
+BufferLatencyHistogram
+***********************************************************************/
+
+		BufferLatencyHistogram::BufferLatencyHistogram()
+		{
+			memset(buckets, 0, sizeof(buckets));
+		}
+
+		vint BufferLatencyHistogram::GetBucket(vuint64_t nanoseconds)
+		{
+			if (nanoseconds < 4) return (vint)nanoseconds;
+			vint exponent = 63 - __builtin_clzll(nanoseconds);
+			vint bucket = 4 + (exponent - 2) * 4 + (vint)((nanoseconds >> (exponent - 2)) & 3);
+			return bucket < BucketCount ? bucket : BucketCount - 1;
+		}
+
+		vuint64_t BufferLatencyHistogram::GetBucketUpperBound(vint bucket)
+		{
+			if (bucket < 4) return (vuint64_t)bucket;
+			vint exponent = (bucket - 4) / 4 + 2;
+			vuint64_t step = (vuint64_t)1 << (exponent - 2);
+			return (4 + (bucket - 4) % 4) * step + step - 1;
+		}
+
+		vuint64_t BufferLatencyHistogram::GetMean()const
+		{
+			return count == 0 ? 0 : totalNanoseconds / count;
+		}
+
+		vuint64_t BufferLatencyHistogram::GetPercentile(double percentile)const
+		{
+			if (count == 0) return 0;
+			vuint64_t target = (vuint64_t)(percentile * count + 0.5);
+			if (target < 1) target = 1;
+			if (target > count) target = count;
+
+			vuint64_t accumulated = 0;
+			for (vint i = 0; i < BucketCount; i++)
+			{
+				accumulated += buckets[i];
+				if (accumulated >= target)
+				{
+					return GetBucketUpperBound(i);
+				}
+			}
+			return GetBucketUpperBound(BucketCount - 1);
+		}
+
+		namespace buffer_internal
+		{
+
+/***********************************************************************
+BufferStatisticsCollector
+***********************************************************************/
+
+			BufferStatisticsCollector::Slot& BufferStatisticsCollector::GetSlot()
+			{
+				int cpu = sched_getcpu();
+				return slots[cpu < 0 ? 0 : cpu % slotCount];
+			}
+
+			BufferStatisticsCollector::BufferStatisticsCollector()
+			{
+				long processors = sysconf(_SC_NPROCESSORS_CONF);
+				slotCount = processors < 1 ? 1 : (vint)processors;
+				slots = (Slot*)calloc(slotCount, sizeof(Slot));
+				CHECK_ERROR(slots != nullptr, L"vl::database::buffer_internal::BufferStatisticsCollector::BufferStatisticsCollector()#Internal error: Failed to allocate slots.");
+			}
+
+			BufferStatisticsCollector::~BufferStatisticsCollector()
+			{
+				free(slots);
+			}
+
+			vuint64_t BufferStatisticsCollector::GetClock()
+			{
+				timespec time;
+				clock_gettime(CLOCK_MONOTONIC, &time);
+				return (vuint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+			}
+
+			void BufferStatisticsCollector::Increase(BufferCounter counter, vuint64_t value)
+			{
+				// a thread could move to another processor, so slots are still changed atomically
+				__atomic_fetch_add(&GetSlot().counters[(vint)counter], value, __ATOMIC_RELAXED);
+			}
+
+			void BufferStatisticsCollector::Record(BufferLatency latency, vuint64_t nanoseconds)
+			{
+				auto& slot = GetSlot();
+				__atomic_fetch_add(&slot.latencyTotals[(vint)latency], nanoseconds, __ATOMIC_RELAXED);
+				__atomic_fetch_add(&slot.histograms[(vint)latency][BufferLatencyHistogram::GetBucket(nanoseconds)], 1, __ATOMIC_RELAXED);
+			}
+
+			void BufferStatisticsCollector::Fill(BufferStatistics& statistics)
+			{
+				vuint64_t counters[CounterCount];
+				memset(counters, 0, sizeof(counters));
+				BufferLatencyHistogram* histograms[] =
+				{
+					&statistics.lockPageLatency,
+					&statistics.unlockPageLatency,
+					&statistics.flushLatency,
+					&statistics.writeBackLatency,
+				};
+
+				for (vint i = 0; i < slotCount; i++)
+				{
+					auto& slot = slots[i];
+					for (vint j = 0; j < CounterCount; j++)
+					{
+						counters[j] += __atomic_load_n(&slot.counters[j], __ATOMIC_RELAXED);
+					}
+					for (vint j = 0; j < LatencyCount; j++)
+					{
+						histograms[j]->totalNanoseconds += __atomic_load_n(&slot.latencyTotals[j], __ATOMIC_RELAXED);
+						for (vint k = 0; k < BufferLatencyHistogram::BucketCount; k++)
+						{
+							vuint64_t count = __atomic_load_n(&slot.histograms[j][k], __ATOMIC_RELAXED);
+							histograms[j]->buckets[k] += count;
+							histograms[j]->count += count;
+						}
+					}
+				}
+
+				statistics.lockCount += counters[(vint)BufferCounter::Locks];
+				statistics.hitCount += counters[(vint)BufferCounter::Hits];
+				statistics.missCount += counters[(vint)BufferCounter::Misses];
+				statistics.failedLockCount += counters[(vint)BufferCounter::FailedLocks];
+				statistics.unlockCount += counters[(vint)BufferCounter::Unlocks];
+				statistics.evictionCount += counters[(vint)BufferCounter::Evictions];
+				statistics.writeBackCount += counters[(vint)BufferCounter::WriteBacks];
+				statistics.flushCount += counters[(vint)BufferCounter::Flushes];
+				statistics.lockWaitCount += counters[(vint)BufferCounter::LockWaits];
+				statistics.lockWaitNanoseconds += counters[(vint)BufferCounter::LockWaitNanoseconds];
+				statistics.hitRatio = statistics.lockCount == 0 ? 0 : (double)statistics.hitCount / statistics.lockCount;
+			}
+
+/***********************************************************************
+BufferLockScope
+***********************************************************************/
+
+			BufferLockScope::BufferLockScope(SpinLock& _spinLock, BufferStatisticsCollector* statistics, BufferStatisticsCollector* sourceStatistics)
+				:spinLock(&_spinLock)
+			{
+				if (spinLock->TryEnter()) return;
+
+				vuint64_t start = BufferStatisticsCollector::GetClock();
+				spinLock->Enter();
+				vuint64_t waited = BufferStatisticsCollector::GetClock() - start;
+				BufferStatisticsCollector* collectors[] = {statistics, sourceStatistics};
+				for (auto collector : collectors)
+				{
+					if (collector)
+					{
+						collector->Increase(BufferCounter::LockWaits);
+						collector->Increase(BufferCounter::LockWaitNanoseconds, waited);
+					}
+				}
+			}
+
+			BufferLockScope::~BufferLockScope()
+			{
+				spinLock->Leave();
+			}
+
+/***********************************************************************
+Formatting
+***********************************************************************/
+
+			namespace
+			{
+				WString FormatHistogram(const WString& name, const BufferLatencyHistogram& histogram)
+				{
+					return name
+						+ L": count " + u64tow(histogram.count)
+						+ L", mean " + u64tow(histogram.GetMean())
+						+ L" ns, p50 " + u64tow(histogram.GetPercentile(0.5))
+						+ L" ns, p99 " + u64tow(histogram.GetPercentile(0.99))
+						+ L" ns, p999 " + u64tow(histogram.GetPercentile(0.999))
+						+ L" ns";
+				}
+			}
+
+			WString FormatBufferStatistics(const BufferStatistics& statistics, const WString& indentation)
+			{
+				return indentation + L"cached pages: " + u64tow(statistics.cachedPageCount) + L"\n"
+					+ indentation + L"locks: " + u64tow(statistics.lockCount)
+						+ L", hits: " + u64tow(statistics.hitCount)
+						+ L", misses: " + u64tow(statistics.missCount)
+						+ L", failed: " + u64tow(statistics.failedLockCount)
+						+ L", hit ratio: " + ftow(statistics.hitRatio) + L"\n"
+					+ indentation + L"unlocks: " + u64tow(statistics.unlockCount)
+						+ L", evictions: " + u64tow(statistics.evictionCount)
+						+ L", write backs: " + u64tow(statistics.writeBackCount)
+						+ L", flushes: " + u64tow(statistics.flushCount) + L"\n"
+					+ indentation + L"lock waits: " + u64tow(statistics.lockWaitCount)
+						+ L", waiting: " + u64tow(statistics.lockWaitNanoseconds) + L" ns\n"
+					+ indentation + FormatHistogram(L"LockPage", statistics.lockPageLatency) + L"\n"
+					+ indentation + FormatHistogram(L"UnlockPage", statistics.unlockPageLatency) + L"\n"
+					+ indentation + FormatHistogram(L"Flush", statistics.flushLatency) + L"\n"
+					+ indentation + FormatHistogram(L"WriteBack", statistics.writeBackLatency) + L"\n"
+					;
+			}
+		}
+	}
+}
@@ -0,0 +1,88 @@
+/***********************************************************************
+Vczh Library++ 3.0
+Developer: Zihan Chen(vczh)
+Database::Utility
+
+***********************************************************************/
+
+#ifndef VCZH_DATABASE_UTILITY_BUFFERSTATISTICS
+#define VCZH_DATABASE_UTILITY_BUFFERSTATISTICS
+
+#include "Buffer.h"
+
+namespace vl
+{
+	namespace database
+	{
+		namespace buffer_internal
+		{
+			enum class BufferCounter
+			{
+				Locks,
+				Hits,
+				Misses,
+				FailedLocks,
+				Unlocks,
+				Evictions,
+				WriteBacks,
+				Flushes,
+				LockWaits,
+				LockWaitNanoseconds,
+			};
+
+			enum class BufferLatency
+			{
+				LockPage,
+				UnlockPage,
+				Flush,
+				WriteBack,
+			};
+
+			class BufferStatisticsCollector : public Object
+			{
+			public:
+				static const vint			CounterCount = (vint)BufferCounter::LockWaitNanoseconds + 1;
+				static const vint			LatencyCount = (vint)BufferLatency::WriteBack + 1;
+
+			private:
+				struct Slot
+				{
+					volatile vuint64_t		counters[CounterCount];
+					volatile vuint64_t		latencyTotals[LatencyCount];
+					volatile vuint64_t		histograms[LatencyCount][BufferLatencyHistogram::BucketCount];
+					char					padding[64];	// counters of neighbour slots are not in the same cache line
+				};
+
+				Slot*						slots;
+				vint						slotCount;				// one slot for every configured processor
+
+				Slot&						GetSlot();
+			public:
+				// every processor adds to its own slot without contention, slots are only summed up by Fill
+				BufferStatisticsCollector();
+				~BufferStatisticsCollector();
+
+				static vuint64_t			GetClock();
+
+				void						Increase(BufferCounter counter, vuint64_t value = 1);
+				void						Record(BufferLatency latency, vuint64_t nanoseconds);
+				// adds everything collected to statistics
+				void						Fill(BufferStatistics& statistics);
+			};
+
+			class BufferLockScope : public Object, public NotCopyable
+			{
+			private:
+				SpinLock*					spinLock;
+			public:
+				// a lock that is not free at the first attempt is counted as a wait, together with the time spent waiting
+				BufferLockScope(SpinLock& _spinLock, BufferStatisticsCollector* statistics, BufferStatisticsCollector* sourceStatistics = nullptr);
+				~BufferLockScope();
+			};
+
+			extern WString					FormatBufferStatistics(const BufferStatistics& statistics, const WString& indentation);
+		}
+	}
+}
+
+#endif
@@ -8,15 +8,30 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <string.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
 
 /*
  * Page Structure
  *		Initial Page	: [uint64 NextInitialPage][uint64 FreePageItems]{[uint64 FreePage] ...}
+ *			Only INDEX_PAGE_FREEITEM is kept and it is always empty, free pages are found from use masks
+ *		Superblock		: [uint64 NextInitialPage][uint64 FreePageItems][uint64 Magic][uint64 Version][uint64 Clean][uint64 TotalPages][uint64 FreePages][uint64 DirectoryPages]{[uint64 DirectoryPage] ...}
+ *			The superblock is INDEX_PAGE_FREEITEM, NextInitialPage and FreePageItems keep it an empty initial page
+ *		Directory Page	: {[uint64 UseMaskPage][uint64 UsedPages] ...}
+ *			UseMaskPage is INDEX_INVALID for unused entries
  *		Use Mask Page	: [uint64 NextUseMaskPage]{[bit FreePageMask] ...}
  *			FreePageMask 1=used, 0=free
  */
 
 #define INDEX_INVALID (~(vuint64_t)0)
+#define REGION_SIZE (64 * 1024 * 1024)
+#define EXTENT_SIZE (1024 * 1024)
+#define IO_QUEUE_DEPTH 64
+#define READAHEAD_MIN_WINDOW 4
+#define READAHEAD_MAX_WINDOW 32
+#define VERIFY_BATCH_SIZE (1024 * 1024)
+#define HOT_PAGE_MAGIC 0x5345474150544F48ULL
 #define INDEX_PAGE_USEMASK 0
 #define INDEX_PAGE_FREEITEM 1
 #define INDEX_PAGE_INDEX 2
@@ -28,6 +43,20 @@
 #define INDEX_FREEITEM_FREEPAGEITEMS 1
 #define INDEX_FREEITEM_FREEPAGEITEMBEGIN 2
 
+#define INDEX_SUPERBLOCK_MAGIC 2
+#define INDEX_SUPERBLOCK_VERSION 3
+#define INDEX_SUPERBLOCK_CLEAN 4
+#define INDEX_SUPERBLOCK_TOTALPAGES 5
+#define INDEX_SUPERBLOCK_FREEPAGES 6
+#define INDEX_SUPERBLOCK_DIRECTORYPAGES 7
+#define INDEX_SUPERBLOCK_DIRECTORYPAGEBEGIN 8
+#define SUPERBLOCK_MAGIC 0x4B4C425245505553ULL
+#define SUPERBLOCK_VERSION 1
+
+#define INDEX_DIRECTORY_USEMASKPAGE 0
+#define INDEX_DIRECTORY_USEDPAGES 1
+#define DIRECTORY_ENTRY_SIZE 2
+
 namespace vl
 {
 	namespace database
@@ -39,406 +68,1800 @@ namespace vl
 		{
 
 /***********************************************************************
-FileMapping
+FileChecksums
 ***********************************************************************/
 
-			FileMapping::FileMapping(vuint64_t _pageSize, int _fileDescriptor, volatile vuint64_t* _totalUsedPages)
+			void FileChecksums::EnsurePageCount(vuint64_t count)
+			{
+				if (count <= pageCount) return;
+				vint oldCapacity = checksums.Count();
+				if ((vuint64_t)oldCapacity < count * 2)
+				{
+					vint capacity = oldCapacity == 0 ? 128 : oldCapacity;
+					while ((vuint64_t)capacity < count * 2)
+					{
+						capacity *= 2;
+					}
+					checksums.Resize(capacity);
+					memset(&checksums[oldCapacity], 0, (capacity - oldCapacity) * sizeof(vuint32_t));
+				}
+				pageCount = count;
+			}
+
+			FileChecksums::FileChecksums(vuint64_t _pageSize, int _fileDescriptor)
 				:pageSize(_pageSize)
 				,fileDescriptor(_fileDescriptor)
-				,totalUsedPages(_totalUsedPages)
 			{
 			}
 
-			void FileMapping::InitializeEmptySource()
+			FileChecksums::~FileChecksums()
 			{
-				totalPageCount = 3;
+				close(fileDescriptor);
 			}
 
-			void FileMapping::InitializeExistingSource()
+			bool FileChecksums::Load()
 			{
 				struct stat fileState;
-				CHECK_ERROR(fstat(fileDescriptor, &fileState) != -1, L"vl::database::buffer_internal::FileMapping::InitializeExistingSource()#Internal error: Failed to call fstat.");
-				totalPageCount = fileState.st_size / pageSize;
+				if (fstat(fileDescriptor, &fileState) == -1)
+				{
+					return false;
+				}
+
+				vuint64_t count = fileState.st_size / (sizeof(vuint32_t) * 2);
+				EnsurePageCount(count);
+				vuint64_t size = count * sizeof(vuint32_t) * 2;
+				vuint64_t read = 0;
+				while (read < size)
+				{
+					auto result = pread(fileDescriptor, (char*)&checksums[0] + read, size - read, read);
+					if (result == -1 && errno == EINTR) continue;
+					if (result <= 0) break;
+					read += result;
+				}
+				return read == size;
 			}
 
-			vuint64_t FileMapping::GetTotalPageCount()
+			bool FileChecksums::NeedsSync(const List<BufferPageDesc*>& pageDescs)
 			{
-				return totalPageCount;
+				SPIN_LOCK(lock)
+				{
+					FOREACH(BufferPageDesc*, pageDesc, pageDescs)
+					{
+						if (unsyncedPages.Keys().Contains(pageDesc->page.index))
+						{
+							return true;
+						}
+					}
+				}
+				return false;
 			}
 
-			Ptr<BufferPageDesc> FileMapping::MapPage(BufferPage page)
+			bool FileChecksums::Update(const List<BufferPageDesc*>& pageDescs, const List<void*>& images)
 			{
-				vint index = mappedPages.Keys().IndexOf(page.index);
-				if (index == -1)
+				List<vuint32_t> values;
+				FOREACH(void*, image, images)
 				{
-					vuint64_t offset = page.index * pageSize;
-					struct stat fileState;	
-					CHECK_ERROR(fstat(fileDescriptor, &fileState) != -1, L"vl::database::buffer_internal::FileMapping::InitializeExistingSource()#Internal error: Failed to call fstat.");
-					if (fileState.st_size < offset + pageSize)
+					values.Add(ComputeCrc32c(image, pageSize));
+				}
+
+				// writes to the checksum file are serialized, so the file never goes back to older checksums
+				CS_LOCK(writeLock)
+				{
+					SortedList<vuint64_t> changedPages;
+					Array<vuint32_t> writing;
+					SPIN_LOCK(lock)
 					{
-						CHECK_ERROR(fileState.st_size == offset, L"vl::database::buffer_internal::FileMapping::InitializeExistingSource()#Internal error: The file is corrupted.");
-						ftruncate(fileDescriptor, offset + pageSize);
-						totalPageCount = offset / pageSize + 1;
+						for (vint i = 0; i < pageDescs.Count(); i++)
+						{
+							vuint64_t index = pageDescs[i]->page.index;
+							EnsurePageCount(index + 1);
+							if (checksums[(vint)index * 2 + 1] != values[i])
+							{
+								// the file could still contain either checksum of this page, there is no room for a third one
+								if (unsyncedPages.Keys().Contains(index))
+								{
+									return false;
+								}
+							}
+						}
+
+						for (vint i = 0; i < pageDescs.Count(); i++)
+						{
+							vuint64_t index = pageDescs[i]->page.index;
+							if (checksums[(vint)index * 2 + 1] != values[i])
+							{
+								unsyncedPages.Set(index, INDEX_INVALID);
+								checksums[(vint)index * 2] = checksums[(vint)index * 2 + 1];
+								checksums[(vint)index * 2 + 1] = values[i];
+								if (!changedPages.Contains(index))
+								{
+									changedPages.Add(index);
+								}
+							}
+						}
+
+						writing.Resize(changedPages.Count() * 2);
+						for (vint i = 0; i < changedPages.Count(); i++)
+						{
+							writing[i * 2] = checksums[(vint)changedPages[i] * 2];
+							writing[i * 2 + 1] = checksums[(vint)changedPages[i] * 2 + 1];
+						}
 					}
 
-					void* address = mmap(nullptr, pageSize, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, offset);
-					if (address == MAP_FAILED)
+					if (changedPages.Count() == 0)
 					{
-						return nullptr;
+						return true;
 					}
-					
-					auto pageDesc = MakePtr<BufferPageDesc>();
-					pageDesc->address = address;
-					pageDesc->offset = offset;
-					pageDesc->lastAccessTime = (vuint64_t)time(nullptr);
-					mappedPages.Add(page.index, pageDesc);
-					INCRC(totalUsedPages);
-					return pageDesc;
+
+					// entries of continuous pages are written together
+					vint begin = 0;
+					while (begin < changedPages.Count())
+					{
+						vint end = begin + 1;
+						while (end < changedPages.Count() && changedPages[end] == changedPages[end - 1] + 1)
+						{
+							end++;
+						}
+
+						vuint64_t size = (end - begin) * sizeof(vuint32_t) * 2;
+						vuint64_t offset = changedPages[begin] * sizeof(vuint32_t) * 2;
+						vuint64_t written = 0;
+						while (written < size)
+						{
+							auto result = pwrite(fileDescriptor, (char*)&writing[begin * 2] + written, size - written, offset + written);
+							if (result == -1 && errno == EINTR) continue;
+							if (result <= 0) break;
+							written += result;
+						}
+						if (written != size)
+						{
+							return false;
+						}
+						begin = end;
+					}
+					return fdatasync(fileDescriptor) != -1;
 				}
-				else
+				return false;
+			}
+
+			void FileChecksums::EndWrite(const List<BufferPageDesc*>& pageDescs, bool synced)
+			{
+				SPIN_LOCK(lock)
 				{
-					auto pageDesc = mappedPages.Values()[index];
-					pageDesc->lastAccessTime = (vuint64_t)time(nullptr);
-					return pageDesc;
+					FOREACH(BufferPageDesc*, pageDesc, pageDescs)
+					{
+						vint index = unsyncedPages.Keys().IndexOf(pageDesc->page.index);
+						if (index != -1 && unsyncedPages.Values()[index] == INDEX_INVALID)
+						{
+							if (synced)
+							{
+								unsyncedPages.Remove(pageDesc->page.index);
+							}
+							else
+							{
+								unsyncedPages.Set(pageDesc->page.index, ++writeSerial);
+							}
+						}
+					}
 				}
 			}
 
-			BufferPage FileMapping::AppendPage()
+			vuint64_t FileChecksums::BeginSync()
 			{
-				BufferPage result;
-				BufferPage page{totalPageCount};
-				if (MapPage(page))
+				SPIN_LOCK(lock)
 				{
-					result = page;
+					return writeSerial;
 				}
-				return result;
+				return 0;
 			}
 
-			bool FileMapping::UnmapPage(BufferPage page)
+			void FileChecksums::EndSync(vuint64_t serial)
 			{
-				vint index = mappedPages.Keys().IndexOf(page.index);
-				if (index != -1)
+				SPIN_LOCK(lock)
 				{
-					auto pageDesc = mappedPages.Values()[index];
-					if (!pageDesc->locked)
+					for (vint i = unsyncedPages.Count() - 1; i >= 0; i--)
 					{
-						if (pageDesc->dirty)
+						if (unsyncedPages.Values()[i] <= serial)
 						{
-							CHECK_ERROR(msync(pageDesc->address, pageSize, MS_SYNC) != -1, L"vl::database::buffer_internal::FileMapping::UnmapPage(BufferPage)#Internal error: Failed to call msync.");
-							pageDesc->dirty = false;
+							unsyncedPages.Remove(unsyncedPages.Keys()[i]);
 						}
-						CHECK_ERROR(munmap(pageDesc->address, pageSize) != -1, L"vl::database::buffer_internal::FileMapping::UnmapPage(BufferPage)#Internal error: Failed to call munmap.");
+					}
+				}
+			}
 
-						mappedPages.Remove(page.index);
-						DECRC(totalUsedPages);
+			bool FileChecksums::Verify(BufferPage page, const void* address)
+			{
+				vuint32_t value = ComputeCrc32c(address, pageSize);
+				vuint64_t index = page.index;
+				SPIN_LOCK(lock)
+				{
+					if (index >= pageCount)
+					{
+						return true;
+					}
+					vuint32_t previous = checksums[(vint)index * 2];
+					vuint32_t last = checksums[(vint)index * 2 + 1];
+					if ((previous == 0 && last == 0) || value == previous || value == last)
+					{
 						return true;
 					}
 				}
+				INCRC(&failureCount);
 				return false;
 			}
 
-			void FileMapping::UnmapAllPages()
+			void FileChecksums::Truncate(vuint64_t count)
 			{
-				FOREACH(Ptr<BufferPageDesc>, pageDesc, mappedPages.Values())
+				CS_LOCK(writeLock)
 				{
-					DECRC(totalUsedPages);
-					CHECK_ERROR(munmap(pageDesc->address, pageSize) != -1, L"vl::database::buffer_internal::FileMapping::UnmapAllPages(BufferPage)#Internal error: Failed to call munmap.");
+					SPIN_LOCK(lock)
+					{
+						if (count >= pageCount)
+						{
+							return;
+						}
+						memset(&checksums[(vint)count * 2], 0, (pageCount - count) * sizeof(vuint32_t) * 2);
+						pageCount = count;
+						for (vint i = unsyncedPages.Count() - 1; i >= 0; i--)
+						{
+							if (unsyncedPages.Keys()[i] >= count)
+							{
+								unsyncedPages.Remove(unsyncedPages.Keys()[i]);
+							}
+						}
+					}
+					ftruncate(fileDescriptor, count * sizeof(vuint32_t) * 2);
 				}
 			}
 
-			vint FileMapping::GetMappedPageCount()
-			{
-				return mappedPages.Count();
-			}
-			
-			BufferPage FileMapping::GetMappedPage(vint index)
+			vuint64_t FileChecksums::GetFailureCount()
 			{
-				return mappedPages.Keys()[index];
+				return failureCount;
 			}
 
-			Ptr<BufferPageDesc> FileMapping::GetMappedPageDesc(vint index)
+/***********************************************************************
+FileMapping
+***********************************************************************/
+
+			bool FileMapping::ExtendFile(vuint64_t size)
 			{
-				return mappedPages.Values()[index];
+				vuint64_t extentSize = EXTENT_SIZE > pageSize ? EXTENT_SIZE / pageSize * pageSize : pageSize;
+				size = (size + extentSize - 1) / extentSize * extentSize;
+
+				// fallocate reserves blocks for the whole extent, file systems that do not support it only get a larger file
+				if (fallocate(fileDescriptor, 0, fileSize, size - fileSize) == -1)
+				{
+					if (ftruncate(fileDescriptor, size) == -1)
+					{
+						return false;
+					}
+				}
+				fileSize = size;
+				return true;
 			}
 
-			Ptr<BufferPageDesc> FileMapping::GetMappedPageDesc(BufferPage page)
+			void* FileMapping::GetRegionAddress(BufferPage page)
 			{
-				vint index = mappedPages.Keys().IndexOf(page.index);
-				if (index == -1)
+				vint regionIndex = (vint)(page.index / pagesPerRegion);
+				while (regions.Count() <= regionIndex)
 				{
-					return nullptr;
+					// a region could extend beyond the end of the file, pages there are not touched until the file grows
+					vuint64_t regionSize = pagesPerRegion * pageSize;
+					void* address = mmap(nullptr, regionSize, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, regions.Count() * regionSize);
+					if (address == MAP_FAILED)
+					{
+						return nullptr;
+					}
+					regions.Add((char*)address);
 				}
-				return mappedPages.Values()[index];
+				return regions[regionIndex] + (page.index % pagesPerRegion) * pageSize;
 			}
 
-/***********************************************************************
-FileUseMasks
-***********************************************************************/
-
-			FileUseMasks::FileUseMasks(vuint64_t _pageSize, int _fileDescriptor)
-				:pageSize(_pageSize)
-				,fileDescriptor(_fileDescriptor)
-				,useMaskPageItemCount((_pageSize - INDEX_USEMASK_USEMASKBEGIN * sizeof(vuint64_t)) / sizeof(vuint64_t))
+			void FileMapping::ReleaseRegions()
 			{
+				FOREACH(char*, region, regions)
+				{
+					CHECK_ERROR(munmap(region, pagesPerRegion * pageSize) != -1, L"vl::database::buffer_internal::FileMapping::ReleaseRegions()#Internal error: Failed to call munmap.");
+				}
+				regions.Clear();
 			}
 
-			void FileUseMasks::InitializeEmptySource(FileMapping* _fileMapping)
+			bool FileMapping::ReadFrame(BufferPageDesc* pageDesc)
 			{
-				fileMapping = _fileMapping;
-
-				useMaskPages.Clear();
-				BufferPage page{INDEX_PAGE_USEMASK};
-				auto pageDesc = fileMapping->MapPage(page);
-				CHECK_ERROR(pageDesc != nullptr, L"vl::database::buffer_internal::FileUseMasks::InitializeEmptySource()#Internal error: Failed to map INDEX_PAGE_USEMASK.");
-				vuint64_t* numbers = (vuint64_t*)pageDesc->address;
-				memset(numbers, 0, pageSize);
-				numbers[INDEX_USEMASK_NEXTUSEMASKPAGE] = INDEX_INVALID;
-				CHECK_ERROR(msync(numbers, pageSize, MS_SYNC) != -1, L"vl::database::buffer_internal::FileUseMasks::InitializeEmptySource()#Internal error: Failed to call msync.");
-				useMaskPages.Add(page.index);
+				vuint64_t read = 0;
+				while (read < pageSize)
+				{
+					auto result = pread(fileDescriptor, (char*)pageDesc->address + read, pageSize - read, pageDesc->offset + read);
+					if (result == -1 && errno == EINTR) continue;
+					if (result <= 0) break;
+					read += result;
+				}
+				return read == pageSize;
 			}
 
-			void FileUseMasks::InitializeExistingSource(FileMapping* _fileMapping)
+			bool FileMapping::LoadFrame(BufferPageDesc* pageDesc)
 			{
-				fileMapping = _fileMapping;
-
-				useMaskPages.Clear();
-				BufferPage page{INDEX_PAGE_USEMASK};
-				
-				while(page.index != INDEX_INVALID)
+				// a page from the compressed tier was verified when it was read from the file
+				if (compressedTier && compressedTier->Load(source, pageDesc->page, pageDesc->address))
 				{
-					useMaskPages.Add(page.index);
-					auto pageDesc = fileMapping->MapPage(page);
-					vuint64_t* numbers = (vuint64_t*)pageDesc->address;
-					page.index = numbers[INDEX_USEMASK_NEXTUSEMASKPAGE];
+					return true;
 				}
+				return ReadFrame(pageDesc) && (!checksums || checksums->Verify(pageDesc->page, pageDesc->address));
 			}
 
-			bool FileUseMasks::GetUseMask(BufferPage page)
+			bool FileMapping::SyncData()
 			{
-				auto useMaskPageBits = 8 * sizeof(vuint64_t);
-				auto useMaskPageIndex = page.index / (useMaskPageBits * useMaskPageItemCount);
-				auto useMaskPageBitIndex = page.index % (useMaskPageBits * useMaskPageItemCount);
-				auto useMaskPageItem = INDEX_USEMASK_USEMASKBEGIN + useMaskPageBitIndex / useMaskPageBits;
-				auto useMaskPageShift = useMaskPageBitIndex % useMaskPageBits;
-
-				BufferPage useMaskPage{useMaskPages[useMaskPageIndex]};
-				auto pageDesc = fileMapping->MapPage(useMaskPage);
-				CHECK_ERROR(pageDesc != nullptr, L"vl::database::buffer_internal::FileUseMasks::GetUseMask(BufferPage)#Internal error: Failed to map the specified use mask page.");
-				vuint64_t* numbers = (vuint64_t*)pageDesc->address;
-				auto& item = numbers[useMaskPageItem];
-				bool result = ((item >> useMaskPageShift) & ((vuint64_t)1)) == 1;
-				CHECK_ERROR(msync(numbers, pageSize, MS_SYNC) != -1, L"vl::database::buffer_internal::FileUseMasks::GetUseMask(page)#Internal error: Failed to call msync.");
-				return result;
+				vuint64_t serial = checksums ? checksums->BeginSync() : 0;
+				if (fdatasync(fileDescriptor) == -1)
+				{
+					return false;
+				}
+				if (checksums)
+				{
+					checksums->EndSync(serial);
+				}
+				return true;
 			}
-			
-			void FileUseMasks::SetUseMask(BufferPage page, bool available)
-			{
-				auto useMaskPageBits = 8 * sizeof(vuint64_t);
-				auto useMaskPageIndex = page.index / (useMaskPageBits * useMaskPageItemCount);
-				auto useMaskPageBitIndex = page.index % (useMaskPageBits * useMaskPageItemCount);
-				auto useMaskPageItem = INDEX_USEMASK_USEMASKBEGIN + useMaskPageBitIndex / useMaskPageBits;
-				auto useMaskPageShift = useMaskPageBitIndex % useMaskPageBits;
-				bool newPage = false;
-
-				BufferPage useMaskPage = BufferPage::Invalid();
 
-				if (useMaskPageIndex == useMaskPages.Count())
+			bool FileMapping::WriteFrame(BufferPageDesc* pageDesc)
+			{
+				// the frame is written from a snapshot, so that the checksum matches exactly the written bytes
+				void* image = nullptr;
+				if (posix_memalign(&image, pageSize, pageSize) != 0)
 				{
-					newPage = true;
-					BufferPage lastPage{useMaskPages[useMaskPageIndex - 1]};
-					useMaskPage = fileMapping->AppendPage();
-					CHECK_ERROR(useMaskPage.IsValid(), L"vl::database::buffer_internal::FileUseMasks::SetUseMask(BufferPage, bool)#Internal error: Failed to create a new use mask page.");
-					SetUseMask(useMaskPage, true);
-					useMaskPages.Add(useMaskPage.index);
-
-					auto pageDesc = fileMapping->MapPage(lastPage);
-					CHECK_ERROR(pageDesc != nullptr, L"vl::database::buffer_internal::FileUseMasks::SetUseMask(BufferPage, bool)#Internal error: Failed to map the last use mask page.");
-					vuint64_t* numbers = (vuint64_t*)pageDesc->address;
-					numbers[INDEX_USEMASK_NEXTUSEMASKPAGE] = useMaskPage.index;
-					CHECK_ERROR(msync(numbers, pageSize, MS_SYNC) != -1, L"vl::database::buffer_internal::FileUseMasks::SetUseMask(page, bool)#Internal error: Failed to call msync.");
+					return false;
 				}
-				else
+				if (!pageDesc->TrySnapshot(image, pageSize))
 				{
-					useMaskPage.index = useMaskPages[useMaskPageIndex];
+					free(image);
+					return false;
 				}
 
-				auto pageDesc = fileMapping->MapPage(useMaskPage);
-				CHECK_ERROR(pageDesc != nullptr, L"vl::database::buffer_internal::FileUseMasks::SetUseMask(BufferPage, bool)#Internal error: Failed to map the specified use mask page.");
-				vuint64_t* numbers = (vuint64_t*)pageDesc->address;
-				if (newPage)
+				List<BufferPageDesc*> checksumPageDescs;
+				if (checksums)
 				{
-					memset(numbers, 0, pageSize);
-					numbers[INDEX_USEMASK_NEXTUSEMASKPAGE] = INDEX_INVALID;
+					List<void*> images;
+					checksumPageDescs.Add(pageDesc);
+					images.Add(image);
+					if ((checksums->NeedsSync(checksumPageDescs) && !SyncData()) || !checksums->Update(checksumPageDescs, images))
+					{
+						free(image);
+						return false;
+					}
 				}
 
-				auto& item = numbers[useMaskPageItem];
-				if (available)
+				vuint64_t written = 0;
+				while (written < pageSize)
 				{
-					vuint64_t mask = ((vuint64_t)1) << useMaskPageShift;
-					item |= mask;
+					auto result = pwrite(fileDescriptor, (char*)image + written, pageSize - written, pageDesc->offset + written);
+					if (result == -1 && errno == EINTR) continue;
+					if (result <= 0) break;
+					written += result;
 				}
-				else
+				if (checksums)
 				{
-					vuint64_t mask = ~(((vuint64_t)1) << useMaskPageShift);
-					item &= mask;
+					checksums->EndWrite(checksumPageDescs, false);
 				}
-				CHECK_ERROR(msync(numbers, pageSize, MS_SYNC) != -1, L"vl::database::buffer_internal::FileUseMasks::SetUseMask(page, bool)#Internal error: Failed to call msync.");
+				free(image);
+				return written == pageSize;
 			}
-		}
 
-/***********************************************************************
-FileFreePages
-***********************************************************************/
+			void FileMapping::ReleaseFrame(BufferPageDesc* pageDesc)
+			{
+				if (ioMode == FileIoMode::MemoryMapped)
+				{
+					CHECK_ERROR(munmap(pageDesc->address, pageSize) != -1, L"vl::database::buffer_internal::FileMapping::ReleaseFrame(BufferPageDesc*)#Internal error: Failed to call munmap.");
+				}
+				// arena frames return to the arena after the last reference to the descriptor is released
+				// region pages stay mapped until the source is unloaded
+			}
 
-			FileFreePages::FileFreePages(vuint64_t _pageSize)
+			FileMapping::FileMapping(vuint64_t _pageSize, int _fileDescriptor, volatile vuint64_t* _totalUsedPages, IBufferPageObserver* _observer, BufferSource _source, FileIoMode _ioMode, Ptr<BufferFrameArena> _arena, Ptr<FileChecksums> _checksums, Ptr<BufferCompressedTier> _compressedTier)
 				:pageSize(_pageSize)
-				,freeItemPageItemCount((_pageSize - INDEX_FREEITEM_FREEPAGEITEMBEGIN * sizeof(vuint64_t)) / sizeof(vuint64_t))
-				,activeFreeItemPageIndex(-1)
+				,fileDescriptor(_fileDescriptor)
+				,ioMode(_ioMode)
+				,arena(_arena)
+				,checksums(_checksums)
+				,compressedTier(_compressedTier)
+				,source(_source)
+				,mappedPages(_source, _totalUsedPages, _observer)
+				,pagesPerRegion(REGION_SIZE > _pageSize ? REGION_SIZE / _pageSize : 1)
 			{
+				CHECK_ERROR(ioMode == FileIoMode::MemoryMapped || ioMode == FileIoMode::RegionMapped || arena, L"vl::database::buffer_internal::FileMapping::FileMapping(...)#Internal error: Frames are required unless pages are memory mapped.");
+				CHECK_ERROR(!checksums || !IsMappedIoMode(), L"vl::database::buffer_internal::FileMapping::FileMapping(...)#Internal error: Checksums are only verified for frames.");
+				if (!IsMappedIoMode())
+				{
+					ioEngine = new BufferIoEngine(IO_QUEUE_DEPTH);
+				}
 			}
 
-			void FileFreePages::InitializeEmptySource(FileMapping* _fileMapping, FileUseMasks* _fileUseMasks)
+			FileIoMode FileMapping::GetIoMode()
 			{
-				fileMapping = _fileMapping;
-				fileUseMasks = _fileUseMasks;
-
-				freeItemPages.Clear();
-				BufferPage page{INDEX_PAGE_FREEITEM};
-				auto pageDesc = fileMapping->MapPage(page);
-				CHECK_ERROR(pageDesc != nullptr, L"vl::database::buffer_internal::FileFreePages::InitializeEmptySource()#Internal error: Failed to map INDEX_PAGE_FREEITEM.");
+				return ioMode;
+			}
 
-				vuint64_t* numbers = (vuint64_t*)pageDesc->address;
-				memset(numbers, 0, pageSize);
-				numbers[INDEX_FREEITEM_NEXTINITIALPAGE] = INDEX_INVALID;
-				numbers[INDEX_FREEITEM_FREEPAGEITEMS] = 0;
-				CHECK_ERROR(msync(numbers, pageSize, MS_SYNC) != -1, L"vl::database::buffer_internal::FileFreePages::InitializeEmptySource()#Internal error: Failed to call msync.");
+			bool FileMapping::IsMappedIoMode()
+			{
+				return ioMode == FileIoMode::MemoryMapped || ioMode == FileIoMode::RegionMapped;
+			}
 
-				freeItemPages.Add(page.index);
-				activeFreeItemPageIndex = 0;
+			Ptr<BufferIoEngine> FileMapping::GetIoEngine()
+			{
+				return ioEngine;
 			}
 
-			void FileFreePages::InitializeExistingSource(FileMapping* _fileMapping, FileUseMasks* _fileUseMasks)
+			Ptr<FileChecksums> FileMapping::GetChecksums()
 			{
-				fileMapping = _fileMapping;
-				fileUseMasks = _fileUseMasks;
+				return checksums;
+			}
 
-				freeItemPages.Clear();
-				BufferPage page{INDEX_PAGE_FREEITEM};
-				
-				while(page.index != INDEX_INVALID)
+			void FileMapping::InitializeEmptySource()
+			{
+				totalPageCount = 3;
+				fileSize = 0;
+				CHECK_ERROR(ExtendFile(totalPageCount * pageSize), L"vl::database::buffer_internal::FileMapping::InitializeEmptySource()#Internal error: Failed to extend the file.");
+				if (checksums)
 				{
-					freeItemPages.Add(page.index);
-					auto pageDesc = fileMapping->MapPage(page);
-					vuint64_t* numbers = (vuint64_t*)pageDesc->address;
-					page.index = numbers[INDEX_FREEITEM_NEXTINITIALPAGE];
-
-					if (numbers[INDEX_FREEITEM_FREEPAGEITEMS] != 0)
-					{
-						activeFreeItemPageIndex = freeItemPages.Count() - 1;
-					}
+					checksums->Truncate(0);
 				}
-				
-				if (activeFreeItemPageIndex == -1)
+			}
+
+			void FileMapping::InitializeExistingSource()
+			{
+				struct stat fileState;
+				CHECK_ERROR(fstat(fileDescriptor, &fileState) != -1, L"vl::database::buffer_internal::FileMapping::InitializeExistingSource()#Internal error: Failed to call fstat.");
+				totalPageCount = fileState.st_size / pageSize;
+				fileSize = fileState.st_size;
+				if (checksums)
 				{
-					activeFreeItemPageIndex = 0;
+					// checksums of pages after the end of the file are left by a crash before the checksum file is trimmed
+					CHECK_ERROR(checksums->Load(), L"vl::database::buffer_internal::FileMapping::InitializeExistingSource()#Internal error: Failed to read checksums.");
+					checksums->Truncate(totalPageCount);
 				}
 			}
 
-			void FileFreePages::PushFreePage(BufferPage page)
+			vuint64_t FileMapping::GetTotalPageCount()
 			{
-				BufferPage initialPage{freeItemPages[activeFreeItemPageIndex]};
-				auto pageDesc = fileMapping->MapPage(initialPage);
-				CHECK_ERROR(pageDesc != nullptr, L"vl::database::buffer_internal::FileFreePages::PushFreePage(BufferPage)#Internal error: Failed to map the last active initial page.");
-				vuint64_t* numbers = (vuint64_t*)pageDesc->address;
-				vuint64_t& count = numbers[INDEX_FREEITEM_FREEPAGEITEMS];
-				if (count == freeItemPageItemCount)
-				{
-					if (activeFreeItemPageIndex == freeItemPages.Count() - 1)
-					{
-						BufferPage newInitialPage{fileMapping->GetTotalPageCount()};
-						numbers[INDEX_FREEITEM_NEXTINITIALPAGE] = newInitialPage.index;
-						msync(numbers, pageSize, MS_SYNC);
-
-						auto newPageDesc = fileMapping->MapPage(newInitialPage);
-						CHECK_ERROR(newPageDesc != nullptr, L"vl::database::buffer_internal::FileFreePages::PushFreePage(BufferPage)#Internal error: Failed to create a new initial page.");
-						numbers = (vuint64_t*)newPageDesc->address;
-						memset(numbers, 0, pageSize);
-						numbers[INDEX_FREEITEM_NEXTINITIALPAGE] = INDEX_INVALID;
-						numbers[INDEX_FREEITEM_FREEPAGEITEMS] = 1;
-						numbers[INDEX_FREEITEM_FREEPAGEITEMBEGIN] = page.index;
-						CHECK_ERROR(msync(numbers, pageSize, MS_SYNC) != -1, L"vl::database::buffer_internal::FileFreePages::PushFreePage(page)#Internal error: Failed to call msync.");
-						freeItemPages.Add(newInitialPage.index);
-						fileUseMasks->SetUseMask(newInitialPage, true);
+				return totalPageCount;
+			}
+
+			Ptr<BufferPageDesc> FileMapping::MapPage(BufferPage page)
+			{
+				auto pageDesc = mappedPages.Get(page);
+				if (!pageDesc)
+				{
+					vuint64_t offset = page.index * pageSize;
+					if (page.index >= totalPageCount)
+					{
+						CHECK_ERROR(page.index == totalPageCount, L"vl::database::buffer_internal::FileMapping::MapPage(BufferPage)#Internal error: The file is corrupted.");
+						// the file is only resized through this object, so the size is known without calling fstat
+						if (fileSize < offset + pageSize && !ExtendFile(offset + pageSize))
+						{
+							return nullptr;
+						}
+						totalPageCount = page.index + 1;
+					}
+
+					if (ioMode == FileIoMode::RegionMapped)
+					{
+						void* address = GetRegionAddress(page);
+						if (!address) return nullptr;
+
+						pageDesc = MakePtr<BufferPageDesc>();
+						pageDesc->address = address;
+					}
+					else if (ioMode == FileIoMode::MemoryMapped)
+					{
+						void* address = mmap(nullptr, pageSize, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, offset);
+						if (address == MAP_FAILED)
+						{
+							return nullptr;
+						}
+
+						pageDesc = MakePtr<BufferPageDesc>();
+						pageDesc->address = address;
 					}
 					else
 					{
-						BufferPage newInitialPage{freeItemPages[activeFreeItemPageIndex + 1]};
-						auto newPageDesc = fileMapping->MapPage(newInitialPage);
-						CHECK_ERROR(newPageDesc != nullptr, L"vl::database::buffer_internal::FileFreePages::PushFreePage(BufferPage)#Internal error: Failed to reuse a created initial page.");
-						numbers = (vuint64_t*)newPageDesc->address;
-						numbers[INDEX_FREEITEM_FREEPAGEITEMS] = 1;
-						numbers[INDEX_FREEITEM_FREEPAGEITEMBEGIN] = page.index;
-						CHECK_ERROR(msync(numbers, pageSize, MS_SYNC) != -1, L"vl::database::buffer_internal::FileFreePages::PushFreePage(page)#Internal error: Failed to call msync.");
+						pageDesc = arena->AllocatePageDesc();
+						if (!pageDesc) return nullptr;
+					}
+					pageDesc->page = page;
+					pageDesc->offset = offset;
+
+					if (!IsMappedIoMode() && !LoadFrame(pageDesc.Obj()))
+					{
+						return nullptr;
 					}
-					activeFreeItemPageIndex++;
+					mappedPages.Add(pageDesc);
+					return pageDesc;
 				}
 				else
 				{
-					numbers[INDEX_FREEITEM_FREEPAGEITEMBEGIN + count] = page.index;
-					count++;
-					CHECK_ERROR(msync(numbers, pageSize, MS_SYNC) != -1, L"vl::database::buffer_internal::FileFreePages::PushFreePage(page)#Internal error: Failed to call msync.");
+					mappedPages.Touch(pageDesc.Obj());
+					return pageDesc;
 				}
 			}
 
-			BufferPage FileFreePages::PopFreePage()
+			void FileMapping::TouchPage(BufferPageDesc* pageDesc)
 			{
-				BufferPage page = BufferPage::Invalid();
-				BufferPage initialPage{freeItemPages[activeFreeItemPageIndex]};
-				auto pageDesc = fileMapping->MapPage(initialPage);
-				CHECK_ERROR(pageDesc != nullptr, L"vl::database::buffer_internal::FileFreePages::PopFreePage()#Internal error: Failed to map the last active initial page.");
-				vuint64_t* numbers = (vuint64_t*)pageDesc->address;
-				vuint64_t& count = numbers[INDEX_FREEITEM_FREEPAGEITEMS];
+				mappedPages.Touch(pageDesc);
+			}
 
-				if (count == 0 && initialPage.index == INDEX_PAGE_FREEITEM)
+			BufferPage FileMapping::AppendPage()
+			{
+				BufferPage result;
+				BufferPage page{totalPageCount};
+				if (MapPage(page))
 				{
-					return page;
+					result = page;
 				}
-				count--;
-				page.index = numbers[INDEX_FREEITEM_FREEPAGEITEMBEGIN + count];
-				CHECK_ERROR(msync(numbers, pageSize, MS_SYNC) != -1, L"vl::database::buffer_internal::FileFreePages::PopFreePage()#Internal error: Failed to call msync.");
+				return result;
+			}
+
+			BufferPage FileMapping::AppendPages(vuint64_t count)
+			{
+				BufferPage page{totalPageCount};
+				if (count == 0 || !ExtendFile((totalPageCount + count) * pageSize))
+				{
+					return BufferPage::Invalid();
+				}
+				totalPageCount += count;
+				return page;
+			}
+
+			bool FileMapping::UnmapPage(BufferPage page, bool discardChanges)
+			{
+				if (auto pageDesc = mappedPages.Get(page))
+				{
+					if (pageDesc->TryBeginUnmap())
+					{
+						if (pageDesc->dirty)
+						{
+							if (!discardChanges)
+							{
+								pageDesc->CancelUnmap();
+								return false;
+							}
+							pageDesc->dirty = false;
+						}
+						else if (!discardChanges && compressedTier && !IsMappedIoMode())
+						{
+							compressedTier->Store(source, page, pageDesc->address);
+						}
+						mappedPages.Remove(page);
+						ReleaseFrame(pageDesc.Obj());
+						return true;
+					}
+				}
+				return false;
+			}
+
+			void FileMapping::ForgetPage(BufferPage page)
+			{
+				if (compressedTier)
+				{
+					compressedTier->Remove(source, page);
+				}
+			}
+
+			void FileMapping::UnmapAllPages()
+			{
+				List<Ptr<BufferPageDesc>> pageDescs;
+				mappedPages.FillPages(pageDescs);
+				FOREACH(Ptr<BufferPageDesc>, pageDesc, pageDescs)
+				{
+					if (!IsMappedIoMode() && pageDesc->dirty)
+					{
+						// nothing else holds changes of a frame, they are lost unless written back here
+						WriteFrame(pageDesc.Obj());
+					}
+					mappedPages.Remove(pageDesc->page);
+					ReleaseFrame(pageDesc.Obj());
+				}
+				ReleaseRegions();
+				if (compressedTier)
+				{
+					compressedTier->RemoveSource(source);
+				}
+
+				if (fileSize > totalPageCount * pageSize && ftruncate(fileDescriptor, totalPageCount * pageSize) != -1)
+				{
+					fileSize = totalPageCount * pageSize;
+				}
+				if (checksums)
+				{
+					checksums->Truncate(totalPageCount);
+				}
+			}
+
+			bool FileMapping::WriteBackPage(BufferPage page)
+			{
+				auto pageDesc = mappedPages.Get(page);
+				if (!pageDesc) return false;
+				if (!pageDesc->TryBeginWriteBack()) return false;
+
+				bool successful = true;
+				if (pageDesc->dirty)
+				{
+					pageDesc->dirty = false;
+					bool written = IsMappedIoMode()
+						? msync(pageDesc->address, pageSize, MS_SYNC) != -1
+						: WriteFrame(pageDesc.Obj())
+						;
+					if (!written)
+					{
+						pageDesc->dirty = true;
+						successful = false;
+					}
+				}
+				pageDesc->EndWriteBack();
+				return successful;
+			}
+
+			bool FileMapping::PersistPage(BufferPageDesc* pageDesc)
+			{
+				if (IsMappedIoMode())
+				{
+					return msync(pageDesc->address, pageSize, MS_SYNC) != -1;
+				}
+				else
+				{
+					return WriteFrame(pageDesc) && SyncData();
+				}
+			}
+
+			vint FileMapping::MapPages(const List<BufferPage>& pages)
+			{
+				vint mapped = 0;
+				if (IsMappedIoMode())
+				{
+					FOREACH(BufferPage, page, pages)
+					{
+						if (!mappedPages.Get(page))
+						{
+							if (auto pageDesc = MapPage(page))
+							{
+								// the kernel reads mapped pages in the background
+								madvise(pageDesc->address, pageSize, MADV_WILLNEED);
+								mapped++;
+							}
+						}
+					}
+					return mapped;
+				}
+
+				SortedList<vuint64_t> visited;
+				List<Ptr<BufferPageDesc>> readingPageDescs;
+				BufferIoEngine::RequestList requests;
+				FOREACH(BufferPage, page, pages)
+				{
+					if (!mappedPages.Get(page) && !visited.Contains(page.index))
+					{
+						visited.Add(page.index);
+						if (auto pageDesc = arena->AllocatePageDesc())
+						{
+							pageDesc->page = page;
+							pageDesc->offset = page.index * pageSize;
+							if (compressedTier && compressedTier->Load(source, page, pageDesc->address))
+							{
+								mappedPages.Add(pageDesc);
+								mapped++;
+								continue;
+							}
+							readingPageDescs.Add(pageDesc);
+
+							BufferIoRequest request;
+							request.address = pageDesc->address;
+							request.offset = pageDesc->offset;
+							request.length = pageSize;
+							requests.Add(request);
+						}
+					}
+				}
+
+				ioEngine->Submit(fileDescriptor, requests, false);
+				for (vint i = 0; i < readingPageDescs.Count(); i++)
+				{
+					if (requests[i].successful && (!checksums || checksums->Verify(readingPageDescs[i]->page, readingPageDescs[i]->address)))
+					{
+						mappedPages.Add(readingPageDescs[i]);
+						mapped++;
+					}
+				}
+				return mapped;
+			}
+
+			bool FileMapping::AdvisePages(BufferPage firstPage, vuint64_t count)
+			{
+				if (ioMode == FileIoMode::DirectReadWrite)
+				{
+					return false;
+				}
+				return posix_fadvise(fileDescriptor, firstPage.index * pageSize, count * pageSize, POSIX_FADV_WILLNEED) == 0;
+			}
+
+			bool FileMapping::WriteFrames(List<Ptr<BufferPageDesc>>& pageDescs, bool sync)
+			{
+				// frames are written from snapshots in one page aligned buffer, so that checksums match exactly the written bytes
+				char* images = nullptr;
+				if (pageDescs.Count() > 0 && posix_memalign((void**)&images, pageSize, pageSize * pageDescs.Count()) != 0)
+				{
+					return false;
+				}
+
+				// writing back keeps the page mapped until its frame is written
+				List<Ptr<BufferPageDesc>> writingPageDescs;
+				List<void*> writingImages;
+				BufferIoEngine::RequestList requests;
+				FOREACH(Ptr<BufferPageDesc>, pageDesc, pageDescs)
+				{
+					if (pageDesc->TryBeginWriteBack())
+					{
+						// a page being changed stays dirty, the owner marks it dirty again anyway when it unlocks the page
+						pageDesc->dirty = false;
+						void* image = images + pageSize * writingPageDescs.Count();
+						if (!pageDesc->TrySnapshot(image, pageSize))
+						{
+							pageDesc->dirty = true;
+							pageDesc->EndWriteBack();
+							continue;
+						}
+						writingPageDescs.Add(pageDesc);
+						writingImages.Add(image);
+
+						BufferIoRequest request;
+						request.address = image;
+						request.offset = pageDesc->offset;
+						request.length = pageSize;
+						request.write = true;
+						requests.Add(request);
+					}
+				}
+
+				List<BufferPageDesc*> checksumPageDescs;
+				vuint64_t serial = 0;
+				if (checksums)
+				{
+					FOREACH(Ptr<BufferPageDesc>, pageDesc, writingPageDescs)
+					{
+						checksumPageDescs.Add(pageDesc.Obj());
+					}
+					// a page written twice between synchronizations could be anything between its two writes on the disk
+					bool synced = !checksums->NeedsSync(checksumPageDescs) || SyncData();
+					serial = checksums->BeginSync();
+					if (!synced || !checksums->Update(checksumPageDescs, writingImages))
+					{
+						// no frame is written before its checksum is durable
+						FOREACH(Ptr<BufferPageDesc>, pageDesc, writingPageDescs)
+						{
+							pageDesc->dirty = true;
+							pageDesc->EndWriteBack();
+						}
+						free(images);
+						return false;
+					}
+				}
+
+				bool successful = ioEngine->Submit(fileDescriptor, requests, sync);
+				if (checksums)
+				{
+					checksums->EndWrite(checksumPageDescs, sync && successful);
+					if (sync && successful)
+					{
+						checksums->EndSync(serial);
+					}
+				}
+				for (vint i = 0; i < writingPageDescs.Count(); i++)
+				{
+					// a failed datasync leaves every page of the batch dirty
+					if (!requests[i].successful || (sync && !successful))
+					{
+						writingPageDescs[i]->dirty = true;
+					}
+					writingPageDescs[i]->EndWriteBack();
+				}
+				free(images);
+				return successful;
+			}
+
+			bool FileMapping::WriteBackPages(List<Ptr<BufferPageDesc>>& pageDescs)
+			{
+				if (!IsMappedIoMode())
+				{
+					return WriteFrames(pageDescs, false);
+				}
+
+				FOREACH(Ptr<BufferPageDesc>, pageDesc, pageDescs)
+				{
+					// changes of mapped pages are already in the page cache
+					if (pageDesc->TryBeginWriteBack())
+					{
+						pageDesc->dirty = false;
+						pageDesc->EndWriteBack();
+					}
+				}
+				return true;
+			}
+
+			bool FileMapping::SyncFile(List<Ptr<BufferPageDesc>>& pageDescs)
+			{
+				// one fdatasync makes all written frames and all changed mapped pages durable
+				if (!SyncData())
+				{
+					FOREACH(Ptr<BufferPageDesc>, pageDesc, pageDescs)
+					{
+						pageDesc->dirty = true;
+					}
+					return false;
+				}
+				return true;
+			}
+
+			bool FileMapping::PersistPages(List<Ptr<BufferPageDesc>>& pageDescs)
+			{
+				if (!IsMappedIoMode())
+				{
+					// the datasync is queued behind the writes of the same batch
+					return WriteFrames(pageDescs, true);
+				}
+				bool written = WriteBackPages(pageDescs);
+				return SyncFile(pageDescs) && written;
+			}
+
+			void FileMapping::FillDirtyPages(List<Ptr<BufferPageDesc>>& pageDescs)
+			{
+				mappedPages.FillDirtyPages(pageDescs);
+			}
+
+			void FileMapping::FillPages(List<Ptr<BufferPageDesc>>& pageDescs)
+			{
+				mappedPages.FillPages(pageDescs);
+			}
+
+			vint FileMapping::GetMappedPageCount()
+			{
+				return mappedPages.Count();
+			}
+
+			Ptr<BufferPageDesc> FileMapping::GetMappedPageDesc(BufferPage page)
+			{
+				return mappedPages.Get(page);
+			}
+
+/***********************************************************************
+FileSuperblock
+***********************************************************************/
+
+			void FileSuperblock::Write()
+			{
+				auto pageDesc = fileMapping->MapPage(BufferPage{INDEX_PAGE_FREEITEM});
+				CHECK_ERROR(pageDesc != nullptr, L"vl::database::buffer_internal::FileSuperblock::Write()#Internal error: Failed to map INDEX_PAGE_FREEITEM.");
+
+				vuint64_t* numbers = (vuint64_t*)pageDesc->address;
+				memset(numbers, 0, pageSize);
+				numbers[INDEX_FREEITEM_NEXTINITIALPAGE] = INDEX_INVALID;
+				numbers[INDEX_FREEITEM_FREEPAGEITEMS] = 0;
+				numbers[INDEX_SUPERBLOCK_MAGIC] = SUPERBLOCK_MAGIC;
+				numbers[INDEX_SUPERBLOCK_VERSION] = SUPERBLOCK_VERSION;
+				numbers[INDEX_SUPERBLOCK_CLEAN] = clean ? 1 : 0;
+				numbers[INDEX_SUPERBLOCK_TOTALPAGES] = totalPageCount;
+				numbers[INDEX_SUPERBLOCK_FREEPAGES] = freePageCount;
+				numbers[INDEX_SUPERBLOCK_DIRECTORYPAGES] = directoryPages.Count();
+				for (vint i = 0; i < directoryPages.Count(); i++)
+				{
+					numbers[INDEX_SUPERBLOCK_DIRECTORYPAGEBEGIN + i] = directoryPages[i];
+				}
+				CHECK_ERROR(fileMapping->PersistPage(pageDesc.Obj()), L"vl::database::buffer_internal::FileSuperblock::Write()#Internal error: Failed to persist the page.");
+			}
+
+			FileSuperblock::FileSuperblock(vuint64_t _pageSize)
+				:pageSize(_pageSize)
+			{
+			}
+
+			void FileSuperblock::InitializeEmptySource(FileMapping* _fileMapping)
+			{
+				fileMapping = _fileMapping;
+				clean = false;
+				totalPageCount = 0;
+				freePageCount = 0;
+				directoryPages.Clear();
+				Write();
+			}
+
+			bool FileSuperblock::InitializeExistingSource(FileMapping* _fileMapping)
+			{
+				fileMapping = _fileMapping;
+				clean = false;
+				totalPageCount = 0;
+				freePageCount = 0;
+				directoryPages.Clear();
+
+				auto pageDesc = fileMapping->MapPage(BufferPage{INDEX_PAGE_FREEITEM});
+				CHECK_ERROR(pageDesc != nullptr, L"vl::database::buffer_internal::FileSuperblock::InitializeExistingSource(FileMapping*)#Internal error: Failed to map INDEX_PAGE_FREEITEM.");
+
+				vuint64_t* numbers = (vuint64_t*)pageDesc->address;
+				vuint64_t directoryPageCount = numbers[INDEX_SUPERBLOCK_DIRECTORYPAGES];
+				if (numbers[INDEX_SUPERBLOCK_MAGIC] != SUPERBLOCK_MAGIC
+					|| numbers[INDEX_SUPERBLOCK_VERSION] != SUPERBLOCK_VERSION
+					|| directoryPageCount > pageSize / sizeof(vuint64_t) - INDEX_SUPERBLOCK_DIRECTORYPAGEBEGIN)
+				{
+					return false;
+				}
+
+				clean = numbers[INDEX_SUPERBLOCK_CLEAN] == 1;
+				totalPageCount = numbers[INDEX_SUPERBLOCK_TOTALPAGES];
+				freePageCount = numbers[INDEX_SUPERBLOCK_FREEPAGES];
+				for (vuint64_t i = 0; i < directoryPageCount; i++)
+				{
+					directoryPages.Add(numbers[INDEX_SUPERBLOCK_DIRECTORYPAGEBEGIN + i]);
+				}
+				return true;
+			}
+
+			bool FileSuperblock::IsClean()
+			{
+				return clean;
+			}
+
+			vuint64_t FileSuperblock::GetTotalPageCount()
+			{
+				return totalPageCount;
+			}
+
+			vuint64_t FileSuperblock::GetFreePageCount()
+			{
+				return freePageCount;
+			}
+
+			vuint64_t FileSuperblock::GetDirectoryEntryCount()
+			{
+				return directoryPages.Count() * (pageSize / sizeof(vuint64_t) / DIRECTORY_ENTRY_SIZE);
+			}
+
+			const FileSuperblock::PageList& FileSuperblock::GetDirectoryPages()
+			{
+				return directoryPages;
+			}
+
+			bool FileSuperblock::AddDirectoryPage(BufferPage page)
+			{
+				if ((vuint64_t)directoryPages.Count() >= pageSize / sizeof(vuint64_t) - INDEX_SUPERBLOCK_DIRECTORYPAGEBEGIN)
+				{
+					return false;
+				}
+				directoryPages.Add(page.index);
+				Write();
+				return true;
+			}
+
+			void FileSuperblock::MarkOpened()
+			{
+				clean = false;
+				Write();
+			}
+
+			void FileSuperblock::MarkClosed(vuint64_t _totalPageCount, vuint64_t _freePageCount)
+			{
+				clean = true;
+				totalPageCount = _totalPageCount;
+				freePageCount = _freePageCount;
+				Write();
+			}
+
+/***********************************************************************
+FileUseMasks
+***********************************************************************/
+
+			namespace
+			{
+				vint FindFirstWordNotEqualScalar(const vuint64_t* words, vint begin, vint end, vuint64_t skipWord)
+				{
+					for (vint i = begin; i < end; i++)
+					{
+						if (words[i] != skipWord) return i;
+					}
+					return -1;
+				}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+				__attribute__((target("avx2")))
+				vint FindFirstWordNotEqualAvx2(const vuint64_t* words, vint begin, vint end, vuint64_t skipWord)
+				{
+					const __m256i skip = _mm256_set1_epi64x((long long)skipWord);
+					vint i = begin;
+					for (; i + 4 <= end; i += 4)
+					{
+						__m256i block = _mm256_loadu_si256((const __m256i*)(words + i));
+						// a bit in the mask is cleared for every byte of a word that is not skipWord
+						int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi64(block, skip));
+						if (mask != -1)
+						{
+							return i + __builtin_ctz(~(unsigned)mask) / 8;
+						}
+					}
+					return FindFirstWordNotEqualScalar(words, i, end, skipWord);
+				}
+
+				vint FindFirstWordNotEqual(const vuint64_t* words, vint begin, vint end, vuint64_t skipWord)
+				{
+					static const bool useAvx2 = __builtin_cpu_supports("avx2");
+					return useAvx2
+						? FindFirstWordNotEqualAvx2(words, begin, end, skipWord)
+						: FindFirstWordNotEqualScalar(words, begin, end, skipWord)
+						;
+				}
+#else
+				vint FindFirstWordNotEqual(const vuint64_t* words, vint begin, vint end, vuint64_t skipWord)
+				{
+					return FindFirstWordNotEqualScalar(words, begin, end, skipWord);
+				}
+#endif
+			}
+
+			void FileUseMasks::Reset(FileMapping* _fileMapping, FileSuperblock* _superblock)
+			{
+				fileMapping = _fileMapping;
+				superblock = _superblock;
+
+				useMaskPages.Clear();
+				useMasks.Resize(0);
+				usedPageCounts.Resize(0);
+				loadedUseMaskPages.Resize(0);
+				dirtyUseMaskPages.Clear();
+				dirtyDirectoryPages.Clear();
+			}
+
+			void FileUseMasks::AddUseMaskPage(BufferPage page)
+			{
+				auto pageDesc = fileMapping->MapPage(page);
+				CHECK_ERROR(pageDesc != nullptr, L"vl::database::buffer_internal::FileUseMasks::AddUseMaskPage(BufferPage)#Internal error: Failed to map the new use mask page.");
+				vuint64_t* numbers = (vuint64_t*)pageDesc->address;
+				memset(numbers, 0, pageSize);
+				numbers[INDEX_USEMASK_NEXTUSEMASKPAGE] = INDEX_INVALID;
+				CHECK_ERROR(fileMapping->PersistPage(pageDesc.Obj()), L"vl::database::buffer_internal::FileUseMasks::AddUseMaskPage(BufferPage)#Internal error: Failed to persist the page.");
+
+				if (useMaskPages.Count() > 0)
+				{
+					BufferPage lastPage{useMaskPages[useMaskPages.Count() - 1]};
+					auto lastPageDesc = fileMapping->MapPage(lastPage);
+					CHECK_ERROR(lastPageDesc != nullptr, L"vl::database::buffer_internal::FileUseMasks::AddUseMaskPage(BufferPage)#Internal error: Failed to map the last use mask page.");
+					numbers = (vuint64_t*)lastPageDesc->address;
+					numbers[INDEX_USEMASK_NEXTUSEMASKPAGE] = page.index;
+					CHECK_ERROR(fileMapping->PersistPage(lastPageDesc.Obj()), L"vl::database::buffer_internal::FileUseMasks::AddUseMaskPage(BufferPage)#Internal error: Failed to persist the page.");
+				}
+
+				useMaskPages.Add(page.index);
+				vint count = useMasks.Count();
+				useMasks.Resize(count + useMaskPageItemCount);
+				memset(&useMasks[count], 0, sizeof(vuint64_t) * useMaskPageItemCount);
+				usedPageCounts.Resize(useMaskPages.Count());
+				usedPageCounts[useMaskPages.Count() - 1] = 0;
+				loadedUseMaskPages.Resize(useMaskPages.Count());
+				loadedUseMaskPages[useMaskPages.Count() - 1] = true;
+
+				if (superblock)
+				{
+					AddDirectoryEntry(useMaskPages.Count() - 1);
+				}
+			}
+
+			void FileUseMasks::MarkDirectoryDirty(vint useMaskPageIndex)
+			{
+				if (superblock)
+				{
+					vint directoryPageIndex = (vint)(useMaskPageIndex / (pageSize / sizeof(vuint64_t) / DIRECTORY_ENTRY_SIZE));
+					if (!dirtyDirectoryPages.Contains(directoryPageIndex))
+					{
+						dirtyDirectoryPages.Add(directoryPageIndex);
+					}
+				}
+			}
+
+			void FileUseMasks::AddDirectoryEntry(vint useMaskPageIndex)
+			{
+				// directories are only written by Flush, a source not unloaded cleanly finds use mask pages from the chain instead
+				while ((vuint64_t)useMaskPageIndex >= superblock->GetDirectoryEntryCount())
+				{
+					auto directoryPage = fileMapping->AppendPage();
+					CHECK_ERROR(directoryPage.IsValid(), L"vl::database::buffer_internal::FileUseMasks::AddDirectoryEntry(vint)#Internal error: Failed to create a new directory page.");
+					CHECK_ERROR(superblock->AddDirectoryPage(directoryPage), L"vl::database::buffer_internal::FileUseMasks::AddDirectoryEntry(vint)#Internal error: Too many use mask pages for the superblock.");
+					MarkDirectoryDirty((vint)(superblock->GetDirectoryEntryCount() - 1));
+					SetUseMask(directoryPage, true);
+				}
+				MarkDirectoryDirty(useMaskPageIndex);
+			}
+
+			void FileUseMasks::LoadUseMaskPage(vint useMaskPageIndex)
+			{
+				if (loadedUseMaskPages[useMaskPageIndex]) return;
+
+				BufferPage page{useMaskPages[useMaskPageIndex]};
+				auto pageDesc = fileMapping->MapPage(page);
+				CHECK_ERROR(pageDesc != nullptr, L"vl::database::buffer_internal::FileUseMasks::LoadUseMaskPage(vint)#Internal error: Failed to map the specified use mask page.");
+				vuint64_t* words = &useMasks[useMaskPageIndex * useMaskPageItemCount];
+				memcpy(words, (vuint64_t*)pageDesc->address + INDEX_USEMASK_USEMASKBEGIN, sizeof(vuint64_t) * useMaskPageItemCount);
+				loadedUseMaskPages[useMaskPageIndex] = true;
+				// bits are kept in useMasks and use mask pages are always persisted after being written, so the page does not stay in the cache
+				pageDesc = nullptr;
+				fileMapping->UnmapPage(page, true);
+
+				vuint64_t usedPageCount = 0;
+				for (vuint64_t i = 0; i < useMaskPageItemCount; i++)
+				{
+					usedPageCount += __builtin_popcountll(words[i]);
+				}
+				if (usedPageCounts[useMaskPageIndex] != usedPageCount)
+				{
+					usedPageCounts[useMaskPageIndex] = usedPageCount;
+					MarkDirectoryDirty(useMaskPageIndex);
+				}
+			}
+
+			FileUseMasks::FileUseMasks(vuint64_t _pageSize, int _fileDescriptor)
+				:pageSize(_pageSize)
+				,fileDescriptor(_fileDescriptor)
+				,useMaskPageItemCount((_pageSize - INDEX_USEMASK_USEMASKBEGIN * sizeof(vuint64_t)) / sizeof(vuint64_t))
+			{
+			}
+
+			void FileUseMasks::InitializeEmptySource(FileMapping* _fileMapping)
+			{
+				Reset(_fileMapping, nullptr);
+				AddUseMaskPage(BufferPage{INDEX_PAGE_USEMASK});
+			}
+
+			void FileUseMasks::InitializeExistingSource(FileMapping* _fileMapping)
+			{
+				Reset(_fileMapping, nullptr);
+				BufferPage page{INDEX_PAGE_USEMASK};
+				
+				while(page.index != INDEX_INVALID)
+				{
+					useMaskPages.Add(page.index);
+					usedPageCounts.Resize(useMaskPages.Count());
+					usedPageCounts[useMaskPages.Count() - 1] = 0;
+					loadedUseMaskPages.Resize(useMaskPages.Count());
+					loadedUseMaskPages[useMaskPages.Count() - 1] = false;
+					useMasks.Resize(useMaskPages.Count() * useMaskPageItemCount);
+
+					auto pageDesc = fileMapping->MapPage(page);
+					CHECK_ERROR(pageDesc != nullptr, L"vl::database::buffer_internal::FileUseMasks::InitializeExistingSource()#Internal error: Failed to map the specified use mask page.");
+					page.index = ((vuint64_t*)pageDesc->address)[INDEX_USEMASK_NEXTUSEMASKPAGE];
+					pageDesc = nullptr;
+					LoadUseMaskPage(useMaskPages.Count() - 1);
+				}
+			}
+
+			void FileUseMasks::InitializeExistingSource(FileMapping* _fileMapping, FileSuperblock* _superblock)
+			{
+				Reset(_fileMapping, _superblock);
+				const vuint64_t entriesPerPage = pageSize / sizeof(vuint64_t) / DIRECTORY_ENTRY_SIZE;
+
+				List<BufferPage> pages;
+				FOREACH(vuint64_t, directoryPage, superblock->GetDirectoryPages())
+				{
+					pages.Add(BufferPage{directoryPage});
+				}
+				fileMapping->MapPages(pages);
+
+				FOREACH(vuint64_t, directoryPage, superblock->GetDirectoryPages())
+				{
+					auto pageDesc = fileMapping->MapPage(BufferPage{directoryPage});
+					CHECK_ERROR(pageDesc != nullptr, L"vl::database::buffer_internal::FileUseMasks::InitializeExistingSource(FileMapping*, FileSuperblock*)#Internal error: Failed to map the directory page.");
+					vuint64_t* numbers = (vuint64_t*)pageDesc->address;
+					for (vuint64_t i = 0; i < entriesPerPage && numbers[INDEX_DIRECTORY_USEMASKPAGE] != INDEX_INVALID; i++, numbers += DIRECTORY_ENTRY_SIZE)
+					{
+						useMaskPages.Add(numbers[INDEX_DIRECTORY_USEMASKPAGE]);
+						usedPageCounts.Resize(useMaskPages.Count());
+						usedPageCounts[useMaskPages.Count() - 1] = numbers[INDEX_DIRECTORY_USEDPAGES];
+					}
+				}
+				CHECK_ERROR(useMaskPages.Count() > 0 && useMaskPages[0] == INDEX_PAGE_USEMASK, L"vl::database::buffer_internal::FileUseMasks::InitializeExistingSource(FileMapping*, FileSuperblock*)#Internal error: The file is corrupted.");
+
+				useMasks.Resize(useMaskPages.Count() * useMaskPageItemCount);
+				loadedUseMaskPages.Resize(useMaskPages.Count());
+				for (vint i = 0; i < loadedUseMaskPages.Count(); i++)
+				{
+					loadedUseMaskPages[i] = false;
+				}
+			}
+
+			void FileUseMasks::AttachSuperblock(FileSuperblock* _superblock)
+			{
+				superblock = _superblock;
+				// a directory page listed in a superblock that was not unloaded cleanly may not be marked as used yet
+				FOREACH(vuint64_t, directoryPage, superblock->GetDirectoryPages())
+				{
+					SetUseMask(BufferPage{directoryPage}, true);
+				}
+				// creating a directory page could add a use mask page, so the number of use mask pages is checked in every iteration
+				for (vint i = 0; i < useMaskPages.Count(); i++)
+				{
+					AddDirectoryEntry(i);
+				}
+			}
+
+			bool FileUseMasks::GetUseMask(BufferPage page)
+			{
+				auto item = page.index / (8 * sizeof(vuint64_t));
+				auto shift = page.index % (8 * sizeof(vuint64_t));
+				if (item >= (vuint64_t)useMasks.Count())
+				{
+					return false;
+				}
+				LoadUseMaskPage((vint)(item / useMaskPageItemCount));
+				return ((useMasks[item] >> shift) & ((vuint64_t)1)) == 1;
+			}
+			
+			void FileUseMasks::SetUseMask(BufferPage page, bool available)
+			{
+				auto item = page.index / (8 * sizeof(vuint64_t));
+				auto shift = page.index % (8 * sizeof(vuint64_t));
+				while (item >= (vuint64_t)useMasks.Count())
+				{
+					auto useMaskPage = fileMapping->AppendPage();
+					CHECK_ERROR(useMaskPage.IsValid(), L"vl::database::buffer_internal::FileUseMasks::SetUseMask(BufferPage, bool)#Internal error: Failed to create a new use mask page.");
+					AddUseMaskPage(useMaskPage);
+					SetUseMask(useMaskPage, true);
+				}
+
+				vint useMaskPageIndex = (vint)(item / useMaskPageItemCount);
+				LoadUseMaskPage(useMaskPageIndex);
+
+				auto& word = useMasks[item];
+				vuint64_t bit = ((vuint64_t)1) << shift;
+				if (((word & bit) != 0) == available)
+				{
+					return;
+				}
+
+				if (available)
+				{
+					word |= bit;
+					usedPageCounts[useMaskPageIndex]++;
+				}
+				else
+				{
+					word &= ~bit;
+					usedPageCounts[useMaskPageIndex]--;
+				}
+
+				if (!dirtyUseMaskPages.Contains(useMaskPageIndex))
+				{
+					dirtyUseMaskPages.Add(useMaskPageIndex);
+				}
+				MarkDirectoryDirty(useMaskPageIndex);
+			}
+
+			void FileUseMasks::SetUseMasks(BufferPage firstPage, vuint64_t count, bool available)
+			{
+				for (vuint64_t i = 0; i < count; i++)
+				{
+					SetUseMask(BufferPage{firstPage.index + i}, available);
+				}
+			}
+
+			BufferPage FileUseMasks::FindFirst(vuint64_t startIndex, vuint64_t endIndex, bool used)
+			{
+				const vuint64_t wordBits = 8 * sizeof(vuint64_t);
+				// words are inverted when searching for used pages, so the search is always for the first cleared bit
+				const vuint64_t invert = used ? ~(vuint64_t)0 : 0;
+				vuint64_t index = startIndex;
+				while (index < endIndex)
+				{
+					vuint64_t item = index / wordBits;
+					if (item >= (vuint64_t)useMasks.Count())
+					{
+						// pages not covered by any use mask page have never been allocated
+						return used ? BufferPage::Invalid() : BufferPage{index};
+					}
+
+					// use mask pages are loaded one by one, so a search never crosses the end of a use mask page
+					vint useMaskPageIndex = (vint)(item / useMaskPageItemCount);
+					LoadUseMaskPage(useMaskPageIndex);
+
+					// the first word could be partially before startIndex, the rest are scanned as whole words
+					vuint64_t word = (useMasks[item] ^ invert) | ((((vuint64_t)1) << (index % wordBits)) - 1);
+					if (word != ~(vuint64_t)0)
+					{
+						vuint64_t found = item * wordBits + __builtin_ctzll(~word);
+						return found < endIndex ? BufferPage{found} : BufferPage::Invalid();
+					}
+
+					vint endItem = (vint)((endIndex + wordBits - 1) / wordBits);
+					if (endItem > (vint)((useMaskPageIndex + 1) * useMaskPageItemCount)) endItem = (vint)((useMaskPageIndex + 1) * useMaskPageItemCount);
+					vint nextItem = item + 1 < (vuint64_t)endItem
+						? FindFirstWordNotEqual(&useMasks[0], item + 1, endItem, ~invert)
+						: -1
+						;
+					if (nextItem == -1)
+					{
+						index = endItem * wordBits;
+					}
+					else
+					{
+						index = nextItem * wordBits;
+					}
+				}
+				return BufferPage::Invalid();
+			}
+
+			BufferPage FileUseMasks::FindFirstFree(vuint64_t startIndex, vuint64_t endIndex)
+			{
+				return FindFirst(startIndex, endIndex, false);
+			}
+
+			BufferPage FileUseMasks::FindFirstUsed(vuint64_t startIndex, vuint64_t endIndex)
+			{
+				return FindFirst(startIndex, endIndex, true);
+			}
+
+			vuint64_t FileUseMasks::GetPagesPerUseMaskPage()
+			{
+				return useMaskPageItemCount * 8 * sizeof(vuint64_t);
+			}
+
+			bool FileUseMasks::IsUseMaskPageFull(vint useMaskPageIndex)
+			{
+				return useMaskPageIndex < usedPageCounts.Count() && usedPageCounts[useMaskPageIndex] == GetPagesPerUseMaskPage();
+			}
+
+			vuint64_t FileUseMasks::GetUsedPageCount()
+			{
+				vuint64_t usedPageCount = 0;
+				for (vint i = 0; i < usedPageCounts.Count(); i++)
+				{
+					usedPageCount += usedPageCounts[i];
+				}
+				return usedPageCount;
+			}
+
+			vint FileUseMasks::GetLoadedUseMaskPageCount()
+			{
+				vint count = 0;
+				for (vint i = 0; i < loadedUseMaskPages.Count(); i++)
+				{
+					if (loadedUseMaskPages[i]) count++;
+				}
+				return count;
+			}
+
+			bool FileUseMasks::IsDirty()
+			{
+				return dirtyUseMaskPages.Count() > 0 || dirtyDirectoryPages.Count() > 0;
+			}
+
+			bool FileUseMasks::FillDirtyPages(List<Ptr<BufferPageDesc>>& pageDescs)
+			{
+				// pages are mapped before anything is changed, so a failure leaves every change in memory
+				List<Ptr<BufferPageDesc>> directoryPageDescs, useMaskPageDescs;
+				FOREACH(vint, directoryPageIndex, dirtyDirectoryPages)
+				{
+					auto pageDesc = fileMapping->MapPage(BufferPage{superblock->GetDirectoryPages()[directoryPageIndex]});
+					if (!pageDesc) return false;
+					directoryPageDescs.Add(pageDesc);
+				}
+				FOREACH(vint, useMaskPageIndex, dirtyUseMaskPages)
+				{
+					auto pageDesc = fileMapping->MapPage(BufferPage{useMaskPages[useMaskPageIndex]});
+					if (!pageDesc) return false;
+					useMaskPageDescs.Add(pageDesc);
+				}
+
+				const vuint64_t entriesPerPage = pageSize / sizeof(vuint64_t) / DIRECTORY_ENTRY_SIZE;
+				for (vint i = 0; i < dirtyDirectoryPages.Count(); i++)
+				{
+					vint directoryPageIndex = dirtyDirectoryPages[i];
+					vuint64_t* numbers = (vuint64_t*)directoryPageDescs[i]->address;
+					for (vuint64_t j = 0; j < entriesPerPage; j++, numbers += DIRECTORY_ENTRY_SIZE)
+					{
+						vuint64_t useMaskPageIndex = directoryPageIndex * entriesPerPage + j;
+						bool used = useMaskPageIndex < (vuint64_t)useMaskPages.Count();
+						numbers[INDEX_DIRECTORY_USEMASKPAGE] = used ? useMaskPages[useMaskPageIndex] : INDEX_INVALID;
+						numbers[INDEX_DIRECTORY_USEDPAGES] = used ? usedPageCounts[useMaskPageIndex] : 0;
+					}
+				}
+				for (vint i = 0; i < dirtyUseMaskPages.Count(); i++)
+				{
+					vint useMaskPageIndex = dirtyUseMaskPages[i];
+					vuint64_t* numbers = (vuint64_t*)useMaskPageDescs[i]->address;
+					memcpy(numbers + INDEX_USEMASK_USEMASKBEGIN, &useMasks[useMaskPageIndex * useMaskPageItemCount], sizeof(vuint64_t) * useMaskPageItemCount);
+				}
+				dirtyDirectoryPages.Clear();
+				dirtyUseMaskPages.Clear();
+
+				// a dirty page is not unmapped before it is written back
+				CopyFrom(directoryPageDescs, useMaskPageDescs, true);
+				FOREACH(Ptr<BufferPageDesc>, pageDesc, directoryPageDescs)
+				{
+					pageDesc->MarkDirty();
+					pageDescs.Add(pageDesc);
+				}
+				return true;
+			}
+
+			void FileUseMasks::RestoreDirtyPages(const List<Ptr<BufferPageDesc>>& pageDescs)
+			{
+				FOREACH(Ptr<BufferPageDesc>, pageDesc, pageDescs)
+				{
+					vint index = useMaskPages.IndexOf(pageDesc->page.index);
+					if (index != -1)
+					{
+						if (!dirtyUseMaskPages.Contains(index))
+						{
+							dirtyUseMaskPages.Add(index);
+						}
+					}
+					else if (superblock && (index = superblock->GetDirectoryPages().IndexOf(pageDesc->page.index)) != -1)
+					{
+						if (!dirtyDirectoryPages.Contains(index))
+						{
+							dirtyDirectoryPages.Add(index);
+						}
+					}
+				}
+			}
+
+			void FileUseMasks::Flush()
+			{
+				List<Ptr<BufferPageDesc>> pageDescs;
+				CHECK_ERROR(FillDirtyPages(pageDescs), L"vl::database::buffer_internal::FileUseMasks::Flush()#Internal error: Failed to map the use mask page.");
+				CHECK_ERROR(fileMapping->PersistPages(pageDescs), L"vl::database::buffer_internal::FileUseMasks::Flush()#Internal error: Failed to persist the page.");
+			}
+		}
+
+/***********************************************************************
+FileFreeExtents
+***********************************************************************/
+
+			vint FileFreeExtents::GetBucket(vuint64_t length)
+			{
+				return 63 - __builtin_clzll(length);
+			}
+
+			void FileFreeExtents::AddExtent(vuint64_t start, vuint64_t length)
+			{
+				extentLengths.Add(start, length);
+				extentStarts.Add(start + length, start);
+				buckets[GetBucket(length)].Add(start);
+				freePageCount += length;
+			}
+
+			void FileFreeExtents::RemoveExtent(vuint64_t start, vuint64_t length)
+			{
+				extentLengths.Remove(start);
+				extentStarts.Remove(start + length);
+				buckets[GetBucket(length)].Remove(start);
+				freePageCount -= length;
+			}
+
+			void FileFreeExtents::MergeExtent(vuint64_t start, vuint64_t length)
+			{
+				vuint64_t end = start + length;
+				vint index = extentStarts.Keys().IndexOf(start);
+				if (index != -1)
+				{
+					vuint64_t previousStart = extentStarts.Values()[index];
+					RemoveExtent(previousStart, start - previousStart);
+					start = previousStart;
+				}
+
+				index = extentLengths.Keys().IndexOf(end);
+				if (index != -1)
+				{
+					vuint64_t nextLength = extentLengths.Values()[index];
+					RemoveExtent(end, nextLength);
+					end += nextLength;
+				}
+
+				AddExtent(start, end - start);
+			}
+
+			void FileFreeExtents::ReleaseFreePageChain()
+			{
+				// INDEX_PAGE_FREEITEM used to begin a chain of pages storing a stack of free pages
+				// pages in the stack are already free in use masks, only pages of the chain itself need to be released
+				auto pageDesc = fileMapping->MapPage(BufferPage{INDEX_PAGE_FREEITEM});
+				CHECK_ERROR(pageDesc != nullptr, L"vl::database::buffer_internal::FileFreeExtents::ReleaseFreePageChain()#Internal error: Failed to map INDEX_PAGE_FREEITEM.");
+				vuint64_t* numbers = (vuint64_t*)pageDesc->address;
+				vuint64_t nextPage = numbers[INDEX_FREEITEM_NEXTINITIALPAGE];
+				if (nextPage == INDEX_INVALID && numbers[INDEX_FREEITEM_FREEPAGEITEMS] == 0)
+				{
+					return;
+				}
+
+				numbers[INDEX_FREEITEM_NEXTINITIALPAGE] = INDEX_INVALID;
+				numbers[INDEX_FREEITEM_FREEPAGEITEMS] = 0;
+				CHECK_ERROR(fileMapping->PersistPage(pageDesc.Obj()), L"vl::database::buffer_internal::FileFreeExtents::ReleaseFreePageChain()#Internal error: Failed to persist the page.");
+
+				while (nextPage != INDEX_INVALID)
+				{
+					BufferPage page{nextPage};
+					pageDesc = fileMapping->MapPage(page);
+					CHECK_ERROR(pageDesc != nullptr, L"vl::database::buffer_internal::FileFreeExtents::ReleaseFreePageChain()#Internal error: Failed to map an initial page.");
+					nextPage = ((vuint64_t*)pageDesc->address)[INDEX_FREEITEM_NEXTINITIALPAGE];
+					fileUseMasks->SetUseMask(page, false);
+				}
+				fileUseMasks->Flush();
+			}
+
+			FileFreeExtents::FileFreeExtents(vuint64_t _pageSize)
+				:pageSize(_pageSize)
+			{
+			}
+
+			void FileFreeExtents::InitializeEmptySource(FileMapping* _fileMapping, FileUseMasks* _fileUseMasks)
+			{
+				fileMapping = _fileMapping;
+				fileUseMasks = _fileUseMasks;
+				scannedPageCount = INDEX_INVALID;
+
+				// INDEX_PAGE_FREEITEM is kept as an empty free page stack, so that the file format does not change
+				BufferPage page{INDEX_PAGE_FREEITEM};
+				auto pageDesc = fileMapping->MapPage(page);
+				CHECK_ERROR(pageDesc != nullptr, L"vl::database::buffer_internal::FileFreeExtents::InitializeEmptySource()#Internal error: Failed to map INDEX_PAGE_FREEITEM.");
+
+				vuint64_t* numbers = (vuint64_t*)pageDesc->address;
+				memset(numbers, 0, pageSize);
+				numbers[INDEX_FREEITEM_NEXTINITIALPAGE] = INDEX_INVALID;
+				numbers[INDEX_FREEITEM_FREEPAGEITEMS] = 0;
+				CHECK_ERROR(fileMapping->PersistPage(pageDesc.Obj()), L"vl::database::buffer_internal::FileFreeExtents::InitializeEmptySource()#Internal error: Failed to persist the page.");
+			}
+
+			bool FileFreeExtents::ScanNextUseMaskPage()
+			{
+				vuint64_t totalPageCount = fileMapping->GetTotalPageCount();
+				if (scannedPageCount == INDEX_INVALID)
+				{
+					return false;
+				}
+				if (scannedPageCount >= totalPageCount)
+				{
+					scannedPageCount = INDEX_INVALID;
+					return false;
+				}
+
+				vuint64_t pagesPerUseMaskPage = fileUseMasks->GetPagesPerUseMaskPage();
+				vuint64_t index = scannedPageCount;
+				vuint64_t endIndex = (index / pagesPerUseMaskPage + 1) * pagesPerUseMaskPage;
+				if (endIndex > totalPageCount) endIndex = totalPageCount;
+				scannedPageCount = endIndex;
+
+				// a full use mask page is skipped without being read
+				if (fileUseMasks->IsUseMaskPageFull((vint)(index / pagesPerUseMaskPage)))
+				{
+					return true;
+				}
+				while (index < endIndex)
+				{
+					auto firstFree = fileUseMasks->FindFirstFree(index, endIndex);
+					if (!firstFree.IsValid()) break;
+					auto firstUsed = fileUseMasks->FindFirstUsed(firstFree.index, endIndex);
+					index = firstUsed.IsValid() ? firstUsed.index : endIndex;
+					MergeExtent(firstFree.index, index - firstFree.index);
+				}
+				return true;
+			}
+
+			void FileFreeExtents::InitializeExistingSource(FileMapping* _fileMapping, FileUseMasks* _fileUseMasks, bool scanLazily)
+			{
+				fileMapping = _fileMapping;
+				fileUseMasks = _fileUseMasks;
+				scannedPageCount = 0;
+				if (!scanLazily)
+				{
+					ReleaseFreePageChain();
+					while (ScanNextUseMaskPage());
+				}
+			}
+
+			vuint64_t FileFreeExtents::GetFreePageCount()
+			{
+				return freePageCount;
+			}
+
+			vint FileFreeExtents::GetExtentCount()
+			{
+				return extentLengths.Count();
+			}
+
+			BufferPage FileFreeExtents::AllocatePages(vuint64_t count)
+			{
+				if (count == 0)
+				{
+					return BufferPage::Invalid();
+				}
+
+				// use mask pages are scanned until an extent is long enough, so a lower extent could still be found in a later use mask page
+				while (scannedPageCount != INDEX_INVALID)
+				{
+					bool found = false;
+					FOREACH(vuint64_t, start, buckets[GetBucket(count)])
+					{
+						if (extentLengths[start] >= count)
+						{
+							found = true;
+							break;
+						}
+					}
+					for (vint i = GetBucket(count) + 1; i < BucketCount && !found; i++)
+					{
+						found = buckets[i].Count() > 0;
+					}
+					if (found || !ScanNextUseMaskPage()) break;
+				}
+
+				// only the first bucket could contain extents that are too short, every extent in a later bucket is long enough
+				vuint64_t bestStart = INDEX_INVALID;
+				vuint64_t bestLength = 0;
+				for (vint i = GetBucket(count); i < BucketCount; i++)
+				{
+					auto& bucket = buckets[i];
+					for (vint j = 0; j < bucket.Count() && bucket[j] < bestStart; j++)
+					{
+						vuint64_t length = extentLengths[bucket[j]];
+						if (length >= count)
+						{
+							bestStart = bucket[j];
+							bestLength = length;
+							break;
+						}
+					}
+				}
+
+				if (bestStart == INDEX_INVALID)
+				{
+					return BufferPage::Invalid();
+				}
+				RemoveExtent(bestStart, bestLength);
+				if (bestLength > count)
+				{
+					AddExtent(bestStart + count, bestLength - count);
+				}
+				return BufferPage{bestStart};
+			}
+
+			void FileFreeExtents::FreePages(BufferPage firstPage, vuint64_t count)
+			{
+				if (count == 0)
+				{
+					return;
+				}
+
+				// pages that are not scanned yet are found from use masks when they are scanned
+				if (firstPage.index >= scannedPageCount)
+				{
+					return;
+				}
+				if (count > scannedPageCount - firstPage.index)
+				{
+					count = scannedPageCount - firstPage.index;
+				}
+				MergeExtent(firstPage.index, count);
+			}
+
+/***********************************************************************
+FileReadahead
+***********************************************************************/
+
+			FileReadahead::FileReadahead(vuint64_t _minWindow, vuint64_t _maxWindow)
+				:minWindow(_minWindow)
+				,maxWindow(_maxWindow)
+			{
+			}
+
+			vuint64_t FileReadahead::OnPageMissed(BufferPage page)
+			{
+				if (page.index == expectedPage)
+				{
+					window = window == 0 ? minWindow : window * 2;
+					if (window > maxWindow)
+					{
+						window = maxWindow;
+					}
+				}
+				else
+				{
+					window = 0;
+				}
+				expectedPage = page.index + 1 + window;
+				return window;
+			}
+
+			vuint64_t FileReadahead::GetWindow()
+			{
+				return window;
+			}
+
+/***********************************************************************
+FileBufferSource
+***********************************************************************/
+
+		FileBufferSource::FileBufferSource(BufferSource _source, volatile vuint64_t* _totalUsedPages, IBufferPageObserver* _observer, vuint64_t _pageSize, const WString& _fileName, int _fileDescriptor, FileIoMode _ioMode, Ptr<buffer_internal::BufferFrameArena> _arena, Ptr<buffer_internal::FileChecksums> _checksums, Ptr<buffer_internal::BufferCompressedTier> _compressedTier)
+			:source(_source)
+			,pageSize(_pageSize)
+			,fileName(_fileName)
+			,fileDescriptor(_fileDescriptor)
+			,fileMapping(_pageSize, _fileDescriptor, _totalUsedPages, _observer, _source, _ioMode, _arena, _checksums, _compressedTier)
+			,fileSuperblock(_pageSize)
+			,fileUseMasks(_pageSize, _fileDescriptor)
+			,fileFreeExtents(_pageSize)
+			,groupFlusher([this](List<Ptr<BufferPageDesc>>& pageDescs){ return FlushBatch(pageDescs); })
+			,readahead(READAHEAD_MIN_WINDOW, READAHEAD_MAX_WINDOW)
+		{
+			indexPage.index = INDEX_PAGE_INDEX;
+		}
+
+		bool FileBufferSource::FlushBatch(List<Ptr<BufferPageDesc>>& pageDescs)
+		{
+			// a persisted page is only reachable after a crash when it is marked as used in the file, so changed use masks join the batch
+			// only copying them to their pages needs the lock, they are written and synchronized with the batch
+			List<Ptr<BufferPageDesc>> useMaskPageDescs;
+			if (fileUseMasks.IsDirty())
+			{
+				SPIN_LOCK(lock)
+				{
+					if (!fileUseMasks.FillDirtyPages(useMaskPageDescs)) return false;
+				}
+			}
+			if (useMaskPageDescs.Count() == 0)
+			{
+				return fileMapping.PersistPages(pageDescs);
+			}
+
+			List<Ptr<BufferPageDesc>> batch;
+			CopyFrom(batch, pageDescs);
+			CopyFrom(batch, useMaskPageDescs, true);
+			if (fileMapping.PersistPages(batch))
+			{
+				return true;
+			}
+			SPIN_LOCK(lock)
+			{
+				fileUseMasks.RestoreDirtyPages(useMaskPageDescs);
+			}
+			return false;
+		}
+
+		void FileBufferSource::ReadAhead(BufferPage page)
+		{
+			vuint64_t window = readahead.OnPageMissed(page);
+			vuint64_t firstPage = page.index + 1;
+			vuint64_t totalPageCount = fileMapping.GetTotalPageCount();
+			if (window == 0 || firstPage >= totalPageCount)
+			{
+				return;
+			}
+			if (window > totalPageCount - firstPage)
+			{
+				window = totalPageCount - firstPage;
+			}
 
-				if (count == 0)
+			// the kernel reads ahead without blocking, frames bypassing the page cache are left to the caller to read in one batch outside of the lock
+			// a window that is not taken yet is replaced, read ahead is only a hint
+			if (!fileMapping.AdvisePages(BufferPage{firstPage}, window))
+			{
+				readaheadPages.Clear();
+				for (vuint64_t i = 0; i < window; i++)
 				{
-					activeFreeItemPageIndex--;
-					if (activeFreeItemPageIndex == -1)
+					BufferPage nextPage{firstPage + i};
+					if (fileUseMasks.GetUseMask(nextPage) && !fileMapping.GetMappedPageDesc(nextPage))
 					{
-						activeFreeItemPageIndex = 0;
+						readaheadPages.Add(nextPage);
 					}
 				}
-				return page;
+				hasReadaheadPages = readaheadPages.Count() > 0;
 			}
-
-/***********************************************************************
-FileBufferSource
-***********************************************************************/
-
-		FileBufferSource::FileBufferSource(BufferSource _source, volatile vuint64_t* _totalUsedPages, vuint64_t _pageSize, const WString& _fileName, int _fileDescriptor)
-			:source(_source)
-			,pageSize(_pageSize)
-			,fileName(_fileName)
-			,fileDescriptor(_fileDescriptor)
-			,fileMapping(_pageSize, _fileDescriptor, _totalUsedPages)
-			,fileUseMasks(_pageSize, _fileDescriptor)
-			,fileFreePages(_pageSize)
-		{
-			indexPage.index = INDEX_PAGE_INDEX;
+			readaheadPageCount += window;
 		}
 
 		void FileBufferSource::InitializeEmptySource()
 		{
 			fileMapping.InitializeEmptySource();
 			fileUseMasks.InitializeEmptySource(&fileMapping);
-			fileFreePages.InitializeEmptySource(&fileMapping, &fileUseMasks);
+			fileFreeExtents.InitializeEmptySource(&fileMapping, &fileUseMasks);
 
 			auto pageDesc = fileMapping.MapPage(BufferPage{INDEX_PAGE_INDEX});
 			CHECK_ERROR(pageDesc != nullptr, L"vl::database::FileBufferSource::InitializeEmptySource()#Internal error: Failed to map INDEX_PAGE_INDEX.");
@@ -446,17 +1869,52 @@ FileBufferSource
 			fileUseMasks.SetUseMask(BufferPage{INDEX_PAGE_FREEITEM}, true);
 			fileUseMasks.SetUseMask(BufferPage{INDEX_PAGE_USEMASK}, true);
 			fileUseMasks.SetUseMask(BufferPage{INDEX_PAGE_INDEX}, true);
+
+			fileSuperblock.InitializeEmptySource(&fileMapping);
+			fileUseMasks.AttachSuperblock(&fileSuperblock);
+			fileUseMasks.Flush();
 		}
 
 		void FileBufferSource::InitializeExistingSource()
 		{
 			fileMapping.InitializeExistingSource();
-			fileUseMasks.InitializeExistingSource(&fileMapping);
-			fileFreePages.InitializeExistingSource(&fileMapping, &fileUseMasks);
+			bool hasSuperblock = fileSuperblock.InitializeExistingSource(&fileMapping);
+			if (hasSuperblock && fileSuperblock.IsClean() && fileSuperblock.GetTotalPageCount() == fileMapping.GetTotalPageCount())
+			{
+				// only the superblock and directories are read, use masks are read when they are needed
+				fileUseMasks.InitializeExistingSource(&fileMapping, &fileSuperblock);
+				fileFreeExtents.InitializeExistingSource(&fileMapping, &fileUseMasks, true);
+			}
+			else if (hasSuperblock)
+			{
+				// directories are not trusted after a crash, they are rebuilt from the chain of use mask pages
+				fileUseMasks.InitializeExistingSource(&fileMapping);
+				fileUseMasks.AttachSuperblock(&fileSuperblock);
+				fileUseMasks.Flush();
+				fileFreeExtents.InitializeExistingSource(&fileMapping, &fileUseMasks);
+			}
+			else
+			{
+				// a file without a superblock is upgraded after the free page chain is released from INDEX_PAGE_FREEITEM
+				fileUseMasks.InitializeExistingSource(&fileMapping);
+				fileFreeExtents.InitializeExistingSource(&fileMapping, &fileUseMasks);
+				fileSuperblock.InitializeEmptySource(&fileMapping);
+				fileUseMasks.AttachSuperblock(&fileSuperblock);
+				fileUseMasks.Flush();
+			}
+			fileSuperblock.MarkOpened();
 		}
 
 		void FileBufferSource::Unload()
 		{
+			// the caller holds the lock, so the group flusher is not used here
+			fileUseMasks.Flush();
+			List<Ptr<BufferPageDesc>> pageDescs;
+			fileMapping.FillDirtyPages(pageDescs);
+			fileMapping.PersistPages(pageDescs);
+			// the file is truncated to the total page count when all pages are unmapped
+			vuint64_t totalPageCount = fileMapping.GetTotalPageCount();
+			fileSuperblock.MarkClosed(totalPageCount, totalPageCount - fileUseMasks.GetUsedPageCount());
 			fileMapping.UnmapAllPages();
 			CloseFileForFileSource(fileDescriptor);
 		}
@@ -488,7 +1946,7 @@ FileBufferSource
 
 		BufferPage FileBufferSource::AllocatePage()
 		{
-			BufferPage page = fileFreePages.PopFreePage();
+			BufferPage page = fileFreeExtents.AllocatePages(1);
 			if (!page.IsValid())
 			{
 				page = fileMapping.AppendPage();
@@ -500,6 +1958,20 @@ FileBufferSource
 			return page;
 		}
 
+		BufferPage FileBufferSource::AllocatePages(vuint64_t count)
+		{
+			BufferPage page = fileFreeExtents.AllocatePages(count);
+			if (!page.IsValid())
+			{
+				page = fileMapping.AppendPages(count);
+			}
+			if (page.IsValid())
+			{
+				fileUseMasks.SetUseMasks(page, count, true);
+			}
+			return page;
+		}
+
 		bool FileBufferSource::FreePage(BufferPage page)
 		{
 			switch(page.index)
@@ -509,37 +1981,48 @@ FileBufferSource
 				case INDEX_PAGE_INDEX:
 					return false;
 			}
+			if (fileSuperblock.GetDirectoryPages().Contains(page.index)) return false;
 
 			if (!fileUseMasks.GetUseMask(page)) return false;
-			if (fileMapping.GetMappedPageDesc(page))
+			if (auto pageDesc = fileMapping.GetMappedPageDesc(page))
 			{
-				if (!UnmapPage(page))
+				// write backs do not take the source lock, a page that the cleaner is writing back is discarded after it
+				while (!fileMapping.UnmapPage(page, true))
 				{
-					return false;
+					if (pageDesc->IsLocked()) return false;
+					if (fileMapping.GetMappedPageDesc(page) != pageDesc) break;
+					if (pageDesc->writeBackCount > 0)
+					{
+						// the write back may wait for the source lock, so it is released until the write back ends
+						lock.Leave();
+						while (pageDesc->writeBackCount > 0)
+						{
+							Thread::Sleep(1);
+						}
+						lock.Enter();
+						if (!fileUseMasks.GetUseMask(page)) return false;
+					}
 				}
 			}
-			fileFreePages.PushFreePage(page);
+			fileMapping.ForgetPage(page);
+			fileFreeExtents.FreePages(page, 1);
 			fileUseMasks.SetUseMask(page, false);
 			return true;
 		}
 
-		void* FileBufferSource::LockPage(BufferPage page)
+		void* FileBufferSource::LockPage(BufferPage page, PageLockAccess access)
 		{
-			if (page.index >= fileMapping.GetTotalPageCount())
-			{
-				return nullptr;
-			}
-			if (!fileUseMasks.GetUseMask(page)) return nullptr;
-			if (auto pageDesc = fileMapping.MapPage(page))
-			{
-				if (pageDesc->locked) return nullptr;
-				pageDesc->locked = true;
-				return pageDesc->address;
-			}
-			else
-			{
-				return nullptr;
-			}
+			bool missed = false;
+			auto pageDesc = LockPageDesc(page, access, missed);
+			return pageDesc ? pageDesc->address : nullptr;
+		}
+
+		bool FileBufferSource::UpgradePage(BufferPage page, void* buffer)
+		{
+			auto pageDesc = fileMapping.GetMappedPageDesc(page);
+			if (!pageDesc) return false;
+			if (pageDesc->address != buffer) return false;
+			return pageDesc->TryUpgrade();
 		}
 
 		bool FileBufferSource::UnlockPage(BufferPage page, void* buffer, PersistanceType persistanceType)
@@ -547,68 +2030,229 @@ FileBufferSource
 			auto pageDesc = fileMapping.GetMappedPageDesc(page);
 			if (!pageDesc) return false;
 			if (pageDesc->address != buffer) return false;
-			if (!pageDesc->locked) return false;
+			return UnlockPageDesc(pageDesc.Obj(), persistanceType);
+		}
+
+		Ptr<BufferPageDesc> FileBufferSource::LockPageDesc(BufferPage page, PageLockAccess access, bool& missed)
+		{
+			missed = false;
+			if (auto pageDesc = fileMapping.GetMappedPageDesc(page))
+			{
+				if (pageDesc->TryLock(access))
+				{
+					fileMapping.TouchPage(pageDesc.Obj());
+					return pageDesc;
+				}
+				if (pageDesc->IsLocked()) return nullptr;
+			}
+
+			SPIN_LOCK(lock)
+			{
+				if (page.index >= fileMapping.GetTotalPageCount())
+				{
+					return nullptr;
+				}
+				if (!fileUseMasks.GetUseMask(page)) return nullptr;
+				bool mapping = !fileMapping.GetMappedPageDesc(page);
+				if (auto pageDesc = fileMapping.MapPage(page))
+				{
+					if (mapping)
+					{
+						ReadAhead(page);
+					}
+					if (!pageDesc->TryLock(access)) return nullptr;
+					missed = mapping;
+					return pageDesc;
+				}
+			}
+			return nullptr;
+		}
+
+		bool FileBufferSource::UnlockPageDesc(BufferPageDesc* pageDesc, PersistanceType persistanceType)
+		{
+			if (!pageDesc->IsLocked()) return false;
+			if (persistanceType != PersistanceType::NoChanging && !pageDesc->IsExclusivelyLocked()) return false;
 
 			switch (persistanceType)
 			{
 				case PersistanceType::NoChanging:
+					// a frame is not shared with the kernel, so any exclusive lock could have changed it
+					if (!fileMapping.IsMappedIoMode() && pageDesc->IsExclusivelyLocked())
+					{
+						pageDesc->MarkDirty();
+					}
 					break;
 				case PersistanceType::Changed:
-					pageDesc->dirty = true;
+					pageDesc->MarkDirty();
 					break;
 				case PersistanceType::ChangedAndPersist:
-					msync(pageDesc->address, pageSize, MS_SYNC);
-					pageDesc->dirty = false;
+					{
+						// the page stays locked until it is durable, a failed flush leaves the page dirty
+						// other threads writing the page back can copy it while it is persisted, because it does not change
+						pageDesc->MarkDirty();
+						List<Ptr<BufferPageDesc>> pageDescs;
+						pageDescs.Add(pageDesc);
+						pageDesc->persisting = true;
+						groupFlusher.Flush(pageDescs);
+						pageDesc->persisting = false;
+					}
 					break;
 			}
-			pageDesc->locked = false;
-			return true;
-		}	
+			return pageDesc->Unlock();
+		}
+
+		bool FileBufferSource::WriteBackPage(BufferPage page)
+		{
+			return fileMapping.WriteBackPage(page);
+		}
+
+		bool FileBufferSource::WriteBackPages(collections::List<Ptr<BufferPageDesc>>& pageDescs)
+		{
+			// checksums and the synchronization they need are shared by the whole batch
+			return fileMapping.WriteBackPages(pageDescs);
+		}
 
-		void FileBufferSource::FillUnmapPageCandidates(collections::List<BufferPageTimeTuple>& pages, vint expectCount)
+		bool FileBufferSource::PersistPages(const collections::List<BufferPage>& pages)
 		{
-			vint mappedCount = fileMapping.GetMappedPageCount();
-			if (mappedCount == 0) return;
+			List<Ptr<BufferPageDesc>> pageDescs;
+			FOREACH(BufferPage, page, pages)
+			{
+				// pages that are not mapped have been written back when they were unmapped
+				if (auto pageDesc = fileMapping.GetMappedPageDesc(page))
+				{
+					pageDescs.Add(pageDesc);
+				}
+			}
+			return groupFlusher.Flush(pageDescs);
+		}
+
+		void FileBufferSource::FillDirtyPages(collections::List<Ptr<BufferPageDesc>>& pageDescs)
+		{
+			fileMapping.FillDirtyPages(pageDescs);
+		}
 
-			Array<BufferPageTimeTuple> tuples(mappedCount);
-			vint usedCount = 0;
-			for (vint i = 0; i < mappedCount; i++)
+		bool FileBufferSource::Checkpoint()
+		{
+			List<Ptr<BufferPageDesc>> pageDescs;
+			fileMapping.FillDirtyPages(pageDescs);
+			for (vint i = pageDescs.Count() - 1; i >= 0; i--)
 			{
-				auto key = fileMapping.GetMappedPage(i);
-				auto value = fileMapping.GetMappedPageDesc(i);
-				if (!value->locked)
+				// a page being changed is written by the next checkpoint
+				if (pageDescs[i]->IsExclusivelyLocked())
 				{
-					BufferPage page{key};
-					tuples[usedCount++] = BufferPageTimeTuple(source, page, value->lastAccessTime);
+					pageDescs.RemoveAt(i);
 				}
 			}
 
-			if (tuples.Count() > 0)
+			// pages are written and synchronized in a batch shared with concurrent persisted unlocks
+			// they are marked dirty again when the synchronization fails
+			return groupFlusher.Flush(pageDescs);
+		}
+
+		vint FileBufferSource::PrefetchPages(const collections::List<BufferPage>& pages)
+		{
+			SPIN_LOCK(lock)
 			{
-				SortLambda(&tuples[0], usedCount, [](const BufferPageTimeTuple& t1, const BufferPageTimeTuple& t2)
+				List<BufferPage> mappingPages;
+				vuint64_t totalPageCount = fileMapping.GetTotalPageCount();
+				FOREACH(BufferPage, page, pages)
 				{
-					if (t1.f2 < t2.f2) return -1;
-					else if (t1.f2 > t2.f2) return 1;
-					else return 0;
-				});
+					if (page.index < totalPageCount && fileUseMasks.GetUseMask(page))
+					{
+						mappingPages.Add(page);
+					}
+				}
 
-				vint copyCount = usedCount < expectCount ? usedCount : expectCount;
-				for (vint i = 0; i < copyCount; i++)
+				// runs of contiguous pages are read by the kernel in large sequential reads before frames copy them
+				vint begin = 0;
+				while (begin < mappingPages.Count())
 				{
-					pages.Add(tuples[i]);
+					vint end = begin + 1;
+					while (end < mappingPages.Count() && mappingPages[end].index == mappingPages[end - 1].index + 1)
+					{
+						end++;
+					}
+					if (end - begin > 1)
+					{
+						fileMapping.AdvisePages(mappingPages[begin], end - begin);
+					}
+					begin = end;
 				}
+				return fileMapping.MapPages(mappingPages);
+			}
+			return 0;
+		}
+
+		vint FileBufferSource::GetCachedPageCount()
+		{
+			return fileMapping.GetMappedPageCount();
+		}
+
+		void FileBufferSource::FillCachedPages(collections::List<Ptr<BufferPageDesc>>& pageDescs)
+		{
+			fileMapping.FillPages(pageDescs);
+		}
+
+		void FileBufferSource::FillReadaheadPages(collections::List<BufferPage>& pages)
+		{
+			if (!hasReadaheadPages) return;
+			SPIN_LOCK(lock)
+			{
+				CopyFrom(pages, readaheadPages, true);
+				readaheadPages.Clear();
+				hasReadaheadPages = false;
 			}
 		}
 
-		int CreateNewFileForFileSource(const WString& fileName)
+		vuint64_t FileBufferSource::GetReadaheadPageCount()
+		{
+			return readaheadPageCount;
+		}
+
+		vuint64_t FileBufferSource::GetFlushBatchCount()
+		{
+			return groupFlusher.GetBatchCount();
+		}
+
+		vuint64_t FileBufferSource::GetChecksumFailureCount()
+		{
+			auto checksums = fileMapping.GetChecksums();
+			return checksums ? checksums->GetFailureCount() : 0;
+		}
+
+		buffer_internal::FileSuperblock& FileBufferSource::GetSuperblock()
+		{
+			return fileSuperblock;
+		}
+
+		buffer_internal::FileUseMasks& FileBufferSource::GetUseMasks()
+		{
+			return fileUseMasks;
+		}
+
+		int OpenFileForFileSource(const WString& fileName, int flags, FileIoMode ioMode)
 		{
 			auto mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
-			return open(wtoa(fileName).Buffer(), O_CREAT | O_TRUNC | O_RDWR, mode);
+			if (ioMode == FileIoMode::DirectReadWrite)
+			{
+				int fileDescriptor = open(wtoa(fileName).Buffer(), flags | O_DIRECT, mode);
+				// file systems like tmpfs reject O_DIRECT, fall back to buffered io
+				if (fileDescriptor != -1 || errno != EINVAL)
+				{
+					return fileDescriptor;
+				}
+			}
+			return open(wtoa(fileName).Buffer(), flags, mode);
+		}
+
+		int CreateNewFileForFileSource(const WString& fileName, FileIoMode ioMode)
+		{
+			return OpenFileForFileSource(fileName, O_CREAT | O_TRUNC | O_RDWR, ioMode);
 		}
 
-		int OpenExistingFileForFileSource(const WString& fileName)
+		int OpenExistingFileForFileSource(const WString& fileName, FileIoMode ioMode)
 		{
-			return open(wtoa(fileName).Buffer(), O_RDWR);
+			return OpenFileForFileSource(fileName, O_RDWR, ioMode);
 		}
 
 		void CloseFileForFileSource(int fileDescriptor)
@@ -616,16 +2260,135 @@ FileBufferSource
 			close(fileDescriptor);
 		}
 
-		IBufferSource* CreateFileSource(BufferSource source, volatile vuint64_t* totalUsedPages, vuint64_t pageSize, const WString& fileName, bool createNew)
+		WString GetChecksumFileName(const WString& fileName)
+		{
+			return fileName + L".crc";
+		}
+
+		WString GetHotPageFileName(const WString& fileName)
+		{
+			return fileName + L".hot";
+		}
+
+		bool SaveHotPages(const WString& fileName, const collections::List<BufferPage>& pages)
+		{
+			SortedList<vuint64_t> indices;
+			FOREACH(BufferPage, page, pages)
+			{
+				if (!indices.Contains(page.index))
+				{
+					indices.Add(page.index);
+				}
+			}
+
+			// the file is a magic number, the number of runs, and the first page and the page count of every run
+			List<vuint64_t> words;
+			words.Add(HOT_PAGE_MAGIC);
+			words.Add(0);
+			for (vint i = 0; i < indices.Count(); i++)
+			{
+				if (i > 0 && indices[i] == indices[i - 1] + 1)
+				{
+					words[words.Count() - 1]++;
+				}
+				else
+				{
+					words.Add(indices[i]);
+					words.Add(1);
+					words[1]++;
+				}
+			}
+
+			// the list is written to a temporary file and renamed, so a crash never leaves a partial list
+			auto hotPageFileName = wtoa(GetHotPageFileName(fileName));
+			auto temporaryFileName = wtoa(GetHotPageFileName(fileName) + L".tmp");
+			int fileDescriptor = open(temporaryFileName.Buffer(), O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+			if (fileDescriptor == -1)
+			{
+				return false;
+			}
+
+			auto buffer = (const char*)&words[0];
+			vuint64_t size = words.Count() * sizeof(vuint64_t);
+			vuint64_t written = 0;
+			while (written < size)
+			{
+				auto result = write(fileDescriptor, buffer + written, size - written);
+				if (result == -1 && errno == EINTR) continue;
+				if (result <= 0) break;
+				written += result;
+			}
+			bool successful = written == size && fdatasync(fileDescriptor) != -1;
+			close(fileDescriptor);
+
+			if (!successful || rename(temporaryFileName.Buffer(), hotPageFileName.Buffer()) == -1)
+			{
+				unlink(temporaryFileName.Buffer());
+				return false;
+			}
+			return true;
+		}
+
+		bool LoadHotPages(const WString& fileName, collections::List<BufferPage>& pages)
+		{
+			pages.Clear();
+			int fileDescriptor = open(wtoa(GetHotPageFileName(fileName)).Buffer(), O_RDONLY);
+			if (fileDescriptor == -1)
+			{
+				return false;
+			}
+
+			struct stat fileState;
+			Array<vuint64_t> words;
+			if (fstat(fileDescriptor, &fileState) != -1 && fileState.st_size >= (off_t)(sizeof(vuint64_t) * 2) && fileState.st_size % sizeof(vuint64_t) == 0)
+			{
+				words.Resize((vint)(fileState.st_size / sizeof(vuint64_t)));
+				auto buffer = (char*)&words[0];
+				vuint64_t size = fileState.st_size;
+				vuint64_t read = 0;
+				while (read < size)
+				{
+					auto result = pread(fileDescriptor, buffer + read, size - read, read);
+					if (result == -1 && errno == EINTR) continue;
+					if (result <= 0) break;
+					read += result;
+				}
+				if (read != size)
+				{
+					words.Resize(0);
+				}
+			}
+			close(fileDescriptor);
+
+			if (words.Count() < 2 || words[0] != HOT_PAGE_MAGIC || words[1] != (vuint64_t)(words.Count() - 2) / 2 || words.Count() % 2 != 0)
+			{
+				return false;
+			}
+			for (vint i = 2; i < words.Count(); i += 2)
+			{
+				for (vuint64_t j = 0; j < words[i + 1]; j++)
+				{
+					pages.Add(BufferPage{words[i] + j});
+				}
+			}
+			return true;
+		}
+
+		IBufferSource* CreateFileSource(BufferSource source, volatile vuint64_t* totalUsedPages, IBufferPageObserver* observer, vuint64_t pageSize, const WString& fileName, bool createNew, FileIoMode ioMode, Ptr<buffer_internal::BufferFrameArena> arena, bool checksums, Ptr<buffer_internal::BufferCompressedTier> compressedTier)
 		{
+			if (checksums && (ioMode == FileIoMode::MemoryMapped || ioMode == FileIoMode::RegionMapped))
+			{
+				return nullptr;
+			}
+
 			int fileDescriptor = 0;
 			if (createNew)
 			{
-				fileDescriptor = CreateNewFileForFileSource(fileName);
+				fileDescriptor = CreateNewFileForFileSource(fileName, ioMode);
 			}
 			else
 			{
-				fileDescriptor = OpenExistingFileForFileSource(fileName);
+				fileDescriptor = OpenExistingFileForFileSource(fileName, ioMode);
 			}
 
 			if (fileDescriptor == -1)
@@ -634,7 +2397,25 @@ FileBufferSource
 			}
 			else
 			{
-				auto result = new FileBufferSource(source, totalUsedPages, pageSize, fileName, fileDescriptor);
+				Ptr<FileChecksums> fileChecksums;
+				auto checksumFileName = wtoa(GetChecksumFileName(fileName));
+				if (checksums)
+				{
+					int checksumFileDescriptor = open(checksumFileName.Buffer(), (createNew ? O_CREAT | O_TRUNC : O_CREAT) | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+					if (checksumFileDescriptor == -1)
+					{
+						CloseFileForFileSource(fileDescriptor);
+						return nullptr;
+					}
+					fileChecksums = new FileChecksums(pageSize, checksumFileDescriptor);
+				}
+				else
+				{
+					// pages written without checksums would not match the checksum file anymore
+					unlink(checksumFileName.Buffer());
+				}
+
+				auto result = new FileBufferSource(source, totalUsedPages, observer, pageSize, fileName, fileDescriptor, ioMode, arena, fileChecksums, compressedTier);
 				if (createNew)
 				{
 					result->InitializeEmptySource();
@@ -646,10 +2427,117 @@ FileBufferSource
 				return result;
 			}
 		}
+
+		bool VerifyFileSource(const WString& fileName, vuint64_t pageSize, vint threadCount, collections::List<vuint64_t>& corruptedPages)
+		{
+			corruptedPages.Clear();
+			int fileDescriptor = open(wtoa(fileName).Buffer(), O_RDONLY);
+			if (fileDescriptor == -1)
+			{
+				return false;
+			}
+			int checksumFileDescriptor = open(wtoa(GetChecksumFileName(fileName)).Buffer(), O_RDONLY);
+			if (checksumFileDescriptor == -1)
+			{
+				close(fileDescriptor);
+				return false;
+			}
+
+			FileChecksums checksums(pageSize, checksumFileDescriptor);
+			struct stat fileState;
+			if (!checksums.Load() || fstat(fileDescriptor, &fileState) == -1)
+			{
+				close(fileDescriptor);
+				return false;
+			}
+			vuint64_t pageCount = fileState.st_size / pageSize;
+			posix_fadvise(fileDescriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+			// every thread reads the next batch of pages until all pages are verified
+			vuint64_t batchPageCount = VERIFY_BATCH_SIZE > pageSize ? VERIFY_BATCH_SIZE / pageSize : 1;
+			volatile vint nextBatch = 0;
+			volatile vint failedThreads = 0;
+			SpinLock corruptedLock;
+			SortedList<vuint64_t> corrupted;
+
+			auto verify = [&]()
+			{
+				char* buffer = (char*)malloc(batchPageCount * pageSize);
+				if (!buffer)
+				{
+					INCRC(&failedThreads);
+					return;
+				}
+
+				while (true)
+				{
+					vuint64_t firstPage = (vuint64_t)(INCRC(&nextBatch) - 1) * batchPageCount;
+					if (firstPage >= pageCount) break;
+					vuint64_t count = pageCount - firstPage < batchPageCount ? pageCount - firstPage : batchPageCount;
+
+					vuint64_t size = count * pageSize;
+					vuint64_t read = 0;
+					while (read < size)
+					{
+						auto result = pread(fileDescriptor, buffer + read, size - read, firstPage * pageSize + read);
+						if (result == -1 && errno == EINTR) continue;
+						if (result <= 0) break;
+						read += result;
+					}
+					if (read != size)
+					{
+						INCRC(&failedThreads);
+						break;
+					}
+
+					for (vuint64_t i = 0; i < count; i++)
+					{
+						BufferPage page{firstPage + i};
+						if (!checksums.Verify(page, buffer + i * pageSize))
+						{
+							SPIN_LOCK(corruptedLock)
+							{
+								corrupted.Add(page.index);
+							}
+						}
+					}
+				}
+				free(buffer);
+			};
+
+			if (threadCount > 1)
+			{
+				List<Thread*> threads;
+				for (vint i = 0; i < threadCount; i++)
+				{
+					threads.Add(Thread::CreateAndStart(verify, false));
+				}
+				FOREACH(Thread*, thread, threads)
+				{
+					thread->Wait();
+					delete thread;
+				}
+			}
+			else
+			{
+				verify();
+			}
+			close(fileDescriptor);
+
+			CopyFrom(corruptedPages, corrupted);
+			return failedThreads == 0;
+		}
 	}
 }
 
 #undef INDEX_INVALID
+#undef REGION_SIZE
+#undef EXTENT_SIZE
+#undef IO_QUEUE_DEPTH
+#undef READAHEAD_MIN_WINDOW
+#undef READAHEAD_MAX_WINDOW
+#undef VERIFY_BATCH_SIZE
+#undef HOT_PAGE_MAGIC
 #undef INDEX_PAGE_FREEITEM
 #undef INDEX_PAGE_USEMASK
 #undef INDEX_PAGE_INDEX
@@ -658,3 +2546,15 @@ FileBufferSource
 #undef INDEX_FREEITEM_FREEPAGEITEMBEGIN
 #undef INDEX_USEMASK_NEXTUSEMASKPAGE
 #undef INDEX_USEMASK_USEMASKBEGIN
+#undef INDEX_SUPERBLOCK_MAGIC
+#undef INDEX_SUPERBLOCK_VERSION
+#undef INDEX_SUPERBLOCK_CLEAN
+#undef INDEX_SUPERBLOCK_TOTALPAGES
+#undef INDEX_SUPERBLOCK_FREEPAGES
+#undef INDEX_SUPERBLOCK_DIRECTORYPAGES
+#undef INDEX_SUPERBLOCK_DIRECTORYPAGEBEGIN
+#undef SUPERBLOCK_MAGIC
+#undef SUPERBLOCK_VERSION
+#undef INDEX_DIRECTORY_USEMASKPAGE
+#undef INDEX_DIRECTORY_USEDPAGES
+#undef DIRECTORY_ENTRY_SIZE
@@ -8,7 +8,11 @@ Database::Utility
 #ifndef VCZH_DATABASE_UTILITY_FILEBUFFER
 #define VCZH_DATABASE_UTILITY_FILEBUFFER
 
-#include "Buffer.h"
+#include "BufferArena.h"
+#include "BufferFlusher.h"
+#include "BufferIo.h"
+#include "BufferChecksum.h"
+#include "BufferCompression.h"
 
 namespace vl
 {
@@ -16,73 +20,259 @@ namespace vl
 	{
 		namespace buffer_internal
 		{
+			class FileChecksums : public Object
+			{
+				typedef collections::Array<vuint32_t>							ChecksumList;
+				typedef collections::Dictionary<vuint64_t, vuint64_t>			SerialMap;
+			private:
+				vuint64_t					pageSize;
+				int							fileDescriptor;
+				CriticalSection				writeLock;
+				SpinLock					lock;
+				ChecksumList				checksums;				// the previous and the last checksum of page n are at 2n and 2n+1
+				SerialMap					unsyncedPages;			// pages whose last checksum may not match the file yet, with the serial of the finished write, INDEX_INVALID when it is being written
+				vuint64_t					writeSerial = 0;
+				vuint64_t					pageCount = 0;
+				volatile vuint64_t			failureCount = 0;
+
+				void						EnsurePageCount(vuint64_t count);
+			public:
+				// checksums are stored in a sidecar file, 8 bytes per page, a page with both checksums zero is not verified
+				// checksums of a batch are written and synchronized before its pages, a page is valid when it matches either checksum
+				// the last checksum only becomes the previous one after the file is synchronized, so the previous one is always on the disk
+				// so a page written partially by a crash is detected, and a page that is not written yet still matches the previous one
+				FileChecksums(vuint64_t _pageSize, int _fileDescriptor);
+				~FileChecksums();
+
+				bool						Load();
+				// returns true when a page is written after the file is synchronized, it cannot be written again before the next synchronization
+				bool						NeedsSync(const collections::List<BufferPageDesc*>& pageDescs);
+				// checksums are computed from the images that are written, fails when a changed page still needs a synchronization
+				bool						Update(const collections::List<BufferPageDesc*>& pageDescs, const collections::List<void*>& images);
+				// called after pages are written, synced is true when the file is also synchronized after them
+				void						EndWrite(const collections::List<BufferPageDesc*>& pageDescs, bool synced);
+				// writes that ended before BeginSync are on the disk when the synchronization after it succeeds
+				vuint64_t					BeginSync();
+				void						EndSync(vuint64_t serial);
+				bool						Verify(BufferPage page, const void* address);
+				void						Truncate(vuint64_t count);
+				vuint64_t					GetFailureCount();
+			};
+
 			class FileMapping : public Object
 			{
-				typedef collections::Dictionary<vuint64_t, Ptr<BufferPageDesc>>	PageMap;
+				typedef collections::List<char*>								RegionList;
 			private:
 				vuint64_t					pageSize;
 				int							fileDescriptor;
-				volatile vuint64_t*			totalUsedPages;
-				PageMap						mappedPages;
+				FileIoMode					ioMode;
+				Ptr<BufferFrameArena>		arena;
+				Ptr<BufferIoEngine>			ioEngine;
+				Ptr<FileChecksums>			checksums;
+				Ptr<BufferCompressedTier>	compressedTier;
+				BufferSource				source;
+				BufferPageTable				mappedPages;
 				vuint64_t					totalPageCount = 0;
+				vuint64_t					fileSize = 0;
+				vuint64_t					pagesPerRegion;
+				RegionList					regions;
+
+				bool						ExtendFile(vuint64_t size);
+				void*						GetRegionAddress(BufferPage page);
+				void						ReleaseRegions();
+				bool						ReadFrame(BufferPageDesc* pageDesc);
+				bool						LoadFrame(BufferPageDesc* pageDesc);
+				bool						SyncData();
+				bool						WriteFrame(BufferPageDesc* pageDesc);
+				void						ReleaseFrame(BufferPageDesc* pageDesc);
+				bool						WriteFrames(collections::List<Ptr<BufferPageDesc>>& pageDescs, bool sync);
 				
 			public:
-				FileMapping(vuint64_t _pageSize, int _fileDescriptor, volatile vuint64_t* _totalUsedPages);
+				// frames for ReadWrite and DirectReadWrite come from the arena, which returns page aligned memory for O_DIRECT
+				// the file grows by extents, the unused part of the last extent is trimmed when all pages are unmapped
+				// regions for RegionMapped are never moved, so the address of a page stays valid until the source is unloaded
+				// batches of frames are written by the io engine, which falls back to pwrite when io_uring is not available
+				// when checksums are given, frames are verified when they are read, mapped pages are never verified
+				// clean frames are kept in the compressed tier when they are unmapped, pages in the kernel page cache are not
+				FileMapping(vuint64_t _pageSize, int _fileDescriptor, volatile vuint64_t* _totalUsedPages, IBufferPageObserver* _observer = nullptr, BufferSource _source = BufferSource::Invalid(), FileIoMode _ioMode = FileIoMode::MemoryMapped, Ptr<BufferFrameArena> _arena = nullptr, Ptr<FileChecksums> _checksums = nullptr, Ptr<BufferCompressedTier> _compressedTier = nullptr);
 
+				FileIoMode					GetIoMode();
+				bool						IsMappedIoMode();
+				Ptr<BufferIoEngine>			GetIoEngine();
+				Ptr<FileChecksums>			GetChecksums();
 				void						InitializeEmptySource();
 				void						InitializeExistingSource();
 
 				vuint64_t					GetTotalPageCount();
 				Ptr<BufferPageDesc>			MapPage(BufferPage page);
+				void						TouchPage(BufferPageDesc* pageDesc);
 				BufferPage					AppendPage();
-				bool						UnmapPage(BufferPage page);
+				BufferPage					AppendPages(vuint64_t count);
+				bool						UnmapPage(BufferPage page, bool discardChanges = false);
+				// removes a freed page from the compressed tier
+				void						ForgetPage(BufferPage page);
 				void						UnmapAllPages();
+				bool						WriteBackPage(BufferPage page);
+				bool						PersistPage(BufferPageDesc* pageDesc);
+				// maps pages that are not mapped, frames are read in one batch and mapped pages are advised to the kernel
+				vint						MapPages(const collections::List<BufferPage>& pages);
+				// asks the kernel to read pages into the page cache, it fails when the page cache is bypassed
+				bool						AdvisePages(BufferPage firstPage, vuint64_t count);
+				bool						WriteBackPages(collections::List<Ptr<BufferPageDesc>>& pageDescs);
+				bool						SyncFile(collections::List<Ptr<BufferPageDesc>>& pageDescs);
+				bool						PersistPages(collections::List<Ptr<BufferPageDesc>>& pageDescs);
+				void						FillDirtyPages(collections::List<Ptr<BufferPageDesc>>& pageDescs);
+				void						FillPages(collections::List<Ptr<BufferPageDesc>>& pageDescs);
 
 				vint						GetMappedPageCount();
-				BufferPage					GetMappedPage(vint index);
-				Ptr<BufferPageDesc>			GetMappedPageDesc(vint index);
 				Ptr<BufferPageDesc>			GetMappedPageDesc(BufferPage page);
 			};
 
+			class FileSuperblock : public Object
+			{
+				typedef collections::List<vuint64_t>							PageList;
+			private:
+				vuint64_t					pageSize;
+				FileMapping*				fileMapping = nullptr;
+				bool						clean = false;
+				vuint64_t					totalPageCount = 0;
+				vuint64_t					freePageCount = 0;
+				PageList					directoryPages;
+
+				void						Write();
+			public:
+				// the superblock is INDEX_PAGE_FREEITEM, its first words stay an empty free page stack, so that earlier versions could still open the file
+				// it lists directory pages, which list every use mask page with the number of used pages covered by it
+				// directories are only trusted when the source was unloaded cleanly
+				FileSuperblock(vuint64_t _pageSize);
+
+				void						InitializeEmptySource(FileMapping* _fileMapping);
+				// returns false when the page is not a superblock of this version
+				bool						InitializeExistingSource(FileMapping* _fileMapping);
+
+				bool						IsClean();
+				vuint64_t					GetTotalPageCount();
+				vuint64_t					GetFreePageCount();
+				vuint64_t					GetDirectoryEntryCount();
+				const PageList&				GetDirectoryPages();
+				bool						AddDirectoryPage(BufferPage page);
+				// the clean flag is cleared before the source is changed, and set after everything else is persisted
+				void						MarkOpened();
+				void						MarkClosed(vuint64_t _totalPageCount, vuint64_t _freePageCount);
+			};
+
 			class FileUseMasks : public Object
 			{
 				typedef collections::List<vuint64_t>							PageList;
+				typedef collections::Array<vuint64_t>							MaskList;
+				typedef collections::Array<vuint64_t>							CountList;
+				typedef collections::Array<bool>								LoadedList;
+				typedef collections::SortedList<vint>							DirtyList;
 			private:
 				int							fileDescriptor;
 				vuint64_t					pageSize;
 				PageList					useMaskPages;
 				vuint64_t					useMaskPageItemCount;
+				MaskList					useMasks;				// bits of all use mask pages, bit n is for page n
+				CountList					usedPageCounts;			// used pages covered by each use mask page
+				LoadedList					loadedUseMaskPages;		// use mask pages whose bits are in useMasks
+				DirtyList					dirtyUseMaskPages;		// positions in useMaskPages
+				DirtyList					dirtyDirectoryPages;	// positions in directory pages of the superblock
 				FileMapping*				fileMapping = nullptr;
+				FileSuperblock*				superblock = nullptr;
+
+				void						Reset(FileMapping* _fileMapping, FileSuperblock* _superblock);
+				void						AddUseMaskPage(BufferPage page);
+				void						MarkDirectoryDirty(vint useMaskPageIndex);
+				void						AddDirectoryEntry(vint useMaskPageIndex);
+				void						LoadUseMaskPage(vint useMaskPageIndex);
+				BufferPage					FindFirst(vuint64_t startIndex, vuint64_t endIndex, bool used);
 	
 			public:
 				FileUseMasks(vuint64_t _pageSize, int _fileDescriptor);
 
 				void						InitializeEmptySource(FileMapping* _fileMapping);
+				// use mask pages are found by following the chain from INDEX_PAGE_USEMASK, they are all read
 				void						InitializeExistingSource(FileMapping* _fileMapping);
+				// use mask pages are found in directories, they are read when they are accessed
+				void						InitializeExistingSource(FileMapping* _fileMapping, FileSuperblock* _superblock);
+				// directories are rewritten from use mask pages, when they are missing or not trusted
+				void						AttachSuperblock(FileSuperblock* _superblock);
 
+				// use masks are changed in memory, changed use mask pages are written to the file by Flush
 				bool						GetUseMask(BufferPage page);
 				void						SetUseMask(BufferPage page, bool available);
+				void						SetUseMasks(BufferPage firstPage, vuint64_t count, bool available);
+				BufferPage					FindFirstFree(vuint64_t startIndex, vuint64_t endIndex);
+				BufferPage					FindFirstUsed(vuint64_t startIndex, vuint64_t endIndex);
+				vuint64_t					GetPagesPerUseMaskPage();
+				// a full use mask page is known from its directory entry without reading it
+				bool						IsUseMaskPageFull(vint useMaskPageIndex);
+				vuint64_t					GetUsedPageCount();
+				vint						GetLoadedUseMaskPageCount();
+				bool						IsDirty();
+				// copies changed use masks and directories to their pages and marks them dirty, the caller persists them with its own batch
+				// fails when a page cannot be read, nothing is filled and changes stay in memory
+				bool						FillDirtyPages(collections::List<Ptr<BufferPageDesc>>& pageDescs);
+				// pages from FillDirtyPages that failed to be persisted are filled again by the next call
+				void						RestoreDirtyPages(const collections::List<Ptr<BufferPageDesc>>& pageDescs);
+				void						Flush();
 			};
 
-			class FileFreePages : public Object
+			class FileFreeExtents : public Object
 			{
-				typedef collections::List<vuint64_t>							PageList;
+				typedef collections::Dictionary<vuint64_t, vuint64_t>			ExtentMap;
+				typedef collections::SortedList<vuint64_t>						ExtentSet;
+				static const vint			BucketCount = 64;
 			private:
 				vuint64_t					pageSize;
-				PageList					freeItemPages;
-				vint						activeFreeItemPageIndex;
-				vuint64_t					freeItemPageItemCount;
+				ExtentMap					extentLengths;			// first page to length
+				ExtentMap					extentStarts;			// page after the last page to first page
+				ExtentSet					buckets[BucketCount];	// first pages of extents, bucket n has lengths in [2^n, 2^(n+1))
+				vuint64_t					freePageCount = 0;
+				vuint64_t					scannedPageCount = 0;	// extents of pages before it are known, all extents are known when it is ~0
 				FileMapping*				fileMapping = nullptr;
 				FileUseMasks*				fileUseMasks = nullptr;
 
+				vint						GetBucket(vuint64_t length);
+				void						AddExtent(vuint64_t start, vuint64_t length);
+				void						RemoveExtent(vuint64_t start, vuint64_t length);
+				void						MergeExtent(vuint64_t start, vuint64_t length);
+				void						ReleaseFreePageChain();
+				bool						ScanNextUseMaskPage();
+
 			public:
-				FileFreePages(vuint64_t _pageSize);
+				// free extents are rebuilt from use masks when a source is loaded, they are persisted together with use masks
+				FileFreeExtents(vuint64_t _pageSize);
 
 				void						InitializeEmptySource(FileMapping* _fileMapping, FileUseMasks* _fileUseMasks);
-				void						InitializeExistingSource(FileMapping* _fileMapping, FileUseMasks* _fileUseMasks);
+				// when scanLazily is true, use masks are scanned in the order of pages until an allocation is satisfied
+				// free extents and free pages are only counted in scanned use masks
+				void						InitializeExistingSource(FileMapping* _fileMapping, FileUseMasks* _fileUseMasks, bool scanLazily = false);
 
-				void						PushFreePage(BufferPage page);
-				BufferPage					PopFreePage();
+				vuint64_t					GetFreePageCount();
+				vint						GetExtentCount();
+				// returns the lowest run of count free pages
+				BufferPage					AllocatePages(vuint64_t count);
+				// freed pages are merged with free neighbours
+				void						FreePages(BufferPage firstPage, vuint64_t count);
+			};
+
+			class FileReadahead : public Object
+			{
+			private:
+				vuint64_t					minWindow;
+				vuint64_t					maxWindow;
+				vuint64_t					window = 0;
+				vuint64_t					expectedPage = ~(vuint64_t)0;	// the first page after the last read ahead window
+
+			public:
+				FileReadahead(vuint64_t _minWindow, vuint64_t _maxWindow);
+
+				// returns the number of pages to read ahead after the missed page
+				// a miss on the expected page doubles the window, any other miss resets it
+				vuint64_t					OnPageMissed(BufferPage page);
+				vuint64_t					GetWindow();
 			};
 		}
 
@@ -97,12 +287,21 @@ namespace vl
 			BufferPage						indexPage;
 
 			buffer_internal::FileMapping	fileMapping;
+			buffer_internal::FileSuperblock	fileSuperblock;
 			buffer_internal::FileUseMasks	fileUseMasks;
-			buffer_internal::FileFreePages	fileFreePages;
+			buffer_internal::FileFreeExtents	fileFreeExtents;
+			buffer_internal::BufferGroupFlusher	groupFlusher;
+			buffer_internal::FileReadahead	readahead;
+			volatile vuint64_t				readaheadPageCount = 0;
+			collections::List<BufferPage>	readaheadPages;			// the last read ahead window that is not taken yet
+			volatile bool					hasReadaheadPages = false;
+
+			bool							FlushBatch(collections::List<Ptr<BufferPageDesc>>& pageDescs);
+			void							ReadAhead(BufferPage page);
 
 		public:
 
-			FileBufferSource(BufferSource _source, volatile vuint64_t* _totalUsedPages, vuint64_t _pageSize, const WString& _fileName, int _fileDescriptor);
+			FileBufferSource(BufferSource _source, volatile vuint64_t* _totalUsedPages, IBufferPageObserver* _observer, vuint64_t _pageSize, const WString& _fileName, int _fileDescriptor, FileIoMode _ioMode = FileIoMode::MemoryMapped, Ptr<buffer_internal::BufferFrameArena> _arena = nullptr, Ptr<buffer_internal::FileChecksums> _checksums = nullptr, Ptr<buffer_internal::BufferCompressedTier> _compressedTier = nullptr);
 
 			void							InitializeEmptySource();
 			void							InitializeExistingSource();
@@ -114,16 +313,45 @@ namespace vl
 			bool							UnmapPage(BufferPage page)override;
 			BufferPage						GetIndexPage()override;
 			BufferPage						AllocatePage()override;
+			BufferPage						AllocatePages(vuint64_t count)override;
 			bool							FreePage(BufferPage page)override;
-			void*							LockPage(BufferPage page)override;
+			void*							LockPage(BufferPage page, PageLockAccess access)override;
+			bool							UpgradePage(BufferPage page, void* buffer)override;
 			bool							UnlockPage(BufferPage page, void* buffer, PersistanceType persistanceType)override;
-			void							FillUnmapPageCandidates(collections::List<BufferPageTimeTuple>& pages, vint expectCount)override;
+			Ptr<BufferPageDesc>				LockPageDesc(BufferPage page, PageLockAccess access, bool& missed)override;
+			bool							UnlockPageDesc(BufferPageDesc* pageDesc, PersistanceType persistanceType)override;
+			bool							WriteBackPage(BufferPage page)override;
+			bool							WriteBackPages(collections::List<Ptr<BufferPageDesc>>& pageDescs)override;
+			bool							PersistPages(const collections::List<BufferPage>& pages)override;
+			void							FillDirtyPages(collections::List<Ptr<BufferPageDesc>>& pageDescs)override;
+			bool							Checkpoint()override;
+			vint							PrefetchPages(const collections::List<BufferPage>& pages)override;
+			void							FillReadaheadPages(collections::List<BufferPage>& pages)override;
+			vint							GetCachedPageCount()override;
+			void							FillCachedPages(collections::List<Ptr<BufferPageDesc>>& pageDescs)override;
+
+			vuint64_t						GetFlushBatchCount();
+			vuint64_t						GetReadaheadPageCount();
+			vuint64_t						GetChecksumFailureCount();
+			buffer_internal::FileSuperblock&	GetSuperblock();
+			buffer_internal::FileUseMasks&	GetUseMasks();
 		};
 
-		int									CreateNewFileForFileSource(const WString& fileName);
-		int									OpenExistingFileForFileSource(const WString& fileName);
+		int									OpenFileForFileSource(const WString& fileName, int flags, FileIoMode ioMode);
+		int									CreateNewFileForFileSource(const WString& fileName, FileIoMode ioMode = FileIoMode::MemoryMapped);
+		int									OpenExistingFileForFileSource(const WString& fileName, FileIoMode ioMode = FileIoMode::MemoryMapped);
 		void								CloseFileForFileSource(int fileDescriptor);
-		extern IBufferSource*				CreateFileSource(BufferSource source, volatile vuint64_t* totalUsedPages, vuint64_t pageSize, const WString& fileName, bool createNew);	
+		WString								GetChecksumFileName(const WString& fileName);
+		WString								GetHotPageFileName(const WString& fileName);
+		// the hot page file of a source lists pages as sorted runs, it is replaced atomically
+		extern bool							SaveHotPages(const WString& fileName, const collections::List<BufferPage>& pages);
+		// returns false when the file does not exist or is damaged, pages are sorted
+		extern bool							LoadHotPages(const WString& fileName, collections::List<BufferPage>& pages);
+		// checksums are only available when pages are read into frames, the checksum file of a source opened without checksums is deleted
+		extern IBufferSource*				CreateFileSource(BufferSource source, volatile vuint64_t* totalUsedPages, IBufferPageObserver* observer, vuint64_t pageSize, const WString& fileName, bool createNew, FileIoMode ioMode = FileIoMode::MemoryMapped, Ptr<buffer_internal::BufferFrameArena> arena = nullptr, bool checksums = false, Ptr<buffer_internal::BufferCompressedTier> compressedTier = nullptr);
+		// verifies every page of a file against its checksum file without loading it, pages are split among threads
+		// returns false when files cannot be read, corrupted pages are sorted
+		extern bool							VerifyFileSource(const WString& fileName, vuint64_t pageSize, vint threadCount, collections::List<vuint64_t>& corruptedPages);
 	}
 }
 
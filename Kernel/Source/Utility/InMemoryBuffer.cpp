@@ -1,6 +1,11 @@
 #include "InMemoryBuffer.h"
 #include <stdlib.h>
+#include <stdio.h>
 #include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
 
 namespace vl
 {
@@ -14,53 +19,141 @@ InMemoryBufferSource
 
 		Ptr<BufferPageDesc> InMemoryBufferSource::MapPage(BufferPage page)
 		{
-			CHECK_ERROR(page.index <= pages.Count(), L"vl::database::InMemoryBufferSource::MapPage(BufferPage)#Internal error: Index of page to map is out of range.");
-			if (page.index < pages.Count() && pages[page.index])
+			CHECK_ERROR(page.index <= pageCount, L"vl::database::InMemoryBufferSource::MapPage(BufferPage)#Internal error: Index of page to map is out of range.");
+			if (auto pageDesc = pages.Get(page))
 			{
-				auto pageDesc = pages[page.index];
-				pageDesc->lastAccessTime = (vuint64_t)time(nullptr);
+				pages.Touch(pageDesc.Obj());
 				return pageDesc;
 			}
 			else
 			{
-				auto address = malloc(pageSize);
-				if (!address) return nullptr;
-
-				auto pageDesc = MakePtr<BufferPageDesc>();
-				pageDesc->address = address;
+				pageDesc = arena->AllocatePageDesc();
+				if (!pageDesc) return nullptr;
+				pageDesc->page = page;
 				pageDesc->offset = page.index * pageSize;
-				pageDesc->lastAccessTime = (vuint64_t)time(nullptr);
 
-				if (page.index == pages.Count())
+				if (page.index == pageCount)
 				{
-					pages.Add(pageDesc);
+					pageCount++;
 				}
-				else
+				pages.Add(pageDesc);
+				return pageDesc;
+			}
+		}
+
+		Ptr<BufferPageDesc> InMemoryBufferSource::LoadSpilledPage(BufferPage page)
+		{
+			vint index = spilledPages.IndexOf(page.index);
+			if (index == -1) return nullptr;
+
+			auto pageDesc = arena->AllocatePageDesc();
+			if (!pageDesc) return nullptr;
+			pageDesc->page = page;
+			pageDesc->offset = page.index * pageSize;
+
+			// a page that was evicted before it was ever written back reads as zeros
+			vuint64_t read = 0;
+			if (compressedTier && compressedTier->Load(source, page, pageDesc->address))
+			{
+				read = pageSize;
+			}
+			else if (spillFileDescriptor != -1)
+			{
+				while (read < pageSize)
 				{
-					pages[page.index] = pageDesc;
+					auto result = pread(spillFileDescriptor, (char*)pageDesc->address + read, pageSize - read, pageDesc->offset + read);
+					if (result == -1 && errno == EINTR) continue;
+					if (result <= 0) break;
+					read += result;
+				}
+			}
+			if (read < pageSize)
+			{
+				memset((char*)pageDesc->address + read, 0, pageSize - read);
+			}
+
+			spilledPages.RemoveAt(index);
+			pages.Add(pageDesc);
+			return pageDesc;
+		}
+
+		int InMemoryBufferSource::GetSpillFile()
+		{
+			if (spillFileDescriptor == -1)
+			{
+				SPIN_LOCK(spillLock)
+				{
+					if (spillFileDescriptor == -1)
+					{
+						spillFileDescriptor = CreateSpillFileForMemorySource();
+					}
 				}
-				INCRC(totalUsedPages);
-				return pageDesc;
 			}
+			return spillFileDescriptor;
 		}
 
-		InMemoryBufferSource::InMemoryBufferSource(BufferSource _source, volatile vuint64_t* _totalUsedPages, vuint64_t _pageSize)
+		bool InMemoryBufferSource::RemovePage(BufferPage page, bool spill)
+		{
+			auto pageDesc = pages.Get(page);
+			if (!pageDesc || !pageDesc->TryBeginUnmap())
+			{
+				return false;
+			}
+			if (pageDesc->dirty)
+			{
+				if (spill)
+				{
+					pageDesc->CancelUnmap();
+					return false;
+				}
+				pageDesc->dirty = false;
+			}
+
+			// the frame returns to the arena after the last reference to the descriptor is released
+			pages.Remove(page);
+			if (spill)
+			{
+				if (compressedTier)
+				{
+					compressedTier->Store(source, page, pageDesc->address);
+				}
+				spilledPages.Add(page.index);
+			}
+			else
+			{
+				freePages.Add(page.index);
+			}
+			return true;
+		}
+
+		InMemoryBufferSource::InMemoryBufferSource(BufferSource _source, volatile vuint64_t* _totalUsedPages, IBufferPageObserver* _observer, Ptr<buffer_internal::BufferFrameArena> _arena, Ptr<buffer_internal::BufferCompressedTier> _compressedTier)
 			:source(_source)
-			,totalUsedPages(_totalUsedPages)
-			,pageSize(_pageSize)
+			,pageSize(_arena->GetPageSize())
+			,arena(_arena)
+			,compressedTier(_compressedTier)
+			,pages(_source, _totalUsedPages, _observer)
 		{
 			indexPage = AllocatePage();
 		}
 
 		void InMemoryBufferSource::Unload()
 		{
-			FOREACH(Ptr<BufferPageDesc>, pageDesc, pages)
+			List<Ptr<BufferPageDesc>> pageDescs;
+			pages.FillPages(pageDescs);
+			FOREACH(Ptr<BufferPageDesc>, pageDesc, pageDescs)
 			{
-				if (pageDesc)
-				{
-					DECRC(totalUsedPages);
-					free(pageDesc->address);
-				}
+				pages.Remove(pageDesc->page);
+			}
+			spilledPages.Clear();
+			if (compressedTier)
+			{
+				compressedTier->RemoveSource(source);
+			}
+
+			if (spillFileDescriptor != -1)
+			{
+				close(spillFileDescriptor);
+				spillFileDescriptor = -1;
 			}
 		}
 
@@ -81,22 +174,7 @@ InMemoryBufferSource
 
 		bool InMemoryBufferSource::InMemoryBufferSource::UnmapPage(BufferPage page)
 		{
-			if (page.index >= pages.Count())
-			{
-				return false;
-			}
-
-			auto pageDesc = pages[page.index];
-			if (!pageDesc || pageDesc->locked)
-			{
-				return false;
-			}
-
-			free(pageDesc->address);
-			pages[page.index] = nullptr;
-			freePages.Add(page.index);
-			DECRC(totalUsedPages);
-			return true;
+			return RemovePage(page, true);
 		}
 
 		BufferPage InMemoryBufferSource::GetIndexPage()
@@ -114,7 +192,7 @@ InMemoryBufferSource
 			}
 			else
 			{
-				page.index = pages.Count();
+				page.index = pageCount;
 			}
 
 			if (MapPage(page))
@@ -127,56 +205,244 @@ InMemoryBufferSource
 			}
 		}
 
+		BufferPage InMemoryBufferSource::AllocatePages(vuint64_t count)
+		{
+			if (count == 0)
+			{
+				return BufferPage::Invalid();
+			}
+
+			// new pages are recorded as spilled pages that are never written back, they are zero filled when first locked
+			BufferPage page{pageCount};
+			for (vuint64_t i = 0; i < count; i++)
+			{
+				spilledPages.Add(pageCount++);
+			}
+			return page;
+		}
+
 		bool InMemoryBufferSource::FreePage(BufferPage page)
 		{
 			if (page.index == indexPage.index)
 			{
 				return false;
 			}
-			return UnmapPage(page);
-		}
 
-		void* InMemoryBufferSource::LockPage(BufferPage page)
-		{
-			if (page.index >= pages.Count())
+			vint index = spilledPages.IndexOf(page.index);
+			if (index != -1)
 			{
-				return nullptr;
+				if (compressedTier)
+				{
+					compressedTier->Remove(source, page);
+				}
+				spilledPages.RemoveAt(index);
+				freePages.Add(page.index);
+				return true;
 			}
+			return RemovePage(page, false);
+		}
 
-			auto pageDesc = pages[page.index];
-			if (!pageDesc || pageDesc->locked)
+		void* InMemoryBufferSource::LockPage(BufferPage page, PageLockAccess access)
+		{
+			bool missed = false;
+			auto pageDesc = LockPageDesc(page, access, missed);
+			return pageDesc ? pageDesc->address : nullptr;
+		}
+
+		bool InMemoryBufferSource::UpgradePage(BufferPage page, void* address)
+		{
+			auto pageDesc = pages.Get(page);
+			if (!pageDesc || address != pageDesc->address)
 			{
-				return nullptr;
+				return false;
 			}
 
-			pageDesc->locked = true;
-			return pageDesc->address;
+			return pageDesc->TryUpgrade();
 		}
 
 		bool InMemoryBufferSource::UnlockPage(BufferPage page, void* address, PersistanceType persistanceType)
 		{
-			if (page.index >= pages.Count())
+			auto pageDesc = pages.Get(page);
+			if (!pageDesc || address != pageDesc->address)
 			{
 				return false;
 			}
+			return UnlockPageDesc(pageDesc.Obj(), persistanceType);
+		}
+
+		Ptr<BufferPageDesc> InMemoryBufferSource::LockPageDesc(BufferPage page, PageLockAccess access, bool& missed)
+		{
+			missed = false;
+			if (auto pageDesc = pages.Get(page))
+			{
+				if (pageDesc->TryLock(access))
+				{
+					pages.Touch(pageDesc.Obj());
+					return pageDesc;
+				}
+				if (pageDesc->IsLocked()) return nullptr;
+			}
 
-			auto pageDesc = pages[page.index];
-			if (!pageDesc || !pageDesc->locked || address != pageDesc->address)
+			SPIN_LOCK(lock)
+			{
+				auto pageDesc = pages.Get(page);
+				bool loaded = false;
+				if (!pageDesc)
+				{
+					pageDesc = LoadSpilledPage(page);
+					loaded = true;
+				}
+				if (pageDesc && pageDesc->TryLock(access))
+				{
+					// like a file page, a loaded page is not accessed until it is found again
+					if (!loaded)
+					{
+						pages.Touch(pageDesc.Obj());
+					}
+					missed = loaded;
+					return pageDesc;
+				}
+			}
+			return nullptr;
+		}
+
+		bool InMemoryBufferSource::UnlockPageDesc(BufferPageDesc* pageDesc, PersistanceType persistanceType)
+		{
+			if (!pageDesc->IsLocked())
+			{
+				return false;
+			}
+			if (persistanceType != PersistanceType::NoChanging && !pageDesc->IsExclusivelyLocked())
 			{
 				return false;
 			}
 
-			pageDesc->locked = false;
+			// there is no file behind a memory page, so any exclusive lock could have changed it
+			if (pageDesc->IsExclusivelyLocked())
+			{
+				pageDesc->MarkDirty();
+			}
+			return pageDesc->Unlock();
+		}
+
+		bool InMemoryBufferSource::WriteBackPage(BufferPage page)
+		{
+			auto pageDesc = pages.Get(page);
+			if (!pageDesc) return false;
+			if (!pageDesc->TryBeginWriteBack()) return false;
+
+			bool successful = true;
+			if (pageDesc->dirty)
+			{
+				int fd = GetSpillFile();
+				pageDesc->dirty = false;
+
+				vuint64_t written = 0;
+				while (fd != -1 && written < pageSize)
+				{
+					auto result = pwrite(fd, (char*)pageDesc->address + written, pageSize - written, pageDesc->offset + written);
+					if (result == -1 && errno == EINTR) continue;
+					if (result <= 0) break;
+					written += result;
+				}
+
+				if (written < pageSize)
+				{
+					pageDesc->dirty = true;
+					successful = false;
+				}
+			}
+			pageDesc->EndWriteBack();
+			return successful;
+		}
+
+		bool InMemoryBufferSource::WriteBackPages(collections::List<Ptr<BufferPageDesc>>& pageDescs)
+		{
+			bool successful = true;
+			FOREACH(Ptr<BufferPageDesc>, pageDesc, pageDescs)
+			{
+				if (!WriteBackPage(pageDesc->page))
+				{
+					successful = false;
+				}
+			}
+			return successful;
+		}
+
+		bool InMemoryBufferSource::PersistPages(const collections::List<BufferPage>&)
+		{
+			// pages of a memory source are never durable
 			return true;
 		}
 
-		void InMemoryBufferSource::FillUnmapPageCandidates(collections::List<BufferPageTimeTuple>& pages, vint expectCount)
+		void InMemoryBufferSource::FillDirtyPages(collections::List<Ptr<BufferPageDesc>>& pageDescs)
 		{
+			pages.FillDirtyPages(pageDescs);
+		}
+
+		bool InMemoryBufferSource::Checkpoint()
+		{
+			// dirty pages of a memory source only need to be spilled when they are evicted
+			return true;
 		}
 
-		IBufferSource* CreateMemorySource(BufferSource source, volatile vuint64_t* totalUsedPages, vuint64_t pageSize)
+		vint InMemoryBufferSource::PrefetchPages(const collections::List<BufferPage>& prefetchPages)
 		{
-			return new InMemoryBufferSource(source, totalUsedPages, pageSize);
+			// only spilled pages are not in memory
+			vint loaded = 0;
+			SPIN_LOCK(lock)
+			{
+				FOREACH(BufferPage, page, prefetchPages)
+				{
+					if (!pages.Get(page) && LoadSpilledPage(page))
+					{
+						loaded++;
+					}
+				}
+			}
+			return loaded;
+		}
+
+		vint InMemoryBufferSource::GetCachedPageCount()
+		{
+			return pages.Count();
+		}
+
+		void InMemoryBufferSource::FillCachedPages(collections::List<Ptr<BufferPageDesc>>& pageDescs)
+		{
+			pages.FillPages(pageDescs);
+		}
+
+		void InMemoryBufferSource::FillReadaheadPages(collections::List<BufferPage>&)
+		{
+		}
+
+		IBufferSource* CreateMemorySource(BufferSource source, volatile vuint64_t* totalUsedPages, IBufferPageObserver* observer, Ptr<buffer_internal::BufferFrameArena> arena, Ptr<buffer_internal::BufferCompressedTier> compressedTier)
+		{
+			return new InMemoryBufferSource(source, totalUsedPages, observer, arena, compressedTier);
+		}
+
+		int CreateSpillFileForMemorySource()
+		{
+			const char* folder = getenv("TMPDIR");
+			if (!folder || !*folder)
+			{
+				folder = "/tmp";
+			}
+
+			char fileName[PATH_MAX];
+			if (snprintf(fileName, sizeof(fileName), "%s/herodb-spill-XXXXXX", folder) >= (int)sizeof(fileName))
+			{
+				return -1;
+			}
+
+			// the file is unlinked immediately, it disappears when the source is unloaded or the process exits
+			int fileDescriptor = mkstemp(fileName);
+			if (fileDescriptor != -1)
+			{
+				unlink(fileName);
+			}
+			return fileDescriptor;
 		}
 	}
 }
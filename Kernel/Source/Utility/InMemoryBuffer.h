@@ -8,7 +8,8 @@ Database::Utility
 #ifndef VCZH_DATABASE_UTILITY_INMEMORYBUFFER
 #define VCZH_DATABASE_UTILITY_INMEMORYBUFFER
 
-#include "Buffer.h"
+#include "BufferArena.h"
+#include "BufferCompression.h"
 
 namespace vl
 {
@@ -16,20 +17,28 @@ namespace vl
 	{
 		class InMemoryBufferSource : public Object, public IBufferSource
 		{
-			typedef collections::List<Ptr<BufferPageDesc>>	PageList;
 			typedef collections::List<vuint64_t>			PageIdList;
+			typedef collections::SortedList<vuint64_t>		PageIdSet;
 		private:
 			BufferSource		source;
-			volatile vuint64_t*	totalUsedPages;
 			vuint64_t			pageSize;
+			Ptr<buffer_internal::BufferFrameArena>	arena;
+			Ptr<buffer_internal::BufferCompressedTier>	compressedTier;
 			SpinLock			lock;
-			PageList			pages;
+			buffer_internal::BufferPageTable	pages;
+			vuint64_t			pageCount = 0;
 			PageIdList			freePages;
+			PageIdSet			spilledPages;		// allocated pages that are not in memory
 			BufferPage			indexPage;
+			SpinLock			spillLock;
+			volatile int		spillFileDescriptor = -1;
 
 			Ptr<BufferPageDesc>	MapPage(BufferPage page);
+			Ptr<BufferPageDesc>	LoadSpilledPage(BufferPage page);
+			int					GetSpillFile();
+			bool				RemovePage(BufferPage page, bool spill);
 		public:
-			InMemoryBufferSource(BufferSource _source, volatile vuint64_t* _totalUsedPages, vuint64_t _pageSize);
+			InMemoryBufferSource(BufferSource _source, volatile vuint64_t* _totalUsedPages, IBufferPageObserver* _observer, Ptr<buffer_internal::BufferFrameArena> _arena, Ptr<buffer_internal::BufferCompressedTier> _compressedTier = nullptr);
 
 			void				Unload()override;
 			BufferSource		GetBufferSource()override;
@@ -38,13 +47,26 @@ namespace vl
 			bool				UnmapPage(BufferPage page)override;
 			BufferPage			GetIndexPage()override;
 			BufferPage			AllocatePage()override;
+			BufferPage			AllocatePages(vuint64_t count)override;
 			bool				FreePage(BufferPage page)override;
-			void* 				LockPage(BufferPage page)override;
+			void* 				LockPage(BufferPage page, PageLockAccess access)override;
+			bool				UpgradePage(BufferPage page, void* address)override;
+			Ptr<BufferPageDesc>	LockPageDesc(BufferPage page, PageLockAccess access, bool& missed)override;
+			bool				UnlockPageDesc(BufferPageDesc* pageDesc, PersistanceType persistanceType)override;
 			bool				UnlockPage(BufferPage page, void* address, PersistanceType persistanceType)override;
-			void				FillUnmapPageCandidates(collections::List<BufferPageTimeTuple>& pages, vint expectCount)override;
+			bool				WriteBackPage(BufferPage page)override;
+			bool				WriteBackPages(collections::List<Ptr<BufferPageDesc>>& pageDescs)override;
+			bool				PersistPages(const collections::List<BufferPage>& pages)override;
+			void				FillDirtyPages(collections::List<Ptr<BufferPageDesc>>& pageDescs)override;
+			bool				Checkpoint()override;
+			vint				PrefetchPages(const collections::List<BufferPage>& pages)override;
+			void				FillReadaheadPages(collections::List<BufferPage>& pages)override;
+			vint				GetCachedPageCount()override;
+			void				FillCachedPages(collections::List<Ptr<BufferPageDesc>>& pageDescs)override;
 		};
 
-		extern IBufferSource*	CreateMemorySource(BufferSource source, volatile vuint64_t* totalUsedPages, vuint64_t pageSize);
+		extern IBufferSource*	CreateMemorySource(BufferSource source, volatile vuint64_t* totalUsedPages, IBufferPageObserver* observer, Ptr<buffer_internal::BufferFrameArena> arena, Ptr<buffer_internal::BufferCompressedTier> compressedTier = nullptr);
+		int						CreateSpillFileForMemorySource();
 	}
 }
 
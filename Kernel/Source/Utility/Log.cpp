@@ -67,7 +67,7 @@ LogAddressItem
 				{
 					previousPage = page;
 					indexPages.Add(page);
-					auto numbers = (vuint64_t*)bm->LockPage(source, previousPage);
+					auto numbers = (vuint64_t*)bm->LockPage(source, previousPage, PageLockAccess::Shared);
 					page.index = numbers[INDEX_INDEXPAGE_NEXTINDEXPAGE];
 					usedTransactionCount += numbers[INDEX_INDEXPAGE_ADDRESSITEMS];
 					bm->UnlockPage(source, previousPage, numbers, PersistanceType::NoChanging);
@@ -83,10 +83,10 @@ LogAddressItem
 				CHECK_ERROR(index <= indexPages.Count(), L"vl::database::log_internal::LogAddressItem::ReadAddressItem(BufferTransaction)#Internal error: Transaction is out of range.");
 
 				BufferPage page = indexPages[index];
-				auto numbers = (vuint64_t*)bm->LockPage(source, page);
+				auto numbers = (vuint64_t*)bm->LockPage(source, page, PageLockAccess::Shared);
 				if (!numbers) return BufferPointer::Invalid();
 				auto result = numbers[item + INDEX_INDEXPAGE_ADDRESSITEMBEGIN];
-				bm->UnlockPage(source, page, numbers, PersistanceType::ChangedAndPersist);
+				bm->UnlockPage(source, page, numbers, PersistanceType::NoChanging);
 
 				BufferPointer address{result};
 				return address;
@@ -324,6 +324,19 @@ LogWriter
 					vuint64_t written = 0;
 					vuint64_t remain = stream.Size();
 					stream.SeekFromBegin(0);
+
+					// blocks are persisted together before anything referencing them is written
+					// the address item is written after the first block is durable, links to following blocks are written after all blocks are durable
+					collections::List<BufferPage> changedPages;
+					collections::List<collections::Pair<BufferPointer, BufferPointer>> links;
+					auto markChanged = [&](BufferPageGuard& guard)
+					{
+						guard.MarkChanged();
+						if (!changedPages.Contains(guard.GetPage()))
+						{
+							changedPages.Add(guard.GetPage());
+						}
+					};
 					while (true)
 					{
 						vuint64_t itemHeader = numberCount * sizeof(vuint64_t);
@@ -335,7 +348,9 @@ LogWriter
 						BufferPage page;
 						vuint64_t offset;
 						CHECK_ERROR(bm->DecodePointer(address, page, offset), L"vl::database::log_internal::LogWriter::Close()#Internal error: Unable to decode block address for saving logs.");
-						auto pointer = (char*)bm->LockPage(source, page);
+						auto guard = bm->AcquirePage(source, page);
+						CHECK_ERROR(guard.IsValid(), L"vl::database::log_internal::LogWriter::Close()#Internal error: Unable to lock page for saving logs.");
+						auto pointer = (char*)guard.GetAddress();
 						auto numbers = (vuint64_t*)(pointer + offset);
 
 						switch (numberCount)
@@ -349,24 +364,25 @@ LogWriter
 								*numbers ++ = INDEX_INVALID;
 						}
 						stream.Read(numbers, (remain < dataSize ? remain : dataSize));
-						CHECK_ERROR(bm->UnlockPage(source, page, pointer, PersistanceType::ChangedAndPersist), L"vl::database::log_internal::LogWriter::Close()#Internal error: Unable to unlock page for saving logs.");
-						
+						markChanged(guard);
+
 						if (numberCount == 4)
 						{
 							desc->firstItem = address;
+							CHECK_ERROR(guard.Release(), L"vl::database::log_internal::LogWriter::Close()#Internal error: Unable to unlock page for saving logs.");
+							CHECK_ERROR(bm->PersistPages(source, changedPages), L"vl::database::log_internal::LogWriter::Close()#Internal error: Unable to save logs.");
+							changedPages.Clear();
 							CHECK_ERROR(logAddressItem->WriteAddressItem(trans, address), L"vl::database::log_internal::LogWriter::Close()#Internal error: Unable to save logs.");
 						}
 						else if (desc->lastItem.IsValid())
 						{
-							BufferPage lastItemPage;
-							vuint64_t lastItemOffset;
-							CHECK_ERROR(bm->DecodePointer(desc->lastItem, lastItemPage, lastItemOffset), L"vl::database::log_internal::LogWriter::Close()#Internal error: Unable to decode block address for saving logs.");
-
-							auto pointer = bm->LockPage(source, lastItemPage);
-							*(vuint64_t*)((char*)pointer + lastItemOffset) = address.index;
-							CHECK_ERROR(bm->UnlockPage(source, lastItemPage, pointer, PersistanceType::ChangedAndPersist), L"vl::database::log_internal::LogWriter::Close()#Internal error: Unable to save logs.");
+							links.Add({desc->lastItem, address});
 						}
 						CHECK_ERROR(bm->EncodePointer(desc->lastItem, page, offset + (numberCount - 1) * sizeof(vuint64_t)), L"vl::database::log_internal::LogWriter::Close()#Internal error: Unable to encode block address for saving logs.");
+						if (guard.IsValid())
+						{
+							CHECK_ERROR(guard.Release(), L"vl::database::log_internal::LogWriter::Close()#Internal error: Unable to unlock page for saving logs.");
+						}
 
 						if (remain > dataSize)
 						{
@@ -379,6 +395,25 @@ LogWriter
 							break;
 						}
 					}
+					CHECK_ERROR(bm->PersistPages(source, changedPages), L"vl::database::log_internal::LogWriter::Close()#Internal error: Unable to save logs.");
+					changedPages.Clear();
+
+					for (vint i = 0; i < links.Count(); i++)
+					{
+						BufferPage lastItemPage;
+						vuint64_t lastItemOffset;
+						CHECK_ERROR(bm->DecodePointer(links[i].key, lastItemPage, lastItemOffset), L"vl::database::log_internal::LogWriter::Close()#Internal error: Unable to decode block address for saving logs.");
+
+						auto lastItemGuard = bm->AcquirePage(source, lastItemPage);
+						CHECK_ERROR(lastItemGuard.IsValid(), L"vl::database::log_internal::LogWriter::Close()#Internal error: Unable to save logs.");
+						*(vuint64_t*)((char*)lastItemGuard.GetAddress() + lastItemOffset) = links[i].value.index;
+						markChanged(lastItemGuard);
+						CHECK_ERROR(lastItemGuard.Release(), L"vl::database::log_internal::LogWriter::Close()#Internal error: Unable to save logs.");
+					}
+					if (changedPages.Count() > 0)
+					{
+						CHECK_ERROR(bm->PersistPages(source, changedPages), L"vl::database::log_internal::LogWriter::Close()#Internal error: Unable to save logs.");
+					}
 
 					opening = false;
 					desc->writer = 0;
@@ -398,6 +433,7 @@ LogReader
 				,logTransactions(_logTransactions)
 				,trans(_trans)
 				,item(BufferPointer::Invalid())
+				,scanStrategy(ScanRingSize)
 			{
 				auto desc = logTransactions->GetTransDesc(trans);
 				if (desc)
@@ -442,8 +478,9 @@ LogReader
 				BufferPage page;
 				vuint64_t offset;
 				CHECK_ERROR(bm->DecodePointer(item, page, offset), L"vl::database::log_internal::LogReader::NextItem()#Internal error: Unable to decode block pointer.");
-				auto pointer = bm->LockPage(source, page);
-				auto numbers = (vuint64_t*)((char*)pointer + offset);
+				auto guard = bm->AcquirePage(source, page, PageLockAccess::Shared, &scanStrategy);
+				CHECK_ERROR(guard.IsValid(), L"vl::database::log_internal::LogReader::NextItem()#Internal error: Unable to lock page.");
+				auto numbers = (vuint64_t*)((char*)guard.GetAddress() + offset);
 				auto remain = numbers[0];
 				auto block = numbers + 1;
 
@@ -455,6 +492,19 @@ LogReader
 					{
 						blockSize = remain;
 					}
+
+					if (blockSize < remain && item.IsValid())
+					{
+						// the page of the next block is read by the cleaner thread while this block is copied
+						BufferPage nextPage;
+						vuint64_t nextOffset;
+						if (bm->DecodePointer(item, nextPage, nextOffset) && nextPage != guard.GetPage())
+						{
+							collections::List<BufferPage> nextPages;
+							nextPages.Add(nextPage);
+							bm->Prefetch(source, nextPages);
+						}
+					}
 					
 					if (blockSize > 0)
 					{
@@ -462,17 +512,22 @@ LogReader
 					}
 
 					remain -= blockSize;
-					CHECK_ERROR(bm->UnlockPage(source, page, pointer, PersistanceType::NoChanging), L"vl::database::log_internal::LogReader::NextItem()#Internal error: Unable to unlock page.");
-
 					if (remain == 0 || !item.IsValid())
 					{
 						break;
 					}
+
 					CHECK_ERROR(bm->DecodePointer(item, page, offset), L"vl::database::log_internal::LogReader::NextItem()#Internal error: Unable to decode pointer.");
-					pointer = bm->LockPage(source, page);
-					numbers = (vuint64_t*)((char*)pointer + offset);
+					if (page != guard.GetPage())
+					{
+						// following blocks often stay in the same page, only switch pages when necessary
+						guard = bm->AcquirePage(source, page, PageLockAccess::Shared, &scanStrategy);
+						CHECK_ERROR(guard.IsValid(), L"vl::database::log_internal::LogReader::NextItem()#Internal error: Unable to lock page.");
+					}
+					numbers = (vuint64_t*)((char*)guard.GetAddress() + offset);
 					block = numbers;
 				}
+				CHECK_ERROR(guard.Release(), L"vl::database::log_internal::LogReader::NextItem()#Internal error: Unable to unlock page.");
 				stream->SeekFromBegin(0);
 
 				return true;
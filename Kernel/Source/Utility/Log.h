@@ -133,6 +133,7 @@ namespace vl
 
 			class LogReader : public Object, public ILogReader
 			{
+				static const vint				ScanRingSize = 8;
 			private:
 				SpinLock&						lock;
 				BufferManager*					bm;
@@ -143,6 +144,7 @@ namespace vl
 				BufferTransaction				trans;
 				BufferPointer					item;
 				Ptr<stream::MemoryStream>		stream;
+				BufferAccessStrategy			scanStrategy;		// replaying logs does not evict pages of other sources
 
 			public:
 				LogReader(SpinLock& _lock, BufferManager* _bm, BufferSource _source, LogAddressItem* _logAddressItem, LogTransactions* _logTransactions, BufferTransaction _trans);
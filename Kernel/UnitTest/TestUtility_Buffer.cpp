@@ -2,6 +2,16 @@
 #include "../Source/Utility/Buffer.h"
 #include "../Source/Utility/InMemoryBuffer.h"
 #include "../Source/Utility/FileBuffer.h"
+#include "../Source/Utility/BufferPolicy.h"
+#include "../Source/Utility/BufferArena.h"
+#include "../Source/Utility/BufferFlusher.h"
+#include "../Source/Utility/BufferIo.h"
+#include "../Source/Utility/BufferChecksum.h"
+#include "../Source/Utility/BufferCompression.h"
+#include "../Source/Utility/BufferStatistics.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace vl;
 using namespace vl::database;
@@ -50,6 +60,24 @@ TEST_CASE(Utility_Buffer_File_##NAME)												\
 	auto source = bm.LoadFileSource(TEMP_DIR L"db.bin", true);						\
 	TestCase_Utility_Buffer_##NAME(bm, source);										\
 }																					\
+TEST_CASE(Utility_Buffer_FileReadWrite_##NAME)										\
+{																					\
+	BufferManager bm(64 KB, 16);													\
+	auto source = bm.LoadFileSource(TEMP_DIR L"db.bin", true, FileIoMode::ReadWrite);\
+	TestCase_Utility_Buffer_##NAME(bm, source);										\
+}																					\
+TEST_CASE(Utility_Buffer_FileDirect_##NAME)											\
+{																					\
+	BufferManager bm(64 KB, 16);													\
+	auto source = bm.LoadFileSource(TEMP_DIR L"db.bin", true, FileIoMode::DirectReadWrite);\
+	TestCase_Utility_Buffer_##NAME(bm, source);										\
+}																					\
+TEST_CASE(Utility_Buffer_FileRegion_##NAME)											\
+{																					\
+	BufferManager bm(64 KB, 16);													\
+	auto source = bm.LoadFileSource(TEMP_DIR L"db.bin", true, FileIoMode::RegionMapped);\
+	TestCase_Utility_Buffer_##NAME(bm, source);										\
+}																					\
 void TestCase_Utility_Buffer_##NAME(BufferManager& bm, BufferSource source)			\
 
 TEST_CASE_SOURCE(LockUnlockPage)
@@ -72,6 +100,75 @@ TEST_CASE_SOURCE(LockUnlockPage)
 	TEST_ASSERT(bm.UnlockPage(source, page, addr, PersistanceType::NoChanging) == false);
 }
 
+TEST_CASE_SOURCE(SharedLockPage)
+{
+	auto page = bm.AllocatePage(source);
+	TEST_ASSERT(page.IsValid());
+
+	auto addr1 = bm.LockPage(source, page, PageLockAccess::Shared);
+	TEST_ASSERT(addr1 != nullptr);
+	auto addr2 = bm.LockPage(source, page, PageLockAccess::Shared);
+	TEST_ASSERT(addr2 == addr1);
+	TEST_ASSERT(bm.LockPage(source, page, PageLockAccess::Exclusive) == nullptr);
+	TEST_ASSERT(bm.UpgradePage(source, page, addr1) == false);
+	TEST_ASSERT(bm.FreePage(source, page) == false);
+
+	TEST_ASSERT(bm.UnlockPage(source, page, addr2, PersistanceType::Changed) == false);
+	TEST_ASSERT(bm.UnlockPage(source, page, addr2, PersistanceType::NoChanging) == true);
+	TEST_ASSERT(bm.UpgradePage(source, page, (char*)addr1 + 1) == false);
+	TEST_ASSERT(bm.UpgradePage(source, page, addr1) == true);
+	TEST_ASSERT(bm.LockPage(source, page, PageLockAccess::Shared) == nullptr);
+
+	strcpy((char*)addr1, "Upgraded");
+	TEST_ASSERT(bm.UnlockPage(source, page, addr1, PersistanceType::Changed) == true);
+	TEST_ASSERT(bm.UnlockPage(source, page, addr1, PersistanceType::NoChanging) == false);
+
+	addr1 = bm.LockPage(source, page, PageLockAccess::Shared);
+	TEST_ASSERT(addr1 != nullptr);
+	TEST_ASSERT(strcmp((char*)addr1, "Upgraded") == 0);
+	TEST_ASSERT(bm.UnlockPage(source, page, addr1, PersistanceType::NoChanging) == true);
+	TEST_ASSERT(bm.FreePage(source, page) == true);
+}
+
+TEST_CASE_SOURCE(PageGuard)
+{
+	auto page = bm.AllocatePage(source);
+	TEST_ASSERT(page.IsValid());
+	{
+		auto guard = bm.AcquirePage(source, page, PageLockAccess::Shared);
+		TEST_ASSERT(guard.IsValid());
+		TEST_ASSERT(guard.GetPage() == page);
+		TEST_ASSERT(guard.GetAddress() != nullptr);
+		TEST_ASSERT(guard.IsExclusive() == false);
+		TEST_ASSERT(guard.MarkChanged() == false);
+		TEST_ASSERT(bm.LockPage(source, page, PageLockAccess::Exclusive) == nullptr);
+
+		auto moved = static_cast<BufferPageGuard&&>(guard);
+		TEST_ASSERT(guard.IsValid() == false);
+		TEST_ASSERT(guard.GetAddress() == nullptr);
+		TEST_ASSERT(guard.Release() == false);
+		TEST_ASSERT(moved.IsValid());
+
+		TEST_ASSERT(moved.Upgrade() == true);
+		TEST_ASSERT(moved.IsExclusive() == true);
+		strcpy((char*)moved.GetAddress(), "Guarded");
+		TEST_ASSERT(moved.MarkChanged() == true);
+	}
+
+	auto addr = bm.LockPage(source, page, PageLockAccess::Exclusive);
+	TEST_ASSERT(addr != nullptr);
+	TEST_ASSERT(strcmp((char*)addr, "Guarded") == 0);
+	TEST_ASSERT(bm.AcquirePage(source, page).IsValid() == false);
+	TEST_ASSERT(bm.UnlockPage(source, page, addr, PersistanceType::NoChanging) == true);
+
+	auto guard = bm.AcquirePage(source, page);
+	TEST_ASSERT(guard.IsValid());
+	TEST_ASSERT(guard.Release() == true);
+	TEST_ASSERT(guard.IsValid() == false);
+	TEST_ASSERT(bm.FreePage(source, page) == true);
+	TEST_ASSERT(bm.AcquirePage(source, page).IsValid() == false);
+}
+
 TEST_CASE_SOURCE(AllocateFreePage)
 {
 	auto indexPage = bm.GetIndexPage(source);
@@ -128,16 +225,174 @@ TEST_CASE_SOURCE(AllocateFreePage)
 	TEST_ASSERT(bm.UnlockPage(source, page3, addr3, PersistanceType::ChangedAndPersist) == true);
 }
 
+TEST_CASE_SOURCE(AllocatePages)
+{
+	TEST_ASSERT(bm.AllocatePages(source, 0).IsValid() == false);
+
+	const vint count = 40;
+	auto first = bm.AllocatePages(source, count);
+	TEST_ASSERT(first.IsValid());
+	for (vint i = 0; i < count; i++)
+	{
+		BufferPage page{first.index + i};
+		auto numbers = (vuint64_t*)bm.LockPage(source, page);
+		TEST_ASSERT(numbers != nullptr);
+		TEST_ASSERT(numbers[0] == 0);
+		numbers[0] = i + 1;
+		TEST_ASSERT(bm.UnlockPage(source, page, numbers, PersistanceType::Changed));
+	}
+
+	auto next = bm.AllocatePage(source);
+	TEST_ASSERT(next.IsValid());
+	TEST_ASSERT(next.index >= first.index + count);
+	TEST_ASSERT(bm.FreePage(source, BufferPage{first.index + 1}));
+
+	for (vint i = 0; i < count; i++)
+	{
+		BufferPage page{first.index + i};
+		auto numbers = (vuint64_t*)bm.LockPage(source, page, PageLockAccess::Shared);
+		if (i == 1)
+		{
+			TEST_ASSERT(numbers == nullptr);
+		}
+		else
+		{
+			TEST_ASSERT(numbers != nullptr);
+			TEST_ASSERT(numbers[0] == i + 1);
+			TEST_ASSERT(bm.UnlockPage(source, page, numbers, PersistanceType::NoChanging));
+		}
+	}
+}
+
+TEST_CASE_SOURCE(PersistPages)
+{
+	List<BufferPage> pages;
+	for (vint i = 0; i < 8; i++)
+	{
+		auto page = bm.AllocatePage(source);
+		TEST_ASSERT(page.IsValid());
+		auto address = (vint*)bm.LockPage(source, page);
+		TEST_ASSERT(address != nullptr);
+		*address = i;
+		TEST_ASSERT(bm.UnlockPage(source, page, address, PersistanceType::Changed));
+		pages.Add(page);
+	}
+	TEST_ASSERT(bm.PersistPages(source, pages));
+
+	for (vint i = 0; i < pages.Count(); i++)
+	{
+		auto address = (vint*)bm.LockPage(source, pages[i], PageLockAccess::Shared);
+		TEST_ASSERT(address != nullptr);
+		TEST_ASSERT(*address == i);
+		TEST_ASSERT(bm.UnlockPage(source, pages[i], address, PersistanceType::NoChanging));
+	}
+}
+
+TEST_CASE_SOURCE(Checkpoint)
+{
+	TEST_ASSERT(bm.Checkpoint(source));
+	TEST_ASSERT(bm.GetDirtyPageCount(source) == 0);
+	TEST_ASSERT(bm.GetDirtyPageAge(source) == 0);
+
+	BufferPage pages[4];
+	for (vint i = 0; i < 4; i++)
+	{
+		pages[i] = bm.AllocatePage(source);
+		TEST_ASSERT(pages[i].IsValid());
+		auto address = (vint*)bm.LockPage(source, pages[i]);
+		TEST_ASSERT(address != nullptr);
+		*address = i;
+		TEST_ASSERT(bm.UnlockPage(source, pages[i], address, PersistanceType::Changed));
+	}
+	TEST_ASSERT(bm.GetDirtyPageCount(source) >= 4);
+	Thread::Sleep(5);
+	TEST_ASSERT(bm.GetDirtyPageAge(source) > 0);
+
+	auto address = (vint*)bm.LockPage(source, pages[0]);
+	TEST_ASSERT(address != nullptr);
+	TEST_ASSERT(bm.Checkpoint(source));
+	if (bm.GetSourceFileName(source) != L"")
+	{
+		// the exclusively locked page is left for the next checkpoint
+		TEST_ASSERT(bm.GetDirtyPageCount(source) == 1);
+		TEST_ASSERT(bm.GetDirtyPageAge(source) > 0);
+	}
+	*address = 4;
+	TEST_ASSERT(bm.UnlockPage(source, pages[0], address, PersistanceType::Changed));
+
+	TEST_ASSERT(bm.CheckpointAll());
+	if (bm.GetSourceFileName(source) != L"")
+	{
+		TEST_ASSERT(bm.GetDirtyPageCount(source) == 0);
+		TEST_ASSERT(bm.GetDirtyPageAge(source) == 0);
+	}
+
+	for (vint i = 0; i < 4; i++)
+	{
+		auto address = (vint*)bm.LockPage(source, pages[i], PageLockAccess::Shared);
+		TEST_ASSERT(address != nullptr);
+		TEST_ASSERT(*address == (i == 0 ? 4 : i));
+		TEST_ASSERT(bm.UnlockPage(source, pages[i], address, PersistanceType::NoChanging));
+	}
+}
+
+TEST_CASE_SOURCE(ConcurrentLockPage)
+{
+	const vint threadCount = 4;
+	const vint pageCount = 8;
+	BufferPage pages[pageCount];
+	for (vint i = 0; i < pageCount; i++)
+	{
+		pages[i] = bm.AllocatePage(source);
+		TEST_ASSERT(pages[i].IsValid());
+	}
+
+	volatile vint finishedThreads = 0;
+	volatile vint failedOperations = 0;
+	for (vint i = 0; i < threadCount; i++)
+	{
+		Thread::CreateAndStart([&, i]()
+		{
+			for (vint j = 0; j < 1000; j++)
+			{
+				auto page = pages[(i + j) % pageCount];
+				if (auto address = (vint*)bm.LockPage(source, page))
+				{
+					*address = i;
+					if (*address != i || !bm.UnlockPage(source, page, address, PersistanceType::Changed))
+					{
+						INCRC(&failedOperations);
+					}
+				}
+			}
+			INCRC(&finishedThreads);
+		});
+	}
+
+	while (finishedThreads < threadCount)
+	{
+		Thread::Sleep(1);
+	}
+	TEST_ASSERT(failedOperations == 0);
+
+	for (vint i = 0; i < pageCount; i++)
+	{
+		auto address = bm.LockPage(source, pages[i]);
+		TEST_ASSERT(address != nullptr);
+		TEST_ASSERT(bm.UnlockPage(source, pages[i], address, PersistanceType::NoChanging));
+	}
+}
+
 #define TEST_ASSERT_CACHE														\
 	console::Console::Write(L"    <CACHED-PAGE-COUNT>: ");						\
 	console::Console::WriteLine(itow(bm.GetCurrentlyCachedPageCount()));		\
 	TEST_ASSERT(bm.GetCurrentlyCachedPageCount() <= bm.GetCachePageCount());	\
 
-TEST_CASE(Utility_Buffer_AllocateAndSwap)
+void TestAllocateAndSwap(Ptr<IBufferEvictionPolicy> policy, FileIoMode ioMode = FileIoMode::MemoryMapped)
 {
-	BufferManager bm(4 KB, 8);
-	auto s1 = bm.LoadFileSource(TEMP_DIR L"db1.bin", true);
-	auto s2 = bm.LoadFileSource(TEMP_DIR L"db2.bin", true);
+	BufferManager bm(4 KB, 8, policy);
+	auto s1 = bm.LoadFileSource(TEMP_DIR L"db1.bin", true, ioMode);
+	auto s2 = bm.LoadFileSource(TEMP_DIR L"db2.bin", true, ioMode);
 	BufferSource sources[] = {s1, s2};
 	const wchar_t* sourceNames[] = {L"db1.bin ", L"db2.bin "};
 	TEST_ASSERT(bm.GetCachePageCount() == 8);
@@ -179,93 +434,1758 @@ TEST_CASE(Utility_Buffer_AllocateAndSwap)
 	}
 }
 
-TEST_CASE(Utility_Buffer_FileUseMasks)
+TEST_CASE(Utility_Buffer_AllocateAndSwap)
 {
-	vuint64_t pageSize = 4 KB;
-	auto fd = CreateNewFileForFileSource(TEMP_DIR L"db.bin");
-	volatile vuint64_t totalUsedPages = 0;
+	TestAllocateAndSwap(nullptr);
+	TestAllocateAndSwap(CreateLruKEvictionPolicy());
+	TestAllocateAndSwap(CreateTwoQueueEvictionPolicy());
+	TestAllocateAndSwap(CreateArcEvictionPolicy());
+	TestAllocateAndSwap(nullptr, FileIoMode::ReadWrite);
+	TestAllocateAndSwap(nullptr, FileIoMode::DirectReadWrite);
+	TestAllocateAndSwap(nullptr, FileIoMode::RegionMapped);
+}
 
-	FileMapping fileMapping(pageSize, fd, &totalUsedPages);
-	FileUseMasks fileUseMasks(pageSize, fd);
+TEST_CASE(Utility_Buffer_RegionMappedAddresses)
+{
+	BufferManager bm(4 KB, 1024);
+	auto source = bm.LoadFileSource(TEMP_DIR L"db.bin", true, FileIoMode::RegionMapped);
+	TEST_ASSERT(source.IsValid());
 
-	fileMapping.InitializeEmptySource();
-	fileUseMasks.InitializeEmptySource(&fileMapping);
+	auto first = bm.AllocatePage(source);
+	TEST_ASSERT(first.IsValid());
+	auto firstAddress = (char*)bm.LockPage(source, first);
+	TEST_ASSERT(firstAddress != nullptr);
+	TEST_ASSERT(bm.UnlockPage(source, first, firstAddress, PersistanceType::Changed));
 
-	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)1023}) == false);
-	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)1024}) == false);
+	// pages in the same region are laid out as in the file
+	for (vint i = 1; i < 100; i++)
+	{
+		auto page = bm.AllocatePage(source);
+		TEST_ASSERT(page.IsValid());
+		TEST_ASSERT(page.index == first.index + i);
+		auto address = (char*)bm.LockPage(source, page);
+		TEST_ASSERT(address == firstAddress + i * 4 KB);
+		TEST_ASSERT(bm.UnlockPage(source, page, address, PersistanceType::Changed));
+	}
+	TEST_ASSERT(bm.UnloadSource(source));
+}
 
-	fileUseMasks.SetUseMask(BufferPage{(vuint64_t)1024}, true);
-	fileUseMasks.SetUseMask(BufferPage{(vuint64_t)32768}, true);
+TEST_CASE(Utility_Buffer_FileExtents)
+{
+	BufferManager bm(4 KB, 1024);
+	auto source = bm.LoadFileSource(TEMP_DIR L"db.bin", true);
+	TEST_ASSERT(source.IsValid());
 
-	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)1023}) == false);
-	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)1024}) == true);
-	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)32767}) == false);
-	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)32768}) == true);
+	struct stat fileState;
+	auto fileName = wtoa(TEMP_DIR L"db.bin");
+	TEST_ASSERT(stat(fileName.Buffer(), &fileState) == 0);
+	TEST_ASSERT(fileState.st_size == 1 MB);
 
-	fileUseMasks.SetUseMask(BufferPage{(vuint64_t)1023}, true);
-	fileUseMasks.SetUseMask(BufferPage{(vuint64_t)1024}, false);
-	fileUseMasks.SetUseMask(BufferPage{(vuint64_t)32767}, true);
-	fileUseMasks.SetUseMask(BufferPage{(vuint64_t)32768}, false);
+	auto first = bm.AllocatePages(source, 300);
+	TEST_ASSERT(first.IsValid());
+	TEST_ASSERT(stat(fileName.Buffer(), &fileState) == 0);
+	TEST_ASSERT(fileState.st_size == 2 MB);
 
-	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)1023}) == true);
-	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)1024}) == false);
-	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)32767}) == true);
-	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)32768}) == false);
+	// the unused part of the last extent is removed when the source is unloaded
+	TEST_ASSERT(bm.UnloadSource(source));
+	TEST_ASSERT(stat(fileName.Buffer(), &fileState) == 0);
+	TEST_ASSERT(fileState.st_size == (vint64_t)(first.index + 300) * 4 KB);
 
-	fileUseMasks.SetUseMask(BufferPage{(vuint64_t)1023}, false);
-	fileUseMasks.SetUseMask(BufferPage{(vuint64_t)32767}, false);
+	source = bm.LoadFileSource(TEMP_DIR L"db.bin", false);
+	TEST_ASSERT(source.IsValid());
+	auto page = bm.AllocatePage(source);
+	TEST_ASSERT(page.index == first.index + 300);
+	TEST_ASSERT(bm.UnloadSource(source));
+}
 
-	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)1023}) == false);
-	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)1024}) == false);
-	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)32767}) == false);
-	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)32768}) == false);
+TEST_CASE(Utility_Buffer_ReopenWithDifferentIoModes)
+{
+	FileIoMode ioModes[] = {FileIoMode::MemoryMapped, FileIoMode::ReadWrite, FileIoMode::DirectReadWrite, FileIoMode::RegionMapped};
+	List<BufferPage> pages;
+	for (vint i = 0; i < 4; i++)
+	{
+		BufferManager bm(4 KB, 8);
+		auto source = bm.LoadFileSource(TEMP_DIR L"db.bin", i == 0, ioModes[i]);
+		TEST_ASSERT(source.IsValid());
 
-	fileMapping.UnmapAllPages();
-	CloseFileForFileSource(fd);
-	TEST_ASSERT(totalUsedPages == 0);
+		for (vint j = 0; j < pages.Count(); j++)
+		{
+			auto address = (vint*)bm.LockPage(source, pages[j], PageLockAccess::Shared);
+			TEST_ASSERT(address != nullptr);
+			TEST_ASSERT(*address == j);
+			TEST_ASSERT(bm.UnlockPage(source, pages[j], address, PersistanceType::NoChanging));
+		}
+
+		// pages written with Changed are only guaranteed after the source is unloaded
+		for (vint j = 0; j < 8; j++)
+		{
+			auto page = bm.AllocatePage(source);
+			TEST_ASSERT(page.IsValid());
+			auto address = (vint*)bm.LockPage(source, page);
+			TEST_ASSERT(address != nullptr);
+			*address = pages.Count();
+			TEST_ASSERT(bm.UnlockPage(source, page, address, PersistanceType::Changed));
+			pages.Add(page);
+		}
+		TEST_ASSERT(bm.UnloadSource(source));
+	}
 }
 
-TEST_CASE(Utility_Buffer_FileFreePages)
+TEST_CASE(Utility_Buffer_Prefetch)
+{
+	FileIoMode ioModes[] = {FileIoMode::MemoryMapped, FileIoMode::ReadWrite, FileIoMode::DirectReadWrite, FileIoMode::RegionMapped};
+	for (vint i = 0; i < 4; i++)
+	{
+		List<BufferPage> pages;
+		{
+			BufferManager bm(4 KB, 64);
+			auto source = bm.LoadFileSource(TEMP_DIR L"db.bin", true, ioModes[i]);
+			for (vint j = 0; j < 16; j++)
+			{
+				auto page = bm.AllocatePage(source);
+				auto address = (vint*)bm.LockPage(source, page);
+				TEST_ASSERT(address != nullptr);
+				*address = j;
+				TEST_ASSERT(bm.UnlockPage(source, page, address, PersistanceType::Changed));
+				pages.Add(page);
+			}
+			TEST_ASSERT(bm.UnloadSource(source));
+		}
+
+		BufferManager bm(4 KB, 64);
+		auto source = bm.LoadFileSource(TEMP_DIR L"db.bin", false, ioModes[i]);
+		TEST_ASSERT(source.IsValid());
+		vuint64_t cachedPages = bm.GetCurrentlyCachedPageCount();
+
+		// prefetching never evicts pages, so it stops at the number of free frames
+		List<BufferPage> prefetchPages;
+		for (vint j = 0; j < 8; j++)
+		{
+			prefetchPages.Add(pages[j]);
+		}
+		TEST_ASSERT(bm.Prefetch(source, prefetchPages) == 8);
+		for (vint j = 0; j < 1000 && bm.GetCurrentlyCachedPageCount() < cachedPages + 8; j++)
+		{
+			Thread::Sleep(1);
+		}
+		TEST_ASSERT(bm.GetCurrentlyCachedPageCount() == cachedPages + 8);
+
+		for (vint j = 0; j < pages.Count(); j++)
+		{
+			auto address = (vint*)bm.LockPage(source, pages[j], PageLockAccess::Shared);
+			TEST_ASSERT(address != nullptr);
+			TEST_ASSERT(*address == j);
+			TEST_ASSERT(bm.UnlockPage(source, pages[j], address, PersistanceType::NoChanging));
+		}
+
+		// prefetched pages are hits when they are locked for the first time
+		BufferStatistics statistics;
+		TEST_ASSERT(bm.GetStatistics(source, statistics));
+		TEST_ASSERT(statistics.lockCount == 16);
+		TEST_ASSERT(statistics.hitCount >= 8);
+		TEST_ASSERT(statistics.missCount <= 8);
+		TEST_ASSERT(bm.UnloadSource(source));
+	}
+}
+
+TEST_CASE(Utility_Buffer_FileReadahead)
+{
+	FileReadahead readahead(4, 16);
+	TEST_ASSERT(readahead.OnPageMissed(BufferPage{10}) == 0);
+	TEST_ASSERT(readahead.OnPageMissed(BufferPage{11}) == 4);
+	TEST_ASSERT(readahead.OnPageMissed(BufferPage{16}) == 8);
+	TEST_ASSERT(readahead.OnPageMissed(BufferPage{25}) == 16);
+	TEST_ASSERT(readahead.OnPageMissed(BufferPage{42}) == 16);
+	TEST_ASSERT(readahead.OnPageMissed(BufferPage{43}) == 0);
+	TEST_ASSERT(readahead.GetWindow() == 0);
+	TEST_ASSERT(readahead.OnPageMissed(BufferPage{44}) == 4);
+
+	FileIoMode ioModes[] = {FileIoMode::ReadWrite, FileIoMode::DirectReadWrite};
+	for (vint i = 0; i < 2; i++)
+	{
+		volatile vuint64_t totalUsedPages = 0;
+		auto arena = MakePtr<BufferFrameArena>(4 KB, 16, false);
+		auto source = CreateFileSource(BufferSource{0}, &totalUsedPages, nullptr, 4 KB, TEMP_DIR L"db.bin", true, ioModes[i], arena);
+		TEST_ASSERT(source != nullptr);
+		auto first = source->AllocatePages(64);
+		TEST_ASSERT(first.IsValid());
+		source->Unload();
+		delete source;
+
+		source = CreateFileSource(BufferSource{0}, &totalUsedPages, nullptr, 4 KB, TEMP_DIR L"db.bin", false, ioModes[i], arena);
+		TEST_ASSERT(source != nullptr);
+		for (vint j = 0; j < 64; j++)
+		{
+			BufferPage page{first.index + j};
+			auto address = source->LockPage(page, PageLockAccess::Shared);
+			TEST_ASSERT(address != nullptr);
+			TEST_ASSERT(source->UnlockPage(page, address, PersistanceType::NoChanging));
+
+			// frames bypassing the page cache are left to the caller, as the buffer manager queues them to the cleaner
+			List<BufferPage> readaheadPages;
+			source->FillReadaheadPages(readaheadPages);
+			TEST_ASSERT(ioModes[i] == FileIoMode::DirectReadWrite || readaheadPages.Count() == 0);
+			source->PrefetchPages(readaheadPages);
+		}
+
+		auto fileSource = dynamic_cast<FileBufferSource*>(source);
+		if (ioModes[i] == FileIoMode::DirectReadWrite)
+		{
+			// read ahead frames are mapped, so only misses after each window trigger the next one, windows are 4, 8, 16 and the last 31 pages
+			TEST_ASSERT(fileSource->GetReadaheadPageCount() == 59);
+		}
+		else
+		{
+			TEST_ASSERT(fileSource->GetReadaheadPageCount() > 64);
+		}
+		source->Unload();
+		delete source;
+	}
+}
+
+TEST_CASE(Utility_Buffer_Crc32c)
+{
+	TEST_ASSERT(ComputeCrc32c("", 0) == 0);
+	TEST_ASSERT(ComputeCrc32c("123456789", 9) == 0xE3069283);
+
+	// every length exercises both the word loop and the byte loop
+	char buffer[64];
+	for (vint i = 0; i < 64; i++)
+	{
+		buffer[i] = (char)(i * 7 + 1);
+	}
+	vuint32_t crc = ComputeCrc32c(buffer, 64);
+	buffer[37] ^= 1;
+	TEST_ASSERT(ComputeCrc32c(buffer, 64) != crc);
+	buffer[37] ^= 1;
+	TEST_ASSERT(ComputeCrc32c(buffer, 64) == crc);
+	TEST_ASSERT(ComputeCrc32c(buffer + 1, 61) != ComputeCrc32c(buffer, 61));
+}
+
+TEST_CASE(Utility_Buffer_ChecksumSync)
+{
+	FileChecksums checksums(4 KB, CreateNewFileForFileSource(TEMP_DIR L"db.bin.crc"));
+	char buffer[4 KB];
+	memset(buffer, 1, sizeof(buffer));
+	BufferPageDesc pageDesc;
+	pageDesc.page = BufferPage{(vuint64_t)3};
+	pageDesc.address = buffer;
+	List<BufferPageDesc*> pageDescs;
+	List<void*> images;
+	pageDescs.Add(&pageDesc);
+	images.Add(buffer);
+
+	TEST_ASSERT(checksums.NeedsSync(pageDescs) == false);
+	TEST_ASSERT(checksums.Update(pageDescs, images));
+	checksums.EndWrite(pageDescs, false);
+
+	// the file could still contain the page before the first write, so the second write waits for a synchronization
+	buffer[0] = 2;
+	TEST_ASSERT(checksums.NeedsSync(pageDescs) == true);
+	TEST_ASSERT(checksums.Update(pageDescs, images) == false);
+	checksums.EndSync(checksums.BeginSync());
+	TEST_ASSERT(checksums.NeedsSync(pageDescs) == false);
+	TEST_ASSERT(checksums.Update(pageDescs, images));
+
+	// a write that ends after a synchronization begins is not covered by it
+	vuint64_t serial = checksums.BeginSync();
+	checksums.EndWrite(pageDescs, false);
+	checksums.EndSync(serial);
+	TEST_ASSERT(checksums.NeedsSync(pageDescs) == true);
+	checksums.EndSync(checksums.BeginSync());
+	TEST_ASSERT(checksums.NeedsSync(pageDescs) == false);
+
+	// both written versions are accepted
+	TEST_ASSERT(checksums.Verify(pageDesc.page, buffer));
+	buffer[0] = 1;
+	TEST_ASSERT(checksums.Verify(pageDesc.page, buffer));
+	buffer[0] = 3;
+	TEST_ASSERT(checksums.Verify(pageDesc.page, buffer) == false);
+	TEST_ASSERT(checksums.GetFailureCount() == 1);
+}
+
+TEST_CASE(Utility_Buffer_PageSnapshot)
+{
+	char buffer[4 KB];
+	char image[4 KB];
+	memset(buffer, 1, sizeof(buffer));
+	BufferPageDesc pageDesc;
+	pageDesc.address = buffer;
+
+	TEST_ASSERT(pageDesc.TryLock(PageLockAccess::Shared));
+	TEST_ASSERT(pageDesc.TrySnapshot(image, sizeof(image)));
+	TEST_ASSERT(memcmp(buffer, image, sizeof(image)) == 0);
+	TEST_ASSERT(pageDesc.Unlock());
+
+	// a page being changed is not copied, unless its owner is persisting it
+	TEST_ASSERT(pageDesc.TryLock(PageLockAccess::Exclusive));
+	buffer[0] = 2;
+	TEST_ASSERT(pageDesc.TrySnapshot(image, sizeof(image)) == false);
+	pageDesc.persisting = true;
+	TEST_ASSERT(pageDesc.TrySnapshot(image, sizeof(image)));
+	TEST_ASSERT(image[0] == 2);
+	pageDesc.persisting = false;
+	TEST_ASSERT(pageDesc.Unlock());
+
+	TEST_ASSERT(pageDesc.TryLock(PageLockAccess::Shared));
+	TEST_ASSERT(pageDesc.TryUpgrade());
+	TEST_ASSERT(pageDesc.exclusiveLockCount == 2);
+	TEST_ASSERT(pageDesc.Unlock());
+}
+
+TEST_CASE(Utility_Buffer_PageChecksums)
 {
-	vuint64_t pageSize = 4 KB;
-	auto fd = CreateNewFileForFileSource(TEMP_DIR L"db.bin");
 	volatile vuint64_t totalUsedPages = 0;
+	auto arena = MakePtr<BufferFrameArena>(4 KB, 16, false);
+	TEST_ASSERT(CreateFileSource(BufferSource{0}, &totalUsedPages, nullptr, 4 KB, TEMP_DIR L"db.bin", true, FileIoMode::MemoryMapped, nullptr, true) == nullptr);
 
-	FileMapping fileMapping(pageSize, fd, &totalUsedPages);
-	FileUseMasks fileUseMasks(pageSize, fd);
-	FileFreePages fileFreePages(pageSize);
+	FileIoMode ioModes[] = {FileIoMode::ReadWrite, FileIoMode::DirectReadWrite};
+	for (vint i = 0; i < 2; i++)
+	{
+		auto source = CreateFileSource(BufferSource{0}, &totalUsedPages, nullptr, 4 KB, TEMP_DIR L"db.bin", true, ioModes[i], arena, true);
+		TEST_ASSERT(source != nullptr);
+		auto first = source->AllocatePages(16);
+		TEST_ASSERT(first.IsValid());
+		for (vint j = 0; j < 16; j++)
+		{
+			BufferPage page{first.index + j};
+			auto address = source->LockPage(page, PageLockAccess::Exclusive);
+			TEST_ASSERT(address != nullptr);
+			memset(address, (int)j + 1, 4 KB);
+			TEST_ASSERT(source->UnlockPage(page, address, j % 2 == 0 ? PersistanceType::Changed : PersistanceType::ChangedAndPersist));
+		}
+		source->Unload();
+		delete source;
 
-	fileMapping.InitializeEmptySource();
-	fileUseMasks.InitializeEmptySource(&fileMapping);
-	fileFreePages.InitializeEmptySource(&fileMapping, &fileUseMasks);
+		List<vuint64_t> corruptedPages;
+		TEST_ASSERT(VerifyFileSource(TEMP_DIR L"db.bin", 4 KB, 4, corruptedPages));
+		TEST_ASSERT(corruptedPages.Count() == 0);
+
+		// a byte of the sixth page is changed behind the source
+		{
+			int fd = open(wtoa(TEMP_DIR L"db.bin").Buffer(), O_RDWR);
+			TEST_ASSERT(fd != -1);
+			char byte = 0;
+			TEST_ASSERT(pwrite(fd, &byte, 1, (first.index + 5) * 4 KB + 100) == 1);
+			close(fd);
+		}
+		TEST_ASSERT(VerifyFileSource(TEMP_DIR L"db.bin", 4 KB, 4, corruptedPages));
+		TEST_ASSERT(corruptedPages.Count() == 1);
+		TEST_ASSERT(corruptedPages[0] == first.index + 5);
+		TEST_ASSERT(VerifyFileSource(TEMP_DIR L"db.bin", 4 KB, 1, corruptedPages));
+		TEST_ASSERT(corruptedPages.Count() == 1);
 
-	vint pushCount = 1024;
-	for (vint i = 0; i < pushCount; i++)
+		source = CreateFileSource(BufferSource{0}, &totalUsedPages, nullptr, 4 KB, TEMP_DIR L"db.bin", false, ioModes[i], arena, true);
+		TEST_ASSERT(source != nullptr);
+		auto fileSource = dynamic_cast<FileBufferSource*>(source);
+		TEST_ASSERT(source->LockPage(BufferPage{first.index + 5}, PageLockAccess::Shared) == nullptr);
+		TEST_ASSERT(fileSource->GetChecksumFailureCount() == 1);
+		for (vint j = 6; j < 16; j++)
+		{
+			BufferPage page{first.index + j};
+			auto address = source->LockPage(page, PageLockAccess::Shared);
+			TEST_ASSERT(address != nullptr);
+			TEST_ASSERT(((char*)address)[4 KB - 1] == (char)(j + 1));
+			TEST_ASSERT(source->UnlockPage(page, address, PersistanceType::NoChanging));
+		}
+		source->Unload();
+		delete source;
+
+		// opening the file without checksums removes the checksum file
+		struct stat fileState;
+		TEST_ASSERT(stat(wtoa(GetChecksumFileName(TEMP_DIR L"db.bin")).Buffer(), &fileState) == 0);
+		source = CreateFileSource(BufferSource{0}, &totalUsedPages, nullptr, 4 KB, TEMP_DIR L"db.bin", false, ioModes[i], arena);
+		TEST_ASSERT(source != nullptr);
+		source->Unload();
+		delete source;
+		TEST_ASSERT(stat(wtoa(GetChecksumFileName(TEMP_DIR L"db.bin")).Buffer(), &fileState) == -1);
+		TEST_ASSERT(!VerifyFileSource(TEMP_DIR L"db.bin", 4 KB, 4, corruptedPages));
+	}
+}
+
+namespace
+{
+	void FillTextPage(char* buffer, vuint64_t size, vint seed)
 	{
-		BufferPage page{(vuint64_t)(1024 + i)};
-		console::Console::WriteLine(L"Pushing free page: " + itow(page.index));
-		fileFreePages.PushFreePage(page);
+		vuint64_t written = 0;
+		vint row = 0;
+		while (written < size)
+		{
+			char line[64];
+			int length = snprintf(line, sizeof(line), "page %d row %d value %d\n", (int)seed, (int)row, (int)(seed * 31 + row * 7));
+			vuint64_t copied = size - written < (vuint64_t)length ? size - written : (vuint64_t)length;
+			memcpy(buffer + written, line, copied);
+			written += copied;
+			row++;
+		}
 	}
-	for (vint i = pushCount - 1; i >= 0; i--)
+}
+
+TEST_CASE(Utility_Buffer_PageCompression)
+{
+	const vuint64_t size = 4 KB;
+	char page[size], compressed[size], decompressed[size];
+
+	memset(page, 0, size);
+	vuint64_t length = CompressPage(page, size, compressed, size);
+	TEST_ASSERT(0 < length && length < 64);
+	TEST_ASSERT(DecompressPage(compressed, length, decompressed, size));
+	TEST_ASSERT(memcmp(page, decompressed, size) == 0);
+
+	FillTextPage(page, size, 7);
+	length = CompressPage(page, size, compressed, size);
+	TEST_ASSERT(0 < length && length < size / 2);
+	TEST_ASSERT(DecompressPage(compressed, length, decompressed, size));
+	TEST_ASSERT(memcmp(page, decompressed, size) == 0);
+
+	// corrupted or truncated input never writes outside of the output
+	TEST_ASSERT(!DecompressPage(compressed, length - 1, decompressed, size));
+	TEST_ASSERT(!DecompressPage(compressed, length, decompressed, size - 1));
+
+	vuint64_t random = 1;
+	for (vuint64_t i = 0; i < size; i++)
 	{
-		auto page = fileFreePages.PopFreePage();
-		console::Console::WriteLine(L"Popping free page: " + itow(page.index) + L", expecting " + itow(1024 + i));
-		TEST_ASSERT(page.index == 1024 + i);
+		random = random * 6364136223846793005ULL + 1442695040888963407ULL;
+		page[i] = (char)(random >> 56);
 	}
-	for (vint i = 0; i < pushCount; i++)
+	TEST_ASSERT(CompressPage(page, size, compressed, size / 4 * 3) == 0);
+	length = CompressPage(page, size, compressed, size);
+	if (length > 0)
 	{
-		BufferPage page{(vuint64_t)(1024 + i)};
-		console::Console::WriteLine(L"Pushing free page: " + itow(page.index));
-		fileFreePages.PushFreePage(page);
+		TEST_ASSERT(DecompressPage(compressed, length, decompressed, size));
+		TEST_ASSERT(memcmp(page, decompressed, size) == 0);
 	}
-	for (vint i = pushCount - 1; i >= 0; i--)
+}
+
+TEST_CASE(Utility_Buffer_CompressedTier)
+{
+	const vuint64_t size = 4 KB;
+	char page[size], compressed[size], loaded[size];
+	BufferSource source{0};
+
+	BufferCompressedTier tier(size);
+	memset(page, 0, size);
+	TEST_ASSERT(!tier.Store(source, BufferPage{0}, page));
+
+	vuint64_t length = CompressPage(page, size, compressed, size);
+	tier.SetCapacity(length * 2);
+	TEST_ASSERT(tier.Store(source, BufferPage{0}, page));
+	TEST_ASSERT(tier.Store(source, BufferPage{1}, page));
+	TEST_ASSERT(tier.Store(source, BufferPage{2}, page));
+	auto statistics = tier.GetStatistics();
+	TEST_ASSERT(statistics.pageCount == 2);
+	TEST_ASSERT(statistics.usedBytes == length * 2);
+	TEST_ASSERT(statistics.droppedPages == 1);
+
+	// pages leave the tier when they are loaded
+	TEST_ASSERT(!tier.Load(source, BufferPage{0}, loaded));
+	TEST_ASSERT(tier.Load(source, BufferPage{2}, loaded));
+	TEST_ASSERT(memcmp(page, loaded, size) == 0);
+	TEST_ASSERT(!tier.Load(source, BufferPage{2}, loaded));
+	tier.Remove(source, BufferPage{1});
+	TEST_ASSERT(!tier.Load(source, BufferPage{1}, loaded));
+
+	statistics = tier.GetStatistics();
+	TEST_ASSERT(statistics.pageCount == 0);
+	TEST_ASSERT(statistics.lookups == 4);
+	TEST_ASSERT(statistics.hits == 1);
+	TEST_ASSERT(statistics.hitRatio == 0.25);
+
+	tier.SetCapacity(1 MB);
+	for (vint i = 0; i < 8; i++)
 	{
-		auto page = fileFreePages.PopFreePage();
-		console::Console::WriteLine(L"Popping free page: " + itow(page.index) + L", expecting " + itow(1024 + i));
-		TEST_ASSERT(page.index == 1024 + i);
+		FillTextPage(page, size, i);
+		TEST_ASSERT(tier.Store(BufferSource{(vuint64_t)(i % 2)}, BufferPage{(vuint64_t)i}, page));
 	}
+	tier.RemoveSource(BufferSource{0});
+	TEST_ASSERT(tier.GetStatistics().pageCount == 4);
+	TEST_ASSERT(tier.Load(BufferSource{1}, BufferPage{5}, loaded));
+	FillTextPage(page, size, 5);
+	TEST_ASSERT(memcmp(page, loaded, size) == 0);
+	tier.SetCapacity(0);
+	TEST_ASSERT(tier.GetStatistics().pageCount == 0);
+}
 
-	fileMapping.UnmapAllPages();
-	CloseFileForFileSource(fd);
-	TEST_ASSERT(totalUsedPages == 0);
+TEST_CASE(Utility_Buffer_CompressedCache)
+{
+	for (vint i = 0; i < 2; i++)
+	{
+		BufferManager bm(4 KB, 16);
+		TEST_ASSERT(bm.GetCompressedCacheSize() == 0);
+		bm.SetCompressedCacheSize(1 MB);
+		TEST_ASSERT(bm.GetCompressedCacheSize() == 1 MB);
+
+		auto source = i == 0
+			? bm.LoadMemorySource()
+			: bm.LoadFileSource(TEMP_DIR L"db.bin", true, FileIoMode::ReadWrite)
+			;
+		TEST_ASSERT(source.IsValid());
+		auto first = bm.AllocatePages(source, 64);
+		TEST_ASSERT(first.IsValid());
+		for (vint j = 0; j < 64; j++)
+		{
+			BufferPage page{first.index + j};
+			auto address = bm.LockPage(source, page, PageLockAccess::Exclusive);
+			TEST_ASSERT(address != nullptr);
+			FillTextPage((char*)address, 4 KB, j);
+			TEST_ASSERT(bm.UnlockPage(source, page, address, PersistanceType::Changed));
+		}
+
+		// at most 16 pages are in frames, evicted pages come back from the tier
+		char expected[4 KB];
+		for (vint k = 0; k < 2; k++)
+		{
+			for (vint j = 0; j < 64; j++)
+			{
+				BufferPage page{first.index + j};
+				auto address = bm.LockPage(source, page, PageLockAccess::Shared);
+				TEST_ASSERT(address != nullptr);
+				FillTextPage(expected, 4 KB, j);
+				TEST_ASSERT(memcmp(address, expected, 4 KB) == 0);
+				TEST_ASSERT(bm.UnlockPage(source, page, address, PersistanceType::NoChanging));
+			}
+		}
+
+		auto statistics = bm.GetCompressedTierStatistics();
+		TEST_ASSERT(statistics.storedPages > 0);
+		TEST_ASSERT(statistics.hits > 0);
+		TEST_ASSERT(statistics.hitRatio > 0);
+		TEST_ASSERT(statistics.usedBytes <= 1 MB);
+		TEST_ASSERT(bm.UnloadSource(source));
+		TEST_ASSERT(bm.GetCompressedTierStatistics().pageCount == 0);
+	}
+}
+
+TEST_CASE(Utility_Buffer_LatencyHistogram)
+{
+	for (vuint64_t i = 0; i < 100000; i += 7)
+	{
+		vint bucket = BufferLatencyHistogram::GetBucket(i);
+		TEST_ASSERT(i <= BufferLatencyHistogram::GetBucketUpperBound(bucket));
+		TEST_ASSERT(bucket == 0 || i > BufferLatencyHistogram::GetBucketUpperBound(bucket - 1));
+	}
+	TEST_ASSERT(BufferLatencyHistogram::GetBucket(~(vuint64_t)0) == BufferLatencyHistogram::BucketCount - 1);
+
+	BufferLatencyHistogram histogram;
+	TEST_ASSERT(histogram.GetMean() == 0);
+	TEST_ASSERT(histogram.GetPercentile(0.5) == 0);
+	for (vuint64_t i = 1; i <= 100; i++)
+	{
+		vuint64_t nanoseconds = i * 1000;
+		histogram.buckets[BufferLatencyHistogram::GetBucket(nanoseconds)]++;
+		histogram.count++;
+		histogram.totalNanoseconds += nanoseconds;
+	}
+	TEST_ASSERT(histogram.GetMean() == 50500);
+
+	// buckets are at most a quarter of an octave wide
+	vuint64_t p50 = histogram.GetPercentile(0.5);
+	vuint64_t p99 = histogram.GetPercentile(0.99);
+	TEST_ASSERT(p50 >= 50000 && p50 < 50000 / 4 * 5);
+	TEST_ASSERT(p99 >= 99000 && p99 < 99000 / 4 * 5);
+	TEST_ASSERT(histogram.GetPercentile(1) >= 100000);
+}
+
+TEST_CASE(Utility_Buffer_Statistics)
+{
+	BufferStatisticsCollector collector;
+	collector.Increase(BufferCounter::Locks, 4);
+	collector.Increase(BufferCounter::Hits, 3);
+	collector.Record(BufferLatency::Flush, 1000);
+	BufferStatistics collected;
+	collector.Fill(collected);
+	TEST_ASSERT(collected.lockCount == 4);
+	TEST_ASSERT(collected.hitCount == 3);
+	TEST_ASSERT(collected.hitRatio == 0.75);
+	TEST_ASSERT(collected.flushLatency.count == 1);
+	TEST_ASSERT(collected.flushLatency.totalNanoseconds == 1000);
+
+	for (vint i = 0; i < 2; i++)
+	{
+		BufferManager bm(4 KB, 16);
+		auto source = i == 0
+			? bm.LoadMemorySource()
+			: bm.LoadFileSource(TEMP_DIR L"db.bin", true, FileIoMode::ReadWrite)
+			;
+		TEST_ASSERT(source.IsValid());
+		auto first = bm.AllocatePages(source, 64);
+		TEST_ASSERT(first.IsValid());
+		for (vint j = 0; j < 64; j++)
+		{
+			BufferPage page{first.index + j};
+			auto address = bm.LockPage(source, page, PageLockAccess::Exclusive);
+			TEST_ASSERT(address != nullptr);
+			memset(address, (char)j, 4 KB);
+			TEST_ASSERT(bm.UnlockPage(source, page, address, PersistanceType::Changed));
+		}
+		TEST_ASSERT(bm.CheckpointAll());
+
+		for (vint j = 0; j < 64; j++)
+		{
+			// the second lock of a page always finds it in a frame
+			BufferPage page{first.index + j};
+			for (vint k = 0; k < 2; k++)
+			{
+				auto address = bm.LockPage(source, page, PageLockAccess::Shared);
+				TEST_ASSERT(address != nullptr);
+				TEST_ASSERT(bm.UnlockPage(source, page, address, PersistanceType::NoChanging));
+			}
+		}
+		TEST_ASSERT(bm.LockPage(BufferSource::Invalid(), first) == nullptr);
+
+		auto statistics = bm.GetStatistics();
+		TEST_ASSERT(statistics.lockCount == 192);
+		TEST_ASSERT(statistics.unlockCount == 192);
+		TEST_ASSERT(statistics.hitCount + statistics.missCount == statistics.lockCount);
+		TEST_ASSERT(statistics.hitCount >= 64);
+		TEST_ASSERT(statistics.missCount > 0);
+		TEST_ASSERT(statistics.evictionCount > 0);
+		TEST_ASSERT(statistics.flushCount == 1);
+		TEST_ASSERT(statistics.flushLatency.count == 1);
+		TEST_ASSERT(statistics.lockPageLatency.count == 192);
+		TEST_ASSERT(statistics.unlockPageLatency.count == 192);
+		TEST_ASSERT(statistics.writeBackLatency.count == statistics.writeBackCount);
+		TEST_ASSERT(statistics.hitRatio > 0 && statistics.hitRatio < 1);
+
+		BufferStatistics sourceStatistics;
+		TEST_ASSERT(bm.GetStatistics(source, sourceStatistics));
+		TEST_ASSERT(sourceStatistics.lockCount == 192);
+		TEST_ASSERT(sourceStatistics.hitCount == statistics.hitCount);
+		TEST_ASSERT(sourceStatistics.cachedPageCount == bm.GetCachedPageCount(source));
+		TEST_ASSERT(!bm.GetStatistics(BufferSource::Invalid(), sourceStatistics));
+
+		auto dump = bm.DumpStatistics();
+		TEST_ASSERT(INVLOC.FindFirst(dump, L"buffer manager:", Locale::None).key == 0);
+		TEST_ASSERT(INVLOC.FindFirst(dump, L"source " + u64tow(source.index), Locale::None).key > 0);
+		TEST_ASSERT(INVLOC.FindFirst(dump, L"LockPage: count 192", Locale::None).key > 0);
+
+		TEST_ASSERT(bm.UnloadSource(source));
+		TEST_ASSERT(!bm.GetStatistics(source, sourceStatistics));
+		TEST_ASSERT(bm.GetStatistics().lockCount == 192);
+	}
+}
+
+TEST_CASE(Utility_Buffer_HotPageFile)
+{
+	auto fileName = TEMP_DIR L"db.bin";
+	auto hotPageFileName = wtoa(GetHotPageFileName(fileName));
+	unlink(hotPageFileName.Buffer());
+
+	List<BufferPage> pages;
+	TEST_ASSERT(!LoadHotPages(fileName, pages));
+	vuint64_t indices[] = {5, 3, 4, 10, 3};
+	for (auto index : indices)
+	{
+		pages.Add(BufferPage{index});
+	}
+	TEST_ASSERT(SaveHotPages(fileName, pages));
+
+	// two runs, 3-5 and 10
+	struct stat fileState;
+	TEST_ASSERT(stat(hotPageFileName.Buffer(), &fileState) == 0);
+	TEST_ASSERT(fileState.st_size == sizeof(vuint64_t) * 6);
+	TEST_ASSERT(LoadHotPages(fileName, pages));
+	TEST_ASSERT(pages.Count() == 4);
+	TEST_ASSERT(pages[0].index == 3);
+	TEST_ASSERT(pages[1].index == 4);
+	TEST_ASSERT(pages[2].index == 5);
+	TEST_ASSERT(pages[3].index == 10);
+
+	TEST_ASSERT(truncate(hotPageFileName.Buffer(), sizeof(vuint64_t) * 4) == 0);
+	TEST_ASSERT(!LoadHotPages(fileName, pages));
+	TEST_ASSERT(pages.Count() == 0);
+	unlink(hotPageFileName.Buffer());
+}
+
+TEST_CASE(Utility_Buffer_HotPages)
+{
+	auto fileName = TEMP_DIR L"db.bin";
+	auto hotPageFileName = wtoa(GetHotPageFileName(fileName));
+	BufferPage first;
+	{
+		BufferManager bm(4 KB, 128);
+		auto source = bm.LoadFileSource(fileName, true, FileIoMode::ReadWrite, BufferSourceQuota(), false, true);
+		TEST_ASSERT(source.IsValid());
+		first = bm.AllocatePages(source, 64);
+		TEST_ASSERT(first.IsValid());
+		for (vint i = 0; i < 64; i++)
+		{
+			BufferPage page{first.index + i};
+			auto address = bm.LockPage(source, page, PageLockAccess::Exclusive);
+			TEST_ASSERT(address != nullptr);
+			memset(address, (char)i, 4 KB);
+			TEST_ASSERT(bm.UnlockPage(source, page, address, PersistanceType::Changed));
+		}
+		TEST_ASSERT(bm.CheckpointAll());
+		TEST_ASSERT(bm.RecordHotPages(source));
+
+		List<BufferPage> pages;
+		TEST_ASSERT(LoadHotPages(fileName, pages));
+		TEST_ASSERT(pages.Count() == (vint)bm.GetCachedPageCount(source));
+
+		auto memorySource = bm.LoadMemorySource();
+		TEST_ASSERT(!bm.RecordHotPages(memorySource));
+		TEST_ASSERT(bm.UnloadSource(source));
+	}
+	{
+		// recorded pages are prefetched in the background, so later locks do not miss
+		BufferManager bm(4 KB, 128);
+		auto source = bm.LoadFileSource(fileName, false, FileIoMode::ReadWrite, BufferSourceQuota(), false, true);
+		TEST_ASSERT(source.IsValid());
+		for (vint i = 0; i < 5000 && bm.GetCachedPageCount(source) < 64; i++)
+		{
+			Thread::Sleep(1);
+		}
+		TEST_ASSERT(bm.GetCachedPageCount(source) >= 64);
+
+		for (vint i = 0; i < 64; i++)
+		{
+			BufferPage page{first.index + i};
+			auto address = (char*)bm.LockPage(source, page, PageLockAccess::Shared);
+			TEST_ASSERT(address != nullptr);
+			TEST_ASSERT(address[0] == (char)i && address[4 KB - 1] == (char)i);
+			TEST_ASSERT(bm.UnlockPage(source, page, address, PersistanceType::NoChanging));
+		}
+		TEST_ASSERT(bm.GetStatistics().missCount == 0);
+	}
+	{
+		// the cleaner records hot pages periodically while pages are accessed
+		unlink(hotPageFileName.Buffer());
+		BufferManager bm(4 KB, 128);
+		TEST_ASSERT(bm.GetHotPageInterval() == 0);
+		bm.SetHotPageInterval(10);
+		TEST_ASSERT(bm.GetHotPageInterval() == 10);
+		auto source = bm.LoadFileSource(fileName, false, FileIoMode::ReadWrite, BufferSourceQuota(), false, true);
+		TEST_ASSERT(source.IsValid());
+		for (vint i = 0; i < 5000 && access(hotPageFileName.Buffer(), F_OK) != 0; i++)
+		{
+			BufferPage page{first.index + i % 64};
+			auto address = bm.LockPage(source, page, PageLockAccess::Shared);
+			TEST_ASSERT(address != nullptr);
+			TEST_ASSERT(bm.UnlockPage(source, page, address, PersistanceType::NoChanging));
+			Thread::Sleep(1);
+		}
+		TEST_ASSERT(access(hotPageFileName.Buffer(), F_OK) == 0);
+	}
+	{
+		// a new file forgets pages of the previous one
+		BufferManager bm(4 KB, 128);
+		auto source = bm.LoadFileSource(fileName, true, FileIoMode::ReadWrite);
+		TEST_ASSERT(source.IsValid());
+		TEST_ASSERT(access(hotPageFileName.Buffer(), F_OK) != 0);
+	}
+}
+
+TEST_CASE(Utility_Buffer_ScanRing)
+{
+	FileIoMode ioModes[] = {FileIoMode::MemoryMapped, FileIoMode::ReadWrite};
+	for (vint i = 0; i < 2; i++)
+	{
+		BufferPage first;
+		{
+			BufferManager bm(4 KB, 32);
+			auto source = bm.LoadFileSource(TEMP_DIR L"db.bin", true, ioModes[i]);
+			first = bm.AllocatePages(source, 64);
+			TEST_ASSERT(first.IsValid());
+			TEST_ASSERT(bm.UnloadSource(source));
+		}
+
+		BufferManager bm(4 KB, 32);
+		auto source = bm.LoadFileSource(TEMP_DIR L"db.bin", false, ioModes[i]);
+		TEST_ASSERT(source.IsValid());
+		auto lockPage = [&](vint index, BufferAccessStrategy* strategy)
+		{
+			BufferPage page{first.index + index};
+			auto address = bm.LockPage(source, page, PageLockAccess::Shared, strategy);
+			TEST_ASSERT(address != nullptr);
+			TEST_ASSERT(bm.UnlockPage(source, page, address, PersistanceType::NoChanging));
+		};
+
+		for (vint j = 0; j < 8; j++)
+		{
+			lockPage(j, nullptr);
+		}
+		vuint64_t cachedPages = bm.GetCurrentlyCachedPageCount();
+
+		// the scan also reads hot pages, they are already cached and stay in the shared cache
+		BufferAccessStrategy strategy(4);
+		TEST_ASSERT(strategy.GetRingSize() == 4);
+		for (vint j = 0; j < 64; j++)
+		{
+			lockPage(j, &strategy);
+		}
+		TEST_ASSERT(strategy.GetRecycledPageCount() == 56 - 4);
+		TEST_ASSERT(bm.GetCurrentlyCachedPageCount() == cachedPages + 4);
+
+		for (vint j = 0; j < 8; j++)
+		{
+			lockPage(j, nullptr);
+		}
+		TEST_ASSERT(bm.GetCurrentlyCachedPageCount() == cachedPages + 4);
+
+		// a page in the ring that others access is left to the eviction policy
+		lockPage(60, nullptr);
+		lockPage(61, nullptr);
+		for (vint j = 8; j < 12; j++)
+		{
+			lockPage(j, &strategy);
+		}
+		TEST_ASSERT(strategy.GetRecycledPageCount() == 56 - 4 + 2);
+		TEST_ASSERT(bm.GetCurrentlyCachedPageCount() == cachedPages + 6);
+		TEST_ASSERT(bm.UnloadSource(source));
+	}
+}
+
+void TestSourceQuotas(Ptr<IBufferEvictionPolicy> policy)
+{
+	BufferManager bm(4 KB, 64, policy);
+	BufferSourceQuota logQuota;
+	logQuota.maxPages = 8;
+	BufferSourceQuota indexQuota;
+	indexQuota.reservedPages = 16;
+	BufferSourceQuota hotQuota;
+	hotQuota.priority = 1;
+
+	auto log = bm.LoadFileSource(TEMP_DIR L"log.bin", true, FileIoMode::ReadWrite, logQuota);
+	auto index = bm.LoadFileSource(TEMP_DIR L"index.bin", true, FileIoMode::MemoryMapped, indexQuota);
+	auto hot = bm.LoadFileSource(TEMP_DIR L"hot.bin", true, FileIoMode::MemoryMapped, hotQuota);
+	auto data = bm.LoadFileSource(TEMP_DIR L"db.bin", true);
+	TEST_ASSERT(log.IsValid() && index.IsValid() && hot.IsValid() && data.IsValid());
+
+	BufferSourceQuota quota;
+	TEST_ASSERT(bm.GetSourceQuota(log, quota));
+	TEST_ASSERT(quota.maxPages == 8 && quota.reservedPages == 0 && quota.priority == 0);
+
+	auto readPages = [&](BufferSource source, BufferPage first, vint count)
+	{
+		for (vint i = 0; i < count; i++)
+		{
+			BufferPage page{first.index + i};
+			auto address = (vint*)bm.LockPage(source, page, PageLockAccess::Shared);
+			TEST_ASSERT(address != nullptr);
+			TEST_ASSERT(bm.UnlockPage(source, page, address, PersistanceType::NoChanging));
+		}
+	};
+
+	// a capped source writes back and unmaps its own pages
+	List<BufferPage> logPages;
+	for (vint i = 0; i < 32; i++)
+	{
+		auto page = bm.AllocatePage(log);
+		auto address = (vint*)bm.LockPage(log, page);
+		TEST_ASSERT(address != nullptr);
+		*address = i;
+		TEST_ASSERT(bm.UnlockPage(log, page, address, PersistanceType::Changed));
+		logPages.Add(page);
+		TEST_ASSERT(bm.GetCachedPageCount(log) <= 8);
+	}
+	for (vint i = 0; i < logPages.Count(); i++)
+	{
+		auto address = (vint*)bm.LockPage(log, logPages[i], PageLockAccess::Shared);
+		TEST_ASSERT(address != nullptr);
+		TEST_ASSERT(*address == i);
+		TEST_ASSERT(bm.UnlockPage(log, logPages[i], address, PersistanceType::NoChanging));
+		TEST_ASSERT(bm.GetCachedPageCount(log) <= 8);
+	}
+
+	// reserved pages and pages with a higher priority survive a flood from another source
+	auto indexFirst = bm.AllocatePages(index, 16);
+	auto hotFirst = bm.AllocatePages(hot, 16);
+	auto dataFirst = bm.AllocatePages(data, 256);
+	readPages(index, indexFirst, 16);
+	readPages(hot, hotFirst, 16);
+	readPages(data, dataFirst, 256);
+	TEST_ASSERT(bm.GetCachedPageCount(index) >= 16);
+	TEST_ASSERT(bm.GetCachedPageCount(hot) >= 16);
+	TEST_ASSERT(bm.GetCurrentlyCachedPageCount() <= 64);
+
+	// quotas could be changed at runtime
+	hotQuota.maxPages = 4;
+	TEST_ASSERT(bm.SetSourceQuota(hot, hotQuota));
+	TEST_ASSERT(bm.GetCachedPageCount(hot) <= 4);
+	TEST_ASSERT(bm.GetSourceQuota(hot, quota));
+	TEST_ASSERT(quota.maxPages == 4 && quota.priority == 1);
+
+	TEST_ASSERT(bm.UnloadSource(log));
+	TEST_ASSERT(!bm.GetSourceQuota(log, quota));
+	TEST_ASSERT(!bm.SetSourceQuota(log, logQuota));
+}
+
+TEST_CASE(Utility_Buffer_SourceQuotas)
+{
+	TestSourceQuotas(nullptr);
+	TestSourceQuotas(CreateLruKEvictionPolicy());
+	TestSourceQuotas(CreateTwoQueueEvictionPolicy());
+	TestSourceQuotas(CreateArcEvictionPolicy());
+}
+
+TEST_CASE(Utility_Buffer_GroupFlusher)
+{
+	List<vint> batchSizes;
+	List<vuint64_t> flushedOffsets;
+	volatile bool firstBatchStarted = false;
+	volatile bool failing = false;
+	BufferGroupFlusher flusher([&](BufferGroupFlusher::PageDescList& pageDescs)
+	{
+		batchSizes.Add(pageDescs.Count());
+		FOREACH(Ptr<BufferPageDesc>, pageDesc, pageDescs)
+		{
+			flushedOffsets.Add(pageDesc->offset);
+		}
+		if (!firstBatchStarted)
+		{
+			firstBatchStarted = true;
+			Thread::Sleep(200);
+		}
+		return !failing;
+	});
+
+	auto flushPage = [&](vuint64_t offset)
+	{
+		auto pageDesc = MakePtr<BufferPageDesc>();
+		pageDesc->offset = offset;
+		BufferGroupFlusher::PageDescList pageDescs;
+		pageDescs.Add(pageDesc);
+		return flusher.Flush(pageDescs);
+	};
+
+	// pages registered while a batch is being flushed join the next batch
+	const vint threadCount = 3;
+	volatile vint finishedThreads = 0;
+	volatile vint failedFlushes = 0;
+	Thread::CreateAndStart([&]()
+	{
+		if (!flushPage(3)) INCRC(&failedFlushes);
+		INCRC(&finishedThreads);
+	});
+	while (!firstBatchStarted)
+	{
+		Thread::Sleep(1);
+	}
+	for (vint i = 0; i < threadCount; i++)
+	{
+		Thread::CreateAndStart([&, i]()
+		{
+			if (!flushPage(9 - i * 2)) INCRC(&failedFlushes);
+			INCRC(&finishedThreads);
+		});
+	}
+	while (finishedThreads < threadCount + 1)
+	{
+		Thread::Sleep(1);
+	}
+
+	TEST_ASSERT(failedFlushes == 0);
+	TEST_ASSERT(flusher.GetBatchCount() == 2);
+	TEST_ASSERT(batchSizes.Count() == 2);
+	TEST_ASSERT(batchSizes[0] == 1);
+	TEST_ASSERT(batchSizes[1] == 3);
+	TEST_ASSERT(flushedOffsets.Count() == 4);
+	TEST_ASSERT(flushedOffsets[0] == 3);
+	TEST_ASSERT(flushedOffsets[1] == 5);
+	TEST_ASSERT(flushedOffsets[2] == 7);
+	TEST_ASSERT(flushedOffsets[3] == 9);
+
+	failing = true;
+	TEST_ASSERT(flushPage(0) == false);
+	failing = false;
+	TEST_ASSERT(flushPage(0) == true);
+	TEST_ASSERT(flusher.GetBatchCount() == 4);
+}
+
+TEST_CASE(Utility_Buffer_CheckpointFailedSync)
+{
+	volatile vuint64_t totalUsedPages = 0;
+	auto fileName = TEMP_DIR L"db.bin";
+	int fd = CreateNewFileForFileSource(fileName);
+	TEST_ASSERT(fd != -1);
+	auto source = new FileBufferSource(BufferSource{0}, &totalUsedPages, nullptr, 4 KB, fileName, fd);
+	source->InitializeEmptySource();
+
+	auto page = source->AllocatePage();
+	TEST_ASSERT(page.IsValid());
+	auto address = (char*)source->LockPage(page, PageLockAccess::Exclusive);
+	TEST_ASSERT(address != nullptr);
+	strcpy(address, "checkpoint");
+	TEST_ASSERT(source->UnlockPage(page, address, PersistanceType::Changed));
+
+	auto isDirty = [&]()
+	{
+		List<Ptr<BufferPageDesc>> pageDescs;
+		source->FillDirtyPages(pageDescs);
+		FOREACH(Ptr<BufferPageDesc>, pageDesc, pageDescs)
+		{
+			if (pageDesc->offset == page.index * 4 KB) return true;
+		}
+		return false;
+	};
+	TEST_ASSERT(isDirty());
+
+	// fdatasync fails on a pipe, the checkpointed page stays dirty after its mapped changes are written back
+	int savedFd = dup(fd);
+	int pipeFds[2];
+	TEST_ASSERT(savedFd != -1);
+	TEST_ASSERT(pipe(pipeFds) == 0);
+	TEST_ASSERT(dup2(pipeFds[0], fd) == fd);
+	TEST_ASSERT(source->Checkpoint() == false);
+	TEST_ASSERT(isDirty());
+
+	TEST_ASSERT(dup2(savedFd, fd) == fd);
+	close(savedFd);
+	close(pipeFds[0]);
+	close(pipeFds[1]);
+	TEST_ASSERT(source->Checkpoint() == true);
+	TEST_ASSERT(!isDirty());
+
+	source->Unload();
+	delete source;
+}
+
+TEST_CASE(Utility_Buffer_FreePageDuringWriteBack)
+{
+	volatile vuint64_t totalUsedPages = 0;
+	auto source = CreateFileSource(BufferSource{0}, &totalUsedPages, nullptr, 4 KB, TEMP_DIR L"db.bin", true);
+	TEST_ASSERT(source != nullptr);
+	auto page = source->AllocatePage();
+	auto address = source->LockPage(page, PageLockAccess::Shared);
+	TEST_ASSERT(address != nullptr);
+	TEST_ASSERT(source->UnlockPage(page, address, PersistanceType::NoChanging));
+
+	Ptr<BufferPageDesc> writingPageDesc;
+	List<Ptr<BufferPageDesc>> pageDescs;
+	source->FillCachedPages(pageDescs);
+	FOREACH(Ptr<BufferPageDesc>, pageDesc, pageDescs)
+	{
+		if (pageDesc->page == page) writingPageDesc = pageDesc;
+	}
+	TEST_ASSERT(writingPageDesc);
+	TEST_ASSERT(writingPageDesc->TryBeginWriteBack());
+
+	// freeing a page that is being written back waits for the write back without holding the source lock
+	volatile bool finished = false;
+	volatile bool freed = false;
+	Thread::CreateAndStart([&]()
+	{
+		SPIN_LOCK(source->GetLock())
+		{
+			freed = source->FreePage(page);
+		}
+		finished = true;
+	});
+	Thread::Sleep(50);
+	TEST_ASSERT(!finished);
+	TEST_ASSERT(source->GetLock().TryEnter());
+	source->GetLock().Leave();
+
+	writingPageDesc->EndWriteBack();
+	while (!finished)
+	{
+		Thread::Sleep(1);
+	}
+	TEST_ASSERT(freed);
+	pageDescs.Clear();
+	source->FillCachedPages(pageDescs);
+	FOREACH(Ptr<BufferPageDesc>, pageDesc, pageDescs)
+	{
+		TEST_ASSERT(pageDesc->page != page);
+	}
+
+	source->Unload();
+	delete source;
+}
+
+TEST_CASE(Utility_Buffer_IoEngine)
+{
+	const vint requestCount = 200;
+	const vuint64_t length = 4 KB;
+	Array<char> written(requestCount * length), read(requestCount * length);
+	for (vint i = 0; i < written.Count(); i++)
+	{
+		written[i] = (char)(i * 7 + i / length);
+	}
+
+	for (vint mode = 0; mode < 2; mode++)
+	{
+		BufferIoEngine engine(16, mode == 0);
+		TEST_ASSERT(mode == 0 || !engine.IsAsync());
+
+		auto fileName = wtoa(TEMP_DIR L"io.bin");
+		int fd = open(fileName.Buffer(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+		TEST_ASSERT(fd != -1);
+
+		// more requests than the queue depth are submitted in several rounds, written in reverse order
+		BufferIoEngine::RequestList requests;
+		for (vint i = requestCount - 1; i >= 0; i--)
+		{
+			BufferIoRequest request;
+			request.address = &written[i * length];
+			request.offset = i * length;
+			request.length = length;
+			request.write = true;
+			requests.Add(request);
+		}
+		TEST_ASSERT(engine.Submit(fd, requests, true));
+		FOREACH(BufferIoRequest, request, requests)
+		{
+			TEST_ASSERT(request.successful);
+		}
+
+		requests.Clear();
+		memset(&read[0], 0, read.Count());
+		for (vint i = 0; i < requestCount; i++)
+		{
+			BufferIoRequest request;
+			request.address = &read[i * length];
+			request.offset = i * length;
+			request.length = length;
+			requests.Add(request);
+		}
+		TEST_ASSERT(engine.Submit(fd, requests, false));
+		TEST_ASSERT(memcmp(&written[0], &read[0], read.Count()) == 0);
+		TEST_ASSERT(engine.IsAsync() == (engine.GetSubmitCount() > 0));
+
+		// reading past the end of the file is a short transfer
+		requests.Clear();
+		BufferIoRequest request;
+		request.address = &read[0];
+		request.offset = requestCount * length;
+		request.length = length;
+		requests.Add(request);
+		TEST_ASSERT(!engine.Submit(fd, requests, false));
+		TEST_ASSERT(!requests[0].successful);
+
+		requests.Clear();
+		TEST_ASSERT(engine.Submit(fd, requests, true));
+		close(fd);
+		unlink(fileName.Buffer());
+	}
+}
+
+TEST_CASE(Utility_Buffer_BackgroundCleaner)
+{
+	BufferManager bm(4 KB, 16);
+	TEST_ASSERT(bm.GetLowWatermark() == 2);
+	TEST_ASSERT(bm.GetHighWatermark() == 4);
+	TEST_ASSERT(!bm.SetWatermarks(4, 2));
+	TEST_ASSERT(!bm.SetWatermarks(2, 17));
+	TEST_ASSERT(bm.SetWatermarks(4, 8));
+
+	auto source = bm.LoadFileSource(TEMP_DIR L"db.bin", true);
+	List<BufferPage> pages;
+	for (vint i = 0; i < 64; i++)
+	{
+		auto page = bm.AllocatePage(source);
+		TEST_ASSERT(page.IsValid());
+		pages.Add(page);
+
+		auto address = (vint*)bm.LockPage(source, page);
+		TEST_ASSERT(address != nullptr);
+		*address = i;
+		TEST_ASSERT(bm.UnlockPage(source, page, address, PersistanceType::Changed));
+	}
+
+	// dirty pages are written back and evicted by the cleaner, not by foreground calls
+	for (vint i = 0; i < 1000 && bm.GetCurrentlyCachedPageCount() > 16 - 4; i++)
+	{
+		Thread::Sleep(1);
+	}
+	TEST_ASSERT(bm.GetCurrentlyCachedPageCount() <= 16 - 4);
+
+	for (vint i = 0; i < 64; i++)
+	{
+		auto address = (vint*)bm.LockPage(source, pages[i]);
+		TEST_ASSERT(address != nullptr);
+		TEST_ASSERT(*address == i);
+		TEST_ASSERT(bm.UnlockPage(source, pages[i], address, PersistanceType::NoChanging));
+	}
+}
+
+TEST_CASE(Utility_Buffer_SpillMemorySource)
+{
+	BufferManager bm(4 KB, 8);
+	auto source = bm.LoadMemorySource();
+	List<BufferPage> pages;
+	for (vint i = 0; i < 32; i++)
+	{
+		auto page = bm.AllocatePage(source);
+		TEST_ASSERT(page.IsValid());
+		pages.Add(page);
+
+		auto address = (vint*)bm.LockPage(source, page);
+		TEST_ASSERT(address != nullptr);
+		address[0] = i;
+		address[4 KB / sizeof(vint) - 1] = i;
+		TEST_ASSERT(bm.UnlockPage(source, page, address, PersistanceType::Changed));
+	}
+
+	// memory pages are spilled to a temporary file instead of staying in the cache forever
+	for (vint i = 0; i < 1000 && bm.GetCurrentlyCachedPageCount() > 8 - 1; i++)
+	{
+		Thread::Sleep(1);
+	}
+	TEST_ASSERT(bm.GetCurrentlyCachedPageCount() <= 8 - 1);
+
+	TEST_ASSERT(bm.FreePage(source, pages[0]));
+	TEST_ASSERT(bm.LockPage(source, pages[0]) == nullptr);
+	for (vint i = 1; i < 32; i++)
+	{
+		auto address = (vint*)bm.LockPage(source, pages[i], PageLockAccess::Shared);
+		TEST_ASSERT(address != nullptr);
+		TEST_ASSERT(address[0] == i);
+		TEST_ASSERT(address[4 KB / sizeof(vint) - 1] == i);
+		TEST_ASSERT(bm.UnlockPage(source, pages[i], address, PersistanceType::NoChanging));
+	}
+	TEST_ASSERT(bm.AllocatePage(source) == pages[0]);
+}
+
+TEST_CASE(Utility_Buffer_FileUseMasks)
+{
+	vuint64_t pageSize = 4 KB;
+	auto fd = CreateNewFileForFileSource(TEMP_DIR L"db.bin");
+	volatile vuint64_t totalUsedPages = 0;
+
+	FileMapping fileMapping(pageSize, fd, &totalUsedPages);
+	FileUseMasks fileUseMasks(pageSize, fd);
+
+	fileMapping.InitializeEmptySource();
+	fileUseMasks.InitializeEmptySource(&fileMapping);
+
+	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)1023}) == false);
+	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)1024}) == false);
+
+	fileUseMasks.SetUseMask(BufferPage{(vuint64_t)1024}, true);
+	fileUseMasks.SetUseMask(BufferPage{(vuint64_t)32768}, true);
+
+	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)1023}) == false);
+	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)1024}) == true);
+	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)32767}) == false);
+	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)32768}) == true);
+
+	fileUseMasks.SetUseMask(BufferPage{(vuint64_t)1023}, true);
+	fileUseMasks.SetUseMask(BufferPage{(vuint64_t)1024}, false);
+	fileUseMasks.SetUseMask(BufferPage{(vuint64_t)32767}, true);
+	fileUseMasks.SetUseMask(BufferPage{(vuint64_t)32768}, false);
+
+	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)1023}) == true);
+	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)1024}) == false);
+	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)32767}) == true);
+	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)32768}) == false);
+
+	fileUseMasks.SetUseMask(BufferPage{(vuint64_t)1023}, false);
+	fileUseMasks.SetUseMask(BufferPage{(vuint64_t)32767}, false);
+
+	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)1023}) == false);
+	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)1024}) == false);
+	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)32767}) == false);
+	TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)32768}) == false);
+
+	fileMapping.UnmapAllPages();
+	CloseFileForFileSource(fd);
+	TEST_ASSERT(totalUsedPages == 0);
+}
+
+TEST_CASE(Utility_Buffer_FileUseMasksFindFirstFree)
+{
+	volatile vuint64_t totalUsedPages = 0;
+	int fileDescriptor = CreateNewFileForFileSource(TEMP_DIR L"db.bin");
+	TEST_ASSERT(fileDescriptor != -1);
+	{
+		FileMapping fileMapping(4 KB, fileDescriptor, &totalUsedPages);
+		FileUseMasks fileUseMasks(4 KB, fileDescriptor);
+		fileMapping.InitializeEmptySource();
+		fileUseMasks.InitializeEmptySource(&fileMapping);
+		TEST_ASSERT(fileUseMasks.IsDirty() == false);
+
+		// 40000 pages need two use mask pages
+		fileUseMasks.SetUseMasks(BufferPage{0}, 40000, true);
+		fileUseMasks.SetUseMask(BufferPage{700}, false);
+		fileUseMasks.SetUseMask(BufferPage{900}, false);
+		fileUseMasks.SetUseMask(BufferPage{35000}, false);
+		TEST_ASSERT(fileUseMasks.IsDirty() == true);
+
+		TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{699}) == true);
+		TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{700}) == false);
+		TEST_ASSERT(fileUseMasks.FindFirstFree(0, 40000) == BufferPage{700});
+		TEST_ASSERT(fileUseMasks.FindFirstFree(700, 40000) == BufferPage{700});
+		TEST_ASSERT(fileUseMasks.FindFirstFree(701, 40000) == BufferPage{900});
+		TEST_ASSERT(fileUseMasks.FindFirstFree(901, 40000) == BufferPage{35000});
+		TEST_ASSERT(fileUseMasks.FindFirstFree(901, 35000).IsValid() == false);
+		TEST_ASSERT(fileUseMasks.FindFirstFree(35001, 40000).IsValid() == false);
+		TEST_ASSERT(fileUseMasks.FindFirstFree(35001, 40001) == BufferPage{40000});
+
+		fileUseMasks.Flush();
+		TEST_ASSERT(fileUseMasks.IsDirty() == false);
+		fileMapping.UnmapAllPages();
+	}
+	{
+		FileMapping fileMapping(4 KB, fileDescriptor, &totalUsedPages);
+		FileUseMasks fileUseMasks(4 KB, fileDescriptor);
+		fileMapping.InitializeExistingSource();
+		fileUseMasks.InitializeExistingSource(&fileMapping);
+
+		TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{0}) == true);
+		TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{39999}) == true);
+		TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{40000}) == false);
+		TEST_ASSERT(fileUseMasks.FindFirstFree(0, 40000) == BufferPage{700});
+		TEST_ASSERT(fileUseMasks.FindFirstFree(901, 40000) == BufferPage{35000});
+		fileMapping.UnmapAllPages();
+	}
+	CloseFileForFileSource(fileDescriptor);
+}
+
+TEST_CASE(Utility_Buffer_FileFreeExtents)
+{
+	vuint64_t pageSize = 4 KB;
+	auto fd = CreateNewFileForFileSource(TEMP_DIR L"db.bin");
+	volatile vuint64_t totalUsedPages = 0;
+	{
+		FileMapping fileMapping(pageSize, fd, &totalUsedPages);
+		FileUseMasks fileUseMasks(pageSize, fd);
+		FileFreeExtents fileFreeExtents(pageSize);
+
+		fileMapping.InitializeEmptySource();
+		fileUseMasks.InitializeEmptySource(&fileMapping);
+		fileFreeExtents.InitializeEmptySource(&fileMapping, &fileUseMasks);
+		fileUseMasks.SetUseMasks(BufferPage{(vuint64_t)0}, 3, true);
+		TEST_ASSERT(fileFreeExtents.AllocatePages(1).IsValid() == false);
+
+		// free pages are merged with neighbours in any order
+		fileFreeExtents.FreePages(BufferPage{(vuint64_t)100}, 10);
+		fileFreeExtents.FreePages(BufferPage{(vuint64_t)120}, 10);
+		TEST_ASSERT(fileFreeExtents.GetExtentCount() == 2);
+		fileFreeExtents.FreePages(BufferPage{(vuint64_t)110}, 10);
+		TEST_ASSERT(fileFreeExtents.GetExtentCount() == 1);
+		TEST_ASSERT(fileFreeExtents.GetFreePageCount() == 30);
+		for (vint i = 0; i < 20; i++)
+		{
+			fileFreeExtents.FreePages(BufferPage{(vuint64_t)(1000 + i * 2)}, 1);
+		}
+		TEST_ASSERT(fileFreeExtents.GetExtentCount() == 21);
+
+		// the lowest extent that is long enough is used
+		TEST_ASSERT(fileFreeExtents.AllocatePages(1) == BufferPage{(vuint64_t)100});
+		TEST_ASSERT(fileFreeExtents.AllocatePages(25) == BufferPage{(vuint64_t)101});
+		TEST_ASSERT(fileFreeExtents.AllocatePages(5).IsValid() == false);
+		TEST_ASSERT(fileFreeExtents.AllocatePages(4) == BufferPage{(vuint64_t)126});
+		TEST_ASSERT(fileFreeExtents.GetExtentCount() == 20);
+		for (vint i = 0; i < 20; i++)
+		{
+			TEST_ASSERT(fileFreeExtents.AllocatePages(1) == BufferPage{(vuint64_t)(1000 + i * 2)});
+		}
+		TEST_ASSERT(fileFreeExtents.GetFreePageCount() == 0);
+		TEST_ASSERT(fileFreeExtents.GetExtentCount() == 0);
+
+		// pages after the index page become free extents when the source is loaded again
+		fileMapping.AppendPages(297);
+		fileUseMasks.SetUseMasks(BufferPage{(vuint64_t)3}, 297, true);
+		fileUseMasks.SetUseMasks(BufferPage{(vuint64_t)10}, 5, false);
+		fileUseMasks.SetUseMasks(BufferPage{(vuint64_t)200}, 100, false);
+		fileUseMasks.Flush();
+		fileMapping.UnmapAllPages();
+	}
+	{
+		FileMapping fileMapping(pageSize, fd, &totalUsedPages);
+		FileUseMasks fileUseMasks(pageSize, fd);
+		FileFreeExtents fileFreeExtents(pageSize);
+
+		fileMapping.InitializeExistingSource();
+		fileUseMasks.InitializeExistingSource(&fileMapping);
+		fileFreeExtents.InitializeExistingSource(&fileMapping, &fileUseMasks);
+		TEST_ASSERT(fileMapping.GetTotalPageCount() == 300);
+		TEST_ASSERT(fileFreeExtents.GetExtentCount() == 2);
+		TEST_ASSERT(fileFreeExtents.GetFreePageCount() == 105);
+		TEST_ASSERT(fileFreeExtents.AllocatePages(50) == BufferPage{(vuint64_t)200});
+		TEST_ASSERT(fileFreeExtents.AllocatePages(5) == BufferPage{(vuint64_t)10});
+		fileMapping.UnmapAllPages();
+	}
+
+	CloseFileForFileSource(fd);
+	TEST_ASSERT(totalUsedPages == 0);
+}
+
+TEST_CASE(Utility_Buffer_FileFreePageChain)
+{
+	vuint64_t pageSize = 4 KB;
+	auto fd = CreateNewFileForFileSource(TEMP_DIR L"db.bin");
+	volatile vuint64_t totalUsedPages = 0;
+	{
+		FileMapping fileMapping(pageSize, fd, &totalUsedPages);
+		FileUseMasks fileUseMasks(pageSize, fd);
+		FileFreeExtents fileFreeExtents(pageSize);
+
+		fileMapping.InitializeEmptySource();
+		fileUseMasks.InitializeEmptySource(&fileMapping);
+		fileFreeExtents.InitializeEmptySource(&fileMapping, &fileUseMasks);
+		fileUseMasks.SetUseMasks(BufferPage{(vuint64_t)0}, 3, true);
+
+		// a free page stack written by earlier versions: page 1 -> page 3, page 4 and page 5 are in the stack
+		fileMapping.AppendPages(3);
+		fileUseMasks.SetUseMask(BufferPage{(vuint64_t)3}, true);
+		auto numbers = (vuint64_t*)fileMapping.MapPage(BufferPage{(vuint64_t)1})->address;
+		numbers[0] = 3;
+		numbers[1] = 2;
+		numbers[2] = 4;
+		numbers[3] = 5;
+		TEST_ASSERT(fileMapping.PersistPage(fileMapping.MapPage(BufferPage{(vuint64_t)1}).Obj()));
+		numbers = (vuint64_t*)fileMapping.MapPage(BufferPage{(vuint64_t)3})->address;
+		numbers[0] = ~(vuint64_t)0;
+		numbers[1] = 0;
+		TEST_ASSERT(fileMapping.PersistPage(fileMapping.MapPage(BufferPage{(vuint64_t)3}).Obj()));
+		fileUseMasks.Flush();
+		fileMapping.UnmapAllPages();
+	}
+	{
+		FileMapping fileMapping(pageSize, fd, &totalUsedPages);
+		FileUseMasks fileUseMasks(pageSize, fd);
+		FileFreeExtents fileFreeExtents(pageSize);
+
+		fileMapping.InitializeExistingSource();
+		fileUseMasks.InitializeExistingSource(&fileMapping);
+		fileFreeExtents.InitializeExistingSource(&fileMapping, &fileUseMasks);
+		TEST_ASSERT(fileUseMasks.GetUseMask(BufferPage{(vuint64_t)3}) == false);
+		TEST_ASSERT(fileFreeExtents.GetExtentCount() == 1);
+		TEST_ASSERT(fileFreeExtents.AllocatePages(3) == BufferPage{(vuint64_t)3});
+		auto numbers = (vuint64_t*)fileMapping.MapPage(BufferPage{(vuint64_t)1})->address;
+		TEST_ASSERT(numbers[0] == ~(vuint64_t)0);
+		TEST_ASSERT(numbers[1] == 0);
+		fileMapping.UnmapAllPages();
+	}
+
+	CloseFileForFileSource(fd);
+	TEST_ASSERT(totalUsedPages == 0);
+}
+
+TEST_CASE(Utility_Buffer_Superblock)
+{
+	volatile vuint64_t totalUsedPages = 0;
+	auto fileName = TEMP_DIR L"db.bin";
+	auto superblockOffset = [](vint word){ return (off_t)(4 KB + word * sizeof(vuint64_t)); };
+	vuint64_t totalPageCount = 0;
+	{
+		// 40000 pages need two use mask pages, the first one is full after page 35000 is freed
+		auto source = CreateFileSource(BufferSource{0}, &totalUsedPages, nullptr, 4 KB, fileName, true);
+		TEST_ASSERT(source != nullptr);
+		auto fileSource = dynamic_cast<FileBufferSource*>(source);
+		TEST_ASSERT(fileSource->GetSuperblock().GetDirectoryPages().Count() == 1);
+		auto first = source->AllocatePages(40000);
+		TEST_ASSERT(first.IsValid());
+		TEST_ASSERT(fileSource->GetUseMasks().GetLoadedUseMaskPageCount() == 2);
+		TEST_ASSERT(source->FreePage(BufferPage{fileSource->GetSuperblock().GetDirectoryPages()[0]}) == false);
+		TEST_ASSERT(source->FreePage(BufferPage{(vuint64_t)35000}));
+		source->Unload();
+		delete source;
+	}
+	{
+		// a clean file is opened by reading the superblock and directories, use masks are read when they are needed
+		auto source = CreateFileSource(BufferSource{0}, &totalUsedPages, nullptr, 4 KB, fileName, false);
+		TEST_ASSERT(source != nullptr);
+		auto fileSource = dynamic_cast<FileBufferSource*>(source);
+		TEST_ASSERT(fileSource->GetSuperblock().GetFreePageCount() == 1);
+		TEST_ASSERT(fileSource->GetUseMasks().GetLoadedUseMaskPageCount() == 0);
+		TEST_ASSERT(fileSource->GetCachedPageCount() <= 2);
+		TEST_ASSERT(fileSource->GetUseMasks().GetUsedPageCount() == fileSource->GetSuperblock().GetTotalPageCount() - 1);
+
+		TEST_ASSERT(source->AllocatePage() == BufferPage{(vuint64_t)35000});
+		TEST_ASSERT(fileSource->GetUseMasks().GetLoadedUseMaskPageCount() == 1);
+		totalPageCount = fileSource->GetSuperblock().GetTotalPageCount();
+		TEST_ASSERT(source->AllocatePage() == BufferPage{totalPageCount});
+		TEST_ASSERT(source->FreePage(BufferPage{(vuint64_t)100}));
+		TEST_ASSERT(source->AllocatePage() == BufferPage{(vuint64_t)100});
+		TEST_ASSERT(source->FreePage(BufferPage{(vuint64_t)35000}));
+		source->Unload();
+		delete source;
+	}
+	{
+		// a file that is not unloaded cleanly reads every use mask page from the chain
+		int fd = open(wtoa(fileName).Buffer(), O_RDWR);
+		TEST_ASSERT(fd != -1);
+		vuint64_t word = 0;
+		TEST_ASSERT(pwrite(fd, &word, sizeof(word), superblockOffset(4)) == sizeof(word));
+		close(fd);
+
+		auto source = CreateFileSource(BufferSource{0}, &totalUsedPages, nullptr, 4 KB, fileName, false);
+		TEST_ASSERT(source != nullptr);
+		auto fileSource = dynamic_cast<FileBufferSource*>(source);
+		TEST_ASSERT(fileSource->GetSuperblock().IsClean() == false);
+		TEST_ASSERT(fileSource->GetUseMasks().GetLoadedUseMaskPageCount() == 2);
+		TEST_ASSERT(fileSource->GetSuperblock().GetDirectoryPages().Count() == 1);
+		TEST_ASSERT(source->AllocatePage() == BufferPage{(vuint64_t)35000});
+		TEST_ASSERT(source->FreePage(BufferPage{(vuint64_t)35000}));
+		source->Unload();
+		delete source;
+	}
+	{
+		// a file written by earlier versions gets a superblock
+		int fd = open(wtoa(fileName).Buffer(), O_RDWR);
+		TEST_ASSERT(fd != -1);
+		vuint64_t word = 0;
+		TEST_ASSERT(pwrite(fd, &word, sizeof(word), superblockOffset(2)) == sizeof(word));
+		close(fd);
+
+		auto source = CreateFileSource(BufferSource{0}, &totalUsedPages, nullptr, 4 KB, fileName, false);
+		TEST_ASSERT(source != nullptr);
+		auto fileSource = dynamic_cast<FileBufferSource*>(source);
+		TEST_ASSERT(fileSource->GetUseMasks().GetLoadedUseMaskPageCount() == 2);
+		TEST_ASSERT(fileSource->GetSuperblock().GetDirectoryPages().Count() == 1);
+		TEST_ASSERT(fileSource->GetSuperblock().GetDirectoryPages()[0] == totalPageCount + 1);
+		source->Unload();
+		delete source;
+
+		source = CreateFileSource(BufferSource{0}, &totalUsedPages, nullptr, 4 KB, fileName, false);
+		TEST_ASSERT(source != nullptr);
+		fileSource = dynamic_cast<FileBufferSource*>(source);
+		TEST_ASSERT(fileSource->GetUseMasks().GetLoadedUseMaskPageCount() == 0);
+		TEST_ASSERT(source->AllocatePage() == BufferPage{(vuint64_t)35000});
+		source->Unload();
+		delete source;
+	}
+	TEST_ASSERT(totalUsedPages == 0);
+}
+
+TEST_CASE(Utility_Buffer_FrameArena)
+{
+	BufferFrameArena arena(4 KB, 4, false);
+	TEST_ASSERT(arena.GetFrameCount() == 0);
+
+	List<Ptr<BufferPageDesc>> pageDescs;
+	for (vint i = 0; i < 6; i++)
+	{
+		auto pageDesc = arena.AllocatePageDesc();
+		TEST_ASSERT(pageDesc);
+		TEST_ASSERT((vuint64_t)pageDesc->address % (4 KB) == 0);
+		memset(pageDesc->address, (int)i, 4 KB);
+		pageDescs.Add(pageDesc);
+	}
+	TEST_ASSERT(arena.GetFrameCount() == 8);
+	TEST_ASSERT(arena.GetUsedFrameCount() == 6);
+	for (vint i = 0; i < 6; i++)
+	{
+		TEST_ASSERT(((char*)pageDescs[i]->address)[4 KB - 1] == (char)i);
+	}
+
+	auto address = pageDescs[1]->address;
+	{
+		auto pageDesc = pageDescs[1];
+		pageDescs.RemoveAt(1);
+		TEST_ASSERT(arena.GetUsedFrameCount() == 6);
+	}
+	TEST_ASSERT(arena.GetUsedFrameCount() == 5);
+
+	auto pageDesc = arena.AllocatePageDesc();
+	TEST_ASSERT(pageDesc->address == address);
+	TEST_ASSERT(pageDesc->lockState == 0);
+	TEST_ASSERT(arena.GetFrameCount() == 8);
+
+	pageDesc = nullptr;
+	pageDescs.Clear();
+	TEST_ASSERT(arena.GetUsedFrameCount() == 0);
+}
+
+TEST_CASE(Utility_Buffer_FrameArenaPartitions)
+{
+	TEST_ASSERT(GetNumaNodeCount() >= 1);
+	TEST_ASSERT(GetCurrentNumaNode() >= 0);
+
+	BufferFrameArena arena(4 KB, 4, false, 2);
+	TEST_ASSERT(arena.GetNodeCount() == 2);
+	vint currentNode = GetCurrentNumaNode() % 2;
+	vint otherNode = 1 - currentNode;
+
+	List<Ptr<BufferPageDesc>> pageDescs;
+	for (vint i = 0; i < 3; i++)
+	{
+		pageDescs.Add(arena.AllocatePageDesc());
+		TEST_ASSERT(pageDescs[i]->arenaNode == currentNode);
+	}
+	for (vint i = 0; i < 5; i++)
+	{
+		auto pageDesc = arena.AllocatePageDesc(otherNode);
+		TEST_ASSERT(pageDesc->arenaNode == otherNode);
+		TEST_ASSERT((vuint64_t)pageDesc->address % (4 KB) == 0);
+		memset(pageDesc->address, (int)i, 4 KB);
+		pageDescs.Add(pageDesc);
+	}
+	TEST_ASSERT(arena.GetFrameCount() == 12);
+	TEST_ASSERT(arena.GetUsedFrameCount() == 8);
+
+	auto local = arena.GetNodeStatistics(currentNode);
+	TEST_ASSERT(local.frameCount == 4);
+	TEST_ASSERT(local.usedFrameCount == 3);
+	TEST_ASSERT(local.localAllocations == 3);
+	TEST_ASSERT(local.remoteAllocations == 0);
+
+	auto remote = arena.GetNodeStatistics(otherNode);
+	TEST_ASSERT(remote.frameCount == 8);
+	TEST_ASSERT(remote.usedFrameCount == 5);
+	TEST_ASSERT(remote.localAllocations == 0);
+	TEST_ASSERT(remote.remoteAllocations == 5);
+
+	// frames return to their own partitions
+	pageDescs.RemoveAt(pageDescs.Count() - 1);
+	TEST_ASSERT(arena.GetNodeStatistics(otherNode).usedFrameCount == 4);
+	pageDescs.Clear();
+	TEST_ASSERT(arena.GetUsedFrameCount() == 0);
+
+	BufferManager bm(4 KB, 16);
+	TEST_ASSERT(bm.GetNumaNodeCount() == GetNumaNodeCount());
+	auto source = bm.LoadMemorySource();
+	auto page = bm.AllocatePage(source);
+	TEST_ASSERT(page.IsValid());
+	vint usedFrameCount = 0;
+	for (vint i = 0; i < bm.GetNumaNodeCount(); i++)
+	{
+		usedFrameCount += bm.GetNumaNodeStatistics(i).usedFrameCount;
+	}
+	TEST_ASSERT(usedFrameCount > 0);
+}
+
+TEST_CASE(Utility_Buffer_GhostQueue)
+{
+	GhostQueue queue;
+	for (vint i = 0; i < 8; i++)
+	{
+		queue.Push(BufferSource{0}, BufferPage{(vuint64_t)i});
+		queue.Trim(4);
+	}
+	TEST_ASSERT(queue.Count() == 4);
+	TEST_ASSERT(queue.Remove(BufferSource{0}, BufferPage{(vuint64_t)3}) == false);
+	TEST_ASSERT(queue.Remove(BufferSource{0}, BufferPage{(vuint64_t)4}) == true);
+
+	// ghost hits remove keys before they are trimmed, stale keys do not accumulate
+	for (vint i = 8; i < 10000; i++)
+	{
+		queue.Push(BufferSource{0}, BufferPage{(vuint64_t)i});
+		TEST_ASSERT(queue.Remove(BufferSource{0}, BufferPage{(vuint64_t)i}));
+		queue.Trim(4);
+		TEST_ASSERT(queue.GetQueuedCount() <= 2 * queue.Count() + 1);
+	}
+	TEST_ASSERT(queue.Count() == 3);
+
+	// pushing a key again keeps only its latest position
+	queue.Push(BufferSource{0}, BufferPage{(vuint64_t)5});
+	queue.Push(BufferSource{0}, BufferPage{(vuint64_t)100});
+	queue.Trim(2);
+	TEST_ASSERT(queue.Remove(BufferSource{0}, BufferPage{(vuint64_t)5}) == true);
+	TEST_ASSERT(queue.Remove(BufferSource{0}, BufferPage{(vuint64_t)100}) == true);
+	TEST_ASSERT(queue.Count() == 0);
+}
+
+TEST_CASE(Utility_Buffer_ClockEvictionPolicy)
+{
+	ClockEvictionPolicy replacer;
+	Ptr<BufferPageDesc> pageDescs[4];
+	for (vint i = 0; i < 4; i++)
+	{
+		pageDescs[i] = new BufferPageDesc;
+		pageDescs[i]->page.index = i;
+		replacer.OnPageMapped(pageDescs[i]);
+	}
+	TEST_ASSERT(replacer.GetFrameCount() == 4);
+
+	TEST_ASSERT(replacer.NextVictim() == pageDescs[0]);
+	pageDescs[1]->referenced = true;
+	TEST_ASSERT(pageDescs[2]->TryLock(PageLockAccess::Shared));
+	TEST_ASSERT(replacer.NextVictim() == pageDescs[3]);
+	TEST_ASSERT(replacer.NextVictim() == pageDescs[0]);
+	TEST_ASSERT(replacer.NextVictim() == pageDescs[1]);
+
+	replacer.OnPageUnmapped(pageDescs[0]);
+	replacer.OnPageUnmapped(pageDescs[1]);
+	replacer.OnPageUnmapped(pageDescs[3]);
+	TEST_ASSERT(replacer.GetFrameCount() == 1);
+	TEST_ASSERT(replacer.NextVictim() == nullptr);
+
+	TEST_ASSERT(pageDescs[2]->Unlock());
+	TEST_ASSERT(replacer.NextVictim() == pageDescs[2]);
+	replacer.OnPageMapped(pageDescs[0]);
+	TEST_ASSERT(pageDescs[0]->frameIndex == 3);
+}
+
+TEST_CASE(Utility_Buffer_SkipVictim)
+{
+	Ptr<IBufferEvictionPolicy> policies[] =
+	{
+		CreateClockEvictionPolicy(),
+		CreateLruKEvictionPolicy(),
+		CreateTwoQueueEvictionPolicy(),
+		CreateArcEvictionPolicy(),
+	};
+
+	for (auto policy : policies)
+	{
+		policy->SetCapacity(4);
+		List<Ptr<BufferPageDesc>> pageDescs;
+		for (vint i = 0; i < 4; i++)
+		{
+			auto pageDesc = MakePtr<BufferPageDesc>();
+			pageDesc->page.index = i;
+			policy->OnPageMapped(pageDesc);
+			pageDescs.Add(pageDesc);
+		}
+
+		// a dirty page at the eviction end is skipped by callers that only evict clean pages, the others are still reached
+		auto dirtyPage = policy->NextVictim();
+		TEST_ASSERT(dirtyPage);
+		dirtyPage->dirty = true;
+		for (vint i = 0; i < 3; i++)
+		{
+			auto victim = policy->NextVictim();
+			for (vint j = 0; j < 4 && victim && victim->dirty; j++)
+			{
+				policy->SkipVictim(victim.Obj());
+				victim = policy->NextVictim();
+			}
+			TEST_ASSERT(victim && victim != dirtyPage);
+			policy->OnPageUnmapped(victim);
+		}
+		TEST_ASSERT(policy->GetFrameCount() == 1);
+		TEST_ASSERT(policy->NextVictim() == dirtyPage);
+	}
+}
+
+TEST_CASE(Utility_Buffer_ScanResistantEvictionPolicies)
+{
+	Ptr<IBufferEvictionPolicy> policies[] =
+	{
+		CreateLruKEvictionPolicy(),
+		CreateTwoQueueEvictionPolicy(),
+		CreateArcEvictionPolicy(),
+	};
+
+	for (auto policy : policies)
+	{
+		policy->SetCapacity(8);
+		List<Ptr<BufferPageDesc>> hotPages;
+		for (vint i = 0; i < 4; i++)
+		{
+			auto pageDesc = MakePtr<BufferPageDesc>();
+			pageDesc->page.index = i;
+			policy->OnPageMapped(pageDesc);
+			hotPages.Add(pageDesc);
+		}
+
+		// the hot pages are evicted once and come back, which makes them frequently used
+		for (vint i = 0; i < 4; i++)
+		{
+			policy->OnPageUnmapped(hotPages[i]);
+			policy->OnPageMapped(hotPages[i]);
+			policy->OnPageAccessed(hotPages[i].Obj());
+		}
+
+		// a sequential scan fills the cache and keeps going, it should only push out scanned pages
+		for (vint i = 0; i < 16; i++)
+		{
+			auto pageDesc = MakePtr<BufferPageDesc>();
+			pageDesc->page.index = 100 + i;
+			policy->OnPageMapped(pageDesc);
+
+			if (policy->GetFrameCount() > 8)
+			{
+				auto victim = policy->NextVictim();
+				TEST_ASSERT(victim && !hotPages.Contains(victim.Obj()));
+				policy->OnPageUnmapped(victim);
+			}
+		}
+		TEST_ASSERT(policy->GetFrameCount() == 8);
+	}
 }